@@ -0,0 +1,201 @@
+// Per-ISA timings of the name kernels over a fixed set of names,
+// build with -DJKDNS_BENCH=ON and run ./name_kernels_bench [rounds]
+
+#include "dns/name_kernels.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define NAMES  4096
+#define ROUNDS 2000
+
+// wire is all lower case, upper the same name all upper case
+typedef struct {
+    char str[256];
+    size_t str_len;
+    uint8_t wire[256];
+    uint8_t upper[256];
+    size_t wire_len;
+} bench_name_t;
+
+static bench_name_t names[NAMES];
+
+static const char* words[] = {
+    "www", "mail", "api", "cdn", "static", "login", "Example", "service",
+    "a", "eu-west-1", "internal", "COM", "net", "org", "io", "telemetry",
+};
+
+static int64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void make_names() {
+    uint64_t x = 88172645463325252ULL;
+    size_t words_count = sizeof(words) / sizeof(words[0]);
+
+    for (size_t i = 0; i < NAMES; i++) {
+        bench_name_t* n = &names[i];
+        size_t labels = 2 + i % 5;
+        size_t pos = 0;
+        size_t str_pos = 0;
+
+        for (size_t l = 0; l < labels; l++) {
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+
+            const char* w = words[x % words_count];
+            size_t len = strlen(w);
+
+            n->wire[pos] = (uint8_t)len;
+            for (size_t k = 0; k < len; k++) {
+                n->wire[pos + 1 + k] = w[k] >= 'A' && w[k] <= 'Z' ? w[k] | 0x20 : w[k];
+            }
+            pos += 1 + len;
+
+            if (l > 0) {
+                n->str[str_pos++] = '.';
+            }
+            memcpy(n->str + str_pos, w, len);
+            str_pos += len;
+        }
+
+        n->wire[pos] = 0;
+        n->wire_len = pos + 1;
+        n->str[str_pos] = '\0';
+        n->str_len = str_pos;
+
+        for (size_t k = 0; k < n->wire_len; k++) {
+            uint8_t c = n->wire[k];
+            n->upper[k] = c >= 'a' && c <= 'z' ? c - 0x20 : c;
+        }
+    }
+}
+
+static void report(const char* isa, const char* kernel, int64_t ns, size_t calls, uint64_t sink) {
+    printf("%-8s %-10s %8.2f ns/name  (%llx)\n",
+           isa, kernel, (double)ns / (double)calls, (unsigned long long)(sink & 0xff));
+}
+
+static void run(const dns_name_kernels_t* k, size_t rounds) {
+    static uint8_t out[256];
+    static uint8_t dots[256];
+    size_t calls = rounds * NAMES;
+    uint64_t sink = 0;
+
+    int64_t start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < NAMES; i++) {
+            sink += k->equal(names[i].wire, names[i].upper, names[i].wire_len);
+        }
+    }
+    report(k->name, "equal", now_ns() - start, calls, sink);
+
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < NAMES; i++) {
+            k->tolower(out, names[i].upper, names[i].wire_len);
+            sink += out[1];
+        }
+    }
+    report(k->name, "tolower", now_ns() - start, calls, sink);
+
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < NAMES; i++) {
+            sink += k->hash(names[i].upper, names[i].wire_len);
+        }
+    }
+    report(k->name, "hash", now_ns() - start, calls, sink);
+
+    start = now_ns();
+    for (size_t r = 0; r < rounds; r++) {
+        for (size_t i = 0; i < NAMES; i++) {
+            sink += k->find_dots(names[i].str, names[i].str_len, dots, sizeof(dots));
+        }
+    }
+    report(k->name, "find_dots", now_ns() - start, calls, sink);
+}
+
+// every variant has to agree with the scalar one
+static bool check(const dns_name_kernels_t* k, const dns_name_kernels_t* ref) {
+    uint8_t a[256];
+    uint8_t b[256];
+    uint8_t dots_a[256];
+    uint8_t dots_b[256];
+
+    for (size_t i = 0; i < NAMES; i++) {
+        bench_name_t* n = &names[i];
+
+        for (size_t len = 0; len <= n->wire_len; len++) {
+            if (k->hash(n->upper, len) != ref->hash(n->wire, len) ||
+                !k->equal(n->upper, n->wire, len)) {
+                return false;
+            }
+        }
+
+        k->tolower(a, n->upper, n->wire_len);
+        ref->tolower(b, n->upper, n->wire_len);
+        if (memcmp(a, b, n->wire_len) != 0 || memcmp(a, n->wire, n->wire_len) != 0) {
+            return false;
+        }
+
+        size_t count = k->find_dots(n->str, n->str_len, dots_a, sizeof(dots_a));
+        if (count != ref->find_dots(n->str, n->str_len, dots_b, sizeof(dots_b)) ||
+            memcmp(dots_a, dots_b, count) != 0) {
+            return false;
+        }
+    }
+
+    // every byte value, the folding is ASCII only
+    for (int c = 0; c < 256; c++) {
+        memset(a, c, 64);
+        memset(b, c >= 'A' && c <= 'Z' ? c | 0x20 : c, 64);
+        if (!k->equal(a, b, 64) || k->hash(a, 64) != ref->hash(b, 64)) {
+            return false;
+        }
+        // flipping the case bit keeps only letters equal
+        bool letter = (c | 0x20) >= 'a' && (c | 0x20) <= 'z';
+        b[63] ^= 0x20;
+        if (k->equal(a, b, 64) != letter) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+int main(int argc, char** argv) {
+    size_t rounds = argc > 1 ? (size_t)strtoul(argv[1], NULL, 10) : ROUNDS;
+
+    make_names();
+
+    const dns_name_kernels_t* ref = dns_name_kernels_for(DNS_ISA_SCALAR);
+    int res = EXIT_SUCCESS;
+
+    printf("selected: %s\n", dns_name_kernels()->name);
+
+    for (int isa = 0; isa < DNS_ISA_COUNT; isa++) {
+        const dns_name_kernels_t* k = dns_name_kernels_for((dns_isa_t)isa);
+        if (k == NULL) {
+            continue;
+        }
+
+        if (!check(k, ref)) {
+            fprintf(stderr, "%s: results differ from scalar\n", k->name);
+            res = EXIT_FAILURE;
+            continue;
+        }
+
+        run(k, rounds);
+    }
+
+    return res;
+}
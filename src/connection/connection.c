@@ -7,8 +7,13 @@
 #include "core/event.h"
 #include "core/ev_backend.h"
 #include "core/net.h"
+#include "core/trace.h"
+#include "core/udp_socket.h"
 #include "logger/logger.h"
+#include "metrics/metrics.h"
+#include "udp_socket/client_pool.h"
 
+#include <dns/dns_handler.h>
 #include <echo/echo_handler.h>
 #include <echo/echo_proxy_handler.h>
 
@@ -18,43 +23,56 @@
 #include <string.h>
 #include <unistd.h>
 
-void handle_new_tcp_connection(int64_t fd) {
+void handle_new_tcp_connection(int64_t fd, address_t* address) {
+    settings_t *s = current_settings;
+
+    void (*handler)(event_t *ev) = s->proxy_mode ? handle_echo_proxy: handle_echo;
+    if (s->dns_mode) {
+        handler = handle_dns_tcp;
+    }
+
+    make_server_connection(fd, address, handler);
+}
+
+connection_t* make_server_connection(
+    int64_t fd,
+    address_t* address,
+    void (*handler)(event_t *ev)
+) {
     connection_t* conn = NULL;
     event_t* r_event = NULL;
     event_t* w_event = NULL;
 
-    settings_t *s = current_settings;
     logger_t *logger = current_logger;
     
     conn = calloc(1, sizeof(connection_t));
     if (conn == NULL) {
-        log_perror("handle_new_tcp_connection.calloc");
+        log_perror("make_server_connection.calloc");
         goto cleanup;
     }
 
     r_event = calloc(1, sizeof(event_t));
     if (conn == NULL) {
-        log_perror("handle_new_tcp_connection.allocate_read_event");
+        log_perror("make_server_connection.allocate_read_event");
         goto cleanup;
     }
     init_event(r_event);
     
     w_event = calloc(1, sizeof(event_t));
     if (conn == NULL) {
-        log_perror("handle_new_tcp_connection.allocate_write_event");
+        log_perror("make_server_connection.allocate_write_event");
         goto cleanup;
     }
     init_event(w_event);
 
     conn->handle.type = CONN_TYPE_TCP;
     conn->handle.data.fd = fd;
+    memcpy(&conn->address, address, sizeof(*address));
 
     conn->read  = r_event;
     conn->write = w_event;
     conn->error = false;
 
-    void (*handler)(event_t *ev) = s->proxy_mode ? handle_echo_proxy: handle_echo;
-
     r_event->owner.tag = EV_OWNER_CONNECTION;
     r_event->owner.ptr = conn;
     r_event->write = false;
@@ -67,7 +85,10 @@ void handle_new_tcp_connection(int64_t fd) {
 
     ev_backend->add_event(r_event);
 
-    return;
+    metrics_add(METRIC_TCP_CONNECTIONS, 1);
+    JK_TRACE3(conn_create, conn, CONN_TYPE_TCP, fd);
+
+    return conn;
 
     cleanup:
     if (conn != NULL) {
@@ -162,6 +183,28 @@ connection_t *make_client_connection(
     void (*write_handler)(event_t *ev)
 ) {
     logger_t *logger = current_logger;
+
+    address_t address;
+    int64_t res = fill_address(&address, ip, port);
+
+    CHECK_INVARIANT(res == JK_OK, "fill_address failed!");
+
+    connection_t* conn = make_client_connection_to(
+        type, &address, read_handler, write_handler);
+    if (conn == NULL) {
+        exit(1);
+    }
+
+    return conn;
+}
+
+connection_t *make_client_connection_to(
+    conn_type_t type,
+    address_t* address,
+    void (*read_handler)(event_t *ev), // NOLINT
+    void (*write_handler)(event_t *ev)
+) {
+    logger_t *logger = current_logger;
     
     connection_t* conn = NULL;
     event_t* r_event = NULL;
@@ -169,27 +212,25 @@ connection_t *make_client_connection(
     
     conn = calloc(1, sizeof(connection_t));
     if (conn == NULL) {
-        log_perror("make_client_connection.allocate_connection");
+        log_perror("make_client_connection_to.allocate_connection");
         goto cleanup;
     }
 
     r_event = calloc(1, sizeof(event_t));
-    if (conn == NULL) {
-        log_perror("make_client_connection.allocate_read_event");
+    if (r_event == NULL) {
+        log_perror("make_client_connection_to.allocate_read_event");
         goto cleanup;
     }
     init_event(r_event);
 
     w_event = calloc(1, sizeof(event_t));
-    if (conn == NULL) {
-        log_perror("make_client_connection.allocate_write_event");
+    if (w_event == NULL) {
+        log_perror("make_client_connection_to.allocate_write_event");
         goto cleanup;
     }
     init_event(w_event);
     
-    int64_t res = fill_address(&conn->address, ip, port);
-
-    CHECK_INVARIANT(res == JK_OK, "fill_address failed!");
+    memcpy(&conn->address, address, sizeof(*address));
     
     conn->handle.type = type;
 
@@ -206,12 +247,21 @@ connection_t *make_client_connection(
     w_event->write = true;
     w_event->handler = write_handler;
 
-    res = ev_backend->add_conn(conn);
+    int64_t res = ev_backend->add_conn(conn);
     if (res != JK_OK) {
-        log_error("make_client_connection: add_conn failed");
-        goto cleanup;
+        log_error("make_client_connection_to: add_conn failed");
+        free(conn);
+        free(r_event);
+        free(w_event);
+        return NULL;
     } 
 
+    if (type == CONN_TYPE_TCP) {
+        metrics_add(METRIC_TCP_CONNECTIONS, 1);
+    }
+
+    JK_TRACE3(conn_create, conn, type, type == CONN_TYPE_TCP ? conn->handle.data.fd : -1);
+
     return conn;
 
     cleanup:
@@ -233,10 +283,17 @@ connection_t *make_client_connection(
 void close_connection(connection_t *conn) {
     logger_t *logger = current_logger;
 
+    JK_TRACE3(conn_close, conn, conn->handle.type,
+        conn->handle.type == CONN_TYPE_TCP ? conn->handle.data.fd : -1);
+
     if (conn->handle.type == CONN_TYPE_TCP) {
         close_tcp_conn(conn->handle.data.fd);
+        metrics_add(METRIC_TCP_CONNECTIONS, -1);
     } else if (conn->handle.type == CONN_TYPE_UDP) {
-        ;
+        udp_socket_t* sock = conn->handle.data.sock;
+        if (sock->owner == conn) {
+            udp_client_socket_close(sock);
+        }
     } else {
         PANIC("bad conneciton type");
     }
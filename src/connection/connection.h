@@ -6,7 +6,12 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-void handle_new_tcp_connection(int64_t fd);
+void handle_new_tcp_connection(int64_t fd, address_t* address);
+// an accepted tcp connection served by handler, waiting for reads
+connection_t *make_server_connection(
+    int64_t fd,
+    address_t* address,
+    void (*handler)(event_t *ev));
 connection_t *make_udp_connection(udp_socket_t* sock, address_t* address);
 connection_t *make_client_connection(
     conn_type_t type,
@@ -14,5 +19,11 @@ connection_t *make_client_connection(
     uint16_t port,
     void (*read_handler)(event_t *ev),
     void (*write_handler)(event_t *ev));
+// returns NULL if the connection could not be opened
+connection_t *make_client_connection_to(
+    conn_type_t type,
+    address_t* address,
+    void (*read_handler)(event_t *ev),
+    void (*write_handler)(event_t *ev));
 void close_connection(connection_t* conn);
 int64_t fill_address(struct address_s* addr, const char* ip, uint16_t port);
@@ -0,0 +1,114 @@
+#include "bloom.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// odd multipliers spreading one hash over the words of a half block (Parquet SBBF)
+static const uint32_t salts[BLOOM_HALF_WORDS] = {
+    0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+    0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U,
+};
+
+static const uint32_t* half_of(const bloom_block_t* block, uint64_t hash, uint32_t* key);
+static void make_mask(uint32_t key, uint32_t* mask);
+
+bloom_t* bloom_create(size_t expected, size_t bits_per_key) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(bits_per_key > 0, "bits_per_key is 0");
+
+    size_t want = (expected * bits_per_key + 511) / 512;
+    size_t count = 1;
+    while (count < want) {
+        count <<= 1;
+    }
+
+    bloom_t* b = malloc(sizeof(bloom_t));
+    if (b == NULL) {
+        log_perror("bloom_create.allocate_bloom");
+        return NULL;
+    }
+
+    b->blocks = aligned_alloc(sizeof(bloom_block_t), count * sizeof(bloom_block_t));
+    if (b->blocks == NULL) {
+        log_perror("bloom_create.allocate_blocks");
+        free(b);
+        return NULL;
+    }
+
+    memset(b->blocks, 0, count * sizeof(bloom_block_t));
+    b->mask = count - 1;
+
+    return b;
+}
+
+void bloom_destroy(bloom_t* b) {
+    if (b == NULL) {
+        return;
+    }
+
+    free(b->blocks);
+    free(b);
+}
+
+void bloom_block_add(bloom_block_t* block, uint64_t hash) {
+    uint32_t key;
+    uint32_t* words = (uint32_t*)half_of(block, hash, &key);
+
+    uint32_t mask[BLOOM_HALF_WORDS];
+    make_mask(key, mask);
+
+    for (size_t i = 0; i < BLOOM_HALF_WORDS; i++) {
+        words[i] |= mask[i];
+    }
+}
+
+bool bloom_block_test(const bloom_block_t* block, uint64_t hash) {
+    uint32_t key;
+    const uint32_t* words = half_of(block, hash, &key);
+
+    _Alignas(16) uint32_t mask[BLOOM_HALF_WORDS];
+    make_mask(key, mask);
+
+#if defined(__SSE2__)
+    // bits of the mask missing from the block
+    __m128i lo = _mm_andnot_si128(
+        _mm_load_si128((const __m128i*)words), _mm_load_si128((const __m128i*)mask));
+    __m128i hi = _mm_andnot_si128(
+        _mm_load_si128((const __m128i*)(words + 4)), _mm_load_si128((const __m128i*)(mask + 4)));
+
+    __m128i missing = _mm_or_si128(lo, hi);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(missing, _mm_setzero_si128())) == 0xffff;
+#else
+    uint32_t missing = 0;
+    for (size_t i = 0; i < BLOOM_HALF_WORDS; i++) {
+        missing |= mask[i] & ~words[i];
+    }
+
+    return missing == 0;
+#endif
+}
+
+// the block was picked by other bits, the key is remixed before use
+static const uint32_t* half_of(const bloom_block_t* block, uint64_t hash, uint32_t* key) {
+    uint64_t mixed = hash * 0x9e3779b97f4a7c15ULL;
+
+    *key = (uint32_t)(mixed >> 32);
+
+    return block->words + ((mixed >> 31) & 1) * BLOOM_HALF_WORDS;
+}
+
+static void make_mask(uint32_t key, uint32_t* mask) {
+    for (size_t i = 0; i < BLOOM_HALF_WORDS; i++) {
+        mask[i] = 1U << ((key * salts[i]) >> 27);
+    }
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BLOOM_BLOCK_WORDS 16 // 64 bytes, one cache line
+#define BLOOM_HALF_WORDS  8  // a key sets one bit in each word of one half
+
+// Blocked bloom filter. Every key lives in a single cache-line-sized block
+// picked by a block hash, so callers that know several keys share a block
+// (names under the same parent) test all of them against one line.
+// Within the block a key sets 8 bits, one per 32-bit word of a half block,
+// which is tested with two SSE2 compares where available.
+
+typedef struct {
+    _Alignas(64) uint32_t words[BLOOM_BLOCK_WORDS];
+} bloom_block_t;
+
+typedef struct {
+    bloom_block_t* blocks;
+    size_t mask;
+} bloom_t;
+
+// sized for bits_per_key bits per expected key, rounded up to a power of two blocks
+bloom_t* bloom_create(size_t expected, size_t bits_per_key);
+void bloom_destroy(bloom_t* b);
+
+static inline bloom_block_t* bloom_block(const bloom_t* b, uint64_t block_hash) {
+    return &b->blocks[(block_hash ^ (block_hash >> 32)) & b->mask];
+}
+
+void bloom_block_add(bloom_block_t* block, uint64_t hash);
+bool bloom_block_test(const bloom_block_t* block, uint64_t hash);
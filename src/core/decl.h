@@ -5,6 +5,7 @@
 
 #include "errors.h"
 
+// largest datagram a peer without EDNS accepts (RFC 1035)
 #define UDP_MSG_SIZE 512
 
 #define BOOL_TO_S(arg) ((arg) ? "true" : "false")
@@ -14,6 +15,15 @@ typedef struct connection_s connection_t;
 typedef struct event_s event_t;
 typedef struct ev_backend_s ev_backend_t;
 typedef struct listener_s listener_t;
+typedef struct signal_source_s signal_source_t;
 typedef struct udp_socket_s udp_socket_t;
 typedef struct buffer_s buffer_t;
 typedef struct settings_s settings_t;
+typedef struct udp_query_s udp_query_t;
+typedef struct tcp_pool_s tcp_pool_t;
+typedef struct dns_cache_key_s dns_cache_key_t;
+typedef struct dns_cache_entry_s dns_cache_entry_t;
+typedef struct dns_request_s dns_request_t;
+typedef struct dns_pending_s dns_pending_t;
+typedef struct dns_pending_key_s dns_pending_key_t;
+typedef struct upstream_s upstream_t;
@@ -0,0 +1,109 @@
+#include "epoch.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct jk_retired_s jk_retired_t;
+typedef struct jk_epoch_s jk_epoch_t;
+
+struct jk_retired_s {
+    void* ptr;
+    jk_epoch_release_pt release;
+    jk_retired_t* next;
+};
+
+struct jk_epoch_s {
+    uint64_t id;
+    size_t pinned;
+
+    // released once this epoch and all before it are unpinned
+    jk_retired_t* retired;
+
+    jk_epoch_t* next;
+};
+
+// oldest first, the tail is the current epoch, retirements are rare so
+// the list stays short
+static jk_epoch_t first_epoch = {0, 0, NULL, NULL};
+static jk_epoch_t* head = &first_epoch;
+static jk_epoch_t* tail = &first_epoch;
+
+static jk_epoch_t* find_epoch(uint64_t id);
+static void collect();
+
+uint64_t jk_epoch_pin() {
+    tail->pinned += 1;
+    return tail->id;
+}
+
+void jk_epoch_unpin(uint64_t epoch) {
+    logger_t* logger = current_logger;
+
+    jk_epoch_t* e = find_epoch(epoch);
+
+    CHECK_INVARIANT(e != NULL && e->pinned > 0, "epoch is not pinned");
+
+    e->pinned -= 1;
+
+    if (e == head) {
+        collect();
+    }
+}
+
+void jk_epoch_retire(void* ptr, jk_epoch_release_pt release) {
+    logger_t* logger = current_logger;
+
+    jk_retired_t* r = malloc(sizeof(jk_retired_t));
+    jk_epoch_t* next = calloc(1, sizeof(jk_epoch_t));
+
+    // without memory to track it, the data is better leaked than freed under a reader
+    if (r == NULL || next == NULL) {
+        log_perror("jk_epoch_retire.allocate");
+        free(r);
+        free(next);
+        return;
+    }
+
+    r->ptr = ptr;
+    r->release = release;
+    r->next = tail->retired;
+    tail->retired = r;
+
+    next->id = tail->id + 1;
+    tail->next = next;
+    tail = next;
+
+    collect();
+}
+
+static jk_epoch_t* find_epoch(uint64_t id) {
+    for (jk_epoch_t* e = head; e != NULL; e = e->next) {
+        if (e->id == id) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+static void collect() {
+    while (head != tail && head->pinned == 0) {
+        jk_epoch_t* e = head;
+        head = e->next;
+
+        while (e->retired != NULL) {
+            jk_retired_t* r = e->retired;
+            e->retired = r->next;
+
+            r->release(r->ptr);
+            free(r);
+        }
+
+        if (e != &first_epoch) {
+            free(e);
+        }
+    }
+}
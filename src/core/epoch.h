@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stdint.h>
+
+typedef void (*jk_epoch_release_pt)(void* ptr);
+
+// Deferred release of data swapped out while work in flight may still point
+// into it, RCU style for a single event loop. Work pins the current epoch
+// when it starts and unpins it once done. Data retired in an epoch is
+// released after everything pinned in that epoch or before has been
+// unpinned, work started later only ever sees the replacement.
+uint64_t jk_epoch_pin();
+void jk_epoch_unpin(uint64_t epoch);
+
+// opens the next epoch, ptr may be released before this returns
+void jk_epoch_retire(void* ptr, jk_epoch_release_pt release);
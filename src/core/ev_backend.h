@@ -3,6 +3,21 @@
 #include "decl.h"
 #include "time.h"
 
+#include <stdbool.h>
+
+typedef struct jk_posted_s jk_posted_t;
+
+// Work run once the events or timers at hand are all handled, for releasing
+// what a handler later in the same batch may still point to. Embedded in
+// whatever it releases, so posting never fails.
+struct jk_posted_s {
+    void (*handler)(void* data);
+    void* data;
+
+    jk_posted_t* next;
+    bool queued;
+};
+
 struct ev_backend_s {
     const char* name;
 
@@ -27,6 +42,9 @@ struct ev_backend_s {
     int64_t (*process_timers)();
 
     jk_timer_t* (*add_timer)(jk_timer_t timer);
+
+    // posting what is queued already does nothing
+    void (*post)(jk_posted_t* p);
 };
 
 extern ev_backend_t* ev_backend;
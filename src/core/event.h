@@ -11,6 +11,7 @@ enum event_owner_tag {
     EV_OWNER_LISTENER,
     EV_OWNER_CONNECTION,
     EV_OWNER_USOCK,
+    EV_OWNER_SIGNAL,
 };
 
 typedef struct {
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "decl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HANDOFF_MAX_FDS 4
+#define HANDOFF_TIMEOUT 5000 // ms a new process waits for the sockets
+
+// Bound sockets passed between processes over a unix stream socket with
+// SCM_RIGHTS. The running process listens, the one replacing it connects
+// and receives the descriptors, both then share the same sockets. The
+// connection stays open until the new process serves them and says so.
+
+// a non-blocking listener on path, a stale socket file is replaced
+listener_t* make_handoff_listener(const char* path);
+
+// the next process asking for the sockets, JK_WOULD_BLOCK if none is waiting
+int64_t accept_handoff(listener_t* l);
+
+// sends count fds over conn_fd, which is left open for poll_handoff_ready
+int64_t send_handoff(int64_t conn_fd, const int64_t* fds, size_t count);
+
+// receives exactly count fds from the process listening on path and returns
+// the connection for handoff_ready, JK_NOT_FOUND if nobody listens there
+int64_t receive_handoff(const char* path, int64_t* fds, size_t count);
+
+// tells the previous process the sockets are served here and closes conn_fd
+int64_t handoff_ready(int64_t conn_fd);
+
+// JK_OK once the new process is ready, JK_WOULD_BLOCK until then, JK_ERROR
+// if it went away without; conn_fd is closed unless JK_WOULD_BLOCK
+int64_t poll_handoff_ready(int64_t conn_fd);
@@ -1,7 +1,9 @@
 #include "ht.h"
 
 #include "core/errors.h"
+#include "core/trace.h"
 #include "logger/logger.h"
+#include "metrics/metrics.h"
 
 #include <stdbool.h>
 #include <stddef.h>
@@ -94,9 +96,13 @@ static int ht_resize(generic_ht_t* ht, ht_essentials_t* hte, size_t capacity) {
         }
     }
 
+    JK_TRACE3(ht_resize, hte->ht_name, ht->capacity, capacity);
+
     *ht = new_ht;
     free(old_slots);
 
+    metrics_inc(METRIC_HT_RESIZES);
+
     return JK_OK;
 }
 
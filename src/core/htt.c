@@ -1,5 +1,8 @@
 #include "htt.h"
 #include "core/decl.h"
+#include "dns/cache.h"
+#include "dns/dispatch.h"
+#include "dns/name.h"
 
 #include <string.h>
 
@@ -61,10 +64,148 @@ DEFINE_HT(
     connection_hash
 )
 
+static size_t udp_wq_hash(const void *vkey) {
+    uintptr_t key = (uintptr_t)*(udp_wq_key_t*)vkey;
+
+    // events are heap allocated, low bits carry no entropy
+    size_t hash = key >> 4;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+
+    return hash;
+}
+
+static int udp_wq_equal(const void *va, const void *vb) {
+    return *(udp_wq_key_t*)va == *(udp_wq_key_t*)vb;
+}
+
 DEFINE_HT( // NOLINT
     udp_wq,
-    connection_key_t,
+    udp_wq_key_t,
     event_t*,
+    udp_wq_equal,
+    udp_wq_hash
+)
+
+static size_t udp_query_hash(const void *vkey) {
+    udp_query_key_t* key = (udp_query_key_t*)vkey;
+
+    size_t hash = connection_hash(&key->upstream);
+
+    uintptr_t sock = (uintptr_t)key->sock;
+    const uint8_t *psock = (const uint8_t *)&sock;
+    for (size_t i = 0; i < sizeof(sock); i++) {
+        hash ^= psock[i];
+        hash *= FNV_PRIME;
+    }
+
+    hash ^= key->id;
+    hash *= FNV_PRIME;
+
+    hash ^= key->qhash;
+    hash *= FNV_PRIME;
+
+    return hash;
+}
+
+static int udp_query_equal(const void *va, const void *vb) {
+    udp_query_key_t* a = (udp_query_key_t*)va;
+    udp_query_key_t* b = (udp_query_key_t*)vb;
+
+    if (a->sock != b->sock) return 0;
+    if (a->id != b->id) return 0;
+    if (a->qhash != b->qhash) return 0;
+
+    return connection_equal(&a->upstream, &b->upstream);
+}
+
+DEFINE_HT( // NOLINT
+    udp_query,
+    udp_query_key_t,
+    udp_query_t,
+    udp_query_equal,
+    udp_query_hash
+)
+
+DEFINE_HT( // NOLINT
+    tcp_pool,
+    connection_key_t,
+    tcp_pool_t,
     connection_equal,
     connection_hash
 )
+
+static size_t dns_cache_hash(const void *vkey) {
+    return (*(dns_cache_key_ref_t*)vkey)->hash;
+}
+
+static int dns_cache_equal(const void *va, const void *vb) {
+    dns_cache_key_t* a = *(dns_cache_key_ref_t*)va;
+    dns_cache_key_t* b = *(dns_cache_key_ref_t*)vb;
+
+    if (a->hash != b->hash) return 0;
+    if (a->qtype != b->qtype || a->qclass != b->qclass) return 0;
+    if (a->dnssec != b->dnssec) return 0;
+    if (a->name_len != b->name_len) return 0;
+
+    return memcmp(a->name, b->name, a->name_len) == 0;
+}
+
+DEFINE_HT( // NOLINT
+    dns_cache,
+    dns_cache_key_ref_t,
+    dns_cache_entry_t,
+    dns_cache_equal,
+    dns_cache_hash
+)
+
+static size_t dns_pending_hash(const void *vkey) {
+    return (*(dns_pending_key_ref_t*)vkey)->hash;
+}
+
+static int dns_pending_equal(const void *va, const void *vb) {
+    dns_pending_key_t* a = *(dns_pending_key_ref_t*)va;
+    dns_pending_key_t* b = *(dns_pending_key_ref_t*)vb;
+    dns_cache_key_ref_t qa = &a->question;
+    dns_cache_key_ref_t qb = &b->question;
+
+    if (a->hash != b->hash) return 0;
+    if (a->checking_disabled != b->checking_disabled) return 0;
+    if (a->ecs_len != b->ecs_len) return 0;
+    if (memcmp(a->ecs, b->ecs, a->ecs_len) != 0) return 0;
+
+    return dns_cache_equal(&qa, &qb);
+}
+
+DEFINE_HT( // NOLINT
+    dns_pending,
+    dns_pending_key_ref_t,
+    dns_pending_t,
+    dns_pending_equal,
+    dns_pending_hash
+)
+
+static size_t dns_blocked_hash(const void *vkey) {
+    const uint8_t* name = *(dns_blocked_name_t*)vkey;
+    return dns_name_hash(name, (size_t)dns_name_wire_len(name, DNS_NAME_MAX_LEN));
+}
+
+// case-insensitive, names looked up come straight from queries
+static int dns_blocked_equal(const void *va, const void *vb) {
+    const uint8_t* a = *(dns_blocked_name_t*)va;
+    const uint8_t* b = *(dns_blocked_name_t*)vb;
+
+    int64_t len = dns_name_wire_len(a, DNS_NAME_MAX_LEN);
+    if (len != dns_name_wire_len(b, DNS_NAME_MAX_LEN)) return 0;
+
+    return dns_name_equal(a, b, (size_t)len);
+}
+
+DEFINE_HT( // NOLINT
+    dns_blocked,
+    dns_blocked_name_t,
+    const uint8_t,
+    dns_blocked_equal,
+    dns_blocked_hash
+)
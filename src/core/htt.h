@@ -6,4 +6,27 @@
 
 typedef address_t connection_key_t;
 DECLARE_HT(connection, connection_key_t, connection_t)
-DECLARE_HT(udp_wq, connection_key_t, event_t*)
+
+typedef event_t* udp_wq_key_t;
+DECLARE_HT(udp_wq, udp_wq_key_t, event_t*)
+
+typedef struct {
+    udp_socket_t* sock;
+    address_t upstream;
+    uint16_t id;
+    uint32_t qhash;
+} udp_query_key_t;
+DECLARE_HT(udp_query, udp_query_key_t, udp_query_t)
+
+DECLARE_HT(tcp_pool, connection_key_t, tcp_pool_t)
+
+// keys live inside the entries, the table only points at them
+typedef dns_cache_key_t* dns_cache_key_ref_t;
+DECLARE_HT(dns_cache, dns_cache_key_ref_t, dns_cache_entry_t)
+
+typedef dns_pending_key_t* dns_pending_key_ref_t;
+DECLARE_HT(dns_pending, dns_pending_key_ref_t, dns_pending_t)
+
+// case-folded wire-format names living in the blocklist arena
+typedef const uint8_t* dns_blocked_name_t;
+DECLARE_HT(dns_blocked, dns_blocked_name_t, const uint8_t)
@@ -7,6 +7,9 @@ struct listener_s {
 
     event_t *accept;
 
+    // takes over every accepted connection
+    void (*handle_connection)(int64_t fd, address_t* address);
+
     uint32_t bound:1;
     uint32_t listening:1;
     uint32_t non_blocking:1;
@@ -14,5 +17,9 @@ struct listener_s {
 };
 
 listener_t* make_listener();
+// on the loopback interface, shared with other processes binding the port
+listener_t* make_local_listener(uint16_t port);
+// takes over a listening socket handed off by another process
+listener_t* make_inherited_listener(int64_t fd);
 void release_listener(listener_t* l);
 void accept_handler(event_t* ev);
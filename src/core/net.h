@@ -2,12 +2,16 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
 
 #include "decl.h"
 
 ssize_t recv_buf(connection_t *conn, uint8_t* buf, size_t count);
 ssize_t send_buf(connection_t *conn, uint8_t* buf, size_t count);
 
+// single gathered write on a tcp connection, may be partial
+ssize_t send_iov(connection_t *conn, const struct iovec* iov, int iovcnt);
+
 ssize_t udp_recv(udp_socket_t *sock, uint8_t* buf, size_t count, address_t* address);
 ssize_t udp_send(udp_socket_t *sock, uint8_t* buf, size_t count, address_t* address);
 
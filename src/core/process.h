@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+// index of the event loop this process runs, 0 unless there are several
+extern uint32_t current_worker;
+
+// Forks count event loops sharing the listening ports through SO_REUSEPORT,
+// each pinned to a cpu of its own so whatever it allocates afterwards (the
+// cache shard above all) lands on that cpu's NUMA node. Returns JK_OK in
+// every worker, the parent supervises them and never returns. A single
+// worker runs in the calling process.
+int64_t jk_spawn_workers(uint32_t count);
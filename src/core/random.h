@@ -0,0 +1,7 @@
+#pragma once
+
+#include <stdint.h>
+
+// kernel-backed randomness, suitable for DNS query IDs and source ports
+uint32_t jk_random_u32();
+uint16_t jk_random_u16();
@@ -0,0 +1,21 @@
+#pragma once
+
+#include "decl.h"
+
+// A signal delivered as a readable fd instead of to a handler, so it is
+// dealt with between events like any other input.
+struct signal_source_s {
+    int64_t fd;
+    int signo;
+
+    event_t *ev;
+
+    uint32_t error:1;
+};
+
+// blocks signo for the process, the source owns it from then on
+signal_source_t* make_signal_source(int signo);
+void release_signal_source(signal_source_t* src);
+
+// drains the source, returns how many signals arrived or JK_ERROR
+int64_t read_signals(signal_source_t* src);
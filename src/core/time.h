@@ -9,6 +9,19 @@
 typedef void (*timer_handler)(void* data);
 
 int64_t jk_now();
+// same clock in microseconds, for measuring rather than scheduling
+int64_t jk_now_us();
+// wall clock in ms, for timestamps that outlive the process
+int64_t jk_wall_now();
+// wall clock in microseconds
+int64_t jk_wall_now_us();
+
+// cheapest clock there is for measuring short spans, the cpu cycle counter
+// when it ticks at a constant rate and the monotonic clock in ns otherwise
+uint64_t jk_ticks();
+// picks the tick source and calibrates it, called once before jk_ticks_to_ns()
+void jk_ticks_init();
+uint64_t jk_ticks_to_ns(uint64_t ticks);
 
 typedef struct {
     // time in ms
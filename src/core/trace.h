@@ -0,0 +1,37 @@
+#pragma once
+
+// USDT probes in the "jkdns" provider, for bpftrace and perf:
+//
+//   bpftrace -e 'usdt:./jkdns:jkdns:udp_recv { @bytes = hist(arg1); }'
+//
+// Built with -DJKDNS_USDT=ON they are a single nop each until a tracer
+// attaches, without it they are not compiled at all. Arguments are
+// integers or pointers, a probe never computes anything for its own sake.
+//
+//   event_start, event_done   owner tag, handler
+//   timer_fire                handler, expiry in ms
+//   conn_create, conn_close   connection, type, fd or -1
+//   udp_recv, udp_send        fd, bytes
+//   ht_resize                 table name, old capacity, new capacity
+//   upstream_send             request attempt, upstream port, over tcp
+//   upstream_reply            request attempt, bytes or -1, round trip in us
+//   proxy_remote_send         echo session, bytes
+//   proxy_remote_recv         echo session, bytes
+
+#ifdef JKDNS_USDT
+
+#include <sys/sdt.h>
+
+#define JK_TRACE(name)                   DTRACE_PROBE(jkdns, name)
+#define JK_TRACE1(name, a)               DTRACE_PROBE1(jkdns, name, a)
+#define JK_TRACE2(name, a, b)            DTRACE_PROBE2(jkdns, name, a, b)
+#define JK_TRACE3(name, a, b, c)         DTRACE_PROBE3(jkdns, name, a, b, c)
+
+#else
+
+#define JK_TRACE(name)                   do {} while (0)
+#define JK_TRACE1(name, a)               do {} while (0)
+#define JK_TRACE2(name, a, b)            do {} while (0)
+#define JK_TRACE3(name, a, b, c)         do {} while (0)
+
+#endif
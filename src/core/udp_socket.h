@@ -7,6 +7,7 @@
 #include "udp_wq.h"
 
 #define CLIENT_USOCK_TIMEOUT 10000
+#define UDP_MAX_DATAGRAM 65535
 
 struct udp_socket_s {
     int64_t fd;
@@ -20,8 +21,20 @@ struct udp_socket_s {
     uint32_t readable:1;
     uint32_t writable:1;
 
+    // upstream-facing socket, replies are demultiplexed through the query table
+    uint32_t client:1;
+    // handed off to a new process which reads it from now on, replies still go out
+    uint32_t draining:1;
+
     connection_ht_t *connections;
 
+    // client sockets only: queries awaiting replies
+    size_t inflight;
+
+    // set on a client socket private to one connection, whatever it reads
+    // goes straight to that connection instead of through the query table
+    connection_t *owner;
+
     buffer_t last_read_buf;
     udp_wq_t *wq;
 
@@ -29,7 +42,10 @@ struct udp_socket_s {
 };
 
 udp_socket_t* make_udp_socket();
-udp_socket_t* make_client_udp_socket();
+// takes over a bound socket handed off by another process
+udp_socket_t* make_inherited_udp_socket(int64_t fd);
+// client sockets talk to servers of a single address family, af
+udp_socket_t* make_client_udp_socket(int af);
+// a client socket that reads datagrams of any size, not only DNS replies
+udp_socket_t* make_session_udp_socket(int af);
 void release_udp_socket(udp_socket_t* l);
-
-// ToDo: think about source port randomization for DNS resolver queries
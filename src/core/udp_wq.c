@@ -90,7 +90,7 @@ int udp_wq_add(udp_wq_t* wq, event_t* ev) {
         return JK_OUT_OF_BUFFER;
     }
 
-    connection_key_t *key = &(conn->address);
+    udp_wq_key_t *key = &ev;
     udp_wq_ht_t* ht = wq->ht;
 
     event_t **existing_ev = udp_wq_ht_lookup(ht, key);
@@ -141,7 +141,7 @@ int udp_wq_remove(udp_wq_t* wq, event_t* ev) {
     connection_t *conn = (connection_t*)ev->owner.ptr;
     CHECK_CONN(conn);
 
-    connection_key_t *key = &(conn->address);
+    udp_wq_key_t *key = &ev;
 
     event_t** pos = udp_wq_ht_lookup(ht, key);
     if (pos == NULL) {
@@ -163,9 +163,7 @@ int udp_wq_remove(udp_wq_t* wq, event_t* ev) {
     CHECK_INVARIANT(*last_element != NULL, "last element is NULL");
 
     event_t* last_ev = *last_element;
-
-    connection_t *le_conn = (connection_t*)last_ev->owner.ptr;
-    connection_key_t *le_key = &(le_conn->address);
+    udp_wq_key_t *le_key = &last_ev;
     
     res = udp_wq_ht_insert(ht, le_key, pos);
     CHECK_INVARIANT(res == JK_OK, "ht insert failed!");
@@ -0,0 +1,688 @@
+#include "blocklist.h"
+#include "name.h"
+#include "name_kernels.h"
+#include "core/bloom.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/htt.h"
+#include "core/time.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct {
+    bloom_t* bloom;
+    dns_blocked_ht_t* names;
+
+    // the names back to back in wire format, the table points into it
+    uint8_t* arena;
+    size_t count;
+
+    // single-label names, the last label is probed only if there are any
+    size_t short_count;
+
+    // parents keyed a label deeper, set when the parent is listed itself
+    uint64_t crowded[DNS_BLOCKLIST_CROWDED_MAX];
+    bool crowded_listed[DNS_BLOCKLIST_CROWDED_MAX];
+    size_t crowded_count;
+} dns_blocklist_t;
+
+static dns_blocklist_t* active = NULL;
+
+// the file as it was when it was last loaded
+static struct stat loaded_stat;
+static jk_timer_t* watch_timer = NULL;
+
+// a list being built aside by the loader thread, polled from the event loop
+static pthread_t loader;
+static bool loading = false;
+static atomic_bool loader_done = false;
+static char* loader_path = NULL;
+static struct stat loader_stat;
+static dns_blocklist_t* loader_result = NULL;
+static jk_timer_t* loader_timer = NULL;
+// another load was asked for while one was running
+static bool load_again = false;
+
+static dns_blocklist_t* load_file(const char* path, struct stat* st);
+static void swap_in(dns_blocklist_t* bl, const struct stat* st, const char* path);
+static void start_loading(const char* path);
+static void* run_loader(void* data);
+static void arm_loader_timer();
+static void handle_loader_timer(void* data);
+static int64_t read_names(FILE* f, const char* path, uint8_t** arena, size_t* count);
+static int64_t parse_line(char* line, uint8_t* name);
+static dns_blocklist_t* build_blocklist(uint8_t* arena, size_t count);
+static void destroy_blocklist(dns_blocklist_t* bl);
+static void hash_suffixes(const uint8_t* name, const dns_name_labels_t* labels, uint64_t* hashes);
+static int64_t find_crowded(const dns_blocklist_t* bl, uint64_t hash);
+static size_t block_depth(const dns_blocklist_t* bl, const uint64_t* hashes, size_t count, bool* listed);
+static int64_t find_crowded_parents(dns_blocklist_t* bl, const uint8_t* arena, size_t count);
+static int compare_hashes(const void* a, const void* b);
+static bool is_listed(dns_blocklist_t* bl, const uint8_t* name);
+static bool file_changed(const char* path);
+static void arm_watch_timer();
+static void handle_watch_timer(void* data);
+
+int64_t dns_blocklist_init() {
+    settings_t* s = current_settings;
+
+    if (s->blocklist == NULL) {
+        return JK_OK;
+    }
+
+    return dns_blocklist_load(s->blocklist);
+}
+
+void dns_blocklist_start() {
+    settings_t* s = current_settings;
+
+    // a respawned worker is forked with the list loaded at startup,
+    // the settings or the file may have changed since
+    if (s->blocklist == NULL || file_changed(s->blocklist)) {
+        return dns_blocklist_reload();
+    }
+
+    arm_watch_timer();
+}
+
+int64_t dns_blocklist_load(const char* path) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(path != NULL, "path is NULL");
+
+    struct stat st;
+    dns_blocklist_t* bl = load_file(path, &st);
+    if (bl == NULL) {
+        return JK_ERROR;
+    }
+
+    swap_in(bl, &st, path);
+
+    return JK_OK;
+}
+
+void dns_blocklist_reload() {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    if (s->blocklist == NULL) {
+        if (watch_timer != NULL) {
+            watch_timer->enabled = false;
+            watch_timer = NULL;
+        }
+
+        if (active != NULL) {
+            log_info("dns_blocklist: blocklist removed");
+        }
+
+        destroy_blocklist(active);
+        active = NULL;
+
+        // a load still running is thrown away once it is done
+        return;
+    }
+
+    start_loading(s->blocklist);
+
+    if (watch_timer == NULL) {
+        arm_watch_timer();
+    }
+}
+
+bool dns_blocklist_match(const uint8_t* name) {
+    dns_blocklist_t* bl = active;
+    if (bl == NULL) {
+        return false;
+    }
+
+    dns_name_labels_t labels;
+    if (dns_name_labels(name, DNS_NAME_MAX_LEN, &labels) == JK_ERROR || labels.count == 0) {
+        return false;
+    }
+
+    size_t count = labels.count;
+
+    uint64_t hashes[DNS_NAME_MAX_LABELS];
+    hash_suffixes(name, &labels, hashes);
+
+    bool listed = false;
+    size_t depth = block_depth(bl, hashes, count, &listed);
+    if (listed) {
+        return true;
+    }
+
+    // the name and every parent down to the one picking the block share it
+    const bloom_block_t* block = bloom_block(bl->bloom, hashes[count - depth]);
+
+    for (size_t i = 0; i <= count - depth; i++) {
+        if (bloom_block_test(block, hashes[i]) && is_listed(bl, name + labels.offsets[i])) {
+            return true;
+        }
+    }
+
+    if (depth == 1 || bl->short_count == 0) {
+        return false;
+    }
+
+    uint64_t hash = hashes[count - 1];
+
+    return bloom_block_test(bloom_block(bl->bloom, hash), hash) &&
+           is_listed(bl, name + labels.offsets[count - 1]);
+}
+
+// builds the list without touching the one in use, safe off the event loop
+static dns_blocklist_t* load_file(const char* path, struct stat* st) {
+    logger_t* logger = current_logger;
+
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        log_perror("dns_blocklist.fopen");
+        return NULL;
+    }
+
+    // remembered before reading, a write racing the load is picked up next time
+    if (fstat(fileno(f), st) != 0) {
+        log_perror("dns_blocklist.fstat");
+        memset(st, 0, sizeof(*st));
+    }
+
+    uint8_t* arena = NULL;
+    size_t count = 0;
+
+    int64_t res = read_names(f, path, &arena, &count);
+    fclose(f);
+
+    if (res != JK_OK) {
+        free(arena);
+        return NULL;
+    }
+
+    dns_blocklist_t* bl = build_blocklist(arena, count);
+    if (bl == NULL) {
+        free(arena);
+        return NULL;
+    }
+
+    return bl;
+}
+
+// queries see either the old list or the new one
+static void swap_in(dns_blocklist_t* bl, const struct stat* st, const char* path) {
+    logger_t* logger = current_logger;
+
+    dns_blocklist_t* old = active;
+    active = bl;
+    destroy_blocklist(old);
+
+    memcpy(&loaded_stat, st, sizeof(loaded_stat));
+
+    log_info("dns_blocklist: loaded %zu names from %s", bl->count, path);
+}
+
+// big lists take a while to build, the event loop keeps answering meanwhile
+static void start_loading(const char* path) {
+    logger_t* logger = current_logger;
+
+    if (loading) {
+        load_again = true;
+        return;
+    }
+
+    loader_path = strdup(path);
+    if (loader_path == NULL) {
+        log_perror("dns_blocklist.copy_path");
+        return;
+    }
+
+    // picked before the thread starts, the choice is not made twice at once
+    dns_name_kernels();
+
+    loader_result = NULL;
+    atomic_store(&loader_done, false);
+
+    if (pthread_create(&loader, NULL, run_loader, NULL) != 0) {
+        log_error("dns_blocklist: failed to start the loader, loading in place");
+        dns_blocklist_load(loader_path);
+        free(loader_path);
+        loader_path = NULL;
+        return;
+    }
+
+    loading = true;
+    load_again = false;
+
+    arm_loader_timer();
+}
+
+static void* run_loader(void* data) {
+    (void)data; // unused
+
+    loader_result = load_file(loader_path, &loader_stat);
+    atomic_store(&loader_done, true);
+
+    return NULL;
+}
+
+static void arm_loader_timer() {
+    jk_timer_t timer;
+    jk_timer_start(&timer, DNS_BLOCKLIST_LOADER_POLL);
+    timer.handler = handle_loader_timer;
+    timer.data = NULL;
+
+    loader_timer = ev_backend->add_timer(timer);
+}
+
+static void handle_loader_timer(void* data) {
+    (void)data; // unused
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    // the firing timer is popped right after this handler returns
+    loader_timer = NULL;
+
+    if (!atomic_load(&loader_done)) {
+        return arm_loader_timer();
+    }
+
+    pthread_join(loader, NULL);
+    loading = false;
+
+    dns_blocklist_t* bl = loader_result;
+    loader_result = NULL;
+
+    // the list was dropped or its file changed again while this one was built
+    if (s->blocklist == NULL || load_again) {
+        destroy_blocklist(bl);
+    } else if (bl == NULL) {
+        log_error("dns_blocklist: keeping the old list");
+    } else {
+        swap_in(bl, &loader_stat, loader_path);
+    }
+
+    free(loader_path);
+    loader_path = NULL;
+
+    if (s->blocklist != NULL && load_again) {
+        start_loading(s->blocklist);
+    }
+}
+
+static int64_t read_names(FILE* f, const char* path, uint8_t** arena, size_t* count) {
+    logger_t* logger = current_logger;
+
+    char line[DNS_BLOCKLIST_LINE_MAX];
+    uint8_t name[DNS_NAME_MAX_LEN];
+
+    size_t len = 0;
+    size_t cap = 0;
+    size_t line_no = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        line_no += 1;
+
+        if (strchr(line, '\n') == NULL && !feof(f)) {
+            log_warn("dns_blocklist: %s:%zu: line is too long, skipped", path, line_no);
+
+            int c;
+            while ((c = fgetc(f)) != EOF && c != '\n') {
+            }
+
+            continue;
+        }
+
+        int64_t name_len = parse_line(line, name);
+        if (name_len == 0) {
+            continue;
+        }
+
+        if (name_len == JK_ERROR) {
+            log_warn("dns_blocklist: %s:%zu: bad name, skipped", path, line_no);
+            continue;
+        }
+
+        if (len + (size_t)name_len > cap) {
+            size_t new_cap = cap > 0 ? cap * 2 : 4096;
+            uint8_t* grown = realloc(*arena, new_cap);
+            if (grown == NULL) {
+                log_perror("dns_blocklist.grow_arena");
+                return JK_ERROR;
+            }
+
+            *arena = grown;
+            cap = new_cap;
+        }
+
+        memcpy(*arena + len, name, (size_t)name_len);
+        len += (size_t)name_len;
+        *count += 1;
+    }
+
+    if (ferror(f)) {
+        log_perror("dns_blocklist.fgets");
+        return JK_ERROR;
+    }
+
+    return JK_OK;
+}
+
+// returns the wire length of the name on the line, 0 if there is none
+static int64_t parse_line(char* line, uint8_t* name) {
+    char* comment = strchr(line, '#');
+    if (comment != NULL) {
+        *comment = '\0';
+    }
+
+    // the last of at most two fields, hosts files put an address first
+    char* fields[2] = {NULL, NULL};
+    size_t nfields = 0;
+
+    for (char* p = line; *p != '\0';) {
+        while (isspace((unsigned char)*p)) {
+            p++;
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+
+        if (nfields == 2) {
+            return JK_ERROR;
+        }
+
+        fields[nfields++] = p;
+
+        while (*p != '\0' && !isspace((unsigned char)*p)) {
+            p++;
+        }
+
+        if (*p != '\0') {
+            *p++ = '\0';
+        }
+    }
+
+    if (nfields == 0) {
+        return 0;
+    }
+
+    char* str = fields[nfields - 1];
+
+    if (strcmp(str, "localhost") == 0) {
+        return 0;
+    }
+
+    if (strncmp(str, "*.", 2) == 0) {
+        str += 2;
+    }
+
+    int64_t len = dns_name_from_str(str, name, DNS_NAME_MAX_LEN);
+
+    // the root would block everything
+    if (len <= 1) {
+        return JK_ERROR;
+    }
+
+    dns_name_tolower(name, name, (size_t)len);
+
+    return len;
+}
+
+static dns_blocklist_t* build_blocklist(uint8_t* arena, size_t count) {
+    logger_t* logger = current_logger;
+
+    dns_blocklist_t* bl = calloc(1, sizeof(dns_blocklist_t));
+    if (bl == NULL) {
+        log_perror("dns_blocklist.allocate_blocklist");
+        return NULL;
+    }
+
+    size_t capacity = 16;
+    while (capacity < count * DNS_BLOCKLIST_HT_LOAD) {
+        capacity <<= 1;
+    }
+
+    bl->bloom = bloom_create(count, DNS_BLOCKLIST_BITS_PER_NAME);
+    bl->names = dns_blocked_ht_create(capacity);
+
+    if (bl->bloom == NULL || bl->names == NULL) {
+        log_error("dns_blocklist: failed to allocate %zu names", count);
+        bloom_destroy(bl->bloom);
+        if (bl->names != NULL) {
+            dns_blocked_ht_destroy(bl->names);
+        }
+        free(bl);
+        return NULL;
+    }
+
+    if (find_crowded_parents(bl, arena, count) != JK_OK) {
+        destroy_blocklist(bl);
+        return NULL;
+    }
+
+    uint8_t* name = arena;
+
+    for (size_t i = 0; i < count; i++) {
+        dns_name_labels_t labels;
+        int64_t len = dns_name_labels(name, DNS_NAME_MAX_LEN, &labels);
+        CHECK_INVARIANT(len != JK_ERROR, "arena holds a bad name");
+
+        dns_blocked_name_t key = name;
+
+        // duplicates are common in merged lists
+        if (dns_blocked_ht_lookup(bl->names, &key) == NULL) {
+            if (dns_blocked_ht_insert(bl->names, &key, name) != JK_OK) {
+                log_error("dns_blocklist.dns_blocked_ht_insert");
+                destroy_blocklist(bl);
+                return NULL;
+            }
+
+            uint64_t hashes[DNS_NAME_MAX_LABELS];
+            hash_suffixes(name, &labels, hashes);
+
+            bool listed = false;
+            size_t depth = block_depth(bl, hashes, labels.count, &listed);
+
+            // a crowded parent listed itself is caught before the block is read
+            int64_t crowded = find_crowded(bl, hashes[0]);
+            if (crowded != JK_NOT_FOUND) {
+                bl->crowded_listed[crowded] = true;
+            }
+
+            bloom_block_add(bloom_block(bl->bloom, hashes[labels.count - depth]), hashes[0]);
+
+            bl->count += 1;
+            bl->short_count += labels.count == 1;
+        }
+
+        name += len;
+    }
+
+    bl->arena = arena;
+
+    return bl;
+}
+
+static void destroy_blocklist(dns_blocklist_t* bl) {
+    if (bl == NULL) {
+        return;
+    }
+
+    bloom_destroy(bl->bloom);
+    dns_blocked_ht_destroy(bl->names);
+    free(bl->arena);
+    free(bl);
+}
+
+// hashes[i] covers the name from label i down to the root, every suffix
+// continues the hash of its parent so all of them take a single pass
+static void hash_suffixes(const uint8_t* name, const dns_name_labels_t* labels, uint64_t* hashes) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+
+    for (size_t i = labels->count; i > 0; i--) {
+        const uint8_t* label = name + labels->offsets[i - 1];
+
+        for (size_t j = 0; j <= label[0]; j++) {
+            hash ^= dns_tolower(label[j]);
+            hash *= FNV_PRIME;
+        }
+
+        hashes[i - 1] = hash;
+    }
+}
+
+static int64_t find_crowded(const dns_blocklist_t* bl, uint64_t hash) {
+    for (size_t i = 0; i < bl->crowded_count; i++) {
+        if (bl->crowded[i] == hash) {
+            return (int64_t)i;
+        }
+    }
+
+    return JK_NOT_FOUND;
+}
+
+// labels from the root of the suffix whose hash picks the block, two unless
+// that suffix is a crowded parent; listed is set when a crowded parent on
+// the way is blocked itself
+static size_t block_depth(const dns_blocklist_t* bl, const uint64_t* hashes, size_t count, bool* listed) {
+    size_t depth = count < 2 ? count : 2;
+
+    for (;;) {
+        int64_t crowded = find_crowded(bl, hashes[count - depth]);
+        if (crowded == JK_NOT_FOUND) {
+            return depth;
+        }
+
+        if (bl->crowded_listed[crowded]) {
+            *listed = true;
+        }
+
+        if (depth == count) {
+            return depth;
+        }
+
+        depth += 1;
+    }
+}
+
+// a pass per depth counts the names keyed by each suffix of that depth,
+// suffixes with more than DNS_BLOCKLIST_CROWDED names are keyed deeper
+static int64_t find_crowded_parents(dns_blocklist_t* bl, const uint8_t* arena, size_t count) {
+    logger_t* logger = current_logger;
+
+    uint64_t* keys = malloc((count > 0 ? count : 1) * sizeof(uint64_t));
+    if (keys == NULL) {
+        log_perror("dns_blocklist.allocate_crowded_keys");
+        return JK_ERROR;
+    }
+
+    for (size_t depth = 2; depth < DNS_NAME_MAX_LABELS; depth++) {
+        size_t nkeys = 0;
+        const uint8_t* name = arena;
+
+        for (size_t i = 0; i < count; i++) {
+            dns_name_labels_t labels;
+            int64_t len = dns_name_labels(name, DNS_NAME_MAX_LEN, &labels);
+            CHECK_INVARIANT(len != JK_ERROR, "arena holds a bad name");
+
+            if (labels.count > depth) {
+                uint64_t hashes[DNS_NAME_MAX_LABELS];
+                hash_suffixes(name, &labels, hashes);
+
+                bool listed = false;
+                if (block_depth(bl, hashes, labels.count, &listed) == depth) {
+                    keys[nkeys++] = hashes[labels.count - depth];
+                }
+            }
+
+            name += len;
+        }
+
+        qsort(keys, nkeys, sizeof(uint64_t), compare_hashes);
+
+        size_t found = bl->crowded_count;
+
+        for (size_t i = 0, run = 1; i < nkeys; i++, run++) {
+            if (i + 1 < nkeys && keys[i + 1] == keys[i]) {
+                continue;
+            }
+
+            if (run > DNS_BLOCKLIST_CROWDED && bl->crowded_count < DNS_BLOCKLIST_CROWDED_MAX) {
+                bl->crowded[bl->crowded_count++] = keys[i];
+            }
+
+            run = 0;
+        }
+
+        if (bl->crowded_count == found || bl->crowded_count == DNS_BLOCKLIST_CROWDED_MAX) {
+            break;
+        }
+    }
+
+    free(keys);
+
+    return JK_OK;
+}
+
+static int compare_hashes(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+
+    return (x > y) - (x < y);
+}
+
+static bool is_listed(dns_blocklist_t* bl, const uint8_t* name) {
+    dns_blocked_name_t key = name;
+    return dns_blocked_ht_lookup(bl->names, &key) != NULL;
+}
+
+static bool file_changed(const char* path) {
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        return false;
+    }
+
+    return st.st_size != loaded_stat.st_size ||
+           st.st_mtim.tv_sec != loaded_stat.st_mtim.tv_sec ||
+           st.st_mtim.tv_nsec != loaded_stat.st_mtim.tv_nsec ||
+           st.st_ino != loaded_stat.st_ino;
+}
+
+static void arm_watch_timer() {
+    jk_timer_t timer;
+    jk_timer_start(&timer, DNS_BLOCKLIST_CHECK_INTERVAL);
+    timer.handler = handle_watch_timer;
+    timer.data = NULL;
+
+    watch_timer = ev_backend->add_timer(timer);
+}
+
+static void handle_watch_timer(void* data) {
+    (void)data; // unused
+    settings_t* s = current_settings;
+
+    // the firing timer is popped right after this handler returns
+    watch_timer = NULL;
+
+    if (s->blocklist == NULL) {
+        return;
+    }
+
+    if (!loading && file_changed(s->blocklist)) {
+        start_loading(s->blocklist);
+    }
+
+    arm_watch_timer();
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_BLOCKLIST_BITS_PER_NAME  16    // bloom filter bits, under 0.1% false positives
+#define DNS_BLOCKLIST_HT_LOAD        2     // table slots per name, never grown after loading
+#define DNS_BLOCKLIST_CROWDED        64    // names under one parent before it is keyed a label deeper
+#define DNS_BLOCKLIST_CROWDED_MAX    16    // crowded parents remembered, the rest share their block
+#define DNS_BLOCKLIST_LINE_MAX       1024
+#define DNS_BLOCKLIST_CHECK_INTERVAL 10000 // ms between checks of the file for changes
+#define DNS_BLOCKLIST_LOADER_POLL    20    // ms between checks for a list loaded aside
+
+// Domains answered with NXDOMAIN together with everything below them.
+// A blocked-bloom filter fronts an exact table. A name and its parents are
+// tested against the one block picked by its last two labels, so a clean
+// query costs a single cache line. Parents with too many names under them
+// (co.uk) are keyed a label deeper, names of a single label are probed in a
+// block of their own if the list has any. Only bloom hits reach the table.
+//
+// The file holds one name per line, "#" starts a comment, hosts-file
+// lines ("0.0.0.0 example.com") and "*." prefixes are accepted.
+
+// loads --blocklist if set, before the workers are forked so that they
+// share the list until one of them loads another
+int64_t dns_blocklist_init();
+
+// watches the file from the event loop, a changed file is loaded aside
+// and swapped in whole, the old list stays if loading fails
+void dns_blocklist_start();
+
+// loads path in place, blocking until the list is swapped in
+int64_t dns_blocklist_load(const char* path);
+
+// follows --blocklist of current_settings, the list is loaded by a thread of
+// its own and swapped in from the event loop once built
+void dns_blocklist_reload();
+
+// name is the uncompressed wire-format qname
+bool dns_blocklist_match(const uint8_t* name);
@@ -0,0 +1,439 @@
+#include "cache.h"
+#include "cache_snapshot.h"
+#include "dispatch.h"
+#include "edns.h"
+#include "message.h"
+#include "name.h"
+#include "core/errors.h"
+#include "core/htt.h"
+#include "core/time.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+static dns_cache_ht_t* cache = NULL;
+static size_t cache_size = 0;
+
+static dns_cache_entry_t* lru_head = NULL;
+static dns_cache_entry_t* lru_tail = NULL;
+
+static uint32_t key_hash(const dns_cache_key_t* key);
+static size_t shard_capacity();
+static dns_cache_ht_t* get_cache();
+static void lru_unlink(dns_cache_entry_t* e);
+static void lru_push_front(dns_cache_entry_t* e);
+static void remove_entry(dns_cache_entry_t* e);
+static int64_t skip_question(const uint8_t* msg, size_t len);
+static void cap_negative_ttl(uint8_t* msg, size_t len);
+static int64_t find_min_ttl(const uint8_t* msg, size_t len, uint32_t* ttl);
+
+void dns_cache_make_key(dns_cache_key_t* key, const dns_question_t* q, bool dnssec) {
+    return dns_cache_make_raw_key(key, q->qname, q->qname_len, q->qtype, q->qclass, dnssec);
+}
+
+void dns_cache_make_raw_key(dns_cache_key_t* key, const uint8_t* name, size_t name_len,
+                            uint16_t qtype, uint16_t qclass, bool dnssec) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(key != NULL, "key is NULL");
+    CHECK_INVARIANT(name_len <= DNS_NAME_MAX_LEN, "name is too long");
+
+    memset(key, 0, sizeof(*key));
+
+    dns_name_tolower(key->name, name, name_len);
+
+    key->name_len = name_len;
+    key->qtype = qtype;
+    key->qclass = qclass;
+    key->dnssec = dnssec;
+    key->hash = key_hash(key);
+}
+
+dns_cache_entry_t* dns_cache_lookup(const dns_cache_key_t* key, dns_cache_state_t* state) {
+    settings_t* s = current_settings;
+
+    *state = DNS_CACHE_MISS;
+
+    if (s->cache_size == 0) {
+        return NULL;
+    }
+
+    dns_cache_entry_t* e = NULL;
+
+    if (cache != NULL) {
+        dns_cache_key_ref_t ref = (dns_cache_key_t*)key;
+        e = dns_cache_ht_lookup(cache, &ref);
+    }
+
+    // answers saved by the previous run move in when first asked for
+    if (e == NULL) {
+        e = dns_cache_snapshot_take(key);
+    }
+
+    if (e == NULL) {
+        return NULL;
+    }
+
+    int64_t age = jk_now() - e->stored_at;
+    int64_t ttl = (int64_t)e->ttl * 1000;
+
+    if (age < ttl) {
+        *state = DNS_CACHE_FRESH;
+    } else if (age < ttl + DNS_CACHE_STALE_WINDOW * 1000) {
+        *state = DNS_CACHE_STALE;
+    } else {
+        remove_entry(e);
+        return NULL;
+    }
+
+    e->hits += 1;
+
+    lru_unlink(e);
+    lru_push_front(e);
+
+    return e;
+}
+
+bool dns_cache_need_refresh(dns_cache_entry_t* e) {
+    int64_t now = jk_now();
+
+    if (e->refresh_at != 0 && now - e->refresh_at < DNS_CACHE_REFRESH_TIMEOUT) {
+        return false;
+    }
+
+    int64_t ttl = (int64_t)e->ttl * 1000;
+    int64_t left = ttl - (now - e->stored_at);
+
+    // the last stretch of a popular answer is refreshed before anyone misses it
+    bool expiring =
+        left * 100 <= ttl * DNS_CACHE_PREFETCH_PERCENT && e->hits >= DNS_CACHE_PREFETCH_HITS;
+
+    if (left > 0 && !expiring) {
+        return false;
+    }
+
+    e->refresh_at = now;
+    return true;
+}
+
+size_t dns_cache_copy(dns_cache_entry_t* e, uint8_t* out, bool stale) {
+    memcpy(out, e->msg, e->len);
+
+    int64_t age = (jk_now() - e->stored_at) / 1000;
+
+    // the message was walked when it was stored
+    int64_t res = skip_question(out, e->len);
+    size_t pos = (size_t)res;
+
+    size_t count = dns_get_ancount(out) + dns_get_nscount(out) + dns_get_arcount(out);
+
+    for (size_t i = 0; i < count && res != JK_ERROR; i++) {
+        res = dns_skip_name(out, e->len, pos);
+        if (res == JK_ERROR) {
+            break;
+        }
+
+        uint8_t* ttl_pos = out + res + 4;
+        uint32_t ttl = ((uint32_t)dns_read_u16(ttl_pos) << 16) | dns_read_u16(ttl_pos + 2);
+
+        if (stale) {
+            ttl = ttl < DNS_CACHE_STALE_TTL ? ttl : DNS_CACHE_STALE_TTL;
+        } else {
+            ttl = ttl > age ? ttl - (uint32_t)age : 0;
+        }
+
+        dns_write_u16(ttl_pos, (uint16_t)(ttl >> 16));
+        dns_write_u16(ttl_pos + 2, (uint16_t)(ttl & 0xffff));
+
+        res = dns_skip_rr(out, e->len, pos);
+        pos = (size_t)res;
+    }
+
+    return e->len;
+}
+
+void dns_cache_store(const dns_cache_key_t* key, const uint8_t* msg, size_t len) {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    if (s->cache_size == 0 || len < DNS_HEADER_SIZE) {
+        return;
+    }
+
+    uint16_t flags = dns_get_flags(msg);
+    uint16_t rcode = flags & DNS_RCODE_MASK;
+
+    if (flags & DNS_FLAG_TC || (rcode != DNS_RCODE_NOERROR && rcode != DNS_RCODE_NXDOMAIN)) {
+        return;
+    }
+
+    dns_edns_t edns;
+    if (dns_edns_find(msg, len, &edns) != JK_OK || edns.ext_rcode != 0) {
+        return;
+    }
+
+    uint8_t* copy = malloc(len);
+    if (copy == NULL) {
+        log_perror("dns_cache_store.allocate_message");
+        return;
+    }
+
+    memcpy(copy, msg, len);
+
+    if (edns.present) {
+        len = dns_edns_strip(copy, len, &edns);
+    }
+
+    cap_negative_ttl(copy, len);
+
+    // answers without records (or with zero ttls) have nothing to expire by
+    uint32_t ttl = 0;
+    if (find_min_ttl(copy, len, &ttl) != JK_OK || ttl == 0) {
+        free(copy);
+        return;
+    }
+
+    if (ttl > DNS_CACHE_MAX_TTL) {
+        ttl = DNS_CACHE_MAX_TTL;
+    }
+
+    dns_cache_insert(key, copy, len, ttl, jk_now());
+}
+
+dns_cache_entry_t* dns_cache_insert(const dns_cache_key_t* key, uint8_t* msg, size_t len,
+                                    uint32_t ttl, int64_t stored_at) {
+    logger_t* logger = current_logger;
+
+    dns_cache_ht_t* ht = get_cache();
+    if (ht == NULL) {
+        free(msg);
+        return NULL;
+    }
+
+    dns_cache_key_ref_t ref = (dns_cache_key_t*)key;
+    dns_cache_entry_t* e = dns_cache_ht_lookup(ht, &ref);
+
+    if (e != NULL) {
+        free(e->msg);
+        lru_unlink(e);
+    } else {
+        e = calloc(1, sizeof(dns_cache_entry_t));
+        if (e == NULL) {
+            log_perror("dns_cache_insert.allocate_entry");
+            free(msg);
+            return NULL;
+        }
+
+        memcpy(&e->key, key, sizeof(*key));
+
+        ref = &e->key;
+        if (dns_cache_ht_insert(ht, &ref, e) != JK_OK) {
+            log_error("dns_cache_insert.dns_cache_ht_insert");
+            free(msg);
+            free(e);
+            return NULL;
+        }
+
+        cache_size += 1;
+    }
+
+    e->msg = msg;
+    e->len = len;
+    e->stored_at = stored_at;
+    e->ttl = ttl;
+    e->hits = 0;
+    e->refresh_at = 0;
+
+    lru_push_front(e);
+
+    // the new entry is the most recently used one and never evicted here
+    while (cache_size > shard_capacity()) {
+        remove_entry(lru_tail);
+    }
+
+    return e;
+}
+
+dns_cache_entry_t* dns_cache_newest() {
+    return lru_head;
+}
+
+bool dns_cache_contains(const dns_cache_key_t* key) {
+    if (cache == NULL) {
+        return false;
+    }
+
+    dns_cache_key_ref_t ref = (dns_cache_key_t*)key;
+    return dns_cache_ht_lookup(cache, &ref) != NULL;
+}
+
+static uint32_t key_hash(const dns_cache_key_t* key) {
+    uint64_t hash = dns_name_hash(key->name, key->name_len);
+    hash ^= ((uint64_t)key->qtype << 17) | ((uint64_t)key->qclass << 1) | key->dnssec;
+    hash *= 1099511628211ULL;
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// every worker keeps a shard of its own, --cache-size is shared among them
+static size_t shard_capacity() {
+    settings_t* s = current_settings;
+
+    size_t capacity = s->cache_size / s->workers;
+    return capacity > 0 ? capacity : 1;
+}
+
+static dns_cache_ht_t* get_cache() {
+    logger_t* logger = current_logger;
+
+    if (cache == NULL) {
+        cache = dns_cache_ht_create(DNS_CACHE_HT_CAPACITY);
+        if (cache == NULL) {
+            log_error("dns_cache.dns_cache_ht_create");
+            return NULL;
+        }
+    }
+
+    return cache;
+}
+
+static void lru_unlink(dns_cache_entry_t* e) {
+    if (e->prev != NULL) {
+        e->prev->next = e->next;
+    } else {
+        lru_head = e->next;
+    }
+
+    if (e->next != NULL) {
+        e->next->prev = e->prev;
+    } else {
+        lru_tail = e->prev;
+    }
+
+    e->prev = NULL;
+    e->next = NULL;
+}
+
+static void lru_push_front(dns_cache_entry_t* e) {
+    e->prev = NULL;
+    e->next = lru_head;
+
+    if (lru_head != NULL) {
+        lru_head->prev = e;
+    } else {
+        lru_tail = e;
+    }
+
+    lru_head = e;
+}
+
+static void remove_entry(dns_cache_entry_t* e) {
+    logger_t* logger = current_logger;
+
+    dns_cache_key_ref_t ref = &e->key;
+    int res = dns_cache_ht_delete(cache, &ref);
+    CHECK_INVARIANT(res == JK_OK, "cache entry is not in the table");
+
+    lru_unlink(e);
+    cache_size -= 1;
+
+    free(e->msg);
+    free(e);
+}
+
+static int64_t skip_question(const uint8_t* msg, size_t len) {
+    size_t pos = DNS_HEADER_SIZE;
+
+    for (uint16_t i = 0; i < dns_get_qdcount(msg); i++) {
+        int64_t res = dns_skip_name(msg, len, pos);
+        if (res == JK_ERROR || (size_t)res + 4 > len) {
+            return JK_ERROR;
+        }
+        pos = (size_t)res + 4;
+    }
+
+    return (int64_t)pos;
+}
+
+// RFC 2308 section 5: a negative answer lives for the smaller of the SOA
+// ttl and its MINIMUM field; the SOA ttl is lowered to that, so the entry
+// expires by it and clients see it counting down from there
+static void cap_negative_ttl(uint8_t* msg, size_t len) {
+    uint16_t rcode = dns_get_flags(msg) & DNS_RCODE_MASK;
+    size_t ancount = dns_get_ancount(msg);
+
+    if (ancount != 0 && rcode != DNS_RCODE_NXDOMAIN) {
+        return;
+    }
+
+    int64_t res = skip_question(msg, len);
+    size_t pos = (size_t)res;
+    size_t count = ancount + dns_get_nscount(msg);
+
+    for (size_t i = 0; i < count && res != JK_ERROR; i++) {
+        int64_t name_end = dns_skip_name(msg, len, pos);
+        res = dns_skip_rr(msg, len, pos);
+        if (res == JK_ERROR) {
+            break;
+        }
+
+        pos = (size_t)res;
+
+        uint8_t* rr = msg + name_end;
+        uint16_t rdlength = dns_read_u16(rr + 8);
+
+        if (i < ancount || dns_read_u16(rr) != DNS_TYPE_SOA || rdlength < DNS_SOA_MIN_RDATA) {
+            continue;
+        }
+
+        uint8_t* ttl_pos = rr + 4;
+        uint8_t* minimum_pos = rr + DNS_RR_FIXED_SIZE + rdlength - 4;
+
+        uint32_t ttl = ((uint32_t)dns_read_u16(ttl_pos) << 16) | dns_read_u16(ttl_pos + 2);
+        uint32_t minimum = ((uint32_t)dns_read_u16(minimum_pos) << 16) | dns_read_u16(minimum_pos + 2);
+
+        if (minimum < ttl) {
+            dns_write_u16(ttl_pos, (uint16_t)(minimum >> 16));
+            dns_write_u16(ttl_pos + 2, (uint16_t)(minimum & 0xffff));
+        }
+    }
+}
+
+static int64_t find_min_ttl(const uint8_t* msg, size_t len, uint32_t* ttl) {
+    int64_t res = skip_question(msg, len);
+    if (res == JK_ERROR) {
+        return JK_ERROR;
+    }
+
+    size_t count = dns_get_ancount(msg) + dns_get_nscount(msg) + dns_get_arcount(msg);
+    if (count == 0) {
+        return JK_NOT_FOUND;
+    }
+
+    uint32_t min = UINT32_MAX;
+    size_t pos = (size_t)res;
+
+    for (size_t i = 0; i < count; i++) {
+        int64_t name_end = dns_skip_name(msg, len, pos);
+        res = dns_skip_rr(msg, len, pos);
+        if (res == JK_ERROR) {
+            return JK_ERROR;
+        }
+
+        const uint8_t* ttl_pos = msg + name_end + 4;
+        uint32_t rr_ttl = ((uint32_t)dns_read_u16(ttl_pos) << 16) | dns_read_u16(ttl_pos + 2);
+        if (rr_ttl < min) {
+            min = rr_ttl;
+        }
+
+        pos = (size_t)res;
+    }
+
+    *ttl = min;
+    return JK_OK;
+}
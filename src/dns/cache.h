@@ -0,0 +1,87 @@
+#pragma once
+
+#include "core/decl.h"
+#include "message.h"
+#include "name.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_CACHE_HT_CAPACITY      1024
+#define DNS_CACHE_MAX_TTL          86400 // seconds
+#define DNS_CACHE_PREFETCH_PERCENT 10    // of the original ttl still left
+#define DNS_CACHE_PREFETCH_HITS    2     // hits before an entry is refreshed ahead of expiry
+#define DNS_CACHE_STALE_WINDOW     3600  // seconds an expired answer may still be served
+#define DNS_CACHE_STALE_TTL        30    // ttl handed out with stale answers (RFC 8767)
+#define DNS_CACHE_REFRESH_TIMEOUT  5000  // ms before a lost refresh may be retried
+
+typedef enum {
+    DNS_CACHE_MISS = 0,
+    DNS_CACHE_FRESH,
+    DNS_CACHE_STALE,
+} dns_cache_state_t;
+
+struct dns_cache_key_s {
+    // case-folded wire format
+    uint8_t name[DNS_NAME_MAX_LEN];
+    size_t name_len;
+    uint16_t qtype;
+    uint16_t qclass;
+
+    // DO answers carry signatures and are kept apart
+    bool dnssec;
+
+    uint32_t hash;
+};
+
+// An upstream answer without its OPT record, ttls are kept as received and
+// aged when the entry is copied out.
+struct dns_cache_entry_s {
+    dns_cache_key_t key;
+
+    uint8_t* msg;
+    size_t len;
+
+    int64_t stored_at;
+    uint32_t ttl;
+
+    // popularity since the answer was stored
+    uint32_t hits;
+    // when the last refresh went upstream, 0 if none did
+    int64_t refresh_at;
+
+    // lru order, most recently used first
+    dns_cache_entry_t* prev;
+    dns_cache_entry_t* next;
+};
+
+void dns_cache_make_key(dns_cache_key_t* key, const dns_question_t* q, bool dnssec);
+void dns_cache_make_raw_key(dns_cache_key_t* key, const uint8_t* name, size_t name_len,
+                            uint16_t qtype, uint16_t qclass, bool dnssec);
+
+// answers expired longer than DNS_CACHE_STALE_WINDOW are dropped here
+dns_cache_entry_t* dns_cache_lookup(const dns_cache_key_t* key, dns_cache_state_t* state);
+
+// true once per DNS_CACHE_REFRESH_TIMEOUT for entries that are popular and about
+// to expire or already stale, the caller is expected to query upstream
+bool dns_cache_need_refresh(dns_cache_entry_t* e);
+
+// copies the answer into out (at least e->len bytes) with aged ttls,
+// returns the message length
+size_t dns_cache_copy(dns_cache_entry_t* e, uint8_t* out, bool stale);
+
+// keeps a NOERROR or NXDOMAIN upstream answer for its smallest ttl,
+// anything else is ignored
+void dns_cache_store(const dns_cache_key_t* key, const uint8_t* msg, size_t len);
+
+// takes msg (malloc'ed, without OPT) as is, replacing any entry under key,
+// returns NULL if the entry could not be added
+dns_cache_entry_t* dns_cache_insert(const dns_cache_key_t* key, uint8_t* msg, size_t len,
+                                    uint32_t ttl, int64_t stored_at);
+
+// head of the lru list, entries follow through next
+dns_cache_entry_t* dns_cache_newest();
+
+// whether key has a live entry, without counting as a lookup
+bool dns_cache_contains(const dns_cache_key_t* key);
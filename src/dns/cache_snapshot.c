@@ -0,0 +1,677 @@
+#include "cache_snapshot.h"
+#include "cache.h"
+#include "message.h"
+#include "name.h"
+#include "core/buffer.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/process.h"
+#include "core/time.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define SNAPSHOT_MAGIC    "JKDNSCSN"
+#define SNAPSHOT_PATH_MAX 4096
+#define SNAPSHOT_ALIGN    8
+#define SNAPSHOT_IMAGE_SIZE 65536 // to begin with, doubled as records come
+
+#define SLOT_TAKEN UINT32_MAX
+
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    // wall clock, ms
+    int64_t written_at;
+    // bytes of records after the header
+    uint64_t data_len;
+    // FNV-1a of the records
+    uint64_t checksum;
+} snapshot_header_t;
+
+// followed by name_len bytes of case-folded name and msg_len bytes of
+// message, padded to SNAPSHOT_ALIGN
+typedef struct {
+    uint32_t ttl;
+    uint32_t msg_len;
+    // ms since the answer was stored, as of written_at
+    int64_t age;
+    uint16_t qtype;
+    uint16_t qclass;
+    uint8_t name_len;
+    uint8_t dnssec;
+    uint8_t reserved[2];
+} snapshot_record_t;
+
+// offset of a record into the mapping, 0 for an empty slot
+typedef struct {
+    uint32_t hash;
+    uint32_t offset;
+} snapshot_slot_t;
+
+typedef struct {
+    uint8_t* map;
+    size_t map_len;
+    int64_t written_at;
+
+    // open addressing over the records, taken ones stay as SLOT_TAKEN
+    snapshot_slot_t* slots;
+    size_t mask;
+
+    // records not taken yet
+    size_t left;
+} snapshot_t;
+
+static snapshot_t* loaded = NULL;
+static char snapshot_path[SNAPSHOT_PATH_MAX];
+
+static jk_timer_t* write_timer = NULL;
+static jk_timer_t* release_timer = NULL;
+
+// the periodic snapshot is laid out on the event loop and written by a
+// thread of its own, one at a time
+static pthread_t writer;
+static bool writing = false;
+static atomic_bool writer_done = false;
+static buffer_t writer_image;
+
+static int64_t load_snapshot(const char* path);
+static int64_t index_records(snapshot_t* snap, uint32_t count, int64_t* remaining_max);
+static snapshot_slot_t* find_slot(snapshot_t* snap, const dns_cache_key_t* key);
+static bool record_matches(const snapshot_record_t* rec, const dns_cache_key_t* key);
+static int64_t record_age(const snapshot_t* snap, const snapshot_record_t* rec);
+static bool expired(int64_t age, uint32_t ttl);
+static int64_t build_image(buffer_t* image);
+static int64_t write_image(const char* path, buffer_t* image);
+static int64_t append_record(buffer_t* image, const snapshot_record_t* rec,
+                             const uint8_t* name, const uint8_t* msg);
+static uint64_t fnv_update(uint64_t hash, const void* data, size_t len);
+static void release_snapshot();
+static void arm_write_timer();
+static void handle_write_timer(void* data);
+static void handle_release_timer(void* data);
+static void start_writing();
+static void* run_writer(void* data);
+static void wait_for_writer();
+
+int64_t dns_cache_snapshot_init() {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    if (s->cache_snapshot == NULL || s->cache_size == 0) {
+        return JK_OK;
+    }
+
+    // every worker saves its own shard
+    int len = s->workers > 1
+        ? snprintf(snapshot_path, sizeof(snapshot_path), "%s.%u", s->cache_snapshot, current_worker)
+        : snprintf(snapshot_path, sizeof(snapshot_path), "%s", s->cache_snapshot);
+
+    if (len < 0 || (size_t)len + sizeof(".tmp") > sizeof(snapshot_path)) {
+        log_error("dns_cache_snapshot: path is too long");
+        return JK_ERROR;
+    }
+
+    // a damaged snapshot only means a cold start
+    if (load_snapshot(snapshot_path) == JK_ERROR) {
+        log_warn("dns_cache_snapshot: starting with an empty cache");
+    }
+
+    arm_write_timer();
+
+    return JK_OK;
+}
+
+dns_cache_entry_t* dns_cache_snapshot_take(const dns_cache_key_t* key) {
+    logger_t* logger = current_logger;
+
+    if (loaded == NULL) {
+        return NULL;
+    }
+
+    snapshot_slot_t* slot = find_slot(loaded, key);
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    const snapshot_record_t* rec = (snapshot_record_t*)(loaded->map + slot->offset);
+    const uint8_t* msg = (const uint8_t*)(rec + 1) + rec->name_len;
+
+    slot->offset = SLOT_TAKEN;
+    loaded->left -= 1;
+
+    dns_cache_entry_t* e = NULL;
+    int64_t age = record_age(loaded, rec);
+
+    if (!expired(age, rec->ttl)) {
+        uint8_t* copy = malloc(rec->msg_len);
+        if (copy == NULL) {
+            log_perror("dns_cache_snapshot.allocate_message");
+        } else {
+            memcpy(copy, msg, rec->msg_len);
+            e = dns_cache_insert(key, copy, rec->msg_len, rec->ttl, jk_now() - age);
+        }
+    }
+
+    if (loaded->left == 0) {
+        release_snapshot();
+    }
+
+    return e;
+}
+
+void dns_cache_snapshot_save() {
+    if (snapshot_path[0] != '\0') {
+        dns_cache_snapshot_write(snapshot_path);
+    }
+}
+
+int64_t dns_cache_snapshot_write(const char* path) {
+    // a periodic write still running would rename an older image over this one
+    wait_for_writer();
+
+    buffer_t image;
+    if (build_image(&image) != JK_OK) {
+        return JK_ERROR;
+    }
+
+    int64_t res = write_image(path, &image);
+    free(image.data);
+
+    return res;
+}
+
+// lays the cache out the way it goes to disk, the checksum and the
+// writes are left to write_image
+static int64_t build_image(buffer_t* image) {
+    logger_t* logger = current_logger;
+
+    image->capacity = SNAPSHOT_IMAGE_SIZE;
+    image->taken = sizeof(snapshot_header_t);
+    image->data = calloc(image->capacity, 1);
+    if (image->data == NULL) {
+        log_perror("dns_cache_snapshot.allocate_image");
+        return JK_ERROR;
+    }
+
+    uint32_t count = 0;
+    int64_t res = JK_OK;
+    int64_t now = jk_now();
+
+    for (dns_cache_entry_t* e = dns_cache_newest(); e != NULL && res == JK_OK; e = e->next) {
+        snapshot_record_t rec;
+        memset(&rec, 0, sizeof(rec));
+
+        rec.age = now - e->stored_at;
+        if (expired(rec.age, e->ttl)) {
+            continue;
+        }
+
+        rec.ttl = e->ttl;
+        rec.msg_len = (uint32_t)e->len;
+        rec.qtype = e->key.qtype;
+        rec.qclass = e->key.qclass;
+        rec.name_len = (uint8_t)e->key.name_len;
+        rec.dnssec = e->key.dnssec;
+
+        res = append_record(image, &rec, e->key.name, e->msg);
+        count += 1;
+    }
+
+    // answers of the previous run nobody asked for yet are carried over,
+    // unless their key got a newer answer meanwhile
+    for (size_t i = 0; loaded != NULL && i <= loaded->mask && res == JK_OK; i++) {
+        uint32_t offset = loaded->slots[i].offset;
+        if (offset == 0 || offset == SLOT_TAKEN) {
+            continue;
+        }
+
+        snapshot_record_t rec = *(snapshot_record_t*)(loaded->map + offset);
+        const uint8_t* name = loaded->map + offset + sizeof(rec);
+
+        rec.age = record_age(loaded, &rec);
+        if (expired(rec.age, rec.ttl)) {
+            continue;
+        }
+
+        dns_cache_key_t key;
+        dns_cache_make_raw_key(&key, name, rec.name_len, rec.qtype, rec.qclass, rec.dnssec);
+        if (dns_cache_contains(&key)) {
+            continue;
+        }
+
+        res = append_record(image, &rec, name, name + rec.name_len);
+        count += 1;
+    }
+
+    if (res == JK_OK && image->taken > DNS_CACHE_SNAPSHOT_MAX_SIZE) {
+        log_error("dns_cache_snapshot: snapshot is too large");
+        res = JK_ERROR;
+    }
+
+    if (res != JK_OK) {
+        free(image->data);
+        image->data = NULL;
+        return JK_ERROR;
+    }
+
+    snapshot_header_t* header = (snapshot_header_t*)image->data;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+    header->version = DNS_CACHE_SNAPSHOT_VERSION;
+    header->count = count;
+    header->written_at = jk_wall_now();
+    header->data_len = image->taken - sizeof(*header);
+
+    return JK_OK;
+}
+
+// runs on the writer thread too, it touches nothing but the image
+static int64_t write_image(const char* path, buffer_t* image) {
+    logger_t* logger = current_logger;
+
+    snapshot_header_t* header = (snapshot_header_t*)image->data;
+    header->checksum = fnv_update(FNV_OFFSET_BASIS, header + 1, header->data_len);
+
+    char tmp_path[SNAPSHOT_PATH_MAX];
+    int len = snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    if (len < 0 || (size_t)len >= sizeof(tmp_path)) {
+        log_error("dns_cache_snapshot: path is too long");
+        return JK_ERROR;
+    }
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        log_perror("dns_cache_snapshot.open_tmp");
+        return JK_ERROR;
+    }
+
+    int64_t res = JK_OK;
+    size_t written = 0;
+
+    while (written < image->taken) {
+        ssize_t n = write(fd, image->data + written, image->taken - written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n <= 0) {
+            res = JK_ERROR;
+            break;
+        }
+
+        written += (size_t)n;
+    }
+
+    if (res == JK_OK && fsync(fd) != 0) {
+        res = JK_ERROR;
+    }
+
+    if (close(fd) != 0) {
+        res = JK_ERROR;
+    }
+
+    if (res != JK_OK) {
+        log_perror("dns_cache_snapshot.write");
+        unlink(tmp_path);
+        return JK_ERROR;
+    }
+
+    if (rename(tmp_path, path) != 0) {
+        log_perror("dns_cache_snapshot.rename");
+        unlink(tmp_path);
+        return JK_ERROR;
+    }
+
+    log_trace("dns_cache_snapshot: %u answers written to %s", header->count, path);
+
+    return JK_OK;
+}
+
+static int64_t load_snapshot(const char* path) {
+    logger_t* logger = current_logger;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1 && errno == ENOENT) {
+        log_info("dns_cache_snapshot: no snapshot at %s yet", path);
+        return JK_NOT_FOUND;
+    }
+
+    if (fd == -1) {
+        log_perror("dns_cache_snapshot.open");
+        return JK_ERROR;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        log_perror("dns_cache_snapshot.fstat");
+        close(fd);
+        return JK_ERROR;
+    }
+
+    size_t size = (size_t)st.st_size;
+
+    if (size < sizeof(snapshot_header_t) || (uint64_t)size > DNS_CACHE_SNAPSHOT_MAX_SIZE) {
+        log_warn("dns_cache_snapshot: %s has a bad size", path);
+        close(fd);
+        return JK_ERROR;
+    }
+
+    uint8_t* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        log_perror("dns_cache_snapshot.mmap");
+        return JK_ERROR;
+    }
+
+    const snapshot_header_t* header = (const snapshot_header_t*)map;
+    const uint8_t* data = map + sizeof(*header);
+
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != DNS_CACHE_SNAPSHOT_VERSION ||
+        header->data_len != size - sizeof(*header) ||
+        fnv_update(FNV_OFFSET_BASIS, data, header->data_len) != header->checksum) {
+        log_warn("dns_cache_snapshot: %s is damaged or of another version", path);
+        munmap(map, size);
+        return JK_ERROR;
+    }
+
+    snapshot_t* snap = calloc(1, sizeof(snapshot_t));
+    if (snap == NULL) {
+        log_perror("dns_cache_snapshot.allocate_snapshot");
+        munmap(map, size);
+        return JK_ERROR;
+    }
+
+    snap->map = map;
+    snap->map_len = size;
+    snap->written_at = header->written_at;
+
+    int64_t remaining_max = 0;
+
+    if (index_records(snap, header->count, &remaining_max) != JK_OK) {
+        log_warn("dns_cache_snapshot: %s is damaged", path);
+        free(snap->slots);
+        free(snap);
+        munmap(map, size);
+        return JK_ERROR;
+    }
+
+    log_info("dns_cache_snapshot: %zu answers from %s, written %lld s ago",
+             snap->left, path, (long long)((jk_wall_now() - snap->written_at) / 1000));
+
+    loaded = snap;
+
+    if (snap->left == 0) {
+        release_snapshot();
+        return JK_OK;
+    }
+
+    // whatever is still there once the longest ttl runs out is of no use
+    jk_timer_t timer;
+    jk_timer_start(&timer, remaining_max);
+    timer.handler = handle_release_timer;
+    timer.data = NULL;
+
+    release_timer = ev_backend->add_timer(timer);
+
+    return JK_OK;
+}
+
+// every record is checked against the mapping before it is indexed
+static int64_t index_records(snapshot_t* snap, uint32_t count, int64_t* remaining_max) {
+    logger_t* logger = current_logger;
+
+    size_t capacity = 16;
+    while (capacity < (size_t)count * 2) {
+        capacity <<= 1;
+    }
+
+    snap->slots = calloc(capacity, sizeof(snapshot_slot_t));
+    if (snap->slots == NULL) {
+        log_perror("dns_cache_snapshot.allocate_slots");
+        return JK_ERROR;
+    }
+
+    snap->mask = capacity - 1;
+
+    size_t pos = sizeof(snapshot_header_t);
+
+    for (uint32_t i = 0; i < count; i++) {
+        if (pos + sizeof(snapshot_record_t) > snap->map_len) {
+            return JK_ERROR;
+        }
+
+        const snapshot_record_t* rec = (snapshot_record_t*)(snap->map + pos);
+        const uint8_t* name = (const uint8_t*)(rec + 1);
+
+        size_t end = pos + sizeof(*rec) + rec->name_len + rec->msg_len;
+        end = (end + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+
+        if (end > snap->map_len || rec->msg_len < DNS_HEADER_SIZE ||
+            dns_name_wire_len(name, rec->name_len) != rec->name_len) {
+            return JK_ERROR;
+        }
+
+        int64_t age = record_age(snap, rec);
+
+        dns_cache_key_t key;
+        dns_cache_make_raw_key(&key, name, rec->name_len, rec->qtype, rec->qclass, rec->dnssec);
+
+        // records go newest first, a later one for the same key is older
+        if (!expired(age, rec->ttl) && find_slot(snap, &key) == NULL) {
+            int64_t remaining = ((int64_t)rec->ttl + DNS_CACHE_STALE_WINDOW) * 1000 - age;
+            if (remaining > *remaining_max) {
+                *remaining_max = remaining;
+            }
+
+            size_t slot = key.hash & snap->mask;
+            while (snap->slots[slot].offset != 0) {
+                slot = (slot + 1) & snap->mask;
+            }
+
+            snap->slots[slot].hash = key.hash;
+            snap->slots[slot].offset = (uint32_t)pos;
+            snap->left += 1;
+        }
+
+        pos = end;
+    }
+
+    return pos == snap->map_len ? JK_OK : JK_ERROR;
+}
+
+// a key has one slot at most, once it is taken the key is not found again
+static snapshot_slot_t* find_slot(snapshot_t* snap, const dns_cache_key_t* key) {
+    for (size_t i = key->hash & snap->mask; snap->slots[i].offset != 0; i = (i + 1) & snap->mask) {
+        snapshot_slot_t* slot = &snap->slots[i];
+
+        if (slot->hash != key->hash || slot->offset == SLOT_TAKEN) {
+            continue;
+        }
+
+        if (record_matches((snapshot_record_t*)(snap->map + slot->offset), key)) {
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static bool record_matches(const snapshot_record_t* rec, const dns_cache_key_t* key) {
+    return rec->name_len == key->name_len &&
+           rec->qtype == key->qtype &&
+           rec->qclass == key->qclass &&
+           rec->dnssec == key->dnssec &&
+           memcmp(rec + 1, key->name, key->name_len) == 0;
+}
+
+// a wall clock stepped back does not make answers younger
+static int64_t record_age(const snapshot_t* snap, const snapshot_record_t* rec) {
+    int64_t elapsed = jk_wall_now() - snap->written_at;
+    return rec->age + (elapsed > 0 ? elapsed : 0);
+}
+
+// past the window in which a stale answer may still be served
+static bool expired(int64_t age, uint32_t ttl) {
+    return age >= ((int64_t)ttl + DNS_CACHE_STALE_WINDOW) * 1000;
+}
+
+static int64_t append_record(buffer_t* image, const snapshot_record_t* rec,
+                             const uint8_t* name, const uint8_t* msg) {
+    logger_t* logger = current_logger;
+
+    size_t len = sizeof(*rec) + rec->name_len + rec->msg_len;
+    size_t padded = (len + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+
+    if (image->taken + padded > image->capacity) {
+        size_t capacity = image->capacity * 2;
+        while (capacity < image->taken + padded) {
+            capacity *= 2;
+        }
+
+        uint8_t* data = realloc(image->data, capacity);
+        if (data == NULL) {
+            log_perror("dns_cache_snapshot.grow_image");
+            return JK_ERROR;
+        }
+
+        image->data = data;
+        image->capacity = capacity;
+    }
+
+    uint8_t* pos = image->data + image->taken;
+
+    memcpy(pos, rec, sizeof(*rec));
+    memcpy(pos + sizeof(*rec), name, rec->name_len);
+    memcpy(pos + sizeof(*rec) + rec->name_len, msg, rec->msg_len);
+    memset(pos + len, 0, padded - len);
+
+    image->taken += padded;
+
+    return JK_OK;
+}
+
+static uint64_t fnv_update(uint64_t hash, const void* data, size_t len) {
+    const uint8_t* p = data;
+
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+
+    return hash;
+}
+
+static void release_snapshot() {
+    if (release_timer != NULL) {
+        release_timer->enabled = false;
+        release_timer = NULL;
+    }
+
+    munmap(loaded->map, loaded->map_len);
+    free(loaded->slots);
+    free(loaded);
+
+    loaded = NULL;
+}
+
+static void arm_write_timer() {
+    jk_timer_t timer;
+    jk_timer_start(&timer, DNS_CACHE_SNAPSHOT_INTERVAL);
+    timer.handler = handle_write_timer;
+    timer.data = NULL;
+
+    write_timer = ev_backend->add_timer(timer);
+}
+
+static void handle_write_timer(void* data) {
+    (void)data;
+
+    // the firing timer is popped right after this handler returns
+    write_timer = NULL;
+
+    start_writing();
+
+    arm_write_timer();
+}
+
+static void start_writing() {
+    logger_t* logger = current_logger;
+
+    if (writing && !atomic_load(&writer_done)) {
+        log_warn("dns_cache_snapshot: the previous snapshot is still being written, skipping");
+        return;
+    }
+
+    wait_for_writer();
+
+    if (build_image(&writer_image) != JK_OK) {
+        return;
+    }
+
+    atomic_store(&writer_done, false);
+
+    if (pthread_create(&writer, NULL, run_writer, NULL) != 0) {
+        log_error("dns_cache_snapshot: failed to start the writer, writing in place");
+        write_image(snapshot_path, &writer_image);
+        free(writer_image.data);
+        writer_image.data = NULL;
+        return;
+    }
+
+    writing = true;
+}
+
+static void* run_writer(void* data) {
+    (void)data; // unused
+
+    write_image(snapshot_path, &writer_image);
+    free(writer_image.data);
+    writer_image.data = NULL;
+
+    atomic_store(&writer_done, true);
+
+    return NULL;
+}
+
+// a writer that is done is joined the next time a snapshot is written
+static void wait_for_writer() {
+    if (!writing) {
+        return;
+    }
+
+    pthread_join(writer, NULL);
+    writing = false;
+}
+
+static void handle_release_timer(void* data) {
+    logger_t* logger = current_logger;
+
+    (void)data;
+
+    // the firing timer is popped right after this handler returns
+    release_timer = NULL;
+
+    if (loaded != NULL) {
+        log_trace("dns_cache_snapshot: %zu answers expired unused", loaded->left);
+        release_snapshot();
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stdint.h>
+
+#define DNS_CACHE_SNAPSHOT_INTERVAL 60000 // ms between snapshots
+#define DNS_CACHE_SNAPSHOT_VERSION  1
+#define DNS_CACHE_SNAPSHOT_MAX_SIZE ((uint64_t)1 << 32) // records are indexed by 32-bit offsets
+
+// The cache saved to --cache-snapshot (".<worker>" appended when there are
+// several workers) every DNS_CACHE_SNAPSHOT_INTERVAL. The file is flat and
+// pointer-free: a header, then one record per answer, most recently used
+// first, each holding its key, ttl, age and message, 8-byte aligned. It is
+// laid out in memory on the event loop, written aside by a thread of its
+// own and renamed over the previous one.
+//
+// At startup the last snapshot is mapped, checked and indexed. Answers move
+// into the live cache the first time they are looked up, aged by the time
+// since the snapshot was written, the mapping goes away once every answer
+// in it has moved or expired.
+int64_t dns_cache_snapshot_init();
+
+// NULL unless the mapped snapshot holds a usable answer for key, which
+// is then in the live cache
+dns_cache_entry_t* dns_cache_snapshot_take(const dns_cache_key_t* key);
+
+int64_t dns_cache_snapshot_write(const char* path);
+
+// writes the snapshot now instead of at the next interval, if there is one
+void dns_cache_snapshot_save();
@@ -0,0 +1,1212 @@
+#include "dispatch.h"
+#include "blocklist.h"
+#include "cache.h"
+#include "edns.h"
+#include "message.h"
+#include "name.h"
+#include "render.h"
+#include "connection/connection.h"
+#include "core/connection.h"
+#include "core/decl.h"
+#include "core/epoch.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/net.h"
+#include "core/random.h"
+#include "core/time.h"
+#include "core/trace.h"
+#include "core/udp_socket.h"
+#include "logger/logger.h"
+#include "metrics/metrics.h"
+#include "settings/settings.h"
+#include "udp_socket/client_pool.h"
+#include "udp_socket/udp_query.h"
+#include "upstream/tcp_pool.h"
+#include "upstream/upstream.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// header, the longest question and an OPT record
+#define DNS_ERROR_RESPONSE_SIZE (DNS_HEADER_SIZE + DNS_NAME_MAX_LEN + 4 + DNS_OPT_RR_SIZE)
+
+#define DNS_ATTEMPTS 2 // the first query and its hedge
+
+typedef struct dns_refresh_s dns_refresh_t;
+
+// one upstream asked on behalf of a pending query
+typedef struct {
+    dns_pending_t* pending;
+    upstream_t* upstream;
+    int64_t sent_at; // us
+
+    // at most one is set, none once the attempt is over
+    udp_query_t* udp_query;
+    tcp_pool_query_t* tcp_query;
+} dns_attempt_t;
+
+struct dns_pending_s {
+    dns_pending_key_t key;
+
+    // the first asker's query carrying our OPT, sent on behalf of everyone
+    uint8_t* query;
+    size_t query_len;
+
+    // the first answer wins, the slower attempt is cancelled
+    dns_attempt_t attempts[DNS_ATTEMPTS];
+    size_t attempts_sent;
+
+    // the next best upstream is asked as well if no answer came by hedge_at
+    bool hedge_waiting;
+    int64_t hedge_at;
+    dns_pending_t* hedge_prev;
+    dns_pending_t* hedge_next;
+
+    dns_request_t* head;
+    dns_request_t* tail;
+
+    // waiters leaving while the answer is handed out do not release it
+    bool delivering;
+
+    // settings and upstreams the query started with stay until it is over,
+    // even if every waiter that pinned them has left
+    settings_t* settings;
+    uint64_t epoch;
+};
+
+struct dns_refresh_s {
+    dns_cache_key_t key;
+    dns_refresh_t* next;
+};
+
+// upstream queries in flight by question
+static dns_pending_ht_t* pending_queries = NULL;
+
+// created and not yet destroyed, background refreshes included
+static size_t requests_alive = 0;
+
+// requests with a stale answer in reserve, deadlines grow along the list
+static dns_request_t* stale_head = NULL;
+static dns_request_t* stale_tail = NULL;
+static jk_timer_t* stale_timer = NULL;
+
+// pending queries waiting to be hedged, ordered by hedge_at
+static dns_pending_t* hedge_head = NULL;
+static dns_pending_t* hedge_tail = NULL;
+static jk_timer_t* hedge_timer = NULL;
+
+// cached answers to refresh in the background
+static dns_refresh_t* refresh_head = NULL;
+static dns_refresh_t* refresh_tail = NULL;
+static size_t refresh_queued = 0;
+static jk_timer_t* refresh_timer = NULL;
+
+static void finish(dns_request_t* req);
+static void fit_response(dns_request_t* req);
+static void respond_error(dns_request_t* req, uint16_t rcode);
+static void adapt_response(dns_request_t* req, size_t len, uint8_t ext_rcode);
+static int64_t make_pending_key(dns_pending_key_t* key, const dns_cache_key_t* question,
+                                const uint8_t* msg, const dns_edns_t* edns);
+static void join_upstream_query(dns_request_t* req, dns_pending_key_t* key);
+static dns_pending_t* create_pending(dns_request_t* req, dns_pending_key_t* key);
+static void attach_pending(dns_pending_t* p, dns_request_t* req);
+static void detach_pending(dns_request_t* req);
+static void release_pending(dns_pending_t* p);
+static int64_t prepare_upstream_query(dns_pending_t* p);
+static void start_upstream_query(dns_pending_t* p);
+static bool send_hedge(dns_pending_t* p);
+static void send_attempt(dns_pending_t* p, upstream_t* u);
+static void cancel_attempt(dns_attempt_t* a);
+static bool attempts_in_flight(dns_pending_t* p);
+static void forward_udp(dns_attempt_t* a);
+static void forward_tcp(dns_attempt_t* a);
+static void handle_upstream_reply(void* data, uint8_t* msg, size_t len);
+static void wait_hedge(dns_pending_t* p, int64_t delay);
+static void stop_waiting_hedge(dns_pending_t* p);
+static void arm_hedge_timer(int64_t now);
+static void handle_hedge_timer(void* data);
+static void deliver_reply(dns_request_t* req, uint8_t* msg, size_t len, bool failed);
+static bool lookup_cache(dns_request_t* req, dns_cache_key_t* key);
+static void answer_cached(dns_request_t* req, dns_cache_entry_t* e, bool stale);
+static bool serve_stale(dns_request_t* req);
+static void wait_stale(dns_request_t* req);
+static void stop_waiting_stale(dns_request_t* req);
+static void arm_stale_timer(int64_t delay);
+static void handle_stale_timer(void* data);
+static void schedule_refresh(const dns_cache_key_t* key);
+static void handle_refresh_timer(void* data);
+static void start_refresh(const dns_cache_key_t* key);
+static void refresh_done(dns_request_t* req);
+
+dns_request_t* dns_request_create(
+    const uint8_t* msg,
+    size_t len,
+    address_t* client,
+    bool over_tcp,
+    dns_request_done_pt done,
+    void* data) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+    CHECK_INVARIANT(client != NULL, "client is NULL");
+    CHECK_INVARIANT(done != NULL, "done is NULL");
+
+    dns_request_t* req = calloc(1, sizeof(dns_request_t));
+    if (req == NULL) {
+        log_perror("dns_request_create.allocate_request");
+        return NULL;
+    }
+
+    req->query = malloc(len > 0 ? len : 1);
+    if (req->query == NULL) {
+        log_perror("dns_request_create.allocate_query");
+        free(req);
+        return NULL;
+    }
+
+    memcpy(req->query, msg, len);
+    req->query_len = len;
+
+    memcpy(&req->client, client, sizeof(*client));
+    req->over_tcp = over_tcp;
+    req->received_at = jk_now_us();
+    req->started = jk_ticks();
+    req->lap = req->started;
+    req->udp_limit = UDP_MSG_SIZE;
+    req->done = done;
+    req->data = data;
+
+    // a reload in the meantime does not change the rules halfway through
+    req->settings = current_settings;
+    req->epoch = jk_epoch_pin();
+
+    requests_alive += 1;
+    metrics_add(METRIC_DNS_REQUESTS, 1);
+
+    return req;
+}
+
+void dns_request_destroy(dns_request_t* req) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(req != NULL, "req is NULL");
+
+    detach_pending(req);
+    stop_waiting_stale(req);
+
+    uint64_t epoch = req->epoch;
+
+    free(req->query);
+    free(req->response);
+    free(req);
+
+    requests_alive -= 1;
+    metrics_add(METRIC_DNS_REQUESTS, -1);
+
+    jk_epoch_unpin(epoch);
+}
+
+size_t dns_request_count() {
+    return requests_alive;
+}
+
+void dns_dispatch(dns_request_t* req) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(req != NULL, "req is NULL");
+    CHECK_INVARIANT(req->response == NULL, "request is already answered");
+
+    settings_t* s = req->settings;
+
+    if (!req->refresh) {
+        metrics_inc(METRIC_DNS_QUERIES);
+    }
+
+    // never answer responses, two resolvers could bounce them forever
+    if (req->query_len < DNS_HEADER_SIZE || dns_get_flags(req->query) & DNS_FLAG_QR) {
+        log_trace("dns_dispatch: dropping malformed query");
+        return finish(req);
+    }
+
+    dns_question_t question;
+    if (dns_parse_question(req->query, req->query_len, &question) != JK_OK) {
+        return respond_error(req, DNS_RCODE_FORMERR);
+    }
+
+    req->qname = question.qname;
+    req->qname_len = question.qname_len;
+    req->qtype = question.qtype;
+
+    dns_edns_t edns;
+    if (dns_edns_find(req->query, req->query_len, &edns) != JK_OK) {
+        return respond_error(req, DNS_RCODE_FORMERR);
+    }
+
+    if (!req->refresh) {
+        metrics_lap(HIST_DNS_PARSE, &req->lap);
+    }
+
+    if (edns.present) {
+        req->client_edns = true;
+        req->dnssec = (edns.flags & DNS_EDNS_FLAG_DO) != 0;
+
+        // never promise more than our own buffers take
+        uint16_t limit = edns.udp_size < s->edns_size ? edns.udp_size : s->edns_size;
+        req->udp_limit = limit > UDP_MSG_SIZE ? limit : UDP_MSG_SIZE;
+
+        if (edns.version != 0) {
+            return respond_error(req, DNS_RCODE_BADVERS);
+        }
+    }
+
+    if (!s->proxy_mode) {
+        return respond_error(req, DNS_RCODE_REFUSED);
+    }
+
+    if (dns_blocklist_match(question.qname)) {
+        log_trace("dns_dispatch: name is blocked");
+        return respond_error(req, DNS_RCODE_NXDOMAIN);
+    }
+
+    dns_cache_key_t key;
+    dns_cache_make_key(&key, &question, req->dnssec);
+
+    if (!req->refresh && lookup_cache(req, &key)) {
+        return;
+    }
+
+    dns_pending_key_t pending_key;
+    if (make_pending_key(&pending_key, &key, req->query, &edns) != JK_OK) {
+        return respond_error(req, DNS_RCODE_FORMERR);
+    }
+
+    join_upstream_query(req, &pending_key);
+}
+
+static void finish(dns_request_t* req) {
+    detach_pending(req);
+    stop_waiting_stale(req);
+    fit_response(req);
+
+    if (!req->refresh) {
+        metrics_lap(HIST_DNS_RENDER, &req->lap);
+    }
+
+    req->done(req);
+}
+
+static void fit_response(dns_request_t* req) {
+    settings_t* s = req->settings;
+
+    if (req->response == NULL) {
+        return;
+    }
+
+    if (req->over_tcp || req->response_len <= req->udp_limit) {
+        return;
+    }
+
+    // keep the question only, TC tells the client to come back over tcp
+    size_t len = dns_truncate(req->response, req->response_len);
+
+    // the dropped response was larger than UDP_MSG_SIZE, the OPT fits in its place
+    if (req->client_edns) {
+        dns_edns_write_opt(req->response + len, s->edns_size, 0, 0);
+        dns_set_arcount(req->response, 1);
+        len += DNS_OPT_RR_SIZE;
+    }
+
+    req->response_len = len;
+}
+
+static void respond_error(dns_request_t* req, uint16_t rcode) {
+    logger_t* logger = current_logger;
+    settings_t* s = req->settings;
+
+    size_t cap = DNS_ERROR_RESPONSE_SIZE;
+
+    req->response = malloc(cap);
+    if (req->response == NULL) {
+        log_perror("dns_dispatch.allocate_error_response");
+        return finish(req);
+    }
+
+    uint16_t flags = dns_get_flags(req->query);
+    flags = (flags & (DNS_OPCODE_MASK | DNS_FLAG_RD)) | DNS_FLAG_QR | (rcode & DNS_RCODE_MASK);
+
+    // header plus the echoed question, everything else is dropped
+    dns_render_t r;
+    int64_t res = dns_render_init(&r, req->response, cap, dns_get_id(req->query), flags);
+    CHECK_INVARIANT(res == JK_OK, "error response buffer is too small");
+
+    dns_question_t question;
+    if (dns_parse_question(req->query, req->query_len, &question) == JK_OK) {
+        dns_render_question(&r, question.qname, question.qtype, question.qclass);
+    }
+
+    if (req->client_edns) {
+        res = dns_render_opt(&r, s->edns_size, (uint8_t)(rcode >> 4), 0);
+        CHECK_INVARIANT(res == JK_OK, "error response buffer is too small");
+    }
+
+    req->response_len = dns_render_finish(&r);
+
+    finish(req);
+}
+
+// a shared answer becomes the client's own: ID, RD bit, spelling of the name, OPT
+static void adapt_response(dns_request_t* req, size_t len, uint8_t ext_rcode) {
+    settings_t* s = req->settings;
+
+    uint8_t* resp = req->response;
+
+    dns_set_id(resp, dns_get_id(req->query));
+
+    uint16_t flags = dns_get_flags(resp) & ~DNS_FLAG_RD;
+    dns_set_flags(resp, flags | (dns_get_flags(req->query) & DNS_FLAG_RD));
+
+    dns_question_t asked;
+    dns_question_t answered;
+
+    if (dns_parse_question(req->query, req->query_len, &asked) == JK_OK &&
+        dns_parse_question(resp, len, &answered) == JK_OK &&
+        asked.qname_len == answered.qname_len) {
+        memcpy(resp + DNS_HEADER_SIZE, asked.qname, asked.qname_len);
+    }
+
+    if (req->client_edns) {
+        uint16_t edns_flags = req->dnssec ? DNS_EDNS_FLAG_DO : 0;
+        dns_edns_write_opt(resp + len, s->edns_size, ext_rcode, edns_flags);
+        dns_set_arcount(resp, dns_get_arcount(resp) + 1);
+        len += DNS_OPT_RR_SIZE;
+    }
+
+    req->response_len = len;
+
+    finish(req);
+}
+
+// JK_ERROR when the client subnet option is malformed
+static int64_t make_pending_key(dns_pending_key_t* key, const dns_cache_key_t* question,
+                                const uint8_t* msg, const dns_edns_t* edns) {
+    memset(key, 0, sizeof(*key));
+    memcpy(&key->question, question, sizeof(*question));
+    key->checking_disabled = (dns_get_flags(msg) & DNS_FLAG_CD) != 0;
+
+    uint64_t hash = question->hash;
+    hash ^= key->checking_disabled;
+    hash *= 1099511628211ULL;
+
+    if (!edns->present) {
+        key->hash = (uint32_t)(hash ^ (hash >> 32));
+        return JK_OK;
+    }
+
+    const uint8_t* ecs = NULL;
+    size_t ecs_len = 0;
+
+    int64_t res = dns_edns_find_option(msg, edns, DNS_EDNS_OPTION_ECS, &ecs, &ecs_len);
+    if (res == JK_ERROR || ecs_len > DNS_ECS_MAX_LEN) {
+        return JK_ERROR;
+    }
+
+    if (res == JK_OK) {
+        memcpy(key->ecs, ecs, ecs_len);
+        key->ecs_len = ecs_len;
+    }
+
+    for (size_t i = 0; i < key->ecs_len; i++) {
+        hash ^= key->ecs[i];
+        hash *= 1099511628211ULL;
+    }
+
+    key->hash = (uint32_t)(hash ^ (hash >> 32));
+
+    return JK_OK;
+}
+
+// identical questions in flight share a single upstream query
+static void join_upstream_query(dns_request_t* req, dns_pending_key_t* key) {
+    logger_t* logger = current_logger;
+
+    if (pending_queries == NULL) {
+        pending_queries = dns_pending_ht_create(DNS_PENDING_HT_CAPACITY);
+        if (pending_queries == NULL) {
+            log_error("dns_dispatch.dns_pending_ht_create");
+            return respond_error(req, DNS_RCODE_SERVFAIL);
+        }
+    }
+
+    dns_pending_key_ref_t ref = key;
+    dns_pending_t* p = dns_pending_ht_lookup(pending_queries, &ref);
+
+    if (p != NULL) {
+        log_trace("dns_dispatch: joining upstream query in flight");
+        return attach_pending(p, req);
+    }
+
+    p = create_pending(req, key);
+    if (p == NULL) {
+        return respond_error(req, DNS_RCODE_SERVFAIL);
+    }
+
+    attach_pending(p, req);
+    start_upstream_query(p);
+}
+
+static dns_pending_t* create_pending(dns_request_t* req, dns_pending_key_t* key) {
+    logger_t* logger = current_logger;
+
+    dns_pending_t* p = calloc(1, sizeof(dns_pending_t));
+    if (p == NULL) {
+        log_perror("dns_dispatch.allocate_pending");
+        return NULL;
+    }
+
+    p->query = malloc(req->query_len);
+    if (p->query == NULL) {
+        log_perror("dns_dispatch.allocate_pending_query");
+        free(p);
+        return NULL;
+    }
+
+    memcpy(p->query, req->query, req->query_len);
+    p->query_len = req->query_len;
+    memcpy(&p->key, key, sizeof(*key));
+    p->settings = req->settings;
+
+    if (prepare_upstream_query(p) != JK_OK) {
+        free(p->query);
+        free(p);
+        return NULL;
+    }
+
+    dns_pending_key_ref_t ref = &p->key;
+    if (dns_pending_ht_insert(pending_queries, &ref, p) != JK_OK) {
+        log_error("dns_dispatch.dns_pending_ht_insert");
+        free(p->query);
+        free(p);
+        return NULL;
+    }
+
+    // the creator's pin may go before the query does, the query pins its own
+    p->epoch = jk_epoch_pin();
+
+    return p;
+}
+
+static void attach_pending(dns_pending_t* p, dns_request_t* req) {
+    req->pending = p;
+    req->pending_prev = p->tail;
+    req->pending_next = NULL;
+
+    if (p->tail != NULL) {
+        p->tail->pending_next = req;
+    } else {
+        p->head = req;
+    }
+
+    p->tail = req;
+}
+
+static void detach_pending(dns_request_t* req) {
+    dns_pending_t* p = req->pending;
+    if (p == NULL) {
+        return;
+    }
+
+    if (req->pending_prev != NULL) {
+        req->pending_prev->pending_next = req->pending_next;
+    } else {
+        p->head = req->pending_next;
+    }
+
+    if (req->pending_next != NULL) {
+        req->pending_next->pending_prev = req->pending_prev;
+    } else {
+        p->tail = req->pending_prev;
+    }
+
+    req->pending = NULL;
+    req->pending_prev = NULL;
+    req->pending_next = NULL;
+
+    if (p->head == NULL && !p->delivering) {
+        release_pending(p);
+    }
+}
+
+// nobody waits for the answer anymore
+static void release_pending(dns_pending_t* p) {
+    logger_t* logger = current_logger;
+
+    stop_waiting_hedge(p);
+
+    for (size_t i = 0; i < p->attempts_sent; i++) {
+        cancel_attempt(&p->attempts[i]);
+    }
+
+    dns_pending_key_ref_t ref = &p->key;
+    int res = dns_pending_ht_delete(pending_queries, &ref);
+    CHECK_INVARIANT(res == JK_OK, "pending query is not in the table");
+
+    uint64_t epoch = p->epoch;
+
+    free(p->query);
+    free(p);
+
+    jk_epoch_unpin(epoch);
+}
+
+// advertises our payload size upstream, whatever the client asked for
+static int64_t prepare_upstream_query(dns_pending_t* p) {
+    logger_t* logger = current_logger;
+    settings_t* s = p->settings;
+
+    dns_edns_t edns;
+    if (dns_edns_find(p->query, p->query_len, &edns) != JK_OK) {
+        return JK_ERROR;
+    }
+
+    if (edns.present) {
+        dns_write_u16(p->query + edns.offset + 3, s->edns_size);
+        return JK_OK;
+    }
+
+    uint8_t* query = realloc(p->query, p->query_len + DNS_OPT_RR_SIZE);
+    if (query == NULL) {
+        log_perror("dns_dispatch.extend_query");
+        return JK_ERROR;
+    }
+
+    dns_edns_write_opt(query + p->query_len, s->edns_size, 0, 0);
+    dns_set_arcount(query, dns_get_arcount(query) + 1);
+
+    p->query = query;
+    p->query_len += DNS_OPT_RR_SIZE;
+
+    return JK_OK;
+}
+
+// the fastest upstream is asked first, the runner-up once the first one is late
+static void start_upstream_query(dns_pending_t* p) {
+    upstream_t* u = upstream_pick(NULL);
+
+    // queued before sending, a synchronous failure then hedges right away
+    if (upstream_count() > 1) {
+        wait_hedge(p, upstream_hedge_delay(u));
+    }
+
+    send_attempt(p, u);
+}
+
+// false when there is no other upstream to ask
+static bool send_hedge(dns_pending_t* p) {
+    logger_t* logger = current_logger;
+
+    stop_waiting_hedge(p);
+
+    if (p->attempts_sent == DNS_ATTEMPTS) {
+        return false;
+    }
+
+    upstream_t* u = upstream_pick(p->attempts[0].upstream);
+    if (u == NULL) {
+        return false;
+    }
+
+    log_trace("dns_dispatch: hedging upstream query");
+    send_attempt(p, u);
+
+    return true;
+}
+
+static void send_attempt(dns_pending_t* p, upstream_t* u) {
+    logger_t* logger = current_logger;
+    settings_t* s = p->settings;
+
+    CHECK_INVARIANT(p->attempts_sent < DNS_ATTEMPTS, "too many attempts");
+
+    dns_attempt_t* a = &p->attempts[p->attempts_sent];
+    p->attempts_sent += 1;
+
+    a->pending = p;
+    a->upstream = u;
+    a->sent_at = jk_now_us();
+
+    metrics_inc(METRIC_DNS_UPSTREAM_QUERIES);
+
+    if (s->remote_use_udp) {
+        forward_udp(a);
+    } else {
+        forward_tcp(a);
+    }
+}
+
+static void cancel_attempt(dns_attempt_t* a) {
+    if (a->udp_query != NULL) {
+        udp_query_release(a->udp_query);
+        a->udp_query = NULL;
+    }
+
+    if (a->tcp_query != NULL) {
+        tcp_pool_cancel(a->tcp_query);
+        a->tcp_query = NULL;
+    }
+}
+
+static bool attempts_in_flight(dns_pending_t* p) {
+    for (size_t i = 0; i < p->attempts_sent; i++) {
+        if (p->attempts[i].udp_query != NULL || p->attempts[i].tcp_query != NULL) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void forward_udp(dns_attempt_t* a) {
+    logger_t* logger = current_logger;
+
+    dns_pending_t* p = a->pending;
+    address_t* to = &a->upstream->addr;
+
+    udp_socket_t* sock = udp_client_pool_get(to->af);
+    if (sock == NULL) {
+        log_error("dns_dispatch: no client udp socket available");
+        return handle_upstream_reply(a, NULL, 0);
+    }
+
+    JK_TRACE3(upstream_send, a, to->src_port, 0);
+
+    // the query keeps its own ID, only the copy on the wire is rewritten
+    uint16_t id = dns_get_id(p->query);
+
+    udp_query_t* q = udp_query_track(
+        sock, to, p->query, p->query_len, handle_upstream_reply, a);
+    if (q == NULL) {
+        return handle_upstream_reply(a, NULL, 0);
+    }
+
+    ssize_t sent = udp_send(sock, p->query, p->query_len, to);
+    dns_set_id(p->query, id);
+
+    if (sent < 0) {
+        log_warn("dns_dispatch: failed to send query upstream");
+        udp_query_release(q);
+        return handle_upstream_reply(a, NULL, 0);
+    }
+
+    a->udp_query = q;
+}
+
+static void forward_tcp(dns_attempt_t* a) {
+    dns_pending_t* p = a->pending;
+
+    JK_TRACE3(upstream_send, a, a->upstream->addr.src_port, 1);
+
+    tcp_pool_query_t* q = tcp_pool_send(
+        &a->upstream->addr, p->query, p->query_len, handle_upstream_reply, a);
+    if (q == NULL) {
+        return handle_upstream_reply(a, NULL, 0);
+    }
+
+    a->tcp_query = q;
+}
+
+static void handle_upstream_reply(void* data, uint8_t* msg, size_t len) {
+    logger_t* logger = current_logger;
+
+    dns_attempt_t* a = data;
+    dns_pending_t* p = a->pending;
+    bool via_udp = a->udp_query != NULL;
+
+    // both the udp and the tcp query are released before the handler runs
+    a->udp_query = NULL;
+    a->tcp_query = NULL;
+
+    int64_t now = jk_now_us();
+
+    JK_TRACE3(upstream_reply, a, msg != NULL ? (int64_t)len : -1, now - a->sent_at);
+
+    if (msg == NULL) {
+        log_trace("dns_dispatch: upstream query failed");
+        upstream_report_failure(a->upstream);
+    } else {
+        upstream_report_rtt(a->upstream, now - a->sent_at);
+        metrics_observe(HIST_DNS_UPSTREAM, (uint64_t)(now - a->sent_at) * 1000);
+    }
+
+    uint16_t flags = msg != NULL && len >= DNS_HEADER_SIZE ? dns_get_flags(msg) : 0;
+
+    if (via_udp && flags & DNS_FLAG_TC) {
+        log_trace("dns_dispatch: truncated upstream reply, retrying over tcp");
+        a->sent_at = now;
+        return forward_tcp(a);
+    }
+
+    uint16_t rcode = flags & DNS_RCODE_MASK;
+    bool failed = msg == NULL || rcode == DNS_RCODE_SERVFAIL || rcode == DNS_RCODE_REFUSED;
+
+    // another upstream gets its chance, without waiting out the hedge delay
+    if (failed && p->hedge_waiting && send_hedge(p)) {
+        return;
+    }
+
+    if (failed && attempts_in_flight(p)) {
+        return;
+    }
+
+    stop_waiting_hedge(p);
+
+    // the slower answer is discarded, its upstream is at least that slow
+    for (size_t i = 0; i < p->attempts_sent; i++) {
+        dns_attempt_t* other = &p->attempts[i];
+
+        if (other->udp_query != NULL || other->tcp_query != NULL) {
+            upstream_report_late(other->upstream, now - other->sent_at);
+            cancel_attempt(other);
+        }
+    }
+
+    // the cache is keyed by question alone, answers that skipped validation
+    // or were tailored to one subnet are handed to their askers only
+    bool shareable = !p->key.checking_disabled && p->key.ecs_len == 0;
+
+    if (!failed && shareable) {
+        dns_cache_store(&p->key.question, msg, len);
+    }
+
+    // askers arriving from now on start a query of their own
+    dns_pending_key_ref_t ref = &p->key;
+    int res = dns_pending_ht_delete(pending_queries, &ref);
+    CHECK_INVARIANT(res == JK_OK, "pending query is not in the table");
+
+    p->delivering = true;
+
+    // a done handler may destroy other waiters, the head is reloaded every time
+    while (p->head != NULL) {
+        dns_request_t* req = p->head;
+        detach_pending(req);
+        deliver_reply(req, msg, len, failed);
+    }
+
+    uint64_t epoch = p->epoch;
+
+    free(p->query);
+    free(p);
+
+    jk_epoch_unpin(epoch);
+}
+
+static void deliver_reply(dns_request_t* req, uint8_t* msg, size_t len, bool failed) {
+    logger_t* logger = current_logger;
+
+    // rendering starts now, the wait for upstream is a phase of its own
+    req->lap = jk_ticks();
+
+    if (failed && !req->refresh && serve_stale(req)) {
+        return;
+    }
+
+    if (msg == NULL) {
+        return respond_error(req, DNS_RCODE_SERVFAIL);
+    }
+
+    dns_edns_t edns;
+    if (dns_edns_find(msg, len, &edns) != JK_OK) {
+        log_warn("dns_dispatch: malformed upstream reply");
+        return respond_error(req, DNS_RCODE_SERVFAIL);
+    }
+
+    req->response = malloc(len + DNS_OPT_RR_SIZE);
+    if (req->response == NULL) {
+        log_perror("dns_dispatch.allocate_response");
+        return respond_error(req, DNS_RCODE_SERVFAIL);
+    }
+
+    memcpy(req->response, msg, len);
+
+    // every client gets an OPT of its own, or none
+    if (edns.present) {
+        len = dns_edns_strip(req->response, len, &edns);
+    }
+
+    adapt_response(req, len, edns.ext_rcode);
+}
+
+// fresh hits are answered on the spot, stale ones are kept in reserve
+static bool lookup_cache(dns_request_t* req, dns_cache_key_t* key) {
+    dns_cache_state_t state;
+    dns_cache_entry_t* e = dns_cache_lookup(key, &state);
+
+    metrics_lap(HIST_DNS_LOOKUP, &req->lap);
+
+    if (e == NULL) {
+        metrics_inc(METRIC_DNS_CACHE_MISSES);
+        return false;
+    }
+
+    if (state == DNS_CACHE_STALE) {
+        // the query forwarded for this client refreshes the entry
+        metrics_inc(METRIC_DNS_CACHE_MISSES);
+        wait_stale(req);
+        return false;
+    }
+
+    metrics_inc(METRIC_DNS_CACHE_HITS);
+
+    if (dns_cache_need_refresh(e)) {
+        schedule_refresh(&e->key);
+    }
+
+    answer_cached(req, e, false);
+    return true;
+}
+
+static void answer_cached(dns_request_t* req, dns_cache_entry_t* e, bool stale) {
+    logger_t* logger = current_logger;
+
+    req->response = malloc(e->len + DNS_OPT_RR_SIZE);
+    if (req->response == NULL) {
+        log_perror("dns_dispatch.allocate_cached_response");
+        return respond_error(req, DNS_RCODE_SERVFAIL);
+    }
+
+    size_t len = dns_cache_copy(e, req->response, stale);
+    adapt_response(req, len, 0);
+}
+
+// answers from the cache when upstream failed or is too slow
+static bool serve_stale(dns_request_t* req) {
+    logger_t* logger = current_logger;
+
+    req->lap = jk_ticks();
+
+    dns_question_t question;
+    if (dns_parse_question(req->query, req->query_len, &question) != JK_OK) {
+        return false;
+    }
+
+    dns_cache_key_t key;
+    dns_cache_make_key(&key, &question, req->dnssec);
+
+    dns_cache_state_t state;
+    dns_cache_entry_t* e = dns_cache_lookup(&key, &state);
+    if (e == NULL) {
+        return false;
+    }
+
+    bool stale = state == DNS_CACHE_STALE;
+
+    // the client is answered now, its own upstream query dies with the request
+    if (stale && dns_cache_need_refresh(e)) {
+        schedule_refresh(&e->key);
+    }
+
+    log_trace("dns_dispatch: serving %s answer from cache", stale ? "stale" : "fresh");
+    answer_cached(req, e, stale);
+
+    return true;
+}
+
+static void wait_stale(dns_request_t* req) {
+    req->waiting_stale = true;
+    req->stale_deadline = jk_now() + DNS_STALE_ANSWER_DELAY;
+
+    req->stale_prev = stale_tail;
+    req->stale_next = NULL;
+
+    if (stale_tail != NULL) {
+        stale_tail->stale_next = req;
+    } else {
+        stale_head = req;
+    }
+
+    stale_tail = req;
+
+    if (stale_timer == NULL) {
+        arm_stale_timer(DNS_STALE_ANSWER_DELAY);
+    }
+}
+
+static void stop_waiting_stale(dns_request_t* req) {
+    if (!req->waiting_stale) {
+        return;
+    }
+
+    if (req->stale_prev != NULL) {
+        req->stale_prev->stale_next = req->stale_next;
+    } else {
+        stale_head = req->stale_next;
+    }
+
+    if (req->stale_next != NULL) {
+        req->stale_next->stale_prev = req->stale_prev;
+    } else {
+        stale_tail = req->stale_prev;
+    }
+
+    req->stale_prev = NULL;
+    req->stale_next = NULL;
+    req->waiting_stale = false;
+}
+
+static void handle_stale_timer(void* data) {
+    (void)data; // unused
+
+    // the firing timer is popped right after this handler returns
+    stale_timer = NULL;
+
+    int64_t now = jk_now();
+
+    while (stale_head != NULL && stale_head->stale_deadline <= now) {
+        dns_request_t* req = stale_head;
+        stop_waiting_stale(req);
+
+        // the entry may be gone by now, upstream keeps its chance then
+        serve_stale(req);
+    }
+
+    if (stale_head != NULL) {
+        arm_stale_timer(stale_head->stale_deadline - now);
+    }
+}
+
+// without a timer the waiters wait for upstream alone, a failed upstream
+// query still serves their stale answers
+static void arm_stale_timer(int64_t delay) {
+    logger_t* logger = current_logger;
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, delay);
+    timer.handler = handle_stale_timer;
+    timer.data = NULL;
+
+    stale_timer = ev_backend->add_timer(timer);
+    if (stale_timer != NULL) {
+        return;
+    }
+
+    log_error("dns_dispatch: failed to add stale timer, stale answers wait for upstream");
+
+    while (stale_head != NULL) {
+        stop_waiting_stale(stale_head);
+    }
+}
+
+static void wait_hedge(dns_pending_t* p, int64_t delay) {
+    int64_t now = jk_now();
+
+    p->hedge_waiting = true;
+    p->hedge_at = now + delay;
+
+    // delays differ between upstreams, the list is kept sorted from the tail
+    dns_pending_t* prev = hedge_tail;
+    while (prev != NULL && prev->hedge_at > p->hedge_at) {
+        prev = prev->hedge_prev;
+    }
+
+    p->hedge_prev = prev;
+    p->hedge_next = prev != NULL ? prev->hedge_next : hedge_head;
+
+    if (p->hedge_next != NULL) {
+        p->hedge_next->hedge_prev = p;
+    } else {
+        hedge_tail = p;
+    }
+
+    if (prev != NULL) {
+        prev->hedge_next = p;
+    } else {
+        hedge_head = p;
+    }
+
+    if (hedge_head == p) {
+        arm_hedge_timer(now);
+    }
+}
+
+static void stop_waiting_hedge(dns_pending_t* p) {
+    if (!p->hedge_waiting) {
+        return;
+    }
+
+    if (p->hedge_prev != NULL) {
+        p->hedge_prev->hedge_next = p->hedge_next;
+    } else {
+        hedge_head = p->hedge_next;
+    }
+
+    if (p->hedge_next != NULL) {
+        p->hedge_next->hedge_prev = p->hedge_prev;
+    } else {
+        hedge_tail = p->hedge_prev;
+    }
+
+    p->hedge_prev = NULL;
+    p->hedge_next = NULL;
+    p->hedge_waiting = false;
+}
+
+// a single timer fires for the head of the list, without one the queries
+// waiting to be hedged are left to their first upstream
+static void arm_hedge_timer(int64_t now) {
+    logger_t* logger = current_logger;
+
+    if (hedge_timer != NULL) {
+        if (hedge_timer->expiry <= hedge_head->hedge_at) {
+            return;
+        }
+
+        hedge_timer->enabled = false;
+    }
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, hedge_head->hedge_at - now);
+    timer.handler = handle_hedge_timer;
+    timer.data = NULL;
+
+    hedge_timer = ev_backend->add_timer(timer);
+    if (hedge_timer != NULL) {
+        return;
+    }
+
+    log_error("dns_dispatch: failed to add hedge timer, dropping queued hedges");
+
+    while (hedge_head != NULL) {
+        stop_waiting_hedge(hedge_head);
+    }
+}
+
+static void handle_hedge_timer(void* data) {
+    (void)data; // unused
+
+    // the firing timer is popped right after this handler returns
+    hedge_timer = NULL;
+
+    int64_t now = jk_now();
+
+    // send_hedge takes the query off the list, answers may arrive before it returns
+    while (hedge_head != NULL && hedge_head->hedge_at <= now) {
+        send_hedge(hedge_head);
+    }
+
+    if (hedge_head != NULL) {
+        arm_hedge_timer(now);
+    }
+}
+
+static void schedule_refresh(const dns_cache_key_t* key) {
+    logger_t* logger = current_logger;
+
+    if (refresh_queued >= DNS_REFRESH_QUEUE_MAX) {
+        return;
+    }
+
+    // the entry may be evicted before the refresh goes out, the key is copied
+    dns_refresh_t* r = malloc(sizeof(dns_refresh_t));
+    if (r == NULL) {
+        log_perror("dns_dispatch.allocate_refresh");
+        return;
+    }
+
+    memcpy(&r->key, key, sizeof(*key));
+    r->next = NULL;
+
+    if (refresh_tail != NULL) {
+        refresh_tail->next = r;
+    } else {
+        refresh_head = r;
+    }
+
+    refresh_tail = r;
+    refresh_queued += 1;
+
+    if (refresh_timer != NULL) {
+        return;
+    }
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, 0);
+    timer.handler = handle_refresh_timer;
+    timer.data = NULL;
+
+    refresh_timer = ev_backend->add_timer(timer);
+    if (refresh_timer != NULL) {
+        return;
+    }
+
+    // the entries stay cached, a hit after DNS_CACHE_REFRESH_TIMEOUT asks again
+    log_error("dns_dispatch: failed to add refresh timer, dropping queued refreshes");
+
+    while (refresh_head != NULL) {
+        dns_refresh_t* next = refresh_head->next;
+        free(refresh_head);
+        refresh_head = next;
+    }
+
+    refresh_tail = NULL;
+    refresh_queued = 0;
+}
+
+static void handle_refresh_timer(void* data) {
+    (void)data; // unused
+
+    // the firing timer is popped right after this handler returns
+    refresh_timer = NULL;
+
+    dns_refresh_t* r = refresh_head;
+
+    refresh_head = NULL;
+    refresh_tail = NULL;
+    refresh_queued = 0;
+
+    while (r != NULL) {
+        dns_refresh_t* next = r->next;
+
+        start_refresh(&r->key);
+        free(r);
+
+        r = next;
+    }
+}
+
+// a query of our own goes through the usual path, its answer lands in the cache
+static void start_refresh(const dns_cache_key_t* key) {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    uint8_t query[DNS_HEADER_SIZE + DNS_NAME_MAX_LEN + 4 + DNS_OPT_RR_SIZE];
+
+    dns_render_t r;
+    dns_render_init(&r, query, sizeof(query), jk_random_u16(), DNS_FLAG_RD);
+
+    if (dns_render_question(&r, key->name, key->qtype, key->qclass) != JK_OK) {
+        return;
+    }
+
+    dns_render_opt(&r, s->edns_size, 0, key->dnssec ? DNS_EDNS_FLAG_DO : 0);
+    size_t len = dns_render_finish(&r);
+
+    address_t nobody;
+    memset(&nobody, 0, sizeof(nobody));
+
+    dns_request_t* req = dns_request_create(query, len, &nobody, true, refresh_done, NULL);
+    if (req == NULL) {
+        log_error("dns_dispatch: failed to create refresh request");
+        return;
+    }
+
+    req->refresh = true;
+
+    log_trace("dns_dispatch: refreshing cached answer");
+    dns_dispatch(req);
+}
+
+static void refresh_done(dns_request_t* req) {
+    dns_request_destroy(req);
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include "cache.h"
+#include "edns.h"
+#include "core/decl.h"
+#include "core/connection.h"
+#include "upstream/tcp_pool.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_RCODE_NOERROR  0
+#define DNS_RCODE_FORMERR  1
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+#define DNS_RCODE_REFUSED  5
+#define DNS_RCODE_BADVERS  16 // extended, upper bits travel in OPT
+
+#define DNS_STALE_ANSWER_DELAY 1800 // ms upstream gets before a stale answer is served
+#define DNS_REFRESH_QUEUE_MAX  256
+#define DNS_PENDING_HT_CAPACITY 256
+
+// queries in flight are shared only when the upstream would answer them alike,
+// the CD bit and the client subnet change what comes back
+struct dns_pending_key_s {
+    dns_cache_key_t question;
+    bool checking_disabled;
+    uint8_t ecs[DNS_ECS_MAX_LEN];
+    size_t ecs_len;
+
+    uint32_t hash;
+};
+
+// called exactly once per dispatch, possibly before dns_dispatch returns,
+// response is NULL when the query is dropped without an answer
+typedef void (*dns_request_done_pt)(dns_request_t* req);
+
+struct dns_request_s {
+    uint8_t* query;
+    size_t query_len;
+
+    uint8_t* response;
+    size_t response_len;
+
+    address_t client;
+    uint32_t over_tcp:1;
+
+    // jk_now_us() when the query came in
+    int64_t received_at;
+    // jk_ticks() when the query came in and when its last phase ended
+    uint64_t started;
+    uint64_t lap;
+
+    // the question, qname points into query, NULL until it is parsed
+    const uint8_t* qname;
+    size_t qname_len;
+    uint16_t qtype;
+
+    // the client sent OPT, its answers carry OPT as well
+    uint32_t client_edns:1;
+
+    // the client set DO, signed answers are cached apart
+    uint32_t dnssec:1;
+    // background refresh of a cached answer, never answered from the cache
+    uint32_t refresh:1;
+    // a stale answer exists, it is served if upstream is too slow
+    uint32_t waiting_stale:1;
+
+    // largest response a udp client takes, bigger ones are truncated
+    uint16_t udp_limit;
+
+    // current when the request came in, kept for it until it is destroyed
+    settings_t* settings;
+    uint64_t epoch;
+
+    int64_t stale_deadline;
+    dns_request_t* stale_prev;
+    dns_request_t* stale_next;
+
+    dns_request_done_pt done;
+    void* data;
+
+    // upstream query this request waits for, shared with identical questions
+    dns_pending_t* pending;
+    dns_request_t* pending_prev;
+    dns_request_t* pending_next;
+
+    // free for the owner to link its outstanding requests
+    dns_request_t* prev;
+    dns_request_t* next;
+};
+
+dns_request_t* dns_request_create(
+    const uint8_t* msg,
+    size_t len,
+    address_t* client,
+    bool over_tcp,
+    dns_request_done_pt done,
+    void* data);
+
+// leaves the upstream query, which is cancelled once nobody waits for it
+void dns_request_destroy(dns_request_t* req);
+
+// requests created and not destroyed yet
+size_t dns_request_count();
+
+void dns_dispatch(dns_request_t* req);
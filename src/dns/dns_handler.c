@@ -0,0 +1,578 @@
+#include "dns_handler.h"
+#include "dispatch.h"
+#include "message.h"
+#include "query_log.h"
+#include "rrl.h"
+#include "connection/connection.h"
+#include "core/buffer.h"
+#include "core/connection.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/net.h"
+#include "core/time.h"
+#include "core/udp_socket.h"
+#include "logger/logger.h"
+#include "metrics/metrics.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DNS_TCP_BUFFER_SIZE (2 + 65535)
+#define DNS_TCP_IOV_MAX     64
+
+typedef struct dns_tcp_frame_s dns_tcp_frame_t;
+
+// framed response waiting to be written
+struct dns_tcp_frame_s {
+    dns_tcp_frame_t* next;
+    size_t len;
+    uint8_t data[];
+};
+
+typedef struct {
+    connection_t* conn;
+
+    buffer_t in;
+
+    // dispatched requests still waiting for an answer
+    dns_request_t* reqs;
+
+    // responses in completion order, the head is written up to out_offset
+    dns_tcp_frame_t* out_head;
+    dns_tcp_frame_t* out_tail;
+    size_t out_offset;
+
+    // queries taken off the wire and not completely answered yet
+    size_t pending;
+
+    // no more queries are read, the session ends once pending drops to zero
+    uint32_t eof:1;
+
+    // the socket was read until EAGAIN, with edge-triggered events
+    // nothing more arrives until the next notification
+    uint32_t drained:1;
+
+    // inside a handler, responses are flushed before it returns
+    uint32_t running:1;
+
+    jk_timer_t* timer;
+    jk_timer_t* flush_timer;
+    int64_t last_active;
+} dns_tcp_context_t;
+
+static void udp_request_done(dns_request_t* req);
+static void record_sent(dns_request_t* req);
+
+static dns_tcp_context_t* create_tcp_context(connection_t* conn);
+static void destroy_tcp_context(dns_tcp_context_t* ctx);
+static int64_t read_frames(dns_tcp_context_t* ctx);
+static void dispatch_frames(dns_tcp_context_t* ctx);
+static void tcp_request_done(dns_request_t* req);
+static int64_t flush_responses(dns_tcp_context_t* ctx);
+static void settle_session(dns_tcp_context_t* ctx);
+static bool wants_read(dns_tcp_context_t* ctx);
+static void update_interest(dns_tcp_context_t* ctx);
+static void stop_dns_tcp(dns_tcp_context_t* ctx);
+static void start_flush_timer(dns_tcp_context_t* ctx);
+static void handle_flush_timer(void* data);
+static int64_t start_idle_timer(dns_tcp_context_t* ctx, int64_t timeout);
+static void handle_dns_tcp_timeout(void* data);
+
+void handle_dns_udp(udp_socket_t* sock, uint8_t* msg, size_t len, address_t* address) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(sock != NULL, "sock is NULL");
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+
+    dns_request_t* req = dns_request_create(msg, len, address, false, udp_request_done, sock);
+    if (req == NULL) {
+        log_error("handle_dns_udp: failed to create request");
+        return;
+    }
+
+    dns_dispatch(req);
+}
+
+static void udp_request_done(dns_request_t* req) {
+    logger_t* logger = current_logger;
+
+    udp_socket_t* sock = req->data;
+
+    dns_rrl_action_t action = DNS_RRL_SEND;
+    if (req->response != NULL) {
+        action = dns_rrl_check(&req->client, req->response, req->response_len);
+    }
+
+    if (action == DNS_RRL_SLIP) {
+        req->response_len = dns_truncate(req->response, req->response_len);
+    } else if (action == DNS_RRL_DROP) {
+        log_trace("handle_dns_udp: rate limited, dropping response");
+    }
+
+    ssize_t sent = JK_ERROR;
+
+    if (req->response != NULL && action != DNS_RRL_DROP) {
+        sent = udp_send(sock, req->response, req->response_len, &req->client);
+        if (sent == JK_WOULD_BLOCK) {
+            // the client retries, queueing responses buys nothing
+            log_warn("handle_dns_udp: socket buffer is full, dropping response");
+        } else if (sent < 0) {
+            log_warn("handle_dns_udp: failed to send response");
+        }
+    }
+
+    if (sent >= 0) {
+        record_sent(req);
+    }
+
+    dns_query_log_write(req, sent >= 0);
+
+    dns_request_destroy(req);
+}
+
+static void record_sent(dns_request_t* req) {
+    metrics_lap(HIST_DNS_SEND, &req->lap);
+    metrics_observe(HIST_DNS_TOTAL, jk_ticks_to_ns(req->lap - req->started));
+}
+
+void handle_dns_tcp(event_t* ev) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(ev->owner.tag == EV_OWNER_CONNECTION, "bad event owner");
+    CHECK_INVARIANT(ev->owner.ptr != NULL, "event owner is NULL");
+
+    connection_t* conn = ev->owner.ptr;
+
+    if (conn->data == NULL) {
+        dns_tcp_context_t* ctx = create_tcp_context(conn);
+        if (ctx == NULL) {
+            ev_backend->del_conn(conn);
+            close_connection(conn);
+            return;
+        }
+
+        conn->data = ctx;
+
+        if (start_idle_timer(ctx, DNS_TCP_IDLE_TIMEOUT) != JK_OK) {
+            return stop_dns_tcp(ctx);
+        }
+    }
+
+    dns_tcp_context_t* ctx = conn->data;
+
+    if (conn->error) {
+        log_perror("handle_dns_tcp");
+        return stop_dns_tcp(ctx);
+    }
+
+    // read and write may both be enabled, so either direction can be ready
+    ctx->drained = false;
+    ctx->running = true;
+
+    settle_session(ctx);
+}
+
+static dns_tcp_context_t* create_tcp_context(connection_t* conn) {
+    logger_t* logger = current_logger;
+
+    dns_tcp_context_t* ctx = calloc(1, sizeof(dns_tcp_context_t));
+    if (ctx == NULL) {
+        log_perror("handle_dns_tcp.allocate_context");
+        return NULL;
+    }
+
+    ctx->in.data = malloc(DNS_TCP_BUFFER_SIZE);
+    if (ctx->in.data == NULL) {
+        log_perror("handle_dns_tcp.allocate_buffer");
+        free(ctx);
+        return NULL;
+    }
+
+    ctx->in.capacity = DNS_TCP_BUFFER_SIZE;
+    ctx->conn = conn;
+    ctx->last_active = jk_now();
+
+    return ctx;
+}
+
+static void destroy_tcp_context(dns_tcp_context_t* ctx) {
+    while (ctx->reqs != NULL) {
+        dns_request_t* req = ctx->reqs;
+        ctx->reqs = req->next;
+        dns_request_destroy(req);
+    }
+
+    while (ctx->out_head != NULL) {
+        dns_tcp_frame_t* frame = ctx->out_head;
+        ctx->out_head = frame->next;
+        free(frame);
+    }
+
+    if (ctx->timer != NULL) {
+        ctx->timer->enabled = false;
+    }
+
+    if (ctx->flush_timer != NULL) {
+        ctx->flush_timer->enabled = false;
+    }
+
+    free(ctx->in.data);
+    free(ctx);
+}
+
+static int64_t read_frames(dns_tcp_context_t* ctx) {
+    logger_t* logger = current_logger;
+
+    connection_t* conn = ctx->conn;
+
+    for (;;) {
+        size_t space_left = ctx->in.capacity - ctx->in.taken;
+        if (space_left == 0) {
+            // full of frames over the in-flight limit
+            break;
+        }
+
+        ssize_t read = recv_buf(conn, ctx->in.data + ctx->in.taken, space_left);
+        if (read == JK_WOULD_BLOCK) {
+            ctx->drained = true;
+            break;
+        }
+
+        if (read == 0) {
+            log_trace("peer closed the connection");
+            ctx->eof = true;
+            break;
+        }
+
+        if (read < 0) {
+            log_perror("handle_dns_tcp_read");
+            return JK_ERROR;
+        }
+
+        ctx->in.taken += read;
+        ctx->last_active = jk_now();
+
+        dispatch_frames(ctx);
+
+        if ((size_t)read < space_left) {
+            ctx->drained = true;
+            break;
+        }
+    }
+
+    return JK_OK;
+}
+
+static void dispatch_frames(dns_tcp_context_t* ctx) {
+    logger_t* logger = current_logger;
+
+    connection_t* conn = ctx->conn;
+    size_t pos = 0;
+
+    while (ctx->pending < DNS_TCP_MAX_INFLIGHT && ctx->in.taken - pos >= 2) {
+        size_t len = dns_read_u16(ctx->in.data + pos);
+        if (len < DNS_HEADER_SIZE) {
+            // the stream cannot be resynchronized, answer what was taken and close
+            log_trace("handle_dns_tcp: bad frame length %zu", len);
+            ctx->eof = true;
+            pos = ctx->in.taken;
+            break;
+        }
+
+        if (ctx->in.taken - pos - 2 < len) {
+            break;
+        }
+
+        dns_request_t* req = dns_request_create(
+            ctx->in.data + pos + 2, len, &conn->address, true, tcp_request_done, ctx);
+        if (req == NULL) {
+            ctx->eof = true;
+            pos = ctx->in.taken;
+            break;
+        }
+
+        pos += 2 + len;
+
+        req->prev = NULL;
+        req->next = ctx->reqs;
+        if (ctx->reqs != NULL) {
+            ctx->reqs->prev = req;
+        }
+        ctx->reqs = req;
+
+        ctx->pending += 1;
+
+        // may complete right away
+        dns_dispatch(req);
+    }
+
+    memmove(ctx->in.data, ctx->in.data + pos, ctx->in.taken - pos);
+    ctx->in.taken -= pos;
+}
+
+static void tcp_request_done(dns_request_t* req) {
+    logger_t* logger = current_logger;
+
+    dns_tcp_context_t* ctx = req->data;
+
+    if (req->prev != NULL) {
+        req->prev->next = req->next;
+    } else {
+        ctx->reqs = req->next;
+    }
+
+    if (req->next != NULL) {
+        req->next->prev = req->prev;
+    }
+
+    dns_tcp_frame_t* frame = NULL;
+    if (req->response != NULL && req->response_len <= UINT16_MAX) {
+        frame = malloc(sizeof(dns_tcp_frame_t) + req->response_len + 2);
+        if (frame == NULL) {
+            log_perror("handle_dns_tcp.allocate_frame");
+        }
+    }
+
+    if (frame != NULL) {
+        frame->next = NULL;
+        frame->len = req->response_len + 2;
+        dns_write_u16(frame->data, (uint16_t)req->response_len);
+        memcpy(frame->data + 2, req->response, req->response_len);
+
+        if (ctx->out_tail != NULL) {
+            ctx->out_tail->next = frame;
+        } else {
+            ctx->out_head = frame;
+        }
+        ctx->out_tail = frame;
+    } else {
+        // dropped queries get no answer
+        ctx->pending -= 1;
+    }
+
+    // queued counts as sent, the connection flushes it with the rest
+    if (frame != NULL) {
+        record_sent(req);
+    }
+
+    dns_query_log_write(req, frame != NULL);
+
+    dns_request_destroy(req);
+
+    // answers that arrive in the same loop iteration go out in one write
+    if (!ctx->running) {
+        start_flush_timer(ctx);
+    }
+}
+
+static int64_t flush_responses(dns_tcp_context_t* ctx) {
+    logger_t* logger = current_logger;
+
+    while (ctx->out_head != NULL) {
+        struct iovec iov[DNS_TCP_IOV_MAX];
+        int iovcnt = 0;
+        size_t total = 0;
+
+        for (dns_tcp_frame_t* frame = ctx->out_head;
+            frame != NULL && iovcnt < DNS_TCP_IOV_MAX;
+            frame = frame->next) {
+            size_t offset = iovcnt == 0 ? ctx->out_offset : 0;
+            iov[iovcnt].iov_base = frame->data + offset;
+            iov[iovcnt].iov_len = frame->len - offset;
+            total += frame->len - offset;
+            iovcnt += 1;
+        }
+
+        ssize_t sent = send_iov(ctx->conn, iov, iovcnt);
+        if (sent == JK_WOULD_BLOCK) {
+            return JK_OK;
+        }
+
+        if (sent < 0) {
+            log_perror("handle_dns_tcp_write");
+            return JK_ERROR;
+        }
+
+        ctx->last_active = jk_now();
+
+        size_t left = (size_t)sent;
+        while (left > 0) {
+            dns_tcp_frame_t* frame = ctx->out_head;
+            size_t rest = frame->len - ctx->out_offset;
+
+            if (left < rest) {
+                ctx->out_offset += left;
+                break;
+            }
+
+            left -= rest;
+            ctx->out_offset = 0;
+            ctx->out_head = frame->next;
+            if (ctx->out_head == NULL) {
+                ctx->out_tail = NULL;
+            }
+            free(frame);
+
+            ctx->pending -= 1;
+        }
+
+        if ((size_t)sent < total) {
+            // short write, the socket buffer is full
+            return JK_OK;
+        }
+    }
+
+    return JK_OK;
+}
+
+// reads and dispatches as the in-flight limit allows, writes out what
+// is ready and repeats until neither side makes progress
+static void settle_session(dns_tcp_context_t* ctx) {
+    for (;;) {
+        if (wants_read(ctx) && !ctx->drained && read_frames(ctx) != JK_OK) {
+            return stop_dns_tcp(ctx);
+        }
+
+        size_t pending = ctx->pending;
+
+        if (flush_responses(ctx) != JK_OK) {
+            return stop_dns_tcp(ctx);
+        }
+
+        if (ctx->pending == pending) {
+            break;
+        }
+
+        // room was freed, take the frames that waited in the buffer
+        dispatch_frames(ctx);
+    }
+
+    ctx->running = false;
+
+    if (ctx->eof && ctx->pending == 0) {
+        return stop_dns_tcp(ctx);
+    }
+
+    update_interest(ctx);
+}
+
+static bool wants_read(dns_tcp_context_t* ctx) {
+    return !ctx->eof &&
+        ctx->pending < DNS_TCP_MAX_INFLIGHT &&
+        ctx->in.taken < ctx->in.capacity;
+}
+
+static void update_interest(dns_tcp_context_t* ctx) {
+    connection_t* conn = ctx->conn;
+
+    bool want_read = wants_read(ctx);
+
+    // write interest only while a write is blocked
+    bool want_write = ctx->out_head != NULL;
+
+    if (want_read != (bool)conn->read->enabled) {
+        if (want_read) {
+            // rearming reports data that is already queued
+            ev_backend->enable_event(conn->read);
+        } else {
+            ev_backend->disable_event(conn->read);
+        }
+    }
+
+    if (want_write != (bool)conn->write->enabled) {
+        if (want_write) {
+            ev_backend->enable_event(conn->write);
+        } else {
+            ev_backend->disable_event(conn->write);
+        }
+    }
+}
+
+static void stop_dns_tcp(dns_tcp_context_t* ctx) {
+    logger_t* logger = current_logger;
+
+    log_trace("stopping dns tcp session");
+
+    connection_t* conn = ctx->conn;
+
+    ev_backend->del_conn(conn);
+    destroy_tcp_context(ctx);
+    close_connection(conn);
+}
+
+static void start_flush_timer(dns_tcp_context_t* ctx) {
+    if (ctx->flush_timer != NULL) {
+        return;
+    }
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, 0);
+    timer.handler = handle_flush_timer;
+    timer.data = ctx;
+
+    ctx->flush_timer = ev_backend->add_timer(timer);
+
+    // the answers go out right away then, each in a write of its own
+    if (ctx->flush_timer == NULL) {
+        ctx->running = true;
+        settle_session(ctx);
+    }
+}
+
+static void handle_flush_timer(void* data) {
+    dns_tcp_context_t* ctx = data;
+
+    // the firing timer is popped right after this handler returns
+    ctx->flush_timer = NULL;
+
+    ctx->running = true;
+    settle_session(ctx);
+}
+
+// a session without its idle timer could stay open forever, it is closed instead
+static int64_t start_idle_timer(dns_tcp_context_t* ctx, int64_t timeout) {
+    logger_t* logger = current_logger;
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, timeout);
+    timer.handler = handle_dns_tcp_timeout;
+    timer.data = ctx;
+
+    ctx->timer = ev_backend->add_timer(timer);
+    if (ctx->timer == NULL) {
+        log_error("handle_dns_tcp: failed to add idle timer, closing the session");
+        return JK_ERROR;
+    }
+
+    return JK_OK;
+}
+
+static void handle_dns_tcp_timeout(void* data) {
+    logger_t* logger = current_logger;
+
+    dns_tcp_context_t* ctx = data;
+
+    // the firing timer is popped right after this handler returns
+    ctx->timer = NULL;
+
+    // activity only records a timestamp, the timer catches up here
+    int64_t idle = jk_now() - ctx->last_active;
+
+    if (ctx->pending > 0 || idle < DNS_TCP_IDLE_TIMEOUT) {
+        // the upstream has its own timeout, queries in flight keep the session
+        int64_t left = DNS_TCP_IDLE_TIMEOUT - idle;
+        if (start_idle_timer(ctx, left > 0 ? left : DNS_TCP_IDLE_TIMEOUT) != JK_OK) {
+            stop_dns_tcp(ctx);
+        }
+        return;
+    }
+
+    log_trace("stopping dns tcp session due to the timeout");
+
+    stop_dns_tcp(ctx);
+}
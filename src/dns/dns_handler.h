@@ -0,0 +1,16 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_TCP_IDLE_TIMEOUT 10000
+#define DNS_TCP_MAX_INFLIGHT 128
+
+// a datagram received on the server socket, answered through the same socket
+void handle_dns_udp(udp_socket_t* sock, uint8_t* msg, size_t len, address_t* address);
+
+// length-framed DNS over a client tcp connection (RFC 7766), queries are
+// dispatched as they arrive and answered in completion order
+void handle_dns_tcp(event_t* ev);
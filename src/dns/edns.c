@@ -0,0 +1,124 @@
+#include "edns.h"
+#include "message.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+int64_t dns_edns_find(const uint8_t* msg, size_t len, dns_edns_t* edns) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+    CHECK_INVARIANT(edns != NULL, "edns is NULL");
+
+    memset(edns, 0, sizeof(*edns));
+
+    if (len < DNS_HEADER_SIZE) {
+        return JK_ERROR;
+    }
+
+    size_t pos = DNS_HEADER_SIZE;
+
+    for (uint16_t i = 0; i < dns_get_qdcount(msg); i++) {
+        int64_t res = dns_skip_name(msg, len, pos);
+        if (res == JK_ERROR || (size_t)res + 4 > len) {
+            return JK_ERROR;
+        }
+        pos = (size_t)res + 4;
+    }
+
+    size_t records = (size_t)dns_get_ancount(msg) + dns_get_nscount(msg);
+    for (size_t i = 0; i < records; i++) {
+        int64_t res = dns_skip_rr(msg, len, pos);
+        if (res == JK_ERROR) {
+            return JK_ERROR;
+        }
+        pos = (size_t)res;
+    }
+
+    for (uint16_t i = 0; i < dns_get_arcount(msg); i++) {
+        int64_t res = dns_skip_rr(msg, len, pos);
+        if (res == JK_ERROR) {
+            return JK_ERROR;
+        }
+
+        // only the root name is allowed on OPT
+        if (msg[pos] == 0 && dns_read_u16(msg + pos + 1) == DNS_TYPE_OPT) {
+            if (edns->present) {
+                return JK_ERROR;
+            }
+
+            edns->present = true;
+            edns->udp_size = dns_read_u16(msg + pos + 3);
+            edns->ext_rcode = msg[pos + 5];
+            edns->version = msg[pos + 6];
+            edns->flags = dns_read_u16(msg + pos + 7);
+            edns->offset = pos;
+            edns->rr_len = (size_t)res - pos;
+        }
+
+        pos = (size_t)res;
+    }
+
+    return JK_OK;
+}
+
+int64_t dns_edns_find_option(const uint8_t* msg, const dns_edns_t* edns, uint16_t code,
+                             const uint8_t** data, size_t* data_len) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(edns->present, "no OPT record to search");
+
+    size_t pos = edns->offset + DNS_OPT_RR_SIZE;
+    size_t end = edns->offset + edns->rr_len;
+
+    while (pos < end) {
+        if (pos + 4 > end) {
+            return JK_ERROR;
+        }
+
+        uint16_t option = dns_read_u16(msg + pos);
+        size_t option_len = dns_read_u16(msg + pos + 2);
+
+        pos += 4;
+        if (pos + option_len > end) {
+            return JK_ERROR;
+        }
+
+        if (option == code) {
+            *data = msg + pos;
+            *data_len = option_len;
+            return JK_OK;
+        }
+
+        pos += option_len;
+    }
+
+    return JK_NOT_FOUND;
+}
+
+void dns_edns_write_opt(uint8_t* out, uint16_t udp_size, uint8_t ext_rcode, uint16_t flags) {
+    out[0] = 0;
+    dns_write_u16(out + 1, DNS_TYPE_OPT);
+    dns_write_u16(out + 3, udp_size);
+    out[5] = ext_rcode;
+    out[6] = 0; // version
+    dns_write_u16(out + 7, flags);
+    dns_write_u16(out + 9, 0);
+}
+
+size_t dns_edns_strip(uint8_t* msg, size_t len, const dns_edns_t* edns) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(edns->present, "no OPT record to strip");
+    CHECK_INVARIANT(edns->offset + edns->rr_len <= len, "OPT record is out of bounds");
+
+    size_t end = edns->offset + edns->rr_len;
+    memmove(msg + edns->offset, msg + end, len - end);
+    dns_set_arcount(msg, dns_get_arcount(msg) - 1);
+
+    return len - edns->rr_len;
+}
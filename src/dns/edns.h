@@ -0,0 +1,44 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_TYPE_OPT     41
+#define DNS_OPT_RR_SIZE  11 // root name, fixed fields, empty rdata
+
+#define DNS_EDNS_FLAG_DO 0x8000
+
+#define DNS_EDNS_OPTION_ECS 8
+#define DNS_ECS_MAX_LEN     20 // family, two prefix lengths and an IPv6 address
+
+// EDNS0 pseudo-record of a message (RFC 6891)
+typedef struct {
+    bool present;
+
+    uint16_t udp_size;
+    uint8_t ext_rcode;
+    uint8_t version;
+    uint16_t flags;
+
+    // where the OPT record starts and its wire length
+    size_t offset;
+    size_t rr_len;
+} dns_edns_t;
+
+// walks to the additional section and picks up the OPT record,
+// returns JK_ERROR when the message cannot be walked
+int64_t dns_edns_find(const uint8_t* msg, size_t len, dns_edns_t* edns);
+
+// points data at the first option with the given code, returns JK_NOT_FOUND
+// without one and JK_ERROR when the options run past the OPT record
+int64_t dns_edns_find_option(const uint8_t* msg, const dns_edns_t* edns, uint16_t code,
+                             const uint8_t** data, size_t* data_len);
+
+// writes a DNS_OPT_RR_SIZE bytes OPT record without options
+void dns_edns_write_opt(uint8_t* out, uint16_t udp_size, uint8_t ext_rcode, uint16_t flags);
+
+// removes the OPT record, returns the new length
+size_t dns_edns_strip(uint8_t* msg, size_t len, const dns_edns_t* edns);
@@ -0,0 +1,104 @@
+#include "message.h"
+#include "name.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+int64_t dns_parse_question(const uint8_t* msg, size_t len, dns_question_t* q) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+    CHECK_INVARIANT(q != NULL, "q is NULL");
+
+    if (len < DNS_HEADER_SIZE || dns_get_qdcount(msg) != 1) {
+        return JK_ERROR;
+    }
+
+    int64_t name_len = dns_name_wire_len(msg + DNS_HEADER_SIZE, len - DNS_HEADER_SIZE);
+    if (name_len == JK_ERROR) {
+        return JK_ERROR;
+    }
+
+    size_t pos = DNS_HEADER_SIZE + (size_t)name_len;
+    if (pos + 4 > len) {
+        return JK_ERROR;
+    }
+
+    q->qname = msg + DNS_HEADER_SIZE;
+    q->qname_len = (size_t)name_len;
+    q->qtype = dns_read_u16(msg + pos);
+    q->qclass = dns_read_u16(msg + pos + 2);
+    q->end = pos + 4;
+
+    return JK_OK;
+}
+
+uint32_t dns_question_hash(const dns_question_t* q) {
+    uint64_t hash = dns_name_hash(q->qname, q->qname_len);
+
+    hash ^= ((uint64_t)q->qtype << 16) | q->qclass;
+    hash *= 1099511628211ULL;
+
+    return (uint32_t)(hash ^ (hash >> 32));
+}
+
+int64_t dns_skip_name(const uint8_t* msg, size_t len, size_t pos) {
+    for (;;) {
+        if (pos >= len) {
+            return JK_ERROR;
+        }
+
+        uint8_t label_len = msg[pos];
+
+        // a compression pointer always ends the name
+        if ((label_len & 0xc0) == 0xc0) {
+            return pos + 2 <= len ? (int64_t)pos + 2 : JK_ERROR;
+        }
+
+        if (label_len > DNS_LABEL_MAX_LEN) {
+            return JK_ERROR;
+        }
+
+        pos += 1 + label_len;
+
+        if (label_len == 0) {
+            return (int64_t)pos;
+        }
+    }
+}
+
+int64_t dns_skip_rr(const uint8_t* msg, size_t len, size_t pos) {
+    int64_t res = dns_skip_name(msg, len, pos);
+    if (res == JK_ERROR) {
+        return JK_ERROR;
+    }
+
+    pos = (size_t)res;
+    if (pos + DNS_RR_FIXED_SIZE > len) {
+        return JK_ERROR;
+    }
+
+    size_t rdlength = dns_read_u16(msg + pos + 8);
+    pos += DNS_RR_FIXED_SIZE + rdlength;
+
+    return pos <= len ? (int64_t)pos : JK_ERROR;
+}
+
+size_t dns_truncate(uint8_t* msg, size_t len) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(len >= DNS_HEADER_SIZE, "message is shorter than the header");
+
+    dns_question_t question;
+    bool has_question = dns_parse_question(msg, len, &question) == JK_OK;
+
+    dns_set_flags(msg, dns_get_flags(msg) | DNS_FLAG_TC);
+    dns_write_u16(msg + 4, has_question ? 1 : 0);
+    dns_write_u16(msg + 6, 0);
+    dns_write_u16(msg + 8, 0);
+    dns_set_arcount(msg, 0);
+
+    return has_question ? question.end : DNS_HEADER_SIZE;
+}
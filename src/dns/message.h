@@ -0,0 +1,93 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DNS_HEADER_SIZE 12
+
+#define DNS_FLAG_QR     0x8000
+#define DNS_FLAG_AA     0x0400
+#define DNS_FLAG_TC     0x0200
+#define DNS_FLAG_RD     0x0100
+#define DNS_FLAG_RA     0x0080
+#define DNS_FLAG_CD     0x0010
+
+#define DNS_RR_FIXED_SIZE 10 // type, class, ttl, rdlength
+
+#define DNS_TYPE_SOA      6
+#define DNS_SOA_MIN_RDATA 22 // two root names and five 32-bit fields
+
+#define DNS_OPCODE_MASK 0x7800
+#define DNS_RCODE_MASK  0x000f
+
+typedef struct {
+    const uint8_t* qname;
+    size_t qname_len;
+    uint16_t qtype;
+    uint16_t qclass;
+
+    // offset of the first byte after the question section
+    size_t end;
+} dns_question_t;
+
+static inline uint16_t dns_read_u16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline void dns_write_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)(v & 0xff);
+}
+
+static inline uint16_t dns_get_id(const uint8_t* msg) {
+    return dns_read_u16(msg);
+}
+
+static inline void dns_set_id(uint8_t* msg, uint16_t id) {
+    dns_write_u16(msg, id);
+}
+
+static inline uint16_t dns_get_flags(const uint8_t* msg) {
+    return dns_read_u16(msg + 2);
+}
+
+static inline void dns_set_flags(uint8_t* msg, uint16_t flags) {
+    dns_write_u16(msg + 2, flags);
+}
+
+static inline uint16_t dns_get_qdcount(const uint8_t* msg) {
+    return dns_read_u16(msg + 4);
+}
+
+static inline uint16_t dns_get_ancount(const uint8_t* msg) {
+    return dns_read_u16(msg + 6);
+}
+
+static inline uint16_t dns_get_nscount(const uint8_t* msg) {
+    return dns_read_u16(msg + 8);
+}
+
+static inline uint16_t dns_get_arcount(const uint8_t* msg) {
+    return dns_read_u16(msg + 10);
+}
+
+static inline void dns_set_arcount(uint8_t* msg, uint16_t count) {
+    dns_write_u16(msg + 10, count);
+}
+
+// parses the single question of a message,
+// returns JK_OK or JK_ERROR when the message is not a well-formed single-question DNS message
+int64_t dns_parse_question(const uint8_t* msg, size_t len, dns_question_t* q);
+uint32_t dns_question_hash(const dns_question_t* q);
+
+// offset right after the possibly compressed name at pos, or JK_ERROR
+int64_t dns_skip_name(const uint8_t* msg, size_t len, size_t pos);
+
+// offset right after the resource record at pos, or JK_ERROR
+int64_t dns_skip_rr(const uint8_t* msg, size_t len, size_t pos);
+
+// cuts a response down to header and question with TC set, returns the new length
+size_t dns_truncate(uint8_t* msg, size_t len);
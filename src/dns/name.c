@@ -0,0 +1,137 @@
+#include "name.h"
+#include "name_kernels.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+int64_t dns_name_labels(const uint8_t* name, size_t max, dns_name_labels_t* labels) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(name != NULL, "name is NULL");
+    CHECK_INVARIANT(labels != NULL, "labels is NULL");
+
+    size_t pos = 0;
+    size_t count = 0;
+
+    for (;;) {
+        if (pos >= max) {
+            return JK_ERROR;
+        }
+
+        uint8_t len = name[pos];
+        if (len == 0) {
+            pos += 1;
+            break;
+        }
+
+        // compression pointers and extended label types are rejected here
+        if (len > DNS_LABEL_MAX_LEN || count == DNS_NAME_MAX_LABELS) {
+            return JK_ERROR;
+        }
+
+        labels->offsets[count] = (uint8_t)pos;
+        count += 1;
+        pos += 1 + len;
+
+        if (pos >= DNS_NAME_MAX_LEN) {
+            return JK_ERROR;
+        }
+    }
+
+    labels->name = name;
+    labels->len = pos;
+    labels->count = count;
+
+    return (int64_t)pos;
+}
+
+int64_t dns_name_wire_len(const uint8_t* name, size_t max) {
+    size_t pos = 0;
+
+    for (;;) {
+        if (pos >= max) {
+            return JK_ERROR;
+        }
+
+        uint8_t len = name[pos];
+        if (len == 0) {
+            return (int64_t)pos + 1;
+        }
+
+        if (len > DNS_LABEL_MAX_LEN) {
+            return JK_ERROR;
+        }
+
+        pos += 1 + len;
+
+        if (pos >= DNS_NAME_MAX_LEN) {
+            return JK_ERROR;
+        }
+    }
+}
+
+int64_t dns_name_from_str(const char* str, uint8_t* out, size_t out_size) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(str != NULL, "str is NULL");
+    CHECK_INVARIANT(out != NULL, "out is NULL");
+
+    size_t str_len = strlen(str);
+    if (str_len > 0 && str[str_len - 1] == '.') {
+        str_len -= 1;
+    }
+
+    // on the wire a name takes a length byte more than its text and the root label
+    if (str_len + 2 > DNS_NAME_MAX_LEN) {
+        return JK_ERROR;
+    }
+
+    uint8_t dots[DNS_NAME_MAX_LEN];
+    size_t count = dns_name_kernels()->find_dots(str, str_len, dots, sizeof(dots));
+
+    size_t pos = 0;
+    size_t start = 0;
+
+    for (size_t k = 0; k <= count && str_len > 0; k++) {
+        size_t end = k < count ? dots[k] : str_len;
+        size_t label_len = end - start;
+
+        if (label_len == 0 || label_len > DNS_LABEL_MAX_LEN) {
+            return JK_ERROR;
+        }
+
+        if (pos + 1 + label_len + 1 > out_size) {
+            return JK_ERROR;
+        }
+
+        out[pos] = (uint8_t)label_len;
+        memcpy(out + pos + 1, str + start, label_len);
+        pos += 1 + label_len;
+
+        start = end + 1;
+    }
+
+    if (pos + 1 > out_size) {
+        return JK_ERROR;
+    }
+
+    out[pos] = 0;
+
+    return (int64_t)pos + 1;
+}
+
+// the widest kernels the cpu supports, see name_kernels.h
+uint64_t dns_name_hash(const uint8_t* name, size_t len) {
+    return dns_name_kernels()->hash(name, len);
+}
+
+bool dns_name_equal(const uint8_t* a, const uint8_t* b, size_t len) {
+    return dns_name_kernels()->equal(a, b, len);
+}
+
+void dns_name_tolower(uint8_t* dst, const uint8_t* src, size_t len) {
+    dns_name_kernels()->tolower(dst, src, len);
+}
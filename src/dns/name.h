@@ -0,0 +1,41 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define DNS_NAME_MAX_LEN    255
+#define DNS_LABEL_MAX_LEN   63
+#define DNS_NAME_MAX_LABELS 128
+
+// label boundaries of an uncompressed wire-format name,
+// offsets[i] points to the length byte of the i-th label, root label is not counted
+typedef struct {
+    const uint8_t* name;
+    size_t len;
+    size_t count;
+    uint8_t offsets[DNS_NAME_MAX_LABELS];
+} dns_name_labels_t;
+
+static inline uint8_t dns_tolower(uint8_t c) {
+    return (uint8_t)(c - 'A') < 26 ? c | 0x20 : c;
+}
+
+// scans the name stored in [name, name + max), returns wire length or JK_ERROR
+int64_t dns_name_labels(const uint8_t* name, size_t max, dns_name_labels_t* labels);
+int64_t dns_name_wire_len(const uint8_t* name, size_t max);
+
+// converts presentation format ("www.example.com", trailing dot is optional)
+// into wire format, returns wire length or JK_ERROR
+int64_t dns_name_from_str(const char* str, uint8_t* out, size_t out_size);
+
+// case-insensitive hash of a wire-format name of known length
+uint64_t dns_name_hash(const uint8_t* name, size_t len);
+
+// case-insensitive comparison of two names of the same length
+bool dns_name_equal(const uint8_t* a, const uint8_t* b, size_t len);
+
+// dst may be src
+void dns_name_tolower(uint8_t* dst, const uint8_t* src, size_t len);
@@ -0,0 +1,394 @@
+#include "name_kernels.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__SSE2__) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define DNS_NAME_KERNELS_AVX2 1
+#endif
+
+#define HASH_K0 0x9e3779b97f4a7c15ULL
+#define HASH_K1 0xff51afd7ed558ccdULL
+#define HASH_K2 0xc4ceb9fe1a85ec53ULL
+
+#define BYTES_7F 0x7f7f7f7f7f7f7f7fULL
+#define BYTES_80 0x8080808080808080ULL
+
+static const dns_name_kernels_t* selected = NULL;
+
+// eight bytes at a time: a byte is upper case when its low seven bits are
+// at least 'A' and at most 'Z' and its top bit is clear
+static inline uint64_t fold_word(uint64_t w) {
+    uint64_t low = w & BYTES_7F;
+    uint64_t ge_a = low + 0x3f3f3f3f3f3f3f3fULL;
+    uint64_t gt_z = low + 0x2525252525252525ULL;
+    uint64_t upper = ge_a & ~gt_z & ~w & BYTES_80;
+
+    return w | (upper >> 2);
+}
+
+// little-endian on every host, hashes do not depend on the byte order
+static inline uint64_t load_word(const uint8_t* p) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    w = __builtin_bswap64(w);
+#endif
+    return w;
+}
+
+// the last 0 < r < 8 bytes of [data, data + len) zero padded, names are
+// short so the tail is reread from the word before it whenever there is one
+static inline uint64_t load_tail(const uint8_t* data, size_t len, size_t r) {
+    if (len >= 8) {
+        return load_word(data + len - 8) >> (64 - 8 * r);
+    }
+
+    uint64_t w = 0;
+    for (size_t i = 0; i < r; i++) {
+        w |= (uint64_t)data[len - r + i] << (8 * i);
+    }
+
+    return w;
+}
+
+// the hash consumes folded 8-byte words, the last one zero padded,
+// every variant only differs in how the words are folded
+static inline uint64_t hash_step(uint64_t h, uint64_t w) {
+    h = (h ^ w) * HASH_K1;
+    return h ^ (h >> 32);
+}
+
+static inline uint64_t hash_final(uint64_t h) {
+    h ^= h >> 33;
+    h *= HASH_K2;
+    return h ^ (h >> 33);
+}
+
+// the scalar kernels start at i so the vector ones can hand them their tails
+static bool scalar_equal_from(const uint8_t* a, const uint8_t* b, size_t i, size_t len) {
+    for (; i + 8 <= len; i += 8) {
+        if (fold_word(load_word(a + i)) != fold_word(load_word(b + i))) {
+            return false;
+        }
+    }
+
+    if (i < len) {
+        return fold_word(load_tail(a, len, len - i)) == fold_word(load_tail(b, len, len - i));
+    }
+
+    return true;
+}
+
+static void scalar_tolower_from(uint8_t* dst, const uint8_t* src, size_t i, size_t len) {
+    for (; i + 8 <= len; i += 8) {
+        uint64_t w = fold_word(load_word(src + i));
+        memcpy(dst + i, &w, 8);
+    }
+
+    // folding is idempotent, the overlapping word may be stored again
+    if (i < len && len >= 8) {
+        uint64_t w = fold_word(load_word(src + len - 8));
+        memcpy(dst + len - 8, &w, 8);
+        return;
+    }
+
+    for (; i < len; i++) {
+        uint8_t c = src[i];
+        dst[i] = (uint8_t)(c - 'A') < 26 ? c | 0x20 : c;
+    }
+}
+
+static uint64_t scalar_hash_from(uint64_t h, const uint8_t* data, size_t i, size_t len) {
+    for (; i + 8 <= len; i += 8) {
+        h = hash_step(h, fold_word(load_word(data + i)));
+    }
+
+    if (i < len) {
+        h = hash_step(h, fold_word(load_tail(data, len, len - i)));
+    }
+
+    return hash_final(h);
+}
+
+static bool scalar_equal(const uint8_t* a, const uint8_t* b, size_t len) {
+    return scalar_equal_from(a, b, 0, len);
+}
+
+static void scalar_tolower(uint8_t* dst, const uint8_t* src, size_t len) {
+    scalar_tolower_from(dst, src, 0, len);
+}
+
+static uint64_t scalar_hash(const uint8_t* data, size_t len) {
+    return scalar_hash_from(HASH_K0 ^ len, data, 0, len);
+}
+
+static size_t scalar_find_dots(const char* str, size_t len, uint8_t* positions, size_t max) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < len; i++) {
+        if (str[i] == '.') {
+            if (count < max) {
+                positions[count] = (uint8_t)i;
+            }
+            count += 1;
+        }
+    }
+
+    return count;
+}
+
+static const dns_name_kernels_t scalar_kernels = {
+    "scalar",
+    scalar_equal,
+    scalar_tolower,
+    scalar_hash,
+    scalar_find_dots,
+};
+
+#if defined(__SSE2__)
+
+// 'A'..'Z' land on the lowest 26 signed bytes once shifted by 0x3f
+static inline __m128i fold16(__m128i v) {
+    __m128i shifted = _mm_add_epi8(v, _mm_set1_epi8(0x3f));
+    __m128i upper = _mm_cmplt_epi8(shifted, _mm_set1_epi8((char)(0x80 + 26)));
+
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+}
+
+static inline size_t add_dots(uint32_t mask, size_t base, uint8_t* positions, size_t count, size_t max) {
+    while (mask != 0) {
+        if (count < max) {
+            positions[count] = (uint8_t)(base + (size_t)__builtin_ctz(mask));
+        }
+        count += 1;
+        mask &= mask - 1;
+    }
+
+    return count;
+}
+
+// a tail of at least 16 bytes is covered by one overlapping vector
+static bool sse2_equal_from(const uint8_t* a, const uint8_t* b, size_t i, size_t len) {
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = fold16(_mm_loadu_si128((const __m128i*)(a + i)));
+        __m128i vb = fold16(_mm_loadu_si128((const __m128i*)(b + i)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xffff) {
+            return false;
+        }
+    }
+
+    if (i < len && len >= 16) {
+        __m128i va = fold16(_mm_loadu_si128((const __m128i*)(a + len - 16)));
+        __m128i vb = fold16(_mm_loadu_si128((const __m128i*)(b + len - 16)));
+
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xffff;
+    }
+
+    return scalar_equal_from(a, b, i, len);
+}
+
+static void sse2_tolower_from(uint8_t* dst, const uint8_t* src, size_t i, size_t len) {
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = fold16(_mm_loadu_si128((const __m128i*)(src + i)));
+        _mm_storeu_si128((__m128i*)(dst + i), v);
+    }
+
+    if (i < len && len >= 16) {
+        __m128i v = fold16(_mm_loadu_si128((const __m128i*)(src + len - 16)));
+        _mm_storeu_si128((__m128i*)(dst + len - 16), v);
+        return;
+    }
+
+    scalar_tolower_from(dst, src, i, len);
+}
+
+static uint64_t sse2_hash_from(uint64_t h, const uint8_t* data, size_t i, size_t len) {
+    for (; i + 16 <= len; i += 16) {
+        uint64_t words[2];
+        _mm_storeu_si128((__m128i*)words, fold16(_mm_loadu_si128((const __m128i*)(data + i))));
+
+        h = hash_step(h, words[0]);
+        h = hash_step(h, words[1]);
+    }
+
+    return scalar_hash_from(h, data, i, len);
+}
+
+static size_t sse2_find_dots_from(const char* str, size_t i, size_t len,
+                                  uint8_t* positions, size_t count, size_t max) {
+    __m128i dot = _mm_set1_epi8('.');
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(str + i));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot));
+        count = add_dots(mask, i, positions, count, max);
+    }
+
+    if (i == len) {
+        return count;
+    }
+
+    // the bytes scanned already are shifted out of the overlapping vector,
+    // names shorter than a vector are copied out first
+    uint32_t mask;
+
+    if (len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(str + len - 16));
+        mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, dot)) >> (16 - (len - i));
+    } else {
+        char buf[16] = {0};
+        memcpy(buf, str + i, len - i);
+        mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)buf), dot));
+    }
+
+    return add_dots(mask, i, positions, count, max);
+}
+
+static bool sse2_equal(const uint8_t* a, const uint8_t* b, size_t len) {
+    return sse2_equal_from(a, b, 0, len);
+}
+
+static void sse2_tolower(uint8_t* dst, const uint8_t* src, size_t len) {
+    sse2_tolower_from(dst, src, 0, len);
+}
+
+static uint64_t sse2_hash(const uint8_t* data, size_t len) {
+    return sse2_hash_from(HASH_K0 ^ len, data, 0, len);
+}
+
+static size_t sse2_find_dots(const char* str, size_t len, uint8_t* positions, size_t max) {
+    return sse2_find_dots_from(str, 0, len, positions, 0, max);
+}
+
+static const dns_name_kernels_t sse2_kernels = {
+    "sse2",
+    sse2_equal,
+    sse2_tolower,
+    sse2_hash,
+    sse2_find_dots,
+};
+
+#endif
+
+#if defined(DNS_NAME_KERNELS_AVX2)
+
+#define AVX2 __attribute__((target("avx2")))
+
+// tails go to the sse2 kernels, the upper halves are cleared by hand before
+// that since gcc turns those calls into jumps without a vzeroupper
+
+static inline AVX2 __m256i fold32(__m256i v) {
+    __m256i shifted = _mm256_add_epi8(v, _mm256_set1_epi8(0x3f));
+    __m256i upper = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(0x80 + 26)), shifted);
+
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+}
+
+static AVX2 bool avx2_equal(const uint8_t* a, const uint8_t* b, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i va = fold32(_mm256_loadu_si256((const __m256i*)(a + i)));
+        __m256i vb = fold32(_mm256_loadu_si256((const __m256i*)(b + i)));
+
+        if ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xffffffffU) {
+            return false;
+        }
+    }
+
+    _mm256_zeroupper();
+    return sse2_equal_from(a, b, i, len);
+}
+
+static AVX2 void avx2_tolower(uint8_t* dst, const uint8_t* src, size_t len) {
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = fold32(_mm256_loadu_si256((const __m256i*)(src + i)));
+        _mm256_storeu_si256((__m256i*)(dst + i), v);
+    }
+
+    _mm256_zeroupper();
+    sse2_tolower_from(dst, src, i, len);
+}
+
+static AVX2 uint64_t avx2_hash(const uint8_t* data, size_t len) {
+    uint64_t h = HASH_K0 ^ len;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        uint64_t words[4];
+        _mm256_storeu_si256((__m256i*)words, fold32(_mm256_loadu_si256((const __m256i*)(data + i))));
+
+        h = hash_step(h, words[0]);
+        h = hash_step(h, words[1]);
+        h = hash_step(h, words[2]);
+        h = hash_step(h, words[3]);
+    }
+
+    _mm256_zeroupper();
+    return sse2_hash_from(h, data, i, len);
+}
+
+static AVX2 size_t avx2_find_dots(const char* str, size_t len, uint8_t* positions, size_t max) {
+    __m256i dot = _mm256_set1_epi8('.');
+    size_t count = 0;
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(str + i));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, dot));
+        count = add_dots(mask, i, positions, count, max);
+    }
+
+    _mm256_zeroupper();
+    return sse2_find_dots_from(str, i, len, positions, count, max);
+}
+
+static const dns_name_kernels_t avx2_kernels = {
+    "avx2",
+    avx2_equal,
+    avx2_tolower,
+    avx2_hash,
+    avx2_find_dots,
+};
+
+#endif
+
+const dns_name_kernels_t* dns_name_kernels() {
+    if (selected != NULL) {
+        return selected;
+    }
+
+    for (int isa = DNS_ISA_COUNT - 1; isa >= 0 && selected == NULL; isa--) {
+        selected = dns_name_kernels_for((dns_isa_t)isa);
+    }
+
+    return selected;
+}
+
+const dns_name_kernels_t* dns_name_kernels_for(dns_isa_t isa) {
+    switch (isa) {
+    case DNS_ISA_SCALAR:
+        return &scalar_kernels;
+#if defined(__SSE2__)
+    case DNS_ISA_SSE2:
+        return &sse2_kernels;
+#endif
+#if defined(DNS_NAME_KERNELS_AVX2)
+    case DNS_ISA_AVX2:
+        return __builtin_cpu_supports("avx2") ? &avx2_kernels : NULL;
+#endif
+    default:
+        return NULL;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum {
+    DNS_ISA_SCALAR = 0,
+    DNS_ISA_SSE2,
+    DNS_ISA_AVX2,
+    DNS_ISA_COUNT,
+} dns_isa_t;
+
+// Case-folding primitives over wire-format names, ASCII letters only
+// (RFC 4343). Every variant returns the same results, hashes included,
+// so tables may be filled and probed through different ones.
+typedef struct {
+    const char* name;
+
+    // equality of two byte ranges of the same length, case-insensitive
+    bool (*equal)(const uint8_t* a, const uint8_t* b, size_t len);
+
+    // copies len bytes, upper case letters folded to lower case
+    void (*tolower)(uint8_t* dst, const uint8_t* src, size_t len);
+
+    // case-insensitive hash of len bytes
+    uint64_t (*hash)(const uint8_t* data, size_t len);
+
+    // positions of the dots in a presentation-format name, at most max of them,
+    // returns how many there are (which may exceed max)
+    size_t (*find_dots)(const char* str, size_t len, uint8_t* positions, size_t max);
+} dns_name_kernels_t;
+
+// the fastest variant the cpu runs, chosen on first use
+const dns_name_kernels_t* dns_name_kernels();
+
+// NULL if the variant is not built for this target or the cpu lacks it
+const dns_name_kernels_t* dns_name_kernels_for(dns_isa_t isa);
@@ -0,0 +1,371 @@
+#include "name_trie.h"
+#include "name.h"
+
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NT_END_BIT 16
+
+// two nibbles per label byte plus one end-of-label step per label
+#define NT_MAX_DEPTH (2 * DNS_NAME_MAX_LEN + DNS_NAME_MAX_LABELS + 1)
+
+struct name_trie_node_s {
+    void* value;
+    uint32_t bitmap;
+    name_trie_node_t* children[];
+};
+
+static name_trie_node_t* node_create();
+static void node_destroy(name_trie_node_t* node, name_trie_release_func* release);
+static name_trie_node_t** node_child_slot(name_trie_node_t* node, unsigned bit);
+static name_trie_node_t** node_add_child(name_trie_node_t** slot, unsigned bit);
+static void node_remove_child(name_trie_node_t* node, unsigned bit);
+static name_trie_node_t* walk_label(name_trie_node_t* node, const uint8_t* label);
+
+static inline unsigned child_index(uint32_t bitmap, unsigned bit) {
+    return (unsigned)__builtin_popcount(bitmap & ((1u << bit) - 1));
+}
+
+static name_trie_node_t* node_create() {
+    logger_t* logger = current_logger;
+
+    name_trie_node_t* node = calloc(1, sizeof(name_trie_node_t));
+    if (node == NULL) {
+        log_perror("name_trie.node_create");
+        return NULL;
+    }
+
+    return node;
+}
+
+static void node_destroy(name_trie_node_t* node, name_trie_release_func* release) {
+    unsigned count = (unsigned)__builtin_popcount(node->bitmap);
+
+    for (unsigned i = 0; i < count; i++) {
+        node_destroy(node->children[i], release);
+    }
+
+    if (node->value != NULL && release != NULL) {
+        release(node->value);
+    }
+
+    free(node);
+}
+
+static name_trie_node_t** node_child_slot(name_trie_node_t* node, unsigned bit) {
+    if ((node->bitmap & (1u << bit)) == 0) {
+        return NULL;
+    }
+
+    return &node->children[child_index(node->bitmap, bit)];
+}
+
+// grows the node stored in *slot by one child, the node may move
+static name_trie_node_t** node_add_child(name_trie_node_t** slot, unsigned bit) {
+    logger_t* logger = current_logger;
+
+    name_trie_node_t* node = *slot;
+    unsigned count = (unsigned)__builtin_popcount(node->bitmap);
+    unsigned idx = child_index(node->bitmap, bit);
+
+    name_trie_node_t* child = node_create();
+    if (child == NULL) {
+        return NULL;
+    }
+
+    name_trie_node_t* grown = realloc(
+        node, sizeof(name_trie_node_t) + (count + 1) * sizeof(name_trie_node_t*));
+    if (grown == NULL) {
+        log_perror("name_trie.node_add_child.realloc");
+        free(child);
+        return NULL;
+    }
+
+    memmove( // NOLINT
+        &grown->children[idx + 1],
+        &grown->children[idx],
+        (count - idx) * sizeof(name_trie_node_t*));
+
+    grown->children[idx] = child;
+    grown->bitmap |= 1u << bit;
+    *slot = grown;
+
+    return &grown->children[idx];
+}
+
+static void node_remove_child(name_trie_node_t* node, unsigned bit) {
+    unsigned count = (unsigned)__builtin_popcount(node->bitmap);
+    unsigned idx = child_index(node->bitmap, bit);
+
+    // the allocation is not shrunk, it is reused if the child comes back
+    memmove( // NOLINT
+        &node->children[idx],
+        &node->children[idx + 1],
+        (count - idx - 1) * sizeof(name_trie_node_t*));
+
+    node->bitmap &= ~(1u << bit);
+}
+
+// follows one label (given by its length byte) and its end-of-label step
+static name_trie_node_t* walk_label(name_trie_node_t* node, const uint8_t* label) {
+    uint8_t len = label[0];
+
+    for (uint8_t i = 1; i <= len; i++) {
+        uint8_t c = dns_tolower(label[i]);
+
+        name_trie_node_t** slot = node_child_slot(node, c >> 4);
+        if (slot == NULL) {
+            return NULL;
+        }
+
+        slot = node_child_slot(*slot, c & 0x0f);
+        if (slot == NULL) {
+            return NULL;
+        }
+
+        node = *slot;
+    }
+
+    name_trie_node_t** slot = node_child_slot(node, NT_END_BIT);
+    if (slot == NULL) {
+        return NULL;
+    }
+
+    return *slot;
+}
+
+name_trie_t* name_trie_create() {
+    logger_t* logger = current_logger;
+
+    name_trie_t* trie = calloc(1, sizeof(name_trie_t));
+    if (trie == NULL) {
+        log_perror("name_trie_create.allocate_name_trie_t");
+        return NULL;
+    }
+
+    trie->root = node_create();
+    if (trie->root == NULL) {
+        free(trie);
+        return NULL;
+    }
+
+    trie->size = 0;
+
+    return trie;
+}
+
+void name_trie_destroy(name_trie_t* trie, name_trie_release_func* release) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(trie != NULL, "trie is NULL");
+    CHECK_INVARIANT(trie->root != NULL, "trie->root is NULL");
+
+    node_destroy(trie->root, release);
+    free(trie);
+}
+
+int name_trie_insert(name_trie_t* trie, const uint8_t* name, void* value) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(trie != NULL, "trie is NULL");
+    CHECK_INVARIANT(name != NULL, "name is NULL");
+    CHECK_INVARIANT(value != NULL, "value is NULL");
+
+    dns_name_labels_t labels;
+    if (dns_name_labels(name, DNS_NAME_MAX_LEN, &labels) == JK_ERROR) {
+        return JK_ERROR;
+    }
+
+    name_trie_node_t** slot = &trie->root;
+
+    for (size_t i = labels.count; i > 0; i--) {
+        const uint8_t* label = name + labels.offsets[i - 1];
+        uint8_t len = label[0];
+
+        for (uint8_t j = 0; j <= len; j++) {
+            unsigned steps[2];
+            size_t nsteps = 0;
+
+            if (j < len) {
+                uint8_t c = dns_tolower(label[j + 1]);
+                steps[nsteps++] = c >> 4;
+                steps[nsteps++] = c & 0x0f;
+            } else {
+                steps[nsteps++] = NT_END_BIT;
+            }
+
+            for (size_t k = 0; k < nsteps; k++) {
+                name_trie_node_t** next = node_child_slot(*slot, steps[k]);
+                if (next == NULL) {
+                    next = node_add_child(slot, steps[k]);
+                    if (next == NULL) {
+                        return JK_ERROR;
+                    }
+                }
+                slot = next;
+            }
+        }
+    }
+
+    if ((*slot)->value == NULL) {
+        trie->size += 1;
+    }
+
+    (*slot)->value = value;
+
+    return JK_OK;
+}
+
+void* name_trie_lookup(name_trie_t* trie, const uint8_t* name) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(trie != NULL, "trie is NULL");
+    CHECK_INVARIANT(name != NULL, "name is NULL");
+
+    dns_name_labels_t labels;
+    if (dns_name_labels(name, DNS_NAME_MAX_LEN, &labels) == JK_ERROR) {
+        return NULL;
+    }
+
+    name_trie_node_t* node = trie->root;
+
+    for (size_t i = labels.count; i > 0; i--) {
+        node = walk_label(node, name + labels.offsets[i - 1]);
+        if (node == NULL) {
+            return NULL;
+        }
+    }
+
+    return node->value;
+}
+
+int name_trie_delete(name_trie_t* trie, const uint8_t* name) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(trie != NULL, "trie is NULL");
+    CHECK_INVARIANT(name != NULL, "name is NULL");
+
+    dns_name_labels_t labels;
+    if (dns_name_labels(name, DNS_NAME_MAX_LEN, &labels) == JK_ERROR) {
+        return JK_ERROR;
+    }
+
+    // path[d] is the node at depth d, bits[d] is the step that led to it
+    name_trie_node_t* path[NT_MAX_DEPTH];
+    unsigned bits[NT_MAX_DEPTH];
+    size_t depth = 0;
+
+    path[0] = trie->root;
+
+    for (size_t i = labels.count; i > 0; i--) {
+        const uint8_t* label = name + labels.offsets[i - 1];
+        uint8_t len = label[0];
+
+        for (uint8_t j = 0; j <= len; j++) {
+            unsigned steps[2];
+            size_t nsteps = 0;
+
+            if (j < len) {
+                uint8_t c = dns_tolower(label[j + 1]);
+                steps[nsteps++] = c >> 4;
+                steps[nsteps++] = c & 0x0f;
+            } else {
+                steps[nsteps++] = NT_END_BIT;
+            }
+
+            for (size_t k = 0; k < nsteps; k++) {
+                name_trie_node_t** next = node_child_slot(path[depth], steps[k]);
+                if (next == NULL) {
+                    return JK_NOT_FOUND;
+                }
+
+                CHECK_INVARIANT(depth + 1 < NT_MAX_DEPTH, "trie path is too deep");
+
+                depth += 1;
+                path[depth] = *next;
+                bits[depth] = steps[k];
+            }
+        }
+    }
+
+    if (path[depth]->value == NULL) {
+        return JK_NOT_FOUND;
+    }
+
+    path[depth]->value = NULL;
+    trie->size -= 1;
+
+    // prune nodes that lead nowhere, the root is kept
+    for (; depth > 0; depth--) {
+        name_trie_node_t* node = path[depth];
+        if (node->value != NULL || node->bitmap != 0) {
+            break;
+        }
+
+        node_remove_child(path[depth - 1], bits[depth]);
+        free(node);
+    }
+
+    return JK_OK;
+}
+
+int name_trie_match(name_trie_t* trie, const uint8_t* name, name_trie_match_t* match) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(trie != NULL, "trie is NULL");
+    CHECK_INVARIANT(name != NULL, "name is NULL");
+    CHECK_INVARIANT(match != NULL, "match is NULL");
+
+    memset(match, 0, sizeof(*match));
+
+    dns_name_labels_t labels;
+    if (dns_name_labels(name, DNS_NAME_MAX_LEN, &labels) == JK_ERROR) {
+        return JK_ERROR;
+    }
+
+    name_trie_node_t* encloser = trie->root;
+    size_t matched = 0;
+
+    if (encloser->value != NULL) {
+        match->longest = encloser->value;
+        match->longest_labels = 0;
+    }
+
+    for (size_t i = labels.count; i > 0; i--) {
+        name_trie_node_t* node = walk_label(encloser, name + labels.offsets[i - 1]);
+        if (node == NULL) {
+            break;
+        }
+
+        encloser = node;
+        matched += 1;
+
+        if (node->value != NULL) {
+            match->longest = node->value;
+            match->longest_labels = matched;
+        }
+    }
+
+    match->encloser_labels = matched;
+
+    // an empty non-terminal is no exact match, a parent above it may still be the suffix
+    if (matched == labels.count) {
+        match->exact = encloser->value;
+        return match->longest != NULL ? JK_OK : JK_NOT_FOUND;
+    }
+
+    static const uint8_t wildcard_label[] = { 1, '*' };
+
+    name_trie_node_t* wildcard = walk_label(encloser, wildcard_label);
+    if (wildcard != NULL) {
+        match->wildcard = wildcard->value;
+    }
+
+    return match->longest != NULL || match->wildcard != NULL ? JK_OK : JK_NOT_FOUND;
+}
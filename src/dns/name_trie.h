@@ -0,0 +1,47 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Trie over domain names keyed by labels in reverse order (root first),
+// case-folded. Every label byte is consumed as two nibbles, a node keeps a
+// 16-bit bitmap of nibble children plus one "end of label" bit, children are
+// stored densely and indexed by popcount of the bitmap.
+// Nodes reached through the "end of label" bit correspond to names.
+
+typedef struct name_trie_node_s name_trie_node_t;
+
+typedef struct {
+    name_trie_node_t* root;
+    size_t size;
+} name_trie_t;
+
+typedef struct {
+    // value stored for the name itself
+    void* exact;
+
+    // value of the longest stored suffix (zone cut, forward zone, blocked parent)
+    void* longest;
+    size_t longest_labels;
+
+    // deepest existing name on the path (including empty non-terminals)
+    size_t encloser_labels;
+
+    // value stored for *.<closest encloser>, not set on exact match
+    void* wildcard;
+} name_trie_match_t;
+
+typedef void (name_trie_release_func)(void* value);
+
+name_trie_t* name_trie_create();
+void name_trie_destroy(name_trie_t* trie, name_trie_release_func* release);
+
+// names are in uncompressed wire format
+int name_trie_insert(name_trie_t* trie, const uint8_t* name, void* value);
+void* name_trie_lookup(name_trie_t* trie, const uint8_t* name);
+int name_trie_delete(name_trie_t* trie, const uint8_t* name);
+
+// exact, longest-suffix and wildcard lookup in a single walk
+int name_trie_match(name_trie_t* trie, const uint8_t* name, name_trie_match_t* match);
@@ -0,0 +1,199 @@
+#include "query_log.h"
+#include "dispatch.h"
+#include "message.h"
+#include "core/connection.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/process.h"
+#include "core/time.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#define QUERY_LOG_PATH_MAX 4096
+#define QUERY_LOG_SIZE \
+    (sizeof(dns_query_log_header_t) + (size_t)DNS_QUERY_LOG_RECORDS * sizeof(dns_query_log_record_t))
+
+static dns_query_log_header_t* header = NULL;
+static dns_query_log_record_t* records = NULL;
+
+// wall clock minus jk_now_us(), one clock read per record is all it costs
+static int64_t wall_offset = 0;
+
+static size_t copy_qname(uint8_t* out, const uint8_t* name, size_t len, bool* cut);
+static void sync_wall_clock();
+static void handle_clock_timer(void* data);
+
+int64_t dns_query_log_init() {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    if (s->query_log == NULL) {
+        return JK_OK;
+    }
+
+    char path[QUERY_LOG_PATH_MAX];
+    char tmp_path[QUERY_LOG_PATH_MAX + sizeof(".tmp")];
+
+    // every worker writes a file of its own, there is a single writer per ring
+    int len = s->workers > 1
+        ? snprintf(path, sizeof(path), "%s.%u", s->query_log, current_worker)
+        : snprintf(path, sizeof(path), "%s", s->query_log);
+
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        log_error("dns_query_log: path is too long");
+        return JK_ERROR;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    int fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        log_perror("dns_query_log.open");
+        return JK_ERROR;
+    }
+
+    if (ftruncate(fd, QUERY_LOG_SIZE) != 0) {
+        log_perror("dns_query_log.ftruncate");
+        close(fd);
+        unlink(tmp_path);
+        return JK_ERROR;
+    }
+
+    // faulted in now rather than on the first queries
+    uint8_t* map = mmap(NULL, QUERY_LOG_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        log_perror("dns_query_log.mmap");
+        unlink(tmp_path);
+        return JK_ERROR;
+    }
+
+    header = (dns_query_log_header_t*)map;
+    records = (dns_query_log_record_t*)(map + sizeof(dns_query_log_header_t));
+
+    memcpy(header->magic, DNS_QUERY_LOG_MAGIC, sizeof(header->magic));
+    header->version = DNS_QUERY_LOG_VERSION;
+    header->record_size = sizeof(dns_query_log_record_t);
+    header->capacity = DNS_QUERY_LOG_RECORDS;
+    header->created_at = jk_wall_now();
+    atomic_store_explicit(&header->head, 0, memory_order_release);
+
+    // a reader of the previous file keeps what it has, the new one appears whole
+    if (rename(tmp_path, path) != 0) {
+        log_perror("dns_query_log.rename");
+        munmap(map, QUERY_LOG_SIZE);
+        unlink(tmp_path);
+        header = NULL;
+        records = NULL;
+        return JK_ERROR;
+    }
+
+    sync_wall_clock();
+
+    log_info("dns_query_log: writing to %s", path);
+
+    return JK_OK;
+}
+
+void dns_query_log_write(const dns_request_t* req, bool sent) {
+    if (records == NULL) {
+        return;
+    }
+
+    int64_t latency = jk_now_us() - req->received_at;
+
+    uint64_t index = atomic_load_explicit(&header->head, memory_order_relaxed);
+    dns_query_log_record_t* rec = &records[index & (DNS_QUERY_LOG_RECORDS - 1)];
+
+    // a reader racing with the writer sees seq change under it and skips the record
+    atomic_store_explicit(&rec->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    uint8_t flags = 0;
+
+    if (req->over_tcp) {
+        flags |= DNS_QUERY_LOG_TCP;
+    }
+
+    if (!sent) {
+        flags |= DNS_QUERY_LOG_DROPPED;
+    }
+
+    rec->received_at = req->received_at + wall_offset;
+    rec->latency = latency < 0 ? 0 : latency > UINT32_MAX ? UINT32_MAX : (uint32_t)latency;
+    rec->rcode = req->response != NULL ? dns_get_flags(req->response) & DNS_RCODE_MASK : 0;
+
+    rec->client_af = req->client.af;
+    rec->client_port = req->client.src_port;
+    memset(rec->client, 0, sizeof(rec->client));
+
+    if (req->client.af == AF_INET) {
+        memcpy(rec->client, &req->client.src.src_v4, sizeof(req->client.src.src_v4));
+    } else {
+        memcpy(rec->client, &req->client.src.src_v6, sizeof(req->client.src.src_v6));
+    }
+
+    if (req->qname != NULL) {
+        bool cut = false;
+        rec->qname_len = (uint8_t)copy_qname(rec->qname, req->qname, req->qname_len, &cut);
+        rec->qtype = req->qtype;
+        flags |= cut ? DNS_QUERY_LOG_NAME_CUT : 0;
+    } else {
+        rec->qname_len = 0;
+        rec->qtype = 0;
+        flags |= DNS_QUERY_LOG_MALFORMED;
+    }
+
+    rec->flags = flags;
+
+    atomic_store_explicit(&rec->seq, index + 1, memory_order_release);
+    atomic_store_explicit(&header->head, index + 1, memory_order_release);
+}
+
+// the name is cut at a label boundary, so whatever is kept stays walkable
+static size_t copy_qname(uint8_t* out, const uint8_t* name, size_t len, bool* cut) {
+    if (len <= DNS_QUERY_LOG_QNAME_SIZE) {
+        memcpy(out, name, len);
+        return len;
+    }
+
+    size_t pos = 0;
+    while (pos + 1 + name[pos] <= DNS_QUERY_LOG_QNAME_SIZE) {
+        pos += 1 + name[pos];
+    }
+
+    memcpy(out, name, pos);
+    *cut = true;
+
+    return pos;
+}
+
+// follows steps of the wall clock within DNS_QUERY_LOG_CLOCK_SYNC
+static void sync_wall_clock() {
+    wall_offset = jk_wall_now_us() - jk_now_us();
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, DNS_QUERY_LOG_CLOCK_SYNC);
+    timer.handler = handle_clock_timer;
+    timer.data = NULL;
+
+    ev_backend->add_timer(timer);
+}
+
+static void handle_clock_timer(void* data) {
+    (void)data;
+
+    sync_wall_clock();
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DNS_QUERY_LOG_MAGIC       "JKDNSQLG"
+#define DNS_QUERY_LOG_VERSION     1
+#define DNS_QUERY_LOG_RECORDS     (1 << 18) // power of two, 32 MB per worker
+#define DNS_QUERY_LOG_QNAME_SIZE  84        // wire format, longer names are cut
+#define DNS_QUERY_LOG_CLOCK_SYNC  1000      // ms between wall clock readings
+
+#define DNS_QUERY_LOG_TCP        0x01
+#define DNS_QUERY_LOG_DROPPED    0x02 // nothing was sent back
+#define DNS_QUERY_LOG_NAME_CUT   0x04 // qname holds the first labels only
+#define DNS_QUERY_LOG_MALFORMED  0x08 // no question could be parsed
+
+// The file starts with a header of its own cache line. Records follow, the
+// one with index i sits at slot i & (capacity - 1) and is overwritten once
+// the writer comes around again.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;
+    // wall clock, ms
+    int64_t created_at;
+    // records written so far, the next index
+    _Atomic uint64_t head;
+    uint8_t reserved[24];
+} dns_query_log_header_t;
+
+// seq is index + 1 once the record is complete and 0 while it is being
+// written, a reader copies the record and checks seq before and after
+typedef struct {
+    _Atomic uint64_t seq;
+    // wall clock, us
+    int64_t received_at;
+    // us from the query coming in to the answer leaving
+    uint32_t latency;
+    uint16_t qtype;
+    uint16_t client_port;
+    uint8_t rcode;
+    uint8_t flags;
+    uint8_t client_af;
+    uint8_t qname_len;
+    // 4 bytes for AF_INET
+    uint8_t client[16];
+    uint8_t qname[DNS_QUERY_LOG_QNAME_SIZE];
+} dns_query_log_record_t;
+
+_Static_assert(sizeof(dns_query_log_header_t) == 64, "query log header is not a cache line");
+_Static_assert(sizeof(dns_query_log_record_t) == 128, "query log record is not two cache lines");
+
+// Every answered or dropped query is written to --query-log (".<worker>"
+// appended when there are several workers). The file is mapped shared and
+// written in place with no syscalls, other processes may map it read-only
+// and follow head. It is created aside and renamed over the previous one,
+// a reader should reopen the path when its inode changes.
+int64_t dns_query_log_init();
+
+// called by the transport once it is done with the answer, sent is false
+// when nothing went back to the client
+void dns_query_log_write(const dns_request_t* req, bool sent);
@@ -0,0 +1,261 @@
+#include "render.h"
+#include "edns.h"
+#include "message.h"
+#include "name.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+// how the next name is laid out: labels [0, literal) are written out,
+// the rest is replaced by a pointer
+typedef struct {
+    dns_name_labels_t labels;
+    size_t literal;
+    uint16_t pointer;
+    size_t size;
+} name_plan_t;
+
+static uint32_t hash_label(const uint8_t* label, uint16_t parent);
+static bool label_equal(const uint8_t* a, const uint8_t* b);
+static uint16_t find_suffix(dns_render_t* r, const uint8_t* label, uint16_t parent, uint32_t hash);
+static void insert_suffix(dns_render_t* r, uint16_t offset, uint16_t parent, uint32_t hash);
+static int64_t plan_name(dns_render_t* r, const uint8_t* name, name_plan_t* plan);
+static void emit_name(dns_render_t* r, name_plan_t* plan);
+
+int64_t dns_render_init(dns_render_t* r, uint8_t* buf, size_t cap, uint16_t id, uint16_t flags) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(r != NULL, "r is NULL");
+    CHECK_INVARIANT(buf != NULL, "buf is NULL");
+
+    memset(r->counts, 0, sizeof(r->counts));
+    memset(r->table, 0, sizeof(r->table));
+    r->used = 0;
+
+    r->buf = buf;
+    r->cap = cap;
+    r->len = 0;
+
+    if (cap < DNS_HEADER_SIZE) {
+        return JK_OUT_OF_BUFFER;
+    }
+
+    memset(buf, 0, DNS_HEADER_SIZE);
+    dns_set_id(buf, id);
+    dns_set_flags(buf, flags);
+    r->len = DNS_HEADER_SIZE;
+
+    return JK_OK;
+}
+
+int64_t dns_render_question(dns_render_t* r, const uint8_t* name, uint16_t qtype, uint16_t qclass) {
+    name_plan_t plan;
+    int64_t res = plan_name(r, name, &plan);
+    if (res != JK_OK) {
+        return res;
+    }
+
+    if (r->len + plan.size + 4 > r->cap) {
+        return JK_OUT_OF_BUFFER;
+    }
+
+    emit_name(r, &plan);
+
+    dns_write_u16(r->buf + r->len, qtype);
+    dns_write_u16(r->buf + r->len + 2, qclass);
+    r->len += 4;
+
+    r->counts[DNS_SECTION_QUESTION] += 1;
+
+    return JK_OK;
+}
+
+int64_t dns_render_rr(
+    dns_render_t* r,
+    dns_section_t section,
+    const uint8_t* name,
+    uint16_t type,
+    uint16_t rclass,
+    uint32_t ttl,
+    const uint8_t* rdata,
+    uint16_t rdlength) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(section != DNS_SECTION_QUESTION, "questions have no rr");
+    CHECK_INVARIANT(rdata != NULL || rdlength == 0, "rdata is NULL");
+
+    name_plan_t plan;
+    int64_t res = plan_name(r, name, &plan);
+    if (res != JK_OK) {
+        return res;
+    }
+
+    if (r->len + plan.size + DNS_RR_FIXED_SIZE + rdlength > r->cap) {
+        return JK_OUT_OF_BUFFER;
+    }
+
+    emit_name(r, &plan);
+
+    uint8_t* p = r->buf + r->len;
+    dns_write_u16(p, type);
+    dns_write_u16(p + 2, rclass);
+    dns_write_u16(p + 4, (uint16_t)(ttl >> 16));
+    dns_write_u16(p + 6, (uint16_t)(ttl & 0xffff));
+    dns_write_u16(p + 8, rdlength);
+
+    if (rdlength > 0) {
+        memcpy(p + DNS_RR_FIXED_SIZE, rdata, rdlength);
+    }
+
+    r->len += DNS_RR_FIXED_SIZE + rdlength;
+    r->counts[section] += 1;
+
+    return JK_OK;
+}
+
+int64_t dns_render_opt(dns_render_t* r, uint16_t udp_size, uint8_t ext_rcode, uint16_t flags) {
+    if (r->len + DNS_OPT_RR_SIZE > r->cap) {
+        return JK_OUT_OF_BUFFER;
+    }
+
+    dns_edns_write_opt(r->buf + r->len, udp_size, ext_rcode, flags);
+    r->len += DNS_OPT_RR_SIZE;
+    r->counts[DNS_SECTION_ADDITIONAL] += 1;
+
+    return JK_OK;
+}
+
+size_t dns_render_finish(dns_render_t* r) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(r->len >= DNS_HEADER_SIZE, "header is not rendered");
+
+    dns_write_u16(r->buf + 4, r->counts[DNS_SECTION_QUESTION]);
+    dns_write_u16(r->buf + 6, r->counts[DNS_SECTION_ANSWER]);
+    dns_write_u16(r->buf + 8, r->counts[DNS_SECTION_AUTHORITY]);
+    dns_write_u16(r->buf + 10, r->counts[DNS_SECTION_ADDITIONAL]);
+
+    return r->len;
+}
+
+static uint32_t hash_label(const uint8_t* label, uint16_t parent) {
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i <= label[0]; i++) {
+        hash ^= dns_tolower(label[i]);
+        hash *= 16777619u;
+    }
+
+    hash ^= parent;
+    hash *= 16777619u;
+
+    return hash;
+}
+
+static bool label_equal(const uint8_t* a, const uint8_t* b) {
+    return a[0] == b[0] && dns_name_equal(a + 1, b + 1, a[0]);
+}
+
+static uint16_t find_suffix(dns_render_t* r, const uint8_t* label, uint16_t parent, uint32_t hash) {
+    size_t mask = DNS_RENDER_TABLE_SIZE - 1;
+
+    for (size_t i = hash & mask; r->table[i].offset != 0; i = (i + 1) & mask) {
+        dns_render_entry_t* e = &r->table[i];
+
+        if (e->hash == hash && e->parent == parent && label_equal(r->buf + e->offset, label)) {
+            return e->offset;
+        }
+    }
+
+    return 0;
+}
+
+static void insert_suffix(dns_render_t* r, uint16_t offset, uint16_t parent, uint32_t hash) {
+    size_t mask = DNS_RENDER_TABLE_SIZE - 1;
+
+    // a crowded table only costs compression, never correctness
+    if (r->used >= DNS_RENDER_TABLE_SIZE * 3 / 4) {
+        return;
+    }
+
+    size_t i = hash & mask;
+    while (r->table[i].offset != 0) {
+        i = (i + 1) & mask;
+    }
+
+    r->table[i].hash = hash;
+    r->table[i].offset = offset;
+    r->table[i].parent = parent;
+    r->used += 1;
+}
+
+// matches the name against written suffixes starting from the root label
+static int64_t plan_name(dns_render_t* r, const uint8_t* name, name_plan_t* plan) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(r->len >= DNS_HEADER_SIZE, "header is not rendered");
+    CHECK_INVARIANT(name != NULL, "name is NULL");
+
+    if (dns_name_labels(name, DNS_NAME_MAX_LEN, &plan->labels) == JK_ERROR) {
+        return JK_ERROR;
+    }
+
+    size_t count = plan->labels.count;
+    uint16_t parent = 0;
+    size_t literal = count;
+
+    while (literal > 0) {
+        const uint8_t* label = name + plan->labels.offsets[literal - 1];
+
+        uint16_t offset = find_suffix(r, label, parent, hash_label(label, parent));
+        if (offset == 0) {
+            break;
+        }
+
+        parent = offset;
+        literal -= 1;
+    }
+
+    plan->literal = literal;
+    plan->pointer = parent;
+
+    // literal labels, then either a pointer or the root label
+    size_t size = literal < count ? plan->labels.offsets[literal] : plan->labels.len - 1;
+    plan->size = size + (parent != 0 ? 2 : 1);
+
+    return JK_OK;
+}
+
+static void emit_name(dns_render_t* r, name_plan_t* plan) {
+    const uint8_t* name = plan->labels.name;
+    size_t start = r->len;
+    size_t literal_size = plan->size - (plan->pointer != 0 ? 2 : 1);
+
+    memcpy(r->buf + start, name, literal_size);
+
+    if (plan->pointer != 0) {
+        dns_write_u16(r->buf + start + literal_size, 0xc000 | plan->pointer);
+    } else {
+        r->buf[start + literal_size] = 0;
+    }
+
+    r->len += plan->size;
+
+    // register the new suffixes, innermost first so each one knows its parent
+    uint16_t parent = plan->pointer;
+
+    for (size_t i = plan->literal; i > 0; i--) {
+        size_t offset = start + plan->labels.offsets[i - 1];
+        if (offset > DNS_PTR_MAX_OFFSET) {
+            break;
+        }
+
+        const uint8_t* label = r->buf + offset;
+        insert_suffix(r, (uint16_t)offset, parent, hash_label(label, parent));
+        parent = (uint16_t)offset;
+    }
+}
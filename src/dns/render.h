@@ -0,0 +1,60 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_RENDER_TABLE_SIZE 128 // power of two
+#define DNS_PTR_MAX_OFFSET    0x3fff
+
+typedef enum {
+    DNS_SECTION_QUESTION = 0,
+    DNS_SECTION_ANSWER,
+    DNS_SECTION_AUTHORITY,
+    DNS_SECTION_ADDITIONAL,
+} dns_section_t;
+
+// A written name suffix is identified by its first label and the offset of
+// the suffix that follows it, so a lookup costs one label compare and a name
+// compresses in O(labels) without rescanning the message.
+typedef struct {
+    uint32_t hash;
+    // label length byte in the message, 0 marks a free slot (the header lives there)
+    uint16_t offset;
+    // suffix following the label, 0 for the root
+    uint16_t parent;
+} dns_render_entry_t;
+
+// Builds a message directly in the caller's buffer.
+typedef struct {
+    uint8_t* buf;
+    size_t cap;
+    size_t len;
+
+    uint16_t counts[4];
+
+    size_t used;
+    dns_render_entry_t table[DNS_RENDER_TABLE_SIZE];
+} dns_render_t;
+
+// writes the header, returns JK_OUT_OF_BUFFER when it does not fit
+int64_t dns_render_init(dns_render_t* r, uint8_t* buf, size_t cap, uint16_t id, uint16_t flags);
+
+// names are in uncompressed wire format, rdata is copied verbatim.
+// Return JK_OUT_OF_BUFFER leaving the message as it was before the call,
+// or JK_ERROR for a malformed name.
+int64_t dns_render_question(dns_render_t* r, const uint8_t* name, uint16_t qtype, uint16_t qclass);
+int64_t dns_render_rr(
+    dns_render_t* r,
+    dns_section_t section,
+    const uint8_t* name,
+    uint16_t type,
+    uint16_t rclass,
+    uint32_t ttl,
+    const uint8_t* rdata,
+    uint16_t rdlength);
+int64_t dns_render_opt(dns_render_t* r, uint16_t udp_size, uint8_t ext_rcode, uint16_t flags);
+
+// stores the section counts in the header, returns the message length
+size_t dns_render_finish(dns_render_t* r);
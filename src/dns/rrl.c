@@ -0,0 +1,141 @@
+#include "rrl.h"
+#include "dispatch.h"
+#include "message.h"
+#include "core/connection.h"
+#include "core/time.h"
+#include "settings/settings.h"
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define DNS_RRL_COST 1000 // tokens are kept in thousandths of a response
+
+// 16 bytes, a set of DNS_RRL_WAYS buckets fills one cache line
+typedef struct {
+    // 0 marks a free bucket
+    uint32_t tag;
+    // last refill, ms, wraps around
+    uint32_t stamp;
+    int32_t tokens;
+    // responses over the limit, every rrl_slip-th of them slips through
+    uint32_t limited;
+} dns_rrl_bucket_t;
+
+typedef struct {
+    _Alignas(64) dns_rrl_bucket_t ways[DNS_RRL_WAYS];
+} dns_rrl_set_t;
+
+// the event loop is the only user, no locking is needed
+static dns_rrl_set_t table[DNS_RRL_SETS];
+
+static dns_rrl_class_t classify(const uint8_t* response);
+static uint64_t prefix_hash(const address_t* client, dns_rrl_class_t cls);
+static dns_rrl_bucket_t* find_bucket(dns_rrl_set_t* set, uint32_t tag, uint32_t now);
+
+dns_rrl_action_t dns_rrl_check(const address_t* client, const uint8_t* response, size_t len) {
+    settings_t* s = current_settings;
+
+    if (s->rrl_rate == 0 || len < DNS_HEADER_SIZE) {
+        return DNS_RRL_SEND;
+    }
+
+    uint64_t hash = prefix_hash(client, classify(response));
+    dns_rrl_set_t* set = &table[hash & (DNS_RRL_SETS - 1)];
+    uint32_t tag = (uint32_t)(hash >> 32) | 1;
+
+    uint32_t now = (uint32_t)jk_now();
+    int64_t cap = (int64_t)s->rrl_rate * DNS_RRL_COST;
+
+    dns_rrl_bucket_t* b = find_bucket(set, tag, now);
+
+    if (b->tag != tag) {
+        b->tag = tag;
+        b->stamp = now;
+        b->tokens = (int32_t)cap;
+        b->limited = 0;
+    } else {
+        // rrl_rate responses per second is rrl_rate thousandths per ms
+        int64_t tokens = b->tokens + (int64_t)(uint32_t)(now - b->stamp) * s->rrl_rate;
+        b->tokens = (int32_t)(tokens < cap ? tokens : cap);
+        b->stamp = now;
+    }
+
+    if (b->tokens >= DNS_RRL_COST) {
+        b->tokens -= DNS_RRL_COST;
+        return DNS_RRL_SEND;
+    }
+
+    b->limited += 1;
+
+    // a truncated answer lets a real client retry over tcp
+    // while a spoofed victim gets no more bytes than it sent
+    if (s->rrl_slip != 0 && b->limited % s->rrl_slip == 0) {
+        return DNS_RRL_SLIP;
+    }
+
+    return DNS_RRL_DROP;
+}
+
+static dns_rrl_class_t classify(const uint8_t* response) {
+    uint16_t rcode = dns_get_flags(response) & DNS_RCODE_MASK;
+
+    if (rcode == DNS_RCODE_NXDOMAIN) {
+        return DNS_RRL_NXDOMAIN;
+    }
+
+    if (rcode != DNS_RCODE_NOERROR) {
+        return DNS_RRL_ERROR;
+    }
+
+    return dns_get_ancount(response) > 0 ? DNS_RRL_ANSWER : DNS_RRL_NODATA;
+}
+
+// the prefix bytes, the address family and the class, mixed with the
+// splitmix64 finalizer so that neighbouring prefixes land in distinct sets
+static uint64_t prefix_hash(const address_t* client, dns_rrl_class_t cls) {
+    uint8_t key[8] = {0};
+
+    if (client->af == AF_INET) {
+        memcpy(key, &client->src.src_v4, DNS_RRL_V4_BITS / 8);
+    } else {
+        memcpy(key, &client->src.src_v6, DNS_RRL_V6_BITS / 8);
+    }
+
+    key[7] = (uint8_t)(((client->af == AF_INET) << 4) | cls);
+
+    uint64_t x;
+    memcpy(&x, key, sizeof(x));
+
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+
+    return x;
+}
+
+// the bucket with the tag, otherwise a free one, otherwise the least recently used
+static dns_rrl_bucket_t* find_bucket(dns_rrl_set_t* set, uint32_t tag, uint32_t now) {
+    dns_rrl_bucket_t* victim = &set->ways[0];
+
+    for (size_t i = 0; i < DNS_RRL_WAYS; i++) {
+        dns_rrl_bucket_t* b = &set->ways[i];
+
+        if (b->tag == tag) {
+            return b;
+        }
+
+        if (victim->tag == 0) {
+            continue;
+        }
+
+        if (b->tag == 0 || now - b->stamp > now - victim->stamp) {
+            victim = b;
+        }
+    }
+
+    return victim;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_RRL_SETS    16384 // power of two
+#define DNS_RRL_WAYS    4     // buckets per set, one cache line
+#define DNS_RRL_V4_BITS 24
+#define DNS_RRL_V6_BITS 56
+
+typedef enum {
+    DNS_RRL_SEND = 0,
+    DNS_RRL_SLIP,
+    DNS_RRL_DROP,
+} dns_rrl_action_t;
+
+typedef enum {
+    DNS_RRL_ANSWER = 0,
+    DNS_RRL_NODATA,
+    DNS_RRL_NXDOMAIN,
+    DNS_RRL_ERROR,
+} dns_rrl_class_t;
+
+// Response Rate Limiting for udp answers. Token buckets keyed by client
+// prefix and response class live in a fixed set-associative table owned by
+// the event loop, a check is a hash, one cache line and no allocation.
+// A full table evicts the least recently used bucket of the set.
+dns_rrl_action_t dns_rrl_check(const address_t* client, const uint8_t* response, size_t len);
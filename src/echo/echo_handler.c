@@ -124,6 +124,10 @@ void handle_echo_read(event_t *ev) {
 
     ssize_t read = recv_buf(conn, pos, space_left);
 
+    if (read == JK_WOULD_BLOCK) {
+        return;
+    }
+
     if (read == 0) {
         log_trace("peer closed the connection");
         return stop_echo(ev);
@@ -142,8 +146,10 @@ void handle_echo_read(event_t *ev) {
     buf->taken += read;
 
     // dirty trick to facilitate logging
-    buf->data[buf->taken] = 0;
-    log_trace("handle_echo_read.msg: %s", buf->data);
+    if (buf->taken < buf->capacity) {
+        buf->data[buf->taken] = 0;
+        log_trace("handle_echo_read.msg: %s", buf->data);
+    }
 
     ev_backend->disable_event(conn->read);
     ev_backend->enable_event(conn->write);
@@ -159,8 +165,10 @@ void handle_echo_write(event_t *ev) {
     buffer_t* buf = ctx->buf;
 
     // dirty trick to facilitate logging
-    buf->data[buf->taken] = 0;
-    log_trace("handle_echo_write.msg: %s", buf->data);
+    if (buf->taken < buf->capacity) {
+        buf->data[buf->taken] = 0;
+        log_trace("handle_echo_write.msg: %s", buf->data);
+    }
 
     ssize_t sent = send_buf(conn, buf->data, buf->taken);
 
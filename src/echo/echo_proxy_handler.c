@@ -1,12 +1,16 @@
 #include "echo_proxy_handler.h"
 #include "core/connection.h"
 #include "core/time.h"
+#include "core/trace.h"
 #include "logger/logger.h"
 #include "core/errors.h"
 #include "connection/connection.h"
 #include "settings/settings.h"
+#include "upstream/probe.h"
+#include "upstream/upstream.h"
 
 #include "core/decl.h"
+#include "core/epoch.h"
 #include "core/event.h"
 #include "core/net.h"
 #include "core/buffer.h"
@@ -18,21 +22,50 @@
 #include <string.h>
 #include <unistd.h>
 
-static void handle_echo_read(event_t *ev);
-static void handle_echo_write(event_t *ev);
 static void stop_echo_proxy(connection_t* conn);
 static void abort_echo_proxy(connection_t* conn);
-
-#define NET_BUFFER_SIZE 4096
+static void retire_conn(connection_t* conn);
+static void ignore_retired(event_t* ev);
+static void close_retired(void* data);
+
+#define ECHO_BUFFER_SIZE    65536 // per direction
+#define ECHO_HIGH_WATERMARK 49152 // reads pause once this much waits for the peer
+#define ECHO_LOW_WATERMARK  16384 // and resume when the peer took all but this
+#define ECHO_DATAGRAM_SIZE  4096  // largest chunk sent to a udp peer at once
 #define ECHO_TIMEOUT 5000
 #define ECHO_REMOTE_TIMEOUT 6000
+#define ECHO_CONNECT_TIMEOUT 1000 // a remote that takes longer is given up for the next one
 
+// Both directions stream at once, each through a buffer of its own.
+// A side is read while the buffer towards its peer stays under the
+// high watermark, and written to whenever that peer's buffer has data.
 typedef struct {
     connection_t *client;
     connection_t *remote;
     buffer_t* to_remote;
     buffer_t* to_client;
 
+    // the side closed, what it sent is delivered before the session ends
+    bool client_eof;
+    bool remote_eof;
+
+    // reads held back by the high watermark
+    bool client_paused;
+    bool remote_paused;
+
+    // the remote is picked from the upstream set, which is kept while
+    // the session lasts
+    upstream_t* upstream;
+    uint64_t epoch;
+    // remotes tried so far
+    uint32_t attempts;
+    // the tcp handshake is done, udp remotes have none
+    bool connected;
+    int64_t connect_started;
+    // something was sent to the remote and something came back
+    bool remote_sent;
+    bool remote_answered;
+
     jk_timer_t* timer;
     jk_timer_t* remote_timer;
 } echo_context_t;
@@ -42,16 +75,32 @@ static void reschedule_timer(jk_timer_t* timer, int timeout, connection_t* conn)
 
 static echo_context_t* create_context(connection_t* client);
 static void destroy_context(echo_context_t* ctx);
+static int64_t connect_remote(echo_context_t* ctx, const upstream_t* exclude);
+static void release_remote(echo_context_t* ctx);
+static void remote_failed(echo_context_t* ctx);
+static void remote_connected(echo_context_t* ctx);
+static void fail_side(echo_context_t* ctx, connection_t* conn);
+static void report_failure(upstream_t* u);
 static buffer_t* allocate_buffer();
 static void destroy_buffer(buffer_t* buf);
 
-static void do_echo_read(
-    connection_t* conn, buffer_t* buf, 
-    connection_t* other);
+static void settle_proxy(echo_context_t* ctx, connection_t* conn, bool readable);
+static bool wants_read(connection_t* conn, buffer_t* buf, bool eof, bool* paused);
+static void update_session_interest(echo_context_t* ctx);
+static void update_interest(connection_t* conn, bool want_read, bool want_write);
+static int64_t flush_to(connection_t* conn, buffer_t* buf, connection_t* ready);
+
+static ssize_t do_echo_read(
+    connection_t* conn, buffer_t* buf, bool* eof);
 
-static void do_echo_write(
+static int64_t do_echo_write(
     connection_t* conn, buffer_t* buf);
 
+// connections given up on, linked through their data; events later in
+// the batch may still point to them, so they are closed once it is over
+static connection_t* retired = NULL;
+static jk_posted_t retired_post = {close_retired, NULL, NULL, false};
+
 buffer_t* allocate_buffer() {
     logger_t *logger = current_logger;
     buffer_t* buf = calloc(1, sizeof(buffer_t));
@@ -60,14 +109,14 @@ buffer_t* allocate_buffer() {
         return NULL;
     }
 
-    buf->data = calloc(NET_BUFFER_SIZE, sizeof(*buf->data));
+    buf->data = calloc(ECHO_BUFFER_SIZE, sizeof(*buf->data));
     if (buf->data == NULL) {
         free(buf);
         log_perror("handle_echo_proxy.allocate_buffer_data");
         return NULL;
     }
 
-    buf->capacity = NET_BUFFER_SIZE;
+    buf->capacity = ECHO_BUFFER_SIZE;
     buf->taken = 0;
 
     return buf;
@@ -96,36 +145,10 @@ echo_context_t* create_context(connection_t* client) {
 
     ctx->client = client;
 
-    void (*read_handler)(event_t *ev) = NULL;
-    void (*write_handler)(event_t *ev) = NULL;
-
     CHECK_INVARIANT(s->proxy_mode == true, "unextected non-proxy mode call");
 
-    read_handler = handle_echo_proxy;
-    write_handler = handle_echo_proxy;
-
-    conn_type_t conn_type = s->remote_use_udp ? CONN_TYPE_UDP : CONN_TYPE_TCP;
-    
-    if (conn_type == CONN_TYPE_UDP) {
-        log_trace("using udp for echo proxy");
-    } else {
-        log_trace("using tcp for echo proxy");
-    }
-    
-    connection_t *remote = 
-        make_client_connection(
-            conn_type,
-            s->remote_ip,
-            s->remote_port,
-            read_handler,
-            write_handler);
-    
-    ctx->remote = remote;
-    remote->data = ctx;
-
     buffer_t* to_remote = allocate_buffer();
     if (to_remote == NULL) {
-        close_connection(remote);
         free(ctx);
         log_error("handle_echo_proxy.allocate_to_remote_buffer");
         return NULL;
@@ -136,7 +159,6 @@ echo_context_t* create_context(connection_t* client) {
     buffer_t* to_client = allocate_buffer();
     if (to_client == NULL) {
         destroy_buffer(to_remote);
-        close_connection(remote);
         free(ctx);
         log_error("handle_echo_proxy.allocate_to_client_buffer");
         return NULL;
@@ -144,23 +166,147 @@ echo_context_t* create_context(connection_t* client) {
 
     ctx->to_client = to_client;
 
+    ctx->epoch = jk_epoch_pin();
+
+    if (connect_remote(ctx, NULL) != JK_OK) {
+        log_error("handle_echo_proxy: no upstream could be connected to");
+        destroy_buffer(to_client);
+        destroy_buffer(to_remote);
+        jk_epoch_unpin(ctx->epoch);
+        free(ctx);
+        return NULL;
+    }
+
     ctx->timer = NULL;
     ctx->remote_timer = NULL;
 
     return ctx;
 }
 
+// picks a healthy upstream other than exclude, upstreams that cannot
+// even be connected to are reported and the next one is tried
+int64_t connect_remote(echo_context_t* ctx, const upstream_t* exclude) {
+    logger_t *logger = current_logger;
+    settings_t *s = current_settings;
+
+    conn_type_t conn_type = s->remote_use_udp ? CONN_TYPE_UDP : CONN_TYPE_TCP;
+
+    while (ctx->attempts < upstream_count()) {
+        upstream_t* u = upstream_pick_balanced(exclude);
+        if (u == NULL) {
+            return JK_NOT_FOUND;
+        }
+
+        ctx->attempts += 1;
+
+        connection_t *remote =
+            make_client_connection_to(
+                conn_type,
+                &u->addr,
+                handle_echo_proxy,
+                handle_echo_proxy);
+        if (remote == NULL) {
+            log_error("handle_echo_proxy: failed to connect to upstream");
+            report_failure(u);
+            exclude = u;
+            continue;
+        }
+
+        log_trace("echo proxy remote over %s", conn_type == CONN_TYPE_UDP ? "udp" : "tcp");
+
+        remote->data = ctx;
+        ctx->remote = remote;
+        ctx->upstream = u;
+        ctx->connected = conn_type == CONN_TYPE_UDP;
+        ctx->connect_started = jk_now();
+
+        u->active += 1;
+
+        return JK_OK;
+    }
+
+    return JK_NOT_FOUND;
+}
+
+void release_remote(echo_context_t* ctx) {
+    connection_t* remote = ctx->remote;
+
+    ctx->remote = NULL;
+    ctx->upstream->active -= 1;
+
+    retire_conn(remote);
+}
+
+// a remote that failed before its handshake was done got nothing from
+// the client yet, the session moves on to another upstream
+void remote_failed(echo_context_t* ctx) {
+    logger_t *logger = current_logger;
+
+    report_failure(ctx->upstream);
+
+    if (ctx->connected) {
+        return stop_echo_proxy(ctx->client);
+    }
+
+    const upstream_t* failed = ctx->upstream;
+    release_remote(ctx);
+
+    if (connect_remote(ctx, failed) != JK_OK) {
+        log_warn("handle_echo_proxy: no upstream left to fail over to");
+        return stop_echo_proxy(ctx->client);
+    }
+
+    log_trace("echo proxy failed over to another upstream");
+
+    // the firing timer is popped right after its handler returns
+    ctx->remote_timer->enabled = false;
+    ctx->remote_timer = start_new_timer(ECHO_CONNECT_TIMEOUT, ctx->remote);
+    if (ctx->remote_timer == NULL) {
+        log_error("handle_echo_proxy: failed to add remote timer");
+        return stop_echo_proxy(ctx->client);
+    }
+
+    update_session_interest(ctx);
+}
+
+void remote_connected(echo_context_t* ctx) {
+    ctx->connected = true;
+
+    upstream_report_rtt(ctx->upstream, (jk_now() - ctx->connect_started) * 1000);
+}
+
+void fail_side(echo_context_t* ctx, connection_t* conn) {
+    if (conn == ctx->remote) {
+        return remote_failed(ctx);
+    }
+
+    return stop_echo_proxy(conn);
+}
+
+// ejected tcp upstreams are probed back, udp ones are retried by sessions
+// once UPSTREAM_RETRY_INTERVAL passes
+void report_failure(upstream_t* u) {
+    settings_t *s = current_settings;
+
+    upstream_report_failure(u);
+
+    if (upstream_is_ejected(u) && !s->remote_use_udp) {
+        upstream_probe(u);
+    }
+}
+
 void destroy_context(echo_context_t* ctx) {
     logger_t *logger = current_logger;
 
     CHECK_INVARIANT(ctx != NULL, "ctx is NULL!");
-    CHECK_INVARIANT(ctx->timer != NULL, "ctx->timer is NULL!");
-    CHECK_INVARIANT(ctx->remote_timer != NULL, "ctx->remote_timer is NULL!");
 
     destroy_buffer(ctx->to_client);
     destroy_buffer(ctx->to_remote);
 
+    uint64_t epoch = ctx->epoch;
     free(ctx);
+
+    jk_epoch_unpin(epoch);
 }
 
 void handle_echo_proxy(event_t *ev) {
@@ -173,7 +319,12 @@ void handle_echo_proxy(event_t *ev) {
     
     if (conn->error) {
         log_perror("handle_echo_proxy");
-        return stop_echo_proxy(conn);
+
+        if (conn->data == NULL) {
+            return abort_echo_proxy(conn);
+        }
+
+        return fail_side(conn->data, conn);
     }
     
     if (conn->data == NULL) {
@@ -187,42 +338,169 @@ void handle_echo_proxy(event_t *ev) {
         ctx->remote->data = ctx;
 
         ctx->timer = start_new_timer(ECHO_TIMEOUT, ctx->client);
-        ctx->remote_timer = start_new_timer(ECHO_REMOTE_TIMEOUT, ctx->remote);
-    }
-
-    if (ev->write) {
-        handle_echo_write(ev);
-    } else {
-        handle_echo_read(ev);
+        ctx->remote_timer = start_new_timer(
+            ctx->connected ? ECHO_REMOTE_TIMEOUT : ECHO_CONNECT_TIMEOUT,
+            ctx->remote);
+
+        // without its timers a stalled session would never end
+        if (ctx->timer == NULL || ctx->remote_timer == NULL) {
+            log_error("handle_echo_proxy: failed to add session timers");
+            return stop_echo_proxy(ctx->client);
+        }
     }
-}
 
-void handle_echo_read(event_t *ev) {
-    connection_t* conn = ev->owner.ptr;
     echo_context_t *ctx = (echo_context_t*)conn->data;
-    
-    bool client_read = conn == ctx->client;
+
+    if (conn == ctx->remote && !ctx->connected) {
+        remote_connected(ctx);
+    }
 
     reschedule_timer(
         ctx->timer,
         ECHO_TIMEOUT, 
         ctx->client);
 
-    reschedule_timer(
-        ctx->remote_timer, 
-        ECHO_REMOTE_TIMEOUT,
-        ctx->remote);
+    // the connect timeout runs on regardless of the client
+    if (ctx->connected) {
+        reschedule_timer(
+            ctx->remote_timer, 
+            ECHO_REMOTE_TIMEOUT,
+            ctx->remote);
+    }
+
+    // a tcp connection is notified once for both directions, a udp one
+    // has a datagram to hand over only with its read event
+    bool readable = conn->handle.type == CONN_TYPE_TCP || !ev->write;
+
+    return settle_proxy(ctx, conn, readable);
+}
 
-    if (client_read) {
-        return do_echo_read(conn, ctx->to_remote, ctx->remote);
-    } else {
-        return do_echo_read(conn, ctx->to_client, ctx->client);
+// reads what the ready side has until the buffer towards its peer is over
+// the high watermark, writes out both buffers and repeats while it can read
+void settle_proxy(echo_context_t* ctx, connection_t* conn, bool readable) {
+    bool client_side = conn == ctx->client;
+
+    buffer_t* in = client_side ? ctx->to_remote : ctx->to_client;
+    bool* eof = client_side ? &ctx->client_eof : &ctx->remote_eof;
+    bool* paused = client_side ? &ctx->client_paused : &ctx->remote_paused;
+
+    while (readable) {
+        if (wants_read(conn, in, *eof, paused)) {
+            ssize_t read = do_echo_read(conn, in, eof);
+            if (read == JK_ERROR) {
+                return fail_side(ctx, conn);
+            }
+
+            if (read > 0 && !client_side) {
+                ctx->remote_answered = true;
+                JK_TRACE2(proxy_remote_recv, ctx, read);
+            }
+
+            // udp hands over one datagram per read event
+            if (read == JK_WOULD_BLOCK || read == 0 || conn->handle.type == CONN_TYPE_UDP) {
+                readable = false;
+            }
+        } else {
+            readable = false;
+        }
+
+        if (flush_to(ctx->client, ctx->to_client, conn) != JK_OK) {
+            return fail_side(ctx, ctx->client);
+        }
+
+        // nothing goes out before the handshake, so another remote
+        // can still be given the whole buffer
+        if (!ctx->connected) {
+            continue;
+        }
+
+        size_t pending = ctx->to_remote->taken;
+
+        if (flush_to(ctx->remote, ctx->to_remote, conn) != JK_OK) {
+            return fail_side(ctx, ctx->remote);
+        }
+
+        if (ctx->to_remote->taken != pending) {
+            ctx->remote_sent = true;
+            JK_TRACE2(proxy_remote_send, ctx, pending - ctx->to_remote->taken);
+        }
+    }
+
+    if ((ctx->client_eof && ctx->to_remote->taken == 0) ||
+        (ctx->remote_eof && ctx->to_client->taken == 0)) {
+        return stop_echo_proxy(conn);
+    }
+
+    update_session_interest(ctx);
+}
+
+void update_session_interest(echo_context_t* ctx) {
+    update_interest(
+        ctx->client,
+        wants_read(ctx->client, ctx->to_remote, ctx->client_eof, &ctx->client_paused),
+        ctx->to_client->taken != 0);
+
+    // a connecting remote turns writable once the handshake is done
+    update_interest(
+        ctx->remote,
+        wants_read(ctx->remote, ctx->to_client, ctx->remote_eof, &ctx->remote_paused),
+        ctx->to_remote->taken != 0 || !ctx->connected);
+}
+
+bool wants_read(connection_t* conn, buffer_t* buf, bool eof, bool* paused) {
+    if (eof) {
+        return false;
+    }
+
+    // datagrams keep their boundaries, one is taken only into an empty buffer
+    if (conn->handle.type == CONN_TYPE_UDP) {
+        return buf->taken == 0;
+    }
+
+    if (buf->taken >= ECHO_HIGH_WATERMARK) {
+        *paused = true;
+    } else if (buf->taken <= ECHO_LOW_WATERMARK) {
+        *paused = false;
+    }
+
+    return !*paused && buf->taken < buf->capacity;
+}
+
+// write interest only while a write is blocked
+void update_interest(connection_t* conn, bool want_read, bool want_write) {
+    if (want_read != (bool)conn->read->enabled) {
+        if (want_read) {
+            // rearming reports data that is already queued
+            ev_backend->enable_event(conn->read);
+        } else {
+            ev_backend->disable_event(conn->read);
+        }
+    }
+
+    if (want_write != (bool)conn->write->enabled) {
+        if (want_write) {
+            ev_backend->enable_event(conn->write);
+        } else {
+            ev_backend->disable_event(conn->write);
+        }
     }
 }
 
-void do_echo_read(
-    connection_t* conn, buffer_t* buf, 
-    connection_t* other) {
+int64_t flush_to(connection_t* conn, buffer_t* buf, connection_t* ready) {
+    if (buf->taken == 0) {
+        return JK_OK;
+    }
+
+    // a blocked side is retried once it reports being writable
+    if (conn->write->enabled && conn != ready) {
+        return JK_OK;
+    }
+
+    return do_echo_write(conn, buf);
+}
+
+ssize_t do_echo_read(
+    connection_t* conn, buffer_t* buf, bool* eof) {
     logger_t *logger = current_logger;
 
     size_t space_left = buf->capacity - buf->taken;
@@ -230,75 +508,74 @@ void do_echo_read(
     
     ssize_t read = recv_buf(conn, pos, space_left);
 
+    if (read == JK_WOULD_BLOCK) {
+        return JK_WOULD_BLOCK;
+    }
+
     if (read == 0) {
         log_trace("peer closed the connection");
-        return stop_echo_proxy(conn);
+        *eof = true;
+        return 0;
     }
     
     if (read < 0 && read == JK_OUT_OF_BUFFER) {
         log_error("do_echo_read: no space left to read data into");
-        return stop_echo_proxy(conn);
+        return JK_ERROR;
     }
 
     if (read < 0 && read == JK_ERROR) {
         log_perror("do_echo_read");
-        return stop_echo_proxy(conn);
+        return JK_ERROR;
     }
     
     buf->taken += read;
-    
-    ev_backend->disable_event(conn->read);
-    ev_backend->enable_event(other->write);
+
+    return read;
 }
 
-void handle_echo_write(event_t *ev) {
-    connection_t* conn = ev->owner.ptr;
-    echo_context_t *ctx = (echo_context_t*)conn->data;
-    
-    bool client_write = conn == ctx->client;
+int64_t do_echo_write(
+    connection_t* conn, buffer_t* buf) {
+    logger_t *logger = current_logger;
 
-    reschedule_timer(
-        ctx->timer,
-        ECHO_TIMEOUT, 
-        ctx->client);
+    size_t offset = 0;
 
-    reschedule_timer(
-        ctx->remote_timer, 
-        ECHO_REMOTE_TIMEOUT,
-        ctx->remote);
+    while (offset < buf->taken) {
+        size_t count = buf->taken - offset;
+        if (conn->handle.type == CONN_TYPE_UDP && count > ECHO_DATAGRAM_SIZE) {
+            count = ECHO_DATAGRAM_SIZE;
+        }
 
-    if (client_write) {
-        return do_echo_write(conn, ctx->to_client);
-    } else {
-        return do_echo_write(conn, ctx->to_remote);
-    }
-}
+        ssize_t sent = send_buf(conn, buf->data + offset, count);
 
-void do_echo_write(
-    connection_t* conn, buffer_t* buf) {
-    logger_t *logger = current_logger;
+        if (sent == JK_WOULD_BLOCK) {
+            break;
+        }
 
-    ssize_t sent = send_buf(conn, buf->data, buf->taken);
+        if (sent == 0) {
+            log_trace("peer closed the connection");
+            return JK_ERROR;
+        }
 
-    if (sent == 0) {
-        log_trace("peer closed the connection");
-        return stop_echo_proxy(conn);
-    }
+        if (sent == JK_ERROR) {
+            log_perror("do_echo_write");
+            return JK_ERROR;
+        }
 
-    if (sent == JK_ERROR) {
-        log_perror("do_echo_write");
-        return stop_echo_proxy(conn);
+        offset += sent;
+
+        if ((size_t)sent < count) {
+            // short write, the socket buffer is full
+            break;
+        }
     }
 
-    buf->taken = buf->taken - sent;
+    buf->taken -= offset;
 
-    if (buf->taken != 0) {
-        memmove(buf->data, buf->data + sent * sizeof(*(buf->data)), buf->taken); // NOLINT
-        return;
+    if (buf->taken != 0 && offset != 0) {
+        memmove(buf->data, buf->data + offset * sizeof(*(buf->data)), buf->taken); // NOLINT
     }
 
-    ev_backend->disable_event(conn->write);
-    ev_backend->enable_event(conn->read);
+    return JK_OK;
 }
 
 void abort_echo_proxy(connection_t* conn) {
@@ -307,8 +584,7 @@ void abort_echo_proxy(connection_t* conn) {
 
     CHECK_INVARIANT(conn != NULL, "conn is NULL!");
 
-    ev_backend->del_conn(conn);
-    close_connection(conn);
+    retire_conn(conn);
 }
 
 void stop_echo_proxy(connection_t* conn) {
@@ -321,23 +597,54 @@ void stop_echo_proxy(connection_t* conn) {
     
     CHECK_INVARIANT(ctx != NULL, "ctx is NULL!");
     CHECK_INVARIANT(ctx->client != NULL, "ctx->client is NULL!");
-    CHECK_INVARIANT(ctx->remote != NULL, "ctx->remote is NULL!");
-    
-    connection_t* client = ctx->client;
-    connection_t* remote = ctx->remote;
 
-    ctx->timer->enabled = false;
-    ctx->remote_timer->enabled = false;
+    // either may be missing when adding it failed
+    if (ctx->timer != NULL) {
+        ctx->timer->enabled = false;
+    }
+
+    if (ctx->remote_timer != NULL) {
+        ctx->remote_timer->enabled = false;
+    }
 
-    ev_backend->del_conn(client);
-    close_connection(client);
+    retire_conn(ctx->client);
 
-    ev_backend->del_conn(remote);
-    close_connection(remote);
+    // gone when a failover found no upstream
+    if (ctx->remote != NULL) {
+        ctx->upstream->active -= 1;
+        retire_conn(ctx->remote);
+    }
 
     destroy_context(ctx);
 }
 
+// deregistered now, events still due in this batch find nothing to do
+void retire_conn(connection_t* conn) {
+    ev_backend->del_conn(conn);
+
+    conn->read->handler = ignore_retired;
+    conn->write->handler = ignore_retired;
+
+    conn->data = retired;
+    retired = conn;
+
+    ev_backend->post(&retired_post);
+}
+
+void ignore_retired(event_t* ev) {
+    (void)ev; // unused
+}
+
+void close_retired(void* data) {
+    (void)data; // unused
+
+    while (retired != NULL) {
+        connection_t* conn = retired;
+        retired = conn->data;
+        close_connection(conn);
+    }
+}
+
 void handle_echo_timeout(void* data) {
     logger_t *logger = current_logger;
 
@@ -350,6 +657,17 @@ void handle_echo_timeout(void* data) {
     bool is_client_timeout = ctx->client == conn;
 
     log_trace("echo proxy timeout, client_timeout: %s", BOOL_TO_S(is_client_timeout));
+
+    if (!is_client_timeout && !ctx->connected) {
+        log_warn("handle_echo_proxy: upstream connect timed out");
+        return remote_failed(ctx);
+    }
+
+    // the remote took data and went quiet
+    if (!is_client_timeout && ctx->remote_sent && !ctx->remote_answered) {
+        report_failure(ctx->upstream);
+    }
+
     stop_echo_proxy(conn);
 }
 
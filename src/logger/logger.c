@@ -21,6 +21,7 @@ logger_t* init_logger(settings_t *settings) {
     logger->fd = -1;
     logger->level = -1;
     logger->file_logging = false;
+    logger->async = false;
 
     if (logger == NULL) {
         perror("init_logger.calloc");
@@ -54,5 +55,9 @@ logger_t* init_logger(settings_t *settings) {
         }
     }
 
+    if (logger->level < LOG_MIN_LEVEL) {
+        fprintf(stderr, "init_logger: lines below %s are compiled out\n", log_levels[LOG_MIN_LEVEL]);
+    }
+
     return logger;
 }
@@ -15,12 +15,19 @@
 
 #define DEFAULT_LOG_LEVEL LOG_INFO
 
+// lines below this level are compiled out, set by -DJKDNS_LOG_MIN_LEVEL
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_TRACE
+#endif
+
 typedef struct logger_s logger_t;
 
 struct logger_s {
     int fd;
     int level;
     bool file_logging;
+    // lines below LOG_CRIT are queued for the writer thread
+    bool async;
 };
 
 extern const char* log_levels[];
@@ -35,21 +42,43 @@ void base_log_perror(int64_t level, logger_t *logger, const char *fmt, ...);
 void init_file_logging(logger_t *logger, const char* log_file);
 void init_stdout_logging(logger_t *logger);
 
-#define log_trace(...)  base_log(LOG_TRACE, logger, ##__VA_ARGS__)
-#define log_debug(...)  base_log(LOG_DEBUG, logger, ##__VA_ARGS__)
-#define log_info(...)   base_log(LOG_INFO, logger, ##__VA_ARGS__)
-#define log_notice(...) base_log(LOG_NOTICE, logger, ##__VA_ARGS__)
-#define log_warn(...)   base_log(LOG_WARN, logger, ##__VA_ARGS__)
-#define log_error(...)  base_log(LOG_ERROR, logger, ##__VA_ARGS__)
-#define log_crit(...)   base_log(LOG_CRIT, logger, ##__VA_ARGS__)
-
-#define log_ptrace(...)  base_log_perror(LOG_TRACE, logger, ##__VA_ARGS__)
-#define log_pdebug(...)  base_log_perror(LOG_DEBUG, logger, ##__VA_ARGS__)
-#define log_pinfo(...)   base_log_perror(LOG_INFO, logger, ##__VA_ARGS__)
-#define log_pnotice(...) base_log_perror(LOG_NOTICE, logger, ##__VA_ARGS__)
-#define log_pwarn(...)   base_log_perror(LOG_WARN, logger, ##__VA_ARGS__)
-#define log_perror(...)  base_log_perror(LOG_ERROR, logger, ##__VA_ARGS__)
-#define log_pcrit(...)   base_log_perror(LOG_CRIT, logger, ##__VA_ARGS__)
+// Moves the writes off the calling threads. Every thread queues its lines
+// in a ring of its own, a writer thread gathers them into writev calls.
+// A line is queued as its format and a copy of its arguments, the writer
+// formats it; lines with arguments that cannot be copied are formatted
+// before they are queued. A line that finds the ring full is dropped and
+// counted, the writer reports the count. Lines still queued are written
+// out at exit.
+int64_t start_async_logging(logger_t *logger);
+
+// lines dropped by full rings so far
+uint64_t logger_dropped();
+
+// The level is checked before any argument is evaluated. Below LOG_MIN_LEVEL
+// the condition is constant and the call goes away, the arguments are still
+// type-checked.
+#define LOG_AT(lvl, log_fn, ...)                                        \
+    do {                                                                \
+        if ((lvl) >= LOG_MIN_LEVEL && (lvl) >= logger->level) {         \
+            log_fn(lvl, logger, __VA_ARGS__);                           \
+        }                                                               \
+    } while(0)
+
+#define log_trace(...)  LOG_AT(LOG_TRACE, base_log, __VA_ARGS__)
+#define log_debug(...)  LOG_AT(LOG_DEBUG, base_log, __VA_ARGS__)
+#define log_info(...)   LOG_AT(LOG_INFO, base_log, __VA_ARGS__)
+#define log_notice(...) LOG_AT(LOG_NOTICE, base_log, __VA_ARGS__)
+#define log_warn(...)   LOG_AT(LOG_WARN, base_log, __VA_ARGS__)
+#define log_error(...)  LOG_AT(LOG_ERROR, base_log, __VA_ARGS__)
+#define log_crit(...)   LOG_AT(LOG_CRIT, base_log, __VA_ARGS__)
+
+#define log_ptrace(...)  LOG_AT(LOG_TRACE, base_log_perror, __VA_ARGS__)
+#define log_pdebug(...)  LOG_AT(LOG_DEBUG, base_log_perror, __VA_ARGS__)
+#define log_pinfo(...)   LOG_AT(LOG_INFO, base_log_perror, __VA_ARGS__)
+#define log_pnotice(...) LOG_AT(LOG_NOTICE, base_log_perror, __VA_ARGS__)
+#define log_pwarn(...)   LOG_AT(LOG_WARN, base_log_perror, __VA_ARGS__)
+#define log_perror(...)  LOG_AT(LOG_ERROR, base_log_perror, __VA_ARGS__)
+#define log_pcrit(...)   LOG_AT(LOG_CRIT, base_log_perror, __VA_ARGS__)
 
 #define CHECK_INVARIANT(cond, fmt, ...)                                 \
     do {                                                                \
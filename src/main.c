@@ -2,9 +2,17 @@
 #include "core/ev_backend.h"
 #include "core/event.h"
 #include "core/listener.h"
+#include "core/process.h"
 #include "core/udp_socket.h"
 #include "core/time.h"
 
+#include "dns/blocklist.h"
+#include "dns/cache_snapshot.h"
+#include "dns/query_log.h"
+#include "metrics/admin.h"
+#include "metrics/metrics.h"
+#include "reload/reload.h"
+#include "upgrade/upgrade.h"
 #include "settings/settings.h"
 #include "logger/logger.h"
 #include "udp_socket/udp_socket.h"
@@ -32,6 +40,30 @@ int main(int argc, char *argv[]) {
     current_logger = init_logger(settings);
     logger_t* logger = current_logger;
 
+    if (metrics_init(settings->workers) == -1) {
+        return -1;
+    }
+
+    // shared by the workers until one of them loads a changed list
+    if (settings->dns_mode && dns_blocklist_init() == -1) {
+        return -1;
+    }
+
+    // everything below belongs to a single worker
+    if (jk_spawn_workers(settings->workers) == -1) {
+        return -1;
+    }
+
+    metrics_attach();
+
+    // a respawned worker gets the settings the supervisor reloaded last
+    settings = current_settings;
+
+    // the supervisor keeps writing its few lines itself
+    if (settings->log_async && start_async_logging(logger) == -1) {
+        return -1;
+    }
+
     ev_backend = &epoll_backend;
     jk_timer_heap_t* th = jk_th_create(4096);
     if (th == NULL) {
@@ -43,8 +75,35 @@ int main(int argc, char *argv[]) {
         return -1;
     }
 
+    if (settings->dns_mode) {
+        dns_blocklist_start();
+    }
+
+    // the previous binary, if still running, saves its cache before handing over
+    listener_t* l = NULL;
+    udp_socket_t* usock = NULL;
+
+    if (upgrade_take_over(&l, &usock) == -1) {
+        return -1;
+    }
+
+    if (settings->dns_mode && dns_cache_snapshot_init() == -1) {
+        return -1;
+    }
+
+    if (settings->dns_mode && dns_query_log_init() == -1) {
+        return -1;
+    }
+
+    if (reload_init() == -1) {
+        return -1;
+    }
+
     // Register listener
-    listener_t* l = make_listener();
+    if (l == NULL) {
+        l = make_listener();
+    }
+
     if (l == NULL || l->error == true) {
         release_listener(l);
         return -1;
@@ -62,7 +121,10 @@ int main(int argc, char *argv[]) {
     ev_backend->add_event(&ev);
 
     // Register udp socket
-    udp_socket_t* usock = make_udp_socket();
+    if (usock == NULL) {
+        usock = make_udp_socket();
+    }
+
     if (usock == NULL || usock->error == true) {
         release_udp_socket(usock);
         return -1;
@@ -77,6 +139,14 @@ int main(int argc, char *argv[]) {
     usock->ev = &uev;
     
     ev_backend->add_udp_sock(usock);
+
+    if (upgrade_init(l, usock) == -1) {
+        return -1;
+    }
+
+    if (admin_init() == -1) {
+        return -1;
+    }
     
     // Mainloop
     for (;;) {
@@ -86,7 +156,7 @@ int main(int argc, char *argv[]) {
     
     ev_backend->del_udp_sock(usock);
 
-    free(settings);
+    release_settings(current_settings);
     release_listener(l);
     ev_backend->shutdown();
 
@@ -0,0 +1,280 @@
+#include "admin.h"
+#include "metrics.h"
+#include "connection/connection.h"
+#include "core/connection.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/listener.h"
+#include "core/net.h"
+#include "core/time.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ADMIN_SAMPLE_INTERVAL 1000 // ms between readings of what is not counted in place
+#define ADMIN_HEADERS_SIZE    256
+
+typedef struct {
+    connection_t* conn;
+    jk_timer_t* timer;
+
+    char in[ADMIN_REQUEST_SIZE];
+    size_t in_len;
+
+    // set once the request is read, the headers are put right before the body
+    char* out;
+    size_t out_len;
+    size_t sent;
+} admin_context_t;
+
+static listener_t* admin_listener = NULL;
+static event_t admin_accept;
+
+static void handle_admin_connection(int64_t fd, address_t* address);
+static void handle_admin(event_t* ev);
+static int64_t read_request(admin_context_t* ctx);
+static int64_t prepare_response(admin_context_t* ctx);
+static int64_t write_response(admin_context_t* ctx);
+static void stop_admin(admin_context_t* ctx);
+static void handle_admin_timeout(void* data);
+static void arm_sample_timer();
+static void handle_sample_timer(void* data);
+
+int64_t admin_init() {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    arm_sample_timer();
+
+    if (s->admin_port == 0) {
+        return JK_OK;
+    }
+
+    admin_listener = make_local_listener(s->admin_port);
+    if (admin_listener == NULL || admin_listener->error) {
+        log_error("admin_init: failed to listen on port %u", s->admin_port);
+        release_listener(admin_listener);
+        admin_listener = NULL;
+        return JK_ERROR;
+    }
+
+    admin_listener->handle_connection = handle_admin_connection;
+
+    init_event(&admin_accept);
+    admin_accept.owner.ptr = admin_listener;
+    admin_accept.owner.tag = EV_OWNER_LISTENER;
+    admin_accept.write = false;
+    admin_accept.handler = accept_handler;
+
+    admin_listener->accept = &admin_accept;
+
+    ev_backend->add_event(&admin_accept);
+
+    return JK_OK;
+}
+
+static void handle_admin_connection(int64_t fd, address_t* address) {
+    make_server_connection(fd, address, handle_admin);
+}
+
+static void handle_admin(event_t* ev) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(ev->owner.tag == EV_OWNER_CONNECTION, "bad event owner");
+    CHECK_INVARIANT(ev->owner.ptr != NULL, "event owner is NULL");
+
+    connection_t* conn = ev->owner.ptr;
+
+    if (conn->data == NULL) {
+        admin_context_t* ctx = calloc(1, sizeof(admin_context_t));
+        if (ctx == NULL) {
+            log_perror("handle_admin.allocate_context");
+            ev_backend->del_conn(conn);
+            close_connection(conn);
+            return;
+        }
+
+        ctx->conn = conn;
+        conn->data = ctx;
+
+        jk_timer_t timer;
+        jk_timer_start(&timer, ADMIN_TIMEOUT);
+        timer.handler = handle_admin_timeout;
+        timer.data = ctx;
+
+        ctx->timer = ev_backend->add_timer(timer);
+    }
+
+    admin_context_t* ctx = conn->data;
+
+    if (conn->error) {
+        log_perror("handle_admin");
+        return stop_admin(ctx);
+    }
+
+    if (ctx->out == NULL) {
+        int64_t res = read_request(ctx);
+        if (res == JK_WOULD_BLOCK) {
+            return;
+        }
+
+        if (res == JK_ERROR || prepare_response(ctx) == JK_ERROR) {
+            return stop_admin(ctx);
+        }
+
+        ev_backend->disable_event(conn->read);
+    }
+
+    int64_t res = write_response(ctx);
+    if (res == JK_WOULD_BLOCK) {
+        if (!conn->write->enabled) {
+            ev_backend->enable_event(conn->write);
+        }
+        return;
+    }
+
+    stop_admin(ctx);
+}
+
+// JK_OK once the headers are in, the body of a GET is of no interest
+static int64_t read_request(admin_context_t* ctx) {
+    for (;;) {
+        size_t space_left = sizeof(ctx->in) - 1 - ctx->in_len;
+        if (space_left == 0) {
+            return JK_ERROR;
+        }
+
+        ssize_t read = recv_buf(ctx->conn, (uint8_t*)ctx->in + ctx->in_len, space_left);
+        if (read == JK_WOULD_BLOCK) {
+            return JK_WOULD_BLOCK;
+        }
+
+        if (read <= 0) {
+            return JK_ERROR;
+        }
+
+        ctx->in_len += (size_t)read;
+        ctx->in[ctx->in_len] = '\0';
+
+        if (strstr(ctx->in, "\r\n\r\n") != NULL || strstr(ctx->in, "\n\n") != NULL) {
+            return JK_OK;
+        }
+    }
+}
+
+static int64_t prepare_response(admin_context_t* ctx) {
+    logger_t* logger = current_logger;
+
+    ctx->out = malloc(ADMIN_RESPONSE_SIZE);
+    if (ctx->out == NULL) {
+        log_perror("handle_admin.allocate_response");
+        return JK_ERROR;
+    }
+
+    bool metrics = strncmp(ctx->in, "GET /metrics ", strlen("GET /metrics ")) == 0 ||
+        strncmp(ctx->in, "GET /metrics?", strlen("GET /metrics?")) == 0;
+
+    // the body goes after room left for the headers, which are moved up to it
+    char* body = ctx->out + ADMIN_HEADERS_SIZE;
+    size_t body_size = ADMIN_RESPONSE_SIZE - ADMIN_HEADERS_SIZE;
+    size_t body_len = 0;
+
+    if (metrics) {
+        body_len = metrics_render(body, body_size);
+        if (body_len >= body_size) {
+            log_error("handle_admin: metrics do not fit the response");
+            return JK_ERROR;
+        }
+    } else {
+        body_len = (size_t)snprintf(body, body_size, "not found\n");
+    }
+
+    char headers[ADMIN_HEADERS_SIZE];
+    int n = snprintf(headers, sizeof(headers),
+        "HTTP/1.0 %s\r\n"
+        "Content-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: close\r\n"
+        "\r\n",
+        metrics ? "200 OK" : "404 Not Found", body_len);
+
+    if (n <= 0 || (size_t)n >= sizeof(headers)) {
+        return JK_ERROR;
+    }
+
+    memcpy(body - n, headers, (size_t)n);
+
+    ctx->out_len = ADMIN_HEADERS_SIZE + body_len;
+    ctx->sent = ADMIN_HEADERS_SIZE - (size_t)n;
+
+    return JK_OK;
+}
+
+static int64_t write_response(admin_context_t* ctx) {
+    while (ctx->sent < ctx->out_len) {
+        ssize_t sent = send_buf(ctx->conn, (uint8_t*)ctx->out + ctx->sent, ctx->out_len - ctx->sent);
+        if (sent == JK_WOULD_BLOCK) {
+            return JK_WOULD_BLOCK;
+        }
+
+        if (sent < 0) {
+            return JK_ERROR;
+        }
+
+        ctx->sent += (size_t)sent;
+    }
+
+    return JK_OK;
+}
+
+static void stop_admin(admin_context_t* ctx) {
+    connection_t* conn = ctx->conn;
+
+    if (ctx->timer != NULL) {
+        ctx->timer->enabled = false;
+    }
+
+    ev_backend->del_conn(conn);
+    close_connection(conn);
+
+    free(ctx->out);
+    free(ctx);
+}
+
+static void handle_admin_timeout(void* data) {
+    logger_t* logger = current_logger;
+
+    admin_context_t* ctx = data;
+
+    // the firing timer is popped right after this handler returns
+    ctx->timer = NULL;
+
+    log_warn("handle_admin: request timed out");
+    stop_admin(ctx);
+}
+
+static void arm_sample_timer() {
+    jk_timer_t timer;
+    jk_timer_start(&timer, ADMIN_SAMPLE_INTERVAL);
+    timer.handler = handle_sample_timer;
+    timer.data = NULL;
+
+    ev_backend->add_timer(timer);
+}
+
+static void handle_sample_timer(void* data) {
+    (void)data;
+
+    // counted by the writer thread, which has no slot of its own
+    metrics_set(METRIC_LOG_DROPPED, logger_dropped());
+
+    arm_sample_timer();
+}
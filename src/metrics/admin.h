@@ -0,0 +1,13 @@
+#pragma once
+
+#include <stdint.h>
+
+#define ADMIN_REQUEST_SIZE 2048
+#define ADMIN_RESPONSE_SIZE 65536
+#define ADMIN_TIMEOUT      5000 // ms a scrape may take
+
+// Serves GET /metrics on --admin-port of the loopback interface from the
+// event loop. Every worker binds the port, whichever accepts answers for
+// all of them. Anything else gets a 404, every connection is closed once
+// answered.
+int64_t admin_init();
@@ -0,0 +1,209 @@
+#include "metrics.h"
+#include "core/errors.h"
+#include "core/process.h"
+#include "logger/logger.h"
+
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+
+// octaves exported as Prometheus buckets, 256ns up to about 17s
+#define HIST_LE_MIN_EXP 8
+#define HIST_LE_MAX_EXP 34
+
+typedef struct {
+    const char* name;
+    const char* help;
+    // gauges go up and down, their slots wrap below zero and sum back up
+    bool gauge;
+} metric_info_t;
+
+static const metric_info_t metric_info[METRIC_COUNT] = {
+    [METRIC_LOOP_WAKEUPS] = {"jkdns_loop_wakeups_total", "Returns from epoll_wait.", false},
+    [METRIC_LOOP_EVENTS] = {"jkdns_loop_events_total", "Events handled by the event loops.", false},
+    [METRIC_TIMERS_FIRED] = {"jkdns_timers_fired_total", "Timers that expired and ran.", false},
+    [METRIC_LOOP_STALLS] = {"jkdns_loop_stalls_total", "Handlers that ran past --stall-threshold.", false},
+    [METRIC_TCP_ACCEPTS] = {"jkdns_tcp_accepts_total", "Accepted tcp connections.", false},
+    [METRIC_TCP_CONNECTIONS] = {"jkdns_tcp_connections", "Open tcp connections, both ways.", true},
+    [METRIC_UDP_RECEIVED] = {"jkdns_udp_received_total", "Datagrams received.", false},
+    [METRIC_UDP_SENT] = {"jkdns_udp_sent_total", "Datagrams sent.", false},
+    [METRIC_HT_RESIZES] = {"jkdns_ht_resizes_total", "Hash table resizes.", false},
+    [METRIC_DNS_QUERIES] = {"jkdns_dns_queries_total", "Queries received from clients.", false},
+    [METRIC_DNS_REQUESTS] = {"jkdns_dns_requests", "Queries being answered.", true},
+    [METRIC_DNS_CACHE_HITS] = {"jkdns_dns_cache_hits_total", "Queries answered from the cache.", false},
+    [METRIC_DNS_CACHE_MISSES] = {"jkdns_dns_cache_misses_total", "Cache lookups that found nothing.", false},
+    [METRIC_DNS_UPSTREAM_QUERIES] = {"jkdns_dns_upstream_queries_total", "Queries sent upstream, hedges included.", false},
+    [METRIC_LOG_DROPPED] = {"jkdns_log_dropped_total", "Log lines dropped by the async logger.", false},
+};
+
+typedef struct {
+    const char* name;
+    const char* help;
+} hist_info_t;
+
+static const hist_info_t hist_info[HIST_COUNT] = {
+    [HIST_DNS_PARSE] = {"jkdns_dns_parse_seconds", "From receiving a query to having parsed it."},
+    [HIST_DNS_LOOKUP] = {"jkdns_dns_lookup_seconds", "Blocklist and cache lookup of a query."},
+    [HIST_DNS_RENDER] = {"jkdns_dns_render_seconds", "From having an answer to having the response ready."},
+    [HIST_DNS_SEND] = {"jkdns_dns_send_seconds", "Sending a response, or queueing it on tcp."},
+    [HIST_DNS_TOTAL] = {"jkdns_dns_total_seconds", "From receiving a query to sending the response."},
+    [HIST_DNS_UPSTREAM] = {"jkdns_dns_upstream_seconds", "Round trip of a query sent upstream."},
+    [HIST_LOOP_BUSY] = {"jkdns_loop_busy_seconds", "Event loop iterations, the longest a ready event waits."},
+};
+
+static const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 0.9999};
+
+static void append(char* buf, size_t size, size_t* len, const char* fmt, ...);
+static void render_hist(char* buf, size_t size, size_t* len, hist_id_t id);
+static uint64_t bucket_upper(size_t i);
+
+static metrics_slot_t private_slot;
+metrics_slot_t* current_metrics = &private_slot;
+
+static metrics_slot_t* slots = NULL;
+static uint32_t slots_count = 0;
+
+int64_t metrics_init(uint32_t workers) {
+    logger_t* logger = current_logger;
+
+    // the workers inherit the calibration
+    jk_ticks_init();
+
+    // anonymous and shared, the forked workers all see the same pages
+    void* map = mmap(NULL, sizeof(metrics_slot_t) * workers, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) {
+        log_perror("metrics_init.mmap");
+        return JK_ERROR;
+    }
+
+    slots = map;
+    slots_count = workers;
+
+    return JK_OK;
+}
+
+void metrics_attach() {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(slots != NULL, "metrics are not initialized");
+    CHECK_INVARIANT(current_worker < slots_count, "no metrics slot for the worker");
+
+    // a respawned worker carries on with the counts of the one it replaces
+    current_metrics = &slots[current_worker];
+}
+
+size_t metrics_render(char* buf, size_t size) {
+    size_t len = 0;
+
+    for (int id = 0; id < METRIC_COUNT; id++) {
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < slots_count; i++) {
+            sum += atomic_load_explicit(&slots[i].values[id], memory_order_relaxed);
+        }
+
+        const metric_info_t* info = &metric_info[id];
+
+        if (info->gauge) {
+            append(buf, size, &len, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n",
+                info->name, info->help, info->name, info->name, (long long)(int64_t)sum);
+        } else {
+            append(buf, size, &len, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+                info->name, info->help, info->name, info->name, (unsigned long long)sum);
+        }
+    }
+
+    for (int id = 0; id < HIST_COUNT; id++) {
+        render_hist(buf, size, &len, (hist_id_t)id);
+    }
+
+    return len;
+}
+
+// Octave buckets for Prometheus to aggregate, and the quantiles at full
+// resolution next to them as the octaves are too coarse for the tail.
+static void render_hist(char* buf, size_t size, size_t* len, hist_id_t id) {
+    uint64_t merged[METRICS_HIST_BUCKETS] = {0};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    for (uint32_t i = 0; i < slots_count; i++) {
+        for (size_t b = 0; b < METRICS_HIST_BUCKETS; b++) {
+            merged[b] += atomic_load_explicit(&slots[i].buckets[id][b], memory_order_relaxed);
+        }
+        sum += atomic_load_explicit(&slots[i].sums[id], memory_order_relaxed);
+    }
+
+    for (size_t b = 0; b < METRICS_HIST_BUCKETS; b++) {
+        count += merged[b];
+    }
+
+    const hist_info_t* info = &hist_info[id];
+
+    append(buf, size, len, "# HELP %s %s\n# TYPE %s histogram\n", info->name, info->help, info->name);
+
+    uint64_t below = 0;
+    size_t b = 0;
+
+    for (int exp = HIST_LE_MIN_EXP; exp <= HIST_LE_MAX_EXP; exp++) {
+        // the octave starting at 2^exp starts a row of buckets
+        size_t first = (size_t)(exp - METRICS_HIST_SUB_BITS + 1) * METRICS_HIST_SUB;
+        for (; b < first; b++) {
+            below += merged[b];
+        }
+
+        append(buf, size, len, "%s_bucket{le=\"%.9g\"} %llu\n",
+            info->name, (double)((uint64_t)1 << exp) / 1e9, (unsigned long long)below);
+    }
+
+    append(buf, size, len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n",
+        info->name, (unsigned long long)count,
+        info->name, (double)sum / 1e9,
+        info->name, (unsigned long long)count);
+
+    append(buf, size, len, "# HELP %s_quantile %s\n# TYPE %s_quantile gauge\n",
+        info->name, info->help, info->name);
+
+    for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        // the upper bound of the bucket holding the rank, never under the truth
+        uint64_t rank = (uint64_t)(quantiles[q] * (double)count + 0.999999);
+        uint64_t seen = 0;
+        uint64_t value = 0;
+
+        for (size_t i = 0; i < METRICS_HIST_BUCKETS && count > 0; i++) {
+            seen += merged[i];
+            if (seen >= rank) {
+                value = bucket_upper(i);
+                break;
+            }
+        }
+
+        append(buf, size, len, "%s_quantile{quantile=\"%g\"} %.9g\n",
+            info->name, quantiles[q], (double)value / 1e9);
+    }
+}
+
+static uint64_t bucket_upper(size_t i) {
+    if (i < METRICS_HIST_SUB) {
+        return i + 1;
+    }
+
+    size_t shift = i / METRICS_HIST_SUB - 1;
+    return (uint64_t)(METRICS_HIST_SUB + i % METRICS_HIST_SUB + 1) << shift;
+}
+
+static void append(char* buf, size_t size, size_t* len, const char* fmt, ...) {
+    char* out = *len < size ? buf + *len : NULL;
+    size_t room = *len < size ? size - *len : 0;
+
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(out, room, fmt, args);
+    va_end(args);
+
+    *len += n > 0 ? (size_t)n : 0;
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "core/time.h"
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Log-linear buckets: below 2^SUB_BITS one per value, then 2^SUB_BITS per
+// power of two, so a value lands within 1/16 of its bucket bounds. Values
+// are in ns, anything past 2^MAX_EXP (about a minute) goes to the last one.
+#define METRICS_HIST_SUB_BITS 4
+#define METRICS_HIST_SUB      (1 << METRICS_HIST_SUB_BITS)
+#define METRICS_HIST_MAX_EXP  35
+#define METRICS_HIST_BUCKETS  ((METRICS_HIST_MAX_EXP - METRICS_HIST_SUB_BITS + 2) * METRICS_HIST_SUB)
+
+typedef enum {
+    METRIC_LOOP_WAKEUPS = 0,
+    METRIC_LOOP_EVENTS,
+    METRIC_TIMERS_FIRED,
+    METRIC_LOOP_STALLS,
+    METRIC_TCP_ACCEPTS,
+    METRIC_TCP_CONNECTIONS,
+    METRIC_UDP_RECEIVED,
+    METRIC_UDP_SENT,
+    METRIC_HT_RESIZES,
+    METRIC_DNS_QUERIES,
+    METRIC_DNS_REQUESTS,
+    METRIC_DNS_CACHE_HITS,
+    METRIC_DNS_CACHE_MISSES,
+    METRIC_DNS_UPSTREAM_QUERIES,
+    METRIC_LOG_DROPPED,
+    METRIC_COUNT,
+} metric_id_t;
+
+typedef enum {
+    // phases of a query, receive -> parse -> lookup -> render -> send
+    HIST_DNS_PARSE = 0,
+    HIST_DNS_LOOKUP,
+    HIST_DNS_RENDER,
+    HIST_DNS_SEND,
+    HIST_DNS_TOTAL,
+    // round trip of each query sent upstream
+    HIST_DNS_UPSTREAM,
+    // handling all an epoll_wait returned, and the timers due after it
+    HIST_LOOP_BUSY,
+    HIST_COUNT,
+} hist_id_t;
+
+// values of one event loop, on cache lines of their own
+typedef struct {
+    _Alignas(64) _Atomic uint64_t values[METRIC_COUNT];
+    _Alignas(64) _Atomic uint64_t buckets[HIST_COUNT][METRICS_HIST_BUCKETS];
+    _Atomic uint64_t sums[HIST_COUNT];
+} metrics_slot_t;
+
+// slot of the running event loop, a private one until metrics_attach()
+extern metrics_slot_t* current_metrics;
+
+// Counters and gauges are kept per event loop in memory shared by every
+// worker, so any of them can sum them up for a reader. Only the event loop
+// writes its slot, an update is a plain load and store.
+//
+// Called before the workers are forked.
+int64_t metrics_init(uint32_t workers);
+
+// switches to the slot of current_worker
+void metrics_attach();
+
+// Prometheus text exposition of the sums over all workers, histograms are
+// merged bucket by bucket, returns the length as snprintf would
+size_t metrics_render(char* buf, size_t size);
+
+static inline void metrics_add(metric_id_t id, int64_t n) {
+    _Atomic uint64_t* v = &current_metrics->values[id];
+    atomic_store_explicit(v, atomic_load_explicit(v, memory_order_relaxed) + (uint64_t)n,
+                          memory_order_relaxed);
+}
+
+static inline void metrics_inc(metric_id_t id) {
+    metrics_add(id, 1);
+}
+
+static inline void metrics_set(metric_id_t id, uint64_t value) {
+    atomic_store_explicit(&current_metrics->values[id], value, memory_order_relaxed);
+}
+
+static inline size_t metrics_bucket(uint64_t ns) {
+    if (ns < METRICS_HIST_SUB) {
+        return (size_t)ns;
+    }
+
+    int exp = 63 - __builtin_clzll(ns);
+    if (exp > METRICS_HIST_MAX_EXP) {
+        return METRICS_HIST_BUCKETS - 1;
+    }
+
+    // the power of two picks the row, the bits below the top one the column
+    int shift = exp - METRICS_HIST_SUB_BITS;
+    return (size_t)(shift + 1) * METRICS_HIST_SUB + (size_t)(ns >> shift) - METRICS_HIST_SUB;
+}
+
+static inline void metrics_observe(hist_id_t id, uint64_t ns) {
+    _Atomic uint64_t* b = &current_metrics->buckets[id][metrics_bucket(ns)];
+    atomic_store_explicit(b, atomic_load_explicit(b, memory_order_relaxed) + 1, memory_order_relaxed);
+
+    _Atomic uint64_t* sum = &current_metrics->sums[id];
+    atomic_store_explicit(sum, atomic_load_explicit(sum, memory_order_relaxed) + ns, memory_order_relaxed);
+}
+
+// records the span since *since, which moves on to now for the next phase
+static inline void metrics_lap(hist_id_t id, uint64_t* since) {
+    uint64_t now = jk_ticks();
+    metrics_observe(id, jk_ticks_to_ns(now - *since));
+    *since = now;
+}
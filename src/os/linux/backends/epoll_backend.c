@@ -2,7 +2,10 @@
 #include "core/errors.h"
 #include "core/htt.h"
 #include "core/time.h"
+#include "core/trace.h"
 #include "logger/logger.h"
+#include "metrics/metrics.h"
+#include "settings/settings.h"
 #include "core/decl.h"
 #include "core/event.h"
 #include "core/ev_backend.h"
@@ -10,9 +13,13 @@
 #include "core/connection.h"
 #include "core/udp_socket.h"
 #include "core/net.h"
+#include "core/signal.h"
 #include "udp_socket/udp_socket.h"
+#include "udp_socket/client_pool.h"
 
+#include <dlfcn.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,8 +36,12 @@ static struct epoll_event* event_list;
 static int epoll_fd = -1;
 static jk_timer_heap_t* epoll_th = NULL;
 
-static udp_socket_t* client_usock = NULL;
-static event_t client_udp_event;
+// jk_ticks() when epoll_wait last returned and when the last handler did
+static uint64_t iteration_start = 0;
+static uint64_t handler_start = 0;
+
+static jk_posted_t* posted_head = NULL;
+static jk_posted_t* posted_tail = NULL;
 
 static int64_t epoll_init();
 static int64_t epoll_shutdown();
@@ -40,12 +51,17 @@ static int64_t epoll_enable_event(event_t* ev);
 static int64_t epoll_disable_event(event_t* ev);
 static int64_t epoll_add_conn(connection_t* conn);
 static int64_t epoll_del_conn(connection_t* conn);
+static int64_t epoll_update_conn(connection_t* conn);
 static int64_t epoll_add_udp_sock(udp_socket_t* sock);
 static int64_t epoll_del_udp_sock(udp_socket_t* sock);
 static void epoll_register_time_heap(jk_timer_heap_t* th);
 static int64_t epoll_process_events();
 static int64_t epoll_process_timers();
 static jk_timer_t* epoll_add_timer(jk_timer_t timer);
+static void epoll_post(jk_posted_t* p);
+static void run_posted();
+static void check_stall(void* handler, const char* owner);
+static const char* owner_name(enum event_owner_tag tag);
 
 
 ev_backend_t epoll_backend = {
@@ -63,11 +79,10 @@ ev_backend_t epoll_backend = {
     .register_time_heap = epoll_register_time_heap,
     .process_events = epoll_process_events,
     .process_timers = epoll_process_timers,
-    .add_timer = epoll_add_timer
+    .add_timer = epoll_add_timer,
+    .post = epoll_post
 };
 
-static void epoll_handle_udp_client_timeout(void* data);
-
 static int64_t epoll_init() {
     logger_t* logger = current_logger;
     
@@ -130,6 +145,10 @@ static int64_t epoll_add_event(event_t* ev) {
         return epoll_add(ev, ((listener_t*)ev->owner.ptr)->fd);
     }
 
+    if (ev->owner.tag == EV_OWNER_SIGNAL) {
+        return epoll_add(ev, ((signal_source_t*)ev->owner.ptr)->fd);
+    }
+
     if (ev->owner.tag == EV_OWNER_CONNECTION) {
         connection_t *conn = ev->owner.ptr;
 
@@ -168,6 +187,10 @@ static int64_t epoll_del_event(event_t* ev) {
         return epoll_del(ev, ((listener_t*)ev->owner.ptr)->fd);
     }
 
+    if (ev->owner.tag == EV_OWNER_SIGNAL) {
+        return epoll_del(ev, ((signal_source_t*)ev->owner.ptr)->fd);
+    }
+
     if (ev->owner.tag == EV_OWNER_CONNECTION) {
         connection_t *conn = ev->owner.ptr;
 
@@ -205,6 +228,33 @@ static int64_t epoll_enable(event_t* ev, int64_t fd) {
     return JK_OK;
 }
 
+// A tcp connection has a single registration carrying both directions.
+// When read and write are enabled together the read handler gets every
+// notification and is expected to serve both.
+static int64_t epoll_update_conn(connection_t* conn) {
+    logger_t* logger = current_logger;
+
+    struct epoll_event event = {0};
+    event.events = EPOLLET;
+
+    if (conn->read->enabled) {
+        event.events |= EPOLLIN;
+    }
+
+    if (conn->write->enabled) {
+        event.events |= EPOLLOUT;
+    }
+
+    event.data.ptr = conn->read->enabled ? conn->read : conn->write;
+
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->handle.data.fd, &event) == -1) { // NOLINT
+        log_perror("epoll_update_conn.epoll_ctl");
+        return JK_ERROR;
+    }
+
+    return JK_OK;
+}
+
 static int64_t epoll_enable_event(event_t* ev) {
     logger_t* logger = current_logger;
 
@@ -219,7 +269,8 @@ static int64_t epoll_enable_event(event_t* ev) {
         connection_t *conn = ev->owner.ptr;
 
         if (conn->handle.type == CONN_TYPE_TCP) {
-            return epoll_enable(ev, conn->handle.data.fd);
+            ev->enabled = true;
+            return epoll_update_conn(conn);
         } else if (conn->handle.type == CONN_TYPE_UDP) {
             return udp_enable_event(ev, conn);
         } else {
@@ -262,7 +313,8 @@ static int64_t epoll_disable_event(event_t* ev) {
         connection_t *conn = ev->owner.ptr;
 
         if (conn->handle.type == CONN_TYPE_TCP) {
-            return epoll_disable(ev, conn->handle.data.fd);
+            ev->enabled = false;
+            return epoll_update_conn(conn);
         } else if (conn->handle.type == CONN_TYPE_UDP) {
             return udp_disable_event(ev, conn);
         } else {
@@ -274,18 +326,6 @@ static int64_t epoll_disable_event(event_t* ev) {
     return JK_ERROR;
 }
 
-void epoll_handle_udp_client_timeout(void* data) {
-    logger_t* logger = current_logger;
-
-    log_trace("epoll_handle_udp_client_timeout");
-
-    udp_socket_t* sock = data;
-
-    epoll_del_udp_sock(sock);
-    release_udp_socket(client_usock);
-    client_usock = NULL;
-}
-
 static int64_t epoll_add_conn(connection_t* conn) {
     logger_t* logger = current_logger;
     int64_t fd = 0;
@@ -299,56 +339,15 @@ static int64_t epoll_add_conn(connection_t* conn) {
 
         conn->handle.data.fd = fd;
     } else if (conn->handle.type == CONN_TYPE_UDP) {
-        if (client_usock == NULL) {
-            udp_socket_t* sock = make_client_udp_socket();
-            if (sock == NULL) {
-                log_error("epoll_add_conn: make_client_udp_socket failed");
-                return JK_ERROR;
-            }
-
-            init_event(&client_udp_event);
-            client_udp_event.owner.tag = EV_OWNER_USOCK;
-            client_udp_event.owner.ptr = sock;
-            client_udp_event.write = false;
-            client_udp_event.handler = client_udp_ev_handler;
-
-            sock->ev = &client_udp_event;
-
-            int64_t res = epoll_add_udp_sock(sock);
-            if (res != JK_OK) {
-                release_udp_socket(sock);
-                log_error("epoll_add_conn: epoll_add_udp_sock failed");
-                return JK_ERROR;
-            }
-
-            jk_timer_t timer;
-            jk_timer_start(&timer, CLIENT_USOCK_TIMEOUT);
-            timer.handler = epoll_handle_udp_client_timeout;
-            timer.data = sock;
-            
-            jk_timer_t* timer_p = epoll_add_timer(timer);
-            if (timer_p == NULL) {
-                release_udp_socket(sock);
-                log_perror("epoll_add_conn: epoll_add_timer failed");
-                return JK_ERROR;
-            }
-
-            sock->timer = timer_p;
-
-            client_usock = sock;
-        }
-
-        jk_timer_start(client_usock->timer, CLIENT_USOCK_TIMEOUT);
-
-        connection_ht_t* ht = client_usock->connections;
-
-        int64_t res = connection_ht_insert(ht, &conn->address, conn);
-        if (res != JK_OK) {
-            log_error("epoll_add_conn: failed to insert connection to the udp ht");
-            return res;
+        // a session of its own, several datagrams may be in flight and
+        // anything may come back, there is nothing to match replies by
+        udp_socket_t* sock = udp_client_socket_open(conn);
+        if (sock == NULL) {
+            log_error("epoll_add_conn: no client udp socket available");
+            return JK_ERROR;
         }
 
-        conn->handle.data.sock = client_usock;
+        conn->handle.data.sock = sock;
 
         return JK_OK;
     } else {
@@ -418,6 +417,12 @@ static int64_t epoll_process_events() {
         return JK_ERROR;
     }
 
+    metrics_inc(METRIC_LOOP_WAKEUPS);
+    metrics_add(METRIC_LOOP_EVENTS, nfds);
+
+    iteration_start = jk_ticks();
+    handler_start = iteration_start;
+
     for (int n = 0; n < nfds; ++n) {
         CHECK_INVARIANT(event_list[n].data.ptr != NULL, "event is NULL");
 
@@ -444,13 +449,18 @@ static int64_t epoll_process_events() {
                     ((udp_socket_t*)ev->owner.ptr)->error = true;
                     fd = ((udp_socket_t*)ev->owner.ptr)->fd; // NOLINT
                     break;
+                case EV_OWNER_SIGNAL:
+                    // not a socket, there is no SO_ERROR to read
+                    ((signal_source_t*)ev->owner.ptr)->error = true;
+                    fd = -1;
+                    break;
                 default:
                     PANIC("unknown event owner");
             }
 
             int err = 0;
             socklen_t len = sizeof(err);
-            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+            if (fd != -1 && getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
                 PANIC("failed to getsockopt");
             }
 
@@ -469,9 +479,22 @@ static int64_t epoll_process_events() {
 
         CHECK_INVARIANT(ev->handler != NULL, "event handler is NULL");
 
-        ev->handler(ev);
+        // the handler may free the event along with its owner
+        event_handler_pt handler = ev->handler;
+        enum event_owner_tag tag = ev->owner.tag;
+
+        // probes take integers and data pointers only
+        void* handler_ptr = (void*)(uintptr_t)handler;
+
+        JK_TRACE2(event_start, tag, handler_ptr);
+        handler(ev);
+        JK_TRACE2(event_done, tag, handler_ptr);
+
+        check_stall(handler_ptr, owner_name(tag));
     }
 
+    run_posted();
+
     return JK_OK;
 }
 
@@ -482,6 +505,7 @@ int64_t epoll_process_timers() {
     // jk_th_debug_dump(epoll_th);
     
     int64_t now = jk_now();
+    handler_start = jk_ticks();
     
     for (;;) {
         jk_timer_t* timer = jk_th_peek(epoll_th);
@@ -497,16 +521,27 @@ int64_t epoll_process_timers() {
             continue;
         } else if (timer->expiry <= now) {
             // log_debug("timer expired!");
+            metrics_inc(METRIC_TIMERS_FIRED);
+            JK_TRACE2(timer_fire, (void*)(uintptr_t)timer->handler, timer->expiry);
             timer->handler(timer->data);
+            check_stall((void*)(uintptr_t)timer->handler, "timer");
             jk_th_pop(epoll_th);
             continue;
         } else {
             break;
         }
     }
+
+    run_posted();
     
     // log_trace("epoll_process_timers end");
 
+    // everything ready when epoll_wait returned waited up to this long
+    if (iteration_start != 0) {
+        metrics_observe(HIST_LOOP_BUSY, jk_ticks_to_ns(jk_ticks() - iteration_start));
+        iteration_start = 0;
+    }
+
     return JK_OK;
 }
 
@@ -548,3 +583,79 @@ static int64_t epoll_del_udp_sock(udp_socket_t* sock) {
 static jk_timer_t* epoll_add_timer(jk_timer_t timer) {
     return jk_th_add(epoll_th, timer);
 }
+
+static void epoll_post(jk_posted_t* p) {
+    if (p->queued) {
+        return;
+    }
+
+    p->queued = true;
+    p->next = NULL;
+
+    if (posted_tail != NULL) {
+        posted_tail->next = p;
+    } else {
+        posted_head = p;
+    }
+    posted_tail = p;
+}
+
+// a handler may post more, those run in the same pass
+static void run_posted() {
+    while (posted_head != NULL) {
+        jk_posted_t* p = posted_head;
+
+        posted_head = p->next;
+        if (posted_head == NULL) {
+            posted_tail = NULL;
+        }
+
+        // the handler may free p along with what it is embedded in
+        p->queued = false;
+        p->handler(p->data);
+    }
+}
+
+// one clock read per handler, the time since the previous one ended
+static void check_stall(void* handler, const char* owner) {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    uint64_t now = jk_ticks();
+    uint64_t took = jk_ticks_to_ns(now - handler_start);
+    handler_start = now;
+
+    if (s->stall_threshold == 0 || took < (uint64_t)s->stall_threshold * 1000000) {
+        return;
+    }
+
+    metrics_inc(METRIC_LOOP_STALLS);
+
+    // static handlers are not in the dynamic symbol table, addr2line takes the offset
+    Dl_info info;
+    memset(&info, 0, sizeof(info));
+    dladdr(handler, &info);
+
+    if (info.dli_sname != NULL) {
+        log_warn("event loop stalled for %" PRIu64 " us in %s handler %s",
+            took / 1000, owner, info.dli_sname);
+    } else if (info.dli_fname != NULL) {
+        log_warn("event loop stalled for %" PRIu64 " us in %s handler %s+0x%" PRIxPTR,
+            took / 1000, owner, info.dli_fname, (uintptr_t)handler - (uintptr_t)info.dli_fbase);
+    } else {
+        log_warn("event loop stalled for %" PRIu64 " us in %s handler %p", took / 1000, owner, handler);
+    }
+
+    // the report is not held against the next handler
+    handler_start = jk_ticks();
+}
+
+static const char* owner_name(enum event_owner_tag tag) {
+    switch (tag) {
+        case EV_OWNER_LISTENER:   return "listener";
+        case EV_OWNER_CONNECTION: return "connection";
+        case EV_OWNER_USOCK:      return "udp socket";
+        case EV_OWNER_SIGNAL:     return "signal";
+        default:                  return "unknown";
+    }
+}
@@ -0,0 +1,286 @@
+#include "core/handoff.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "core/listener.h"
+#include "logger/logger.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#define HANDOFF_MAGIC 0x6a6b686f // "jkho"
+#define HANDOFF_READY 'r'
+
+typedef struct {
+    uint32_t magic;
+    uint32_t count;
+} handoff_msg_t;
+
+static int64_t fill_unix_address(struct sockaddr_un* addr, const char* path);
+
+listener_t* make_handoff_listener(const char* path) {
+    logger_t *logger = current_logger;
+
+    listener_t* l = calloc(1, sizeof(listener_t));
+    if (l == NULL) {
+        log_perror("make_handoff_listener.allocate_listener");
+        return NULL;
+    }
+
+    l->accept = NULL;
+    l->fd = -1;
+
+    struct sockaddr_un addr;
+    if (fill_unix_address(&addr, path) != JK_OK) {
+        l->error = true;
+        return l;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_perror("make_handoff_listener.socket");
+        l->error = true;
+        return l;
+    }
+
+    // left behind by the process this one took over from, or by a crash
+    if (unlink(path) == -1 && errno != ENOENT) {
+        log_perror("make_handoff_listener.unlink");
+    }
+
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        log_perror("make_handoff_listener.bind");
+        close(fd);
+        l->error = true;
+        return l;
+    }
+
+    l->fd = fd;
+    l->bound = true;
+    l->non_blocking = true;
+
+    if (listen(fd, 1) == -1) {
+        log_perror("make_handoff_listener.listen");
+        l->error = true;
+        return l;
+    }
+
+    l->listening = true;
+
+    return l;
+}
+
+int64_t accept_handoff(listener_t* l) {
+    logger_t *logger = current_logger;
+
+    for (;;) {
+        int fd = accept4((int)l->fd, NULL, NULL, SOCK_CLOEXEC);
+
+        if (fd == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (fd == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return JK_WOULD_BLOCK;
+        }
+
+        if (fd == -1) {
+            log_perror("accept_handoff.accept");
+            return JK_ERROR;
+        }
+
+        return fd;
+    }
+}
+
+int64_t send_handoff(int64_t conn_fd, const int64_t* fds, size_t count) {
+    logger_t *logger = current_logger;
+
+    CHECK_INVARIANT(count > 0 && count <= HANDOFF_MAX_FDS, "bad number of fds");
+
+    handoff_msg_t msg = {HANDOFF_MAGIC, (uint32_t)count};
+    struct iovec iov = {&msg, sizeof(msg)};
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+
+    int* out = (int*)CMSG_DATA(cmsg);
+    for (size_t i = 0; i < count; i++) {
+        out[i] = (int)fds[i];
+    }
+
+    // the peer is blocked waiting for exactly this, a full buffer is not expected
+    ssize_t sent;
+    do {
+        sent = sendmsg((int)conn_fd, &hdr, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+
+    if (sent != sizeof(msg)) {
+        log_perror("send_handoff.sendmsg");
+        close((int)conn_fd);
+        return JK_ERROR;
+    }
+
+    return JK_OK;
+}
+
+int64_t receive_handoff(const char* path, int64_t* fds, size_t count) {
+    logger_t *logger = current_logger;
+
+    CHECK_INVARIANT(count > 0 && count <= HANDOFF_MAX_FDS, "bad number of fds");
+
+    struct sockaddr_un addr;
+    if (fill_unix_address(&addr, path) != JK_OK) {
+        return JK_ERROR;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_perror("receive_handoff.socket");
+        return JK_ERROR;
+    }
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        bool nobody = errno == ENOENT || errno == ECONNREFUSED;
+        if (!nobody) {
+            log_perror("receive_handoff.connect");
+        }
+        close(fd);
+        return nobody ? JK_NOT_FOUND : JK_ERROR;
+    }
+
+    struct timeval timeout = {HANDOFF_TIMEOUT / 1000, (HANDOFF_TIMEOUT % 1000) * 1000};
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1) {
+        log_perror("receive_handoff.setsockopt");
+    }
+
+    handoff_msg_t msg;
+    struct iovec iov = {&msg, sizeof(msg)};
+
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        struct cmsghdr align;
+    } control;
+
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1) {
+        log_perror("receive_handoff.recvmsg");
+        close(fd);
+        return JK_ERROR;
+    }
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    bool has_fds = cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS;
+    size_t received = has_fds ? (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int) : 0;
+
+    int* in = has_fds ? (int*)CMSG_DATA(cmsg) : NULL;
+
+    if (n != sizeof(msg) || msg.magic != HANDOFF_MAGIC || msg.count != count ||
+        received != count || hdr.msg_flags & MSG_CTRUNC) {
+        log_error("receive_handoff: unexpected message from %s", path);
+        for (size_t i = 0; i < received; i++) {
+            close(in[i]);
+        }
+        close(fd);
+        return JK_ERROR;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        fds[i] = in[i];
+    }
+
+    return fd;
+}
+
+int64_t handoff_ready(int64_t conn_fd) {
+    logger_t *logger = current_logger;
+
+    char ready = HANDOFF_READY;
+
+    ssize_t sent;
+    do {
+        sent = send((int)conn_fd, &ready, sizeof(ready), MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+
+    close((int)conn_fd);
+
+    if (sent != sizeof(ready)) {
+        log_perror("handoff_ready.send");
+        return JK_ERROR;
+    }
+
+    return JK_OK;
+}
+
+int64_t poll_handoff_ready(int64_t conn_fd) {
+    logger_t *logger = current_logger;
+
+    char ready = 0;
+
+    ssize_t n;
+    do {
+        n = recv((int)conn_fd, &ready, sizeof(ready), MSG_DONTWAIT);
+    } while (n == -1 && errno == EINTR);
+
+    if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return JK_WOULD_BLOCK;
+    }
+
+    if (n == -1) {
+        log_perror("poll_handoff_ready.recv");
+    }
+
+    close((int)conn_fd);
+
+    return n == sizeof(ready) && ready == HANDOFF_READY ? JK_OK : JK_ERROR;
+}
+
+static int64_t fill_unix_address(struct sockaddr_un* addr, const char* path) {
+    logger_t *logger = current_logger;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        log_error("handoff: %s is too long for a unix socket path", path);
+        return JK_ERROR;
+    }
+
+    strcpy(addr->sun_path, path);
+
+    return JK_OK;
+}
@@ -2,9 +2,11 @@
 #include <asm-generic/errno-base.h>
 #include <asm-generic/errno.h>
 #include "core/decl.h"
+#include "core/connection.h"
 #include "core/listener.h"
 #include "core/event.h"
 #include "connection/connection.h"
+#include "metrics/metrics.h"
 #include "settings/settings.h"
 
 #include <errno.h>
@@ -15,12 +17,30 @@
 #include <unistd.h>
 #include <fcntl.h>
 
+#include <netinet/in.h>
 #include <sys/socket.h>
 
 #define LISTEN_QUEUE 10
 
+static listener_t* open_listener(in_addr_t addr, uint16_t port, bool reuseport);
+
 listener_t* make_listener() {
     settings_t *s = current_settings;
+
+    // every worker binds the port on its own, the kernel spreads clients over them
+    listener_t* l = open_listener(INADDR_ANY, s->port, s->workers > 1);
+    if (l != NULL) {
+        l->handle_connection = handle_new_tcp_connection;
+    }
+
+    return l;
+}
+
+listener_t* make_local_listener(uint16_t port) {
+    return open_listener(htonl(INADDR_LOOPBACK), port, true);
+}
+
+static listener_t* open_listener(in_addr_t addr, uint16_t port, bool reuseport) {
     logger_t *logger = current_logger;
 
     listener_t* l = calloc(1, sizeof(listener_t));
@@ -37,8 +57,8 @@ listener_t* make_listener() {
     int fd = 0;
     
     server_sockaddr.sin_family=AF_INET;
-	server_sockaddr.sin_port = htons(s->port);
-	server_sockaddr.sin_addr.s_addr=INADDR_ANY;
+	server_sockaddr.sin_port = htons(port);
+	server_sockaddr.sin_addr.s_addr = addr;
 	memset(&(server_sockaddr.sin_zero),0,8);
     
     fd = socket(AF_INET, SOCK_STREAM,0);
@@ -54,6 +74,13 @@ listener_t* make_listener() {
         l->error = true;
         return l;
     }
+
+    if (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        log_perror("make_listener.setsockopt_reuseport");
+        close(fd);
+        l->error = true;
+        return l;
+    }
     
     if (bind(fd, (struct sockaddr *)&server_sockaddr,sizeof(struct sockaddr)) < 0) {
         log_perror("make_listener.bind");
@@ -92,6 +119,35 @@ listener_t* make_listener() {
     return l;
 }
 
+listener_t* make_inherited_listener(int64_t fd) {
+    logger_t *logger = current_logger;
+
+    listener_t* l = calloc(1, sizeof(listener_t));
+    if (l == NULL) {
+        log_perror("make_inherited_listener.allocate_listener");
+        return NULL;
+    }
+
+    l->accept = NULL;
+    l->fd = fd;
+    l->handle_connection = handle_new_tcp_connection;
+
+    // bound and listening already, the flag is shared with the previous owner
+    l->bound = true;
+    l->listening = true;
+
+    int flags = fcntl((int)fd, F_GETFL, 0);
+    if (flags == -1 || fcntl((int)fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        log_perror("make_inherited_listener.fcntl_set_non_blocking");
+        l->error = true;
+        return l;
+    }
+
+    l->non_blocking = true;
+
+    return l;
+}
+
 void release_listener(listener_t *l) {
     if (l != NULL) {
         if (l->fd != -1) {
@@ -109,9 +165,12 @@ void accept_handler(event_t *ev) {
 
     CHECK_INVARIANT(ev->owner.ptr != NULL, "event owner is NULL");
     
+    listener_t* l = NULL;
+
     switch (ev->owner.tag) {
         case EV_OWNER_LISTENER:
-        fd = ((listener_t*)ev->owner.ptr)->fd; // NOLINT
+        l = ev->owner.ptr;
+        fd = l->fd; // NOLINT
         break;
         default:
         PANIC("unexpected event owner");
@@ -146,6 +205,24 @@ void accept_handler(event_t *ev) {
             continue;
         }
 
-        handle_new_tcp_connection(conn_fd);
+        metrics_inc(METRIC_TCP_ACCEPTS);
+
+        // the peer is kept for the query log
+        address_t address;
+        memset(&address, 0, sizeof(address));
+
+        if (addr.ss_family == AF_INET) {
+            struct sockaddr_in *p = (struct sockaddr_in *)&addr;
+            address.af = AF_INET;
+            address.src_port = ntohs(p->sin_port);
+            address.src.src_v4 = p->sin_addr;
+        } else if (addr.ss_family == AF_INET6) {
+            struct sockaddr_in6 *p = (struct sockaddr_in6 *)&addr;
+            address.af = AF_INET6;
+            address.src_port = ntohs(p->sin6_port);
+            address.src.src_v6 = p->sin6_addr;
+        }
+
+        l->handle_connection(conn_fd, &address);
     }
 }
@@ -1,5 +1,7 @@
 #include "logger/logger.h"
 
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,9 +11,116 @@
 #include <time.h>
 #include <stdarg.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/uio.h>
 
 #include "logger/logger.h"
 
+#define LOG_LINE_SIZE    4096
+#define LOG_RECORD_SIZE  512  // queued lines longer than this are cut
+#define LOG_RING_SLOTS   2048 // per thread, power of two
+#define LOG_WRITER_BATCH 256  // lines per writev, at most IOV_MAX
+#define LOG_WRITER_IDLE  5    // ms the writer sleeps once every ring is empty
+#define LOG_SPEC_SIZE    32   // longest conversion spec a deferred line may hold
+
+// While fmt is set, data holds the arguments packed by pack_args() and the
+// writer formats the line, otherwise data is the line itself.
+typedef struct {
+    uint32_t len;
+    uint32_t level;
+    const char* fmt;
+    time_t time;
+    char data[LOG_RECORD_SIZE - 24];
+} log_record_t;
+
+_Static_assert(sizeof(log_record_t) == LOG_RECORD_SIZE, "log record size is off");
+
+typedef enum {
+    LEN_NONE = 0,
+    LEN_HH,
+    LEN_H,
+    LEN_L,
+    LEN_LL,
+    LEN_Z,
+    LEN_J,
+    LEN_T,
+} arg_length_t;
+
+typedef enum {
+    ARG_INT = 0,
+    ARG_UINT,
+    ARG_CHAR,
+    ARG_DOUBLE,
+    ARG_PTR,
+    ARG_STR,
+} arg_kind_t;
+
+// a printf conversion, from its '%' to its conversion character
+typedef struct {
+    const char* start;
+    // up to the length modifier
+    size_t head_len;
+    int stars;
+    // -1 without one, strings are read no further than a precision
+    int precision;
+    bool precision_star;
+    arg_length_t length;
+    arg_kind_t kind;
+    char conv;
+} log_spec_t;
+
+typedef struct log_ring_s log_ring_t;
+
+// Single producer, single consumer. The owning thread moves head, the
+// writer moves tail, each on a cache line of its own.
+struct log_ring_s {
+    _Alignas(64) _Atomic uint64_t head;
+    _Alignas(64) _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+
+    // a ring left by an exited thread is taken over by the next new one
+    atomic_bool in_use;
+    log_ring_t* next;
+
+    log_record_t records[LOG_RING_SLOTS];
+};
+
+static log_ring_t* _Atomic rings = NULL;
+static _Atomic uint64_t dropped_total = 0;
+
+static logger_t* async_logger = NULL;
+static pthread_t writer;
+static atomic_bool writer_stop = false;
+static pthread_key_t ring_key;
+
+static _Thread_local log_ring_t* own_ring = NULL;
+
+// the formatted second is reused by every line logged within it
+static _Thread_local time_t stamp_time = -1;
+static _Thread_local char stamp[32];
+static _Thread_local size_t stamp_len = 0;
+
+static size_t format_line(char* buf, size_t size, int64_t level, const char *fmt, va_list ap);
+static size_t format_notice(char* buf, size_t size, int64_t level, const char *fmt, ...);
+static size_t format_deferred(char* buf, size_t size, const log_record_t* rec);
+static size_t format_prefix(char* buf, size_t size, int64_t level, time_t now);
+static size_t end_line(char* buf, size_t size, size_t len);
+static void queue_line(int64_t level, const char *fmt, va_list ap);
+static const char* parse_spec(const char* p, log_spec_t* spec);
+static bool pack_args(log_record_t* rec, const char* fmt, va_list ap);
+static size_t unpack_args(char* buf, size_t size, const log_record_t* rec);
+static size_t format_spec(char* buf, size_t size, const log_spec_t* spec,
+                          const int* stars, const uint8_t* arg);
+static log_ring_t* get_ring();
+static void release_ring(void* ptr);
+static void* run_writer(void* arg);
+static size_t drain_ring(int fd, log_ring_t* ring);
+static void write_all(int fd, struct iovec* iov, int iovcnt);
+static void stop_writer();
+
 void init_file_logging(logger_t *logger, const char* log_file) {
     if (log_file == NULL) {
         fprintf(stderr, "init_file_logging: log_file is NULL\n");
@@ -32,6 +141,48 @@ void init_stdout_logging(logger_t *logger) {
     logger->fd = STDOUT_FILENO;
 }
 
+int64_t start_async_logging(logger_t *logger) {
+    if (logger->async) {
+        return 0;
+    }
+
+    int res = pthread_key_create(&ring_key, release_ring);
+    if (res != 0) {
+        errno = res;
+        log_perror("start_async_logging.pthread_key_create");
+        return -1;
+    }
+
+    async_logger = logger;
+
+    // signals are left to the event loop, the writer starts with all of them blocked
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    res = pthread_create(&writer, NULL, run_writer, logger);
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (res != 0) {
+        errno = res;
+        log_perror("start_async_logging.pthread_create");
+        return -1;
+    }
+
+    // threads started after this one see the flag through pthread_create
+    logger->async = true;
+
+    atexit(stop_writer);
+
+    return 0;
+}
+
+uint64_t logger_dropped() {
+    return atomic_load_explicit(&dropped_total, memory_order_relaxed);
+}
+
 void base_log(int64_t level, logger_t* logger, const char *fmt, ...) {
     if (fmt == NULL) {
         const char *err = "base_log: fmt is NULL";
@@ -45,26 +196,19 @@ void base_log(int64_t level, logger_t* logger, const char *fmt, ...) {
 
     int saved_errno = errno;
 
-    char buf[4096];
-    size_t len = 0;
-
-    time_t now = time(NULL);
-    struct tm tm;
-    localtime_r(&now, &tm);
-    len += strftime(buf + len, sizeof(buf) - len, "%Y-%m-%d %H:%M:%S ", &tm);
-
-    len += snprintf(buf + len, sizeof(buf) - len, "[%s] ", log_levels[level]);
-
     va_list ap;
     va_start(ap, fmt);
-    len += vsnprintf(buf + len, sizeof(buf) - len, fmt, ap);
-    va_end(ap);
 
-    if (len < sizeof(buf) - 1) {
-        buf[len++] = '\n';
+    // a crit line is followed by abort, it cannot wait for the writer
+    if (logger->async && level < LOG_CRIT) {
+        queue_line(level, fmt, ap);
+    } else {
+        char buf[LOG_LINE_SIZE];
+        size_t len = format_line(buf, sizeof(buf), level, fmt, ap);
+        write(logger->fd, buf, len);
     }
 
-    write(logger->fd, buf, len);
+    va_end(ap);
 
     errno = saved_errno;
 }
@@ -99,9 +243,592 @@ void close_logger(logger_t* logger) {
         exit(1);
     }
 
+    stop_writer();
+
     if (logger->file_logging) {
         close(logger->fd);
     }
 
     free(logger);
 }
+
+// returns the line length, the line is cut to fit and ends with a newline
+static size_t format_line(char* buf, size_t size, int64_t level, const char *fmt, va_list ap) {
+    size_t len = format_prefix(buf, size, level, time(NULL));
+
+    if (len < size) {
+        int n = vsnprintf(buf + len, size - len, fmt, ap);
+        len += n > 0 ? (size_t)n : 0;
+    }
+
+    return end_line(buf, size, len);
+}
+
+static size_t format_deferred(char* buf, size_t size, const log_record_t* rec) {
+    size_t len = format_prefix(buf, size, rec->level, rec->time);
+
+    if (len < size) {
+        len += unpack_args(buf + len, size - len, rec);
+    }
+
+    return end_line(buf, size, len);
+}
+
+static size_t format_prefix(char* buf, size_t size, int64_t level, time_t now) {
+    if (now != stamp_time) {
+        struct tm tm;
+        localtime_r(&now, &tm);
+        stamp_len = strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S ", &tm);
+        stamp_time = now;
+    }
+
+    size_t len = stamp_len;
+    memcpy(buf, stamp, stamp_len);
+
+    int n = snprintf(buf + len, size - len, "[%s] ", log_levels[level]);
+    len += n > 0 ? (size_t)n : 0;
+
+    return len;
+}
+
+static size_t end_line(char* buf, size_t size, size_t len) {
+    if (len > size - 1) {
+        len = size - 1;
+    }
+
+    buf[len++] = '\n';
+
+    return len;
+}
+
+static size_t format_notice(char* buf, size_t size, int64_t level, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    size_t len = format_line(buf, size, level, fmt, ap);
+    va_end(ap);
+
+    return len;
+}
+
+static void queue_line(int64_t level, const char *fmt, va_list ap) {
+    log_ring_t* ring = get_ring();
+    if (ring == NULL) {
+        atomic_fetch_add_explicit(&dropped_total, 1, memory_order_relaxed);
+        return;
+    }
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    // the writer fell behind, the caller is never made to wait
+    if (head - tail == LOG_RING_SLOTS) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&dropped_total, 1, memory_order_relaxed);
+        return;
+    }
+
+    log_record_t* rec = &ring->records[head & (LOG_RING_SLOTS - 1)];
+    rec->level = (uint32_t)level;
+    rec->time = time(NULL);
+
+    // the writer formats the line, unless an argument cannot be kept for it
+    va_list args;
+    va_copy(args, ap);
+
+    if (pack_args(rec, fmt, args)) {
+        rec->fmt = fmt;
+    } else {
+        rec->fmt = NULL;
+        rec->len = (uint32_t)format_line(rec->data, sizeof(rec->data), level, fmt, ap);
+    }
+
+    va_end(args);
+
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+// NULL when the conversion is one pack_args() does not keep: %n, %m,
+// long doubles, wide characters and positional arguments
+static const char* parse_spec(const char* p, log_spec_t* spec) {
+    spec->start = p++;
+    spec->stars = 0;
+    spec->precision = -1;
+    spec->precision_star = false;
+
+    while (*p == '-' || *p == '+' || *p == ' ' || *p == '#' || *p == '0' || *p == '\'') {
+        p++;
+    }
+
+    if (*p == '*') {
+        spec->stars += 1;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    if (*p == '$') {
+        return NULL;
+    }
+
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            spec->stars += 1;
+            spec->precision_star = true;
+            p++;
+        } else {
+            spec->precision = 0;
+            while (*p >= '0' && *p <= '9') {
+                if (spec->precision < UINT16_MAX) {
+                    spec->precision = spec->precision * 10 + (*p - '0');
+                }
+                p++;
+            }
+        }
+    }
+
+    spec->head_len = (size_t)(p - spec->start);
+    spec->length = LEN_NONE;
+
+    switch (*p) {
+    case 'h':
+        spec->length = p[1] == 'h' ? LEN_HH : LEN_H;
+        p += p[1] == 'h' ? 2 : 1;
+        break;
+    case 'l':
+        spec->length = p[1] == 'l' ? LEN_LL : LEN_L;
+        p += p[1] == 'l' ? 2 : 1;
+        break;
+    case 'q':
+        spec->length = LEN_LL;
+        p++;
+        break;
+    case 'z':
+        spec->length = LEN_Z;
+        p++;
+        break;
+    case 'j':
+        spec->length = LEN_J;
+        p++;
+        break;
+    case 't':
+        spec->length = LEN_T;
+        p++;
+        break;
+    }
+
+    spec->conv = *p;
+
+    switch (*p) {
+    case 'd':
+    case 'i':
+        spec->kind = ARG_INT;
+        break;
+    case 'u':
+    case 'o':
+    case 'x':
+    case 'X':
+        spec->kind = ARG_UINT;
+        break;
+    case 'c':
+        spec->kind = ARG_CHAR;
+        break;
+    case 'f':
+    case 'F':
+    case 'e':
+    case 'E':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        spec->kind = ARG_DOUBLE;
+        break;
+    case 'p':
+        spec->kind = ARG_PTR;
+        break;
+    case 's':
+        spec->kind = ARG_STR;
+        break;
+    default:
+        return NULL;
+    }
+
+    bool plain = spec->kind == ARG_INT || spec->kind == ARG_UINT || spec->length == LEN_NONE ||
+        (spec->kind == ARG_DOUBLE && spec->length == LEN_L);
+
+    if (!plain || spec->head_len + 3 > LOG_SPEC_SIZE) {
+        return NULL;
+    }
+
+    return p + 1;
+}
+
+// Copies the arguments fmt takes into rec->data: every number widened to
+// 8 bytes, every string copied after a 2-byte length since the pointer may
+// not outlive the call. False if they do not fit or cannot be kept.
+static bool pack_args(log_record_t* rec, const char* fmt, va_list ap) {
+    uint8_t* out = (uint8_t*)rec->data;
+    uint8_t* end = out + sizeof(rec->data);
+
+    for (const char* p = fmt; *p != '\0'; p++) {
+        if (*p != '%') {
+            continue;
+        }
+
+        if (p[1] == '%') {
+            p++;
+            continue;
+        }
+
+        log_spec_t spec;
+        const char* next = parse_spec(p, &spec);
+        if (next == NULL) {
+            return false;
+        }
+
+        if (out + (spec.stars + 1) * sizeof(uint64_t) > end) {
+            return false;
+        }
+
+        for (int i = 0; i < spec.stars; i++) {
+            int64_t star = va_arg(ap, int);
+            memcpy(out, &star, sizeof(star));
+            out += sizeof(star);
+
+            // the precision star comes last, a negative one means none
+            if (spec.precision_star && i + 1 == spec.stars) {
+                spec.precision = star >= 0 ? (int)(star < UINT16_MAX ? star : UINT16_MAX) : -1;
+            }
+        }
+
+        uint64_t v = 0;
+        double d = 0;
+
+        switch (spec.kind) {
+        case ARG_INT:
+            switch (spec.length) {
+            case LEN_HH: v = (uint64_t)(int64_t)(signed char)va_arg(ap, int); break;
+            case LEN_H:  v = (uint64_t)(int64_t)(short)va_arg(ap, int); break;
+            case LEN_L:  v = (uint64_t)(int64_t)va_arg(ap, long); break;
+            case LEN_LL: v = (uint64_t)(int64_t)va_arg(ap, long long); break;
+            case LEN_Z:  v = (uint64_t)(int64_t)va_arg(ap, ssize_t); break;
+            case LEN_J:  v = (uint64_t)(int64_t)va_arg(ap, intmax_t); break;
+            case LEN_T:  v = (uint64_t)(int64_t)va_arg(ap, ptrdiff_t); break;
+            default:     v = (uint64_t)(int64_t)va_arg(ap, int); break;
+            }
+            break;
+        case ARG_UINT:
+            switch (spec.length) {
+            case LEN_HH: v = (unsigned char)va_arg(ap, unsigned); break;
+            case LEN_H:  v = (unsigned short)va_arg(ap, unsigned); break;
+            case LEN_L:  v = va_arg(ap, unsigned long); break;
+            case LEN_LL: v = va_arg(ap, unsigned long long); break;
+            case LEN_Z:  v = va_arg(ap, size_t); break;
+            case LEN_J:  v = va_arg(ap, uintmax_t); break;
+            case LEN_T:  v = (uint64_t)va_arg(ap, ptrdiff_t); break;
+            default:     v = va_arg(ap, unsigned); break;
+            }
+            break;
+        case ARG_CHAR:
+            v = (uint64_t)va_arg(ap, int);
+            break;
+        case ARG_DOUBLE:
+            d = va_arg(ap, double);
+            memcpy(&v, &d, sizeof(v));
+            break;
+        case ARG_PTR:
+            v = (uintptr_t)va_arg(ap, void*);
+            break;
+        case ARG_STR: {
+            const char* str = va_arg(ap, const char*);
+            if (str == NULL) {
+                str = "(null)";
+            }
+
+            // with a precision the string need not be terminated, it is
+            // copied only as far as printf would read it
+            size_t len = spec.precision >= 0 ? strnlen(str, (size_t)spec.precision) : strlen(str);
+            if (len > UINT16_MAX || out + sizeof(uint16_t) + len + 1 > end) {
+                return false;
+            }
+
+            uint16_t len16 = (uint16_t)len;
+            memcpy(out, &len16, sizeof(len16));
+            memcpy(out + sizeof(len16), str, len);
+            out[sizeof(len16) + len] = '\0';
+            out += sizeof(len16) + len + 1;
+            break;
+        }
+        }
+
+        if (spec.kind != ARG_STR) {
+            memcpy(out, &v, sizeof(v));
+            out += sizeof(v);
+        }
+
+        p = next - 1;
+    }
+
+    rec->len = (uint32_t)(out - (uint8_t*)rec->data);
+
+    return true;
+}
+
+// formats the line pack_args() kept, returns its length as snprintf would
+static size_t unpack_args(char* buf, size_t size, const log_record_t* rec) {
+    const uint8_t* arg = (const uint8_t*)rec->data;
+    size_t len = 0;
+
+    for (const char* p = rec->fmt; *p != '\0'; ) {
+        const char* lit = p;
+        while (*p != '\0' && !(*p == '%' && p[1] != '%')) {
+            p += *p == '%' ? 2 : 1;
+        }
+
+        // literal text, %% folded as printf would
+        for (const char* c = lit; c < p; c++) {
+            if (len < size) {
+                buf[len] = *c;
+            }
+            len += 1;
+            c += *c == '%';
+        }
+
+        if (*p == '\0') {
+            break;
+        }
+
+        log_spec_t spec;
+        p = parse_spec(p, &spec);
+
+        int stars[2] = {0, 0};
+        for (int i = 0; i < spec.stars; i++) {
+            int64_t star;
+            memcpy(&star, arg, sizeof(star));
+            stars[i] = (int)star;
+            arg += sizeof(star);
+        }
+
+        size_t room = len < size ? size - len : 0;
+        len += format_spec(room > 0 ? buf + len : NULL, room, &spec, stars, arg);
+
+        if (spec.kind == ARG_STR) {
+            uint16_t str_len;
+            memcpy(&str_len, arg, sizeof(str_len));
+            arg += sizeof(str_len) + str_len + 1;
+        } else {
+            arg += sizeof(uint64_t);
+        }
+    }
+
+    if (len < size) {
+        buf[len] = '\0';
+    }
+
+    return len;
+}
+
+// integers go out as long long, they were widened and cut to size when packed
+static size_t format_spec(char* buf, size_t size, const log_spec_t* spec,
+                          const int* stars, const uint8_t* arg) {
+    char fmt[LOG_SPEC_SIZE];
+    size_t n = spec->head_len;
+
+    memcpy(fmt, spec->start, n);
+    if (spec->kind == ARG_INT || spec->kind == ARG_UINT) {
+        fmt[n++] = 'l';
+        fmt[n++] = 'l';
+    }
+    fmt[n++] = spec->conv;
+    fmt[n] = '\0';
+
+    uint64_t v = 0;
+    if (spec->kind != ARG_STR) {
+        memcpy(&v, arg, sizeof(v));
+    }
+
+    double d;
+    memcpy(&d, &v, sizeof(d));
+
+    const char* str = (const char*)arg + sizeof(uint16_t);
+
+#define FORMAT_SPEC(value)                                                   \
+    (spec->stars == 0 ? snprintf(buf, size, fmt, value)                      \
+     : spec->stars == 1 ? snprintf(buf, size, fmt, stars[0], value)          \
+     : snprintf(buf, size, fmt, stars[0], stars[1], value))
+
+    int res = 0;
+
+    switch (spec->kind) {
+    case ARG_INT:    res = FORMAT_SPEC((long long)(int64_t)v); break;
+    case ARG_UINT:   res = FORMAT_SPEC((unsigned long long)v); break;
+    case ARG_CHAR:   res = FORMAT_SPEC((int)v); break;
+    case ARG_DOUBLE: res = FORMAT_SPEC(d); break;
+    case ARG_PTR:    res = FORMAT_SPEC((void*)(uintptr_t)v); break;
+    case ARG_STR:    res = FORMAT_SPEC(str); break;
+    }
+
+#undef FORMAT_SPEC
+
+    return res > 0 ? (size_t)res : 0;
+}
+
+static log_ring_t* get_ring() {
+    if (own_ring != NULL) {
+        return own_ring;
+    }
+
+    log_ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire);
+    for (; ring != NULL; ring = ring->next) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&ring->in_use, &expected, true)) {
+            break;
+        }
+    }
+
+    if (ring == NULL) {
+        ring = aligned_alloc(_Alignof(log_ring_t), sizeof(log_ring_t));
+        if (ring == NULL) {
+            return NULL;
+        }
+
+        atomic_init(&ring->head, 0);
+        atomic_init(&ring->tail, 0);
+        atomic_init(&ring->dropped, 0);
+        atomic_init(&ring->in_use, true);
+
+        ring->next = atomic_load_explicit(&rings, memory_order_relaxed);
+        while (!atomic_compare_exchange_weak_explicit(
+            &rings, &ring->next, ring, memory_order_release, memory_order_relaxed)) {
+        }
+    }
+
+    // the destructor hands the ring back when the thread exits
+    pthread_setspecific(ring_key, ring);
+    own_ring = ring;
+
+    return ring;
+}
+
+static void release_ring(void* ptr) {
+    log_ring_t* ring = ptr;
+
+    atomic_store_explicit(&ring->in_use, false, memory_order_release);
+}
+
+static void* run_writer(void* arg) {
+    logger_t* logger = arg;
+
+    for (;;) {
+        bool stopping = atomic_load(&writer_stop);
+
+        size_t written = 0;
+
+        log_ring_t* ring = atomic_load_explicit(&rings, memory_order_acquire);
+        for (; ring != NULL; ring = ring->next) {
+            written += drain_ring(logger->fd, ring);
+        }
+
+        if (written != 0) {
+            continue;
+        }
+
+        // everything queued before the stop was asked for is out
+        if (stopping) {
+            break;
+        }
+
+        struct timespec idle = {0, LOG_WRITER_IDLE * 1000000L};
+        nanosleep(&idle, NULL);
+    }
+
+    return NULL;
+}
+
+// returns the number of lines written
+static size_t drain_ring(int fd, log_ring_t* ring) {
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    size_t count = head - tail;
+    if (count > LOG_WRITER_BATCH) {
+        count = LOG_WRITER_BATCH;
+    }
+
+    struct iovec iov[LOG_WRITER_BATCH + 1];
+    int iovcnt = 0;
+
+    char notice[128];
+    uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+    if (dropped != 0) {
+        iov[iovcnt].iov_base = notice;
+        iov[iovcnt].iov_len = format_notice(notice, sizeof(notice), LOG_WARN,
+            "logger: %llu lines dropped, the writer fell behind", (unsigned long long)dropped);
+        iovcnt += 1;
+    }
+
+    // only the writer thread gets here
+    static char lines[LOG_WRITER_BATCH][LOG_RECORD_SIZE];
+
+    for (size_t i = 0; i < count; i++) {
+        log_record_t* rec = &ring->records[(tail + i) & (LOG_RING_SLOTS - 1)];
+
+        if (rec->fmt != NULL) {
+            iov[iovcnt].iov_base = lines[i];
+            iov[iovcnt].iov_len = format_deferred(lines[i], sizeof(lines[i]), rec);
+        } else {
+            iov[iovcnt].iov_base = rec->data;
+            iov[iovcnt].iov_len = rec->len;
+        }
+
+        iovcnt += 1;
+    }
+
+    if (iovcnt == 0) {
+        return 0;
+    }
+
+    write_all(fd, iov, iovcnt);
+
+    atomic_store_explicit(&ring->tail, tail + count, memory_order_release);
+
+    return count + (dropped != 0);
+}
+
+static void write_all(int fd, struct iovec* iov, int iovcnt) {
+    while (iovcnt > 0) {
+        ssize_t n = writev(fd, iov, iovcnt);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        // nowhere left to report it, the lines are lost
+        if (n <= 0) {
+            return;
+        }
+
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= (ssize_t)iov->iov_len;
+            iov += 1;
+            iovcnt -= 1;
+        }
+
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= (size_t)n;
+        }
+    }
+}
+
+static void stop_writer() {
+    if (async_logger == NULL || atomic_exchange(&writer_stop, true)) {
+        return;
+    }
+
+    pthread_join(writer, NULL);
+
+    // lines logged from here on are written right away
+    async_logger->async = false;
+}
@@ -5,8 +5,10 @@
 #include "core/connection.h"
 #include "core/buffer.h"
 #include "core/time.h"
+#include "core/trace.h"
 #include "core/udp_socket.h"
 #include "logger/logger.h"
+#include "metrics/metrics.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -18,6 +20,7 @@
 #include <unistd.h>
 
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 
 static ssize_t tcp_recv_buf(connection_t *conn, uint8_t* buf, size_t count);
@@ -52,6 +55,11 @@ static ssize_t tcp_recv_buf(connection_t *conn, uint8_t* buf, size_t count) {
     ssize_t read = 0;
     
     for (;;) {
+        if (space_left <= 0 && read > 0) {
+            // buffer is full, the caller drains it and reads again
+            break;
+        }
+
         if (space_left <= 0) {
             log_warn("tcp_recv_buf: no space left to read into");
             return JK_OUT_OF_BUFFER;
@@ -59,10 +67,19 @@ static ssize_t tcp_recv_buf(connection_t *conn, uint8_t* buf, size_t count) {
 
         ssize_t n = recv(fd, pos, space_left, 0);
 
+        // report EOF on the next call, so the data read before it is not lost
+        if (n == 0 && read > 0) {
+            break;
+        }
+
         if (n == 0) {
             return 0;
         }
 
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && read == 0) {
+            return JK_WOULD_BLOCK;
+        }
+
         if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             break;
         }
@@ -120,12 +137,16 @@ ssize_t tcp_send_buf(connection_t *conn, uint8_t* buf, size_t count) {
             break;
         }
 
-        ssize_t n = send(fd, pos, count, 0);
+        ssize_t n = send(fd, pos, count, MSG_NOSIGNAL);
 
         if (n == 0) {
             return 0;
         }
 
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && sent == 0) {
+            return JK_WOULD_BLOCK;
+        }
+
         if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
             break;
         }
@@ -142,6 +163,39 @@ ssize_t tcp_send_buf(connection_t *conn, uint8_t* buf, size_t count) {
     return sent;
 }
 
+ssize_t send_iov(connection_t *conn, const struct iovec* iov, int iovcnt) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(conn != NULL, "conn is null");
+    CHECK_INVARIANT(iov != NULL, "iov is null");
+    CHECK_INVARIANT(conn->handle.type == CONN_TYPE_TCP, "gathered writes need a tcp connection");
+
+    int fd = conn->handle.data.fd; // NOLINT
+
+    struct msghdr msg = {0};
+    msg.msg_iov = (struct iovec*)iov;
+    msg.msg_iovlen = iovcnt;
+
+    for (;;) {
+        // unlike writev, a peer that went away is reported as EPIPE instead of SIGPIPE
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return JK_WOULD_BLOCK;
+        }
+
+        if (n == -1) {
+            return JK_ERROR;
+        }
+
+        return n;
+    }
+}
+
 static ssize_t udp_send_buf(connection_t *conn, uint8_t* buf, size_t count) {
     logger_t* logger = current_logger;
 
@@ -193,6 +247,9 @@ static ssize_t udp_send_buf(connection_t *conn, uint8_t* buf, size_t count) {
         return JK_ERROR;
     }
 
+    metrics_inc(METRIC_UDP_SENT);
+    JK_TRACE2(udp_send, fd, sent);
+
     return sent;
 }
 
@@ -200,7 +257,7 @@ int64_t open_tcp_conn(address_t* address) {
     logger_t* logger = current_logger;
 
     int fd = 0;
-    fd = socket(AF_INET,SOCK_STREAM,0);
+    fd = socket(address->af,SOCK_STREAM,0);
     CHECK_INVARIANT(fd != -1, "failed to create socket");
 
     int flags = fcntl(fd, F_GETFL, 0);
@@ -281,6 +338,9 @@ ssize_t udp_recv(udp_socket_t *sock, uint8_t* buf, size_t count, address_t* addr
         return JK_ERROR;
     }
 
+    metrics_inc(METRIC_UDP_RECEIVED);
+    JK_TRACE2(udp_recv, fd, n);
+
     memset(address, 0, sizeof(*address));
 
     if (peer_addr.ss_family == AF_INET) {
@@ -300,3 +360,56 @@ ssize_t udp_recv(udp_socket_t *sock, uint8_t* buf, size_t count, address_t* addr
 
     return n;
 }
+
+ssize_t udp_send(udp_socket_t *sock, uint8_t* buf, size_t count, address_t* address) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(sock != NULL, "sock is null");
+    CHECK_INVARIANT(buf != NULL, "buf is null");
+    CHECK_INVARIANT(address != NULL, "address is null");
+    CHECK_INVARIANT(count != 0, "count is 0");
+
+    int fd = (int)sock->fd;
+    ssize_t sent = 0;
+
+    if (sock->timer) {
+        jk_timer_start(sock->timer, CLIENT_USOCK_TIMEOUT);
+    }
+
+    if (address->af == AF_INET) {
+        struct sockaddr_in sa4 = {0};
+        sa4.sin_family = AF_INET;
+        sa4.sin_port = htons(address->src_port);
+        sa4.sin_addr = address->src.src_v4;
+
+        sent = 
+            sendto(fd, buf, count, 0,
+            (struct sockaddr*)&sa4, sizeof(sa4));
+    } else if (address->af == AF_INET6) {
+        struct sockaddr_in6 sa6 = {0};
+        sa6.sin6_family = AF_INET6;
+        sa6.sin6_port = htons(address->src_port);
+        sa6.sin6_addr = address->src.src_v6;
+
+        sent = 
+            sendto(fd, buf, count, 0,
+             (struct sockaddr*)&sa6, sizeof(sa6));
+    } else {
+        PANIC("Unrecognized address family");
+    }
+
+    if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        sock->writable = false;
+        return JK_WOULD_BLOCK;
+    }
+
+    if (sent == -1) {
+        log_perror("udp_send.sendto");
+        return JK_ERROR;
+    }
+
+    metrics_inc(METRIC_UDP_SENT);
+    JK_TRACE2(udp_send, fd, sent);
+
+    return sent;
+}
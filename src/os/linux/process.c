@@ -0,0 +1,317 @@
+#include "core/process.h"
+#include "core/errors.h"
+#include "core/time.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/prctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+// a worker dying sooner than this failed to start and is not respawned
+#define WORKER_MIN_UPTIME 1000 // ms
+
+typedef struct {
+    pid_t pid;
+    int64_t started_at;
+} worker_t;
+
+uint32_t current_worker = 0;
+
+static worker_t workers[MAX_WORKERS];
+static uint32_t workers_count = 0;
+
+static volatile sig_atomic_t stop_signal = 0;
+static volatile sig_atomic_t reload_signal = 0;
+static bool stopping = false;
+static int exit_code = 0;
+
+static int64_t spawn_worker(uint32_t index);
+static void pin_to_cpu(uint32_t index);
+static bool supervise();
+static void signal_workers(int sig);
+static void reload_workers();
+static void supervisor_signals(sigset_t* set);
+static void handle_stop(int sig);
+static void handle_reload(int sig);
+static void handle_child(int sig);
+
+int64_t jk_spawn_workers(uint32_t count) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(count >= 1 && count <= MAX_WORKERS, "bad number of workers");
+
+    if (count == 1) {
+        return JK_OK;
+    }
+
+    workers_count = count;
+
+    for (uint32_t i = 0; i < count; i++) {
+        int64_t res = spawn_worker(i);
+
+        if (res == JK_ERROR) {
+            signal_workers(SIGTERM);
+            exit(1);
+        }
+
+        // the child carries on with its event loop
+        if (res == 0) {
+            return JK_OK;
+        }
+    }
+
+    // a respawned worker comes back out of supervise()
+    if (supervise()) {
+        return JK_OK;
+    }
+
+    exit(exit_code);
+}
+
+// returns the pid in the parent, 0 in the child
+static int64_t spawn_worker(uint32_t index) {
+    logger_t* logger = current_logger;
+
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        log_perror("jk_spawn_workers.fork");
+        return JK_ERROR;
+    }
+
+    if (pid == 0) {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        signal(SIGHUP, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+
+        // a respawned worker comes from supervise(), which blocks these
+        sigset_t supervised;
+        supervisor_signals(&supervised);
+        sigprocmask(SIG_UNBLOCK, &supervised, NULL);
+
+        // held until the event loop reads it, a reload must not kill a starting worker
+        sigset_t hup;
+        sigemptyset(&hup);
+        sigaddset(&hup, SIGHUP);
+        sigprocmask(SIG_BLOCK, &hup, NULL);
+
+        // nobody would restart the workers of a dead supervisor
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1) {
+            exit(0);
+        }
+
+        current_worker = index;
+        pin_to_cpu(index);
+
+        return 0;
+    }
+
+    workers[index].pid = pid;
+    workers[index].started_at = jk_now();
+
+    log_info("jk_spawn_workers: worker %u started, pid %d", index, (int)pid);
+
+    return pid;
+}
+
+// the i-th cpu this process may run on, round robin over the allowed ones
+static void pin_to_cpu(uint32_t index) {
+    logger_t* logger = current_logger;
+
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        log_perror("jk_spawn_workers.sched_getaffinity");
+        return;
+    }
+
+    int count = CPU_COUNT(&allowed);
+    int target = (int)(index % (uint32_t)count);
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+
+        if (target-- > 0) {
+            continue;
+        }
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+
+        if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+            log_perror("jk_spawn_workers.sched_setaffinity");
+            return;
+        }
+
+        log_info("jk_spawn_workers: worker %u runs on cpu %d", index, cpu);
+        return;
+    }
+}
+
+// returns true in a respawned worker
+static bool supervise() {
+    logger_t* logger = current_logger;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_stop;
+    sigemptyset(&sa.sa_mask);
+
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+
+    sa.sa_handler = handle_reload;
+    sigaction(SIGHUP, &sa, NULL);
+
+    // ignored by default, sigsuspend would never return for it
+    sa.sa_handler = handle_child;
+    sigaction(SIGCHLD, &sa, NULL);
+
+    // the signals are only let in by sigsuspend, one arriving between
+    // the checks below and the wait cannot get lost
+    sigset_t blocked;
+    sigset_t waiting;
+    supervisor_signals(&blocked);
+    sigprocmask(SIG_BLOCK, &blocked, &waiting);
+
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&blocked, sig) == 1) {
+            sigdelset(&waiting, sig);
+        }
+    }
+
+    uint32_t alive = workers_count;
+
+    while (alive > 0) {
+        if (stop_signal != 0) {
+            stopping = true;
+            signal_workers(stop_signal);
+            stop_signal = 0;
+        }
+
+        if (reload_signal != 0) {
+            reload_signal = 0;
+            reload_workers();
+        }
+
+        int status = 0;
+        pid_t pid = waitpid(-1, &status, WNOHANG);
+
+        if (pid == 0) {
+            sigsuspend(&waiting);
+            continue;
+        }
+
+        if (pid == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            log_perror("jk_spawn_workers.waitpid");
+            return false;
+        }
+
+        uint32_t index = 0;
+        while (index < workers_count && workers[index].pid != pid) {
+            index++;
+        }
+
+        if (index == workers_count) {
+            continue;
+        }
+
+        workers[index].pid = 0;
+        alive -= 1;
+
+        bool failed = WIFSIGNALED(status) || (WIFEXITED(status) && WEXITSTATUS(status) != 0);
+        bool killed = WIFSIGNALED(status) && WTERMSIG(status) == SIGTERM;
+
+        if (!failed || killed || stopping) {
+            log_info("jk_spawn_workers: worker %u exited", index);
+            continue;
+        }
+
+        log_error("jk_spawn_workers: worker %u died, status %d", index, status);
+
+        if (jk_now() - workers[index].started_at < WORKER_MIN_UPTIME) {
+            log_error("jk_spawn_workers: worker %u failed to start, shutting down", index);
+            stopping = true;
+            exit_code = 1;
+            signal_workers(SIGTERM);
+            continue;
+        }
+
+        int64_t res = spawn_worker(index);
+        if (res == 0) {
+            return true;
+        }
+
+        if (res != JK_ERROR) {
+            alive += 1;
+        }
+    }
+
+    return false;
+}
+
+static void signal_workers(int sig) {
+    for (uint32_t i = 0; i < workers_count; i++) {
+        if (workers[i].pid > 0) {
+            kill(workers[i].pid, sig);
+        }
+    }
+}
+
+// workers respawned later start with the new settings as well
+static void reload_workers() {
+    logger_t* logger = current_logger;
+
+    settings_t* next = reload_settings(current_settings);
+    if (next == NULL) {
+        log_error("jk_spawn_workers: new settings rejected, workers keep the old ones");
+        return;
+    }
+
+    // nothing in the supervisor points into the old settings
+    release_settings(current_settings);
+    current_settings = next;
+
+    log_info("jk_spawn_workers: reloading workers");
+    signal_workers(SIGHUP);
+}
+
+static void supervisor_signals(sigset_t* set) {
+    sigemptyset(set);
+    sigaddset(set, SIGTERM);
+    sigaddset(set, SIGINT);
+    sigaddset(set, SIGHUP);
+    sigaddset(set, SIGCHLD);
+}
+
+static void handle_stop(int sig) {
+    stop_signal = sig;
+}
+
+static void handle_reload(int sig) {
+    (void)sig; // unused
+    reload_signal = 1;
+}
+
+static void handle_child(int sig) {
+    (void)sig; // unused
+}
@@ -0,0 +1,56 @@
+#include "core/random.h"
+#include "logger/logger.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/random.h>
+
+#define RANDOM_POOL_SIZE 256
+
+static uint8_t pool[RANDOM_POOL_SIZE];
+static size_t pool_pos = RANDOM_POOL_SIZE;
+
+static void refill_pool() {
+    logger_t* logger = current_logger;
+
+    size_t filled = 0;
+
+    while (filled < sizeof(pool)) {
+        ssize_t n = getrandom(pool + filled, sizeof(pool) - filled, 0);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        CHECK_INVARIANT(n > 0, "getrandom failed");
+        filled += n;
+    }
+
+    pool_pos = 0;
+}
+
+uint32_t jk_random_u32() {
+    if (pool_pos + sizeof(uint32_t) > sizeof(pool)) {
+        refill_pool();
+    }
+
+    uint32_t value = 0;
+    memcpy(&value, pool + pool_pos, sizeof(value));
+    pool_pos += sizeof(value);
+
+    return value;
+}
+
+uint16_t jk_random_u16() {
+    if (pool_pos + sizeof(uint16_t) > sizeof(pool)) {
+        refill_pool();
+    }
+
+    uint16_t value = 0;
+    memcpy(&value, pool + pool_pos, sizeof(value));
+    pool_pos += sizeof(value);
+
+    return value;
+}
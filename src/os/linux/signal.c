@@ -0,0 +1,88 @@
+#include "core/signal.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <sys/signalfd.h>
+
+signal_source_t* make_signal_source(int signo) {
+    logger_t *logger = current_logger;
+
+    signal_source_t* src = calloc(1, sizeof(signal_source_t));
+    if (src == NULL) {
+        log_perror("make_signal_source.allocate_source");
+        return NULL;
+    }
+
+    src->fd = -1;
+    src->signo = signo;
+    src->ev = NULL;
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, signo);
+
+    // the signal is only ever read from the fd
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        log_perror("make_signal_source.sigprocmask");
+        src->error = true;
+        return src;
+    }
+
+    int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd == -1) {
+        log_perror("make_signal_source.signalfd");
+        src->error = true;
+        return src;
+    }
+
+    src->fd = fd;
+
+    return src;
+}
+
+void release_signal_source(signal_source_t* src) {
+    if (src != NULL) {
+        if (src->fd != -1) {
+            close(src->fd); // NOLINT
+        }
+
+        free(src);
+    }
+}
+
+int64_t read_signals(signal_source_t* src) {
+    logger_t *logger = current_logger;
+
+    int64_t count = 0;
+
+    // edge triggered, everything queued is read at once
+    for (;;) {
+        struct signalfd_siginfo info;
+        ssize_t n = read(src->fd, &info, sizeof(info));
+
+        if (n == sizeof(info)) {
+            count += 1;
+            continue;
+        }
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return count;
+        }
+
+        log_perror("read_signals.read");
+        src->error = true;
+        return JK_ERROR;
+    }
+}
@@ -1,8 +1,14 @@
 #include "core/time.h"
 
 #include <time.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
 int64_t jk_now() {
     struct timespec ts;
     // Use CLOCK_REALTIME for wall-clock, CLOCK_MONOTONIC for monotonic
@@ -11,3 +17,78 @@ int64_t jk_now() {
     }
     return (int64_t)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
 }
+
+int64_t jk_now_us() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0) {
+        return -1; // error
+    }
+    return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+int64_t jk_wall_now() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+        return -1; // error
+    }
+    return (int64_t)ts.tv_sec * 1000LL + ts.tv_nsec / 1000000LL;
+}
+
+int64_t jk_wall_now_us() {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_REALTIME, &ts) != 0) {
+        return -1; // error
+    }
+    return (int64_t)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000LL;
+}
+
+#define TICKS_CALIBRATION_NS 10000000 // spent comparing the cycle counter with the clock
+
+static bool use_tsc = false;
+// ns per tick as a 32.32 fixed point number
+static uint64_t tick_mult = (uint64_t)1 << 32;
+
+static uint64_t monotonic_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t jk_ticks() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    if (use_tsc) {
+        return __rdtsc();
+    }
+#endif
+    return monotonic_ns();
+}
+
+void jk_ticks_init() {
+#if defined(__x86_64__) && defined(__GNUC__)
+    // invariant tsc, the same rate in every power state and on every core
+    unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) || !(edx & (1u << 8))) {
+        return;
+    }
+
+    uint64_t ns_start = monotonic_ns();
+    uint64_t tsc_start = __rdtsc();
+
+    uint64_t ns_end = ns_start;
+    while (ns_end - ns_start < TICKS_CALIBRATION_NS) {
+        ns_end = monotonic_ns();
+    }
+
+    uint64_t tsc_end = __rdtsc();
+    if (tsc_end <= tsc_start) {
+        return;
+    }
+
+    tick_mult = (uint64_t)((((unsigned __int128)(ns_end - ns_start)) << 32) / (tsc_end - tsc_start));
+    use_tsc = true;
+#endif
+}
+
+uint64_t jk_ticks_to_ns(uint64_t ticks) {
+    return (uint64_t)(((unsigned __int128)ticks * tick_mult) >> 32);
+}
@@ -5,6 +5,8 @@
 #include "core/decl.h"
 #include "core/udp_socket.h"
 #include "settings/settings.h"
+#include "core/errors.h"
+#include "core/random.h"
 
 #include <asm-generic/errno-base.h>
 #include <asm-generic/errno.h>
@@ -14,40 +16,77 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 
 #include <sys/socket.h>
+#include <netinet/in.h>
 
 #define LISTEN_QUEUE 10
 
-udp_socket_t* make_udp_socket() {
+#define CLIENT_PORT_MIN 1024
+#define CLIENT_BIND_ATTEMPTS 16
+
+static udp_socket_t* make_server_udp_socket(int64_t inherited);
+static udp_socket_t* make_client_socket(size_t read_size, int af);
+
+// datagrams are read whole, up to the advertised EDNS payload size
+static size_t udp_buffer_size() {
     settings_t *s = current_settings;
+
+    return s->edns_size > UDP_MSG_SIZE ? s->edns_size : UDP_MSG_SIZE;
+}
+
+static int64_t bind_random_port(int fd, int af) {
     logger_t *logger = current_logger;
 
-    udp_socket_t* sock = calloc(1, sizeof(udp_socket_t));
-    if (sock == NULL) {
-        log_perror("make_udp_socket.allocate_event_list");
-        return NULL;
+    // the port sits at the same offset in both, only the family differs
+    struct sockaddr_in client_sockaddr;
+    struct sockaddr_in6 client_sockaddr6;
+    memset(&client_sockaddr, 0, sizeof(client_sockaddr));
+    memset(&client_sockaddr6, 0, sizeof(client_sockaddr6));
+    client_sockaddr.sin_family = AF_INET;
+    client_sockaddr.sin_addr.s_addr = INADDR_ANY;
+    client_sockaddr6.sin6_family = AF_INET6;
+    client_sockaddr6.sin6_addr = in6addr_any;
+
+    struct sockaddr *sa = (struct sockaddr *)&client_sockaddr;
+    socklen_t sa_len = sizeof(client_sockaddr);
+    if (af == AF_INET6) {
+        sa = (struct sockaddr *)&client_sockaddr6;
+        sa_len = sizeof(client_sockaddr6);
     }
 
-    sock->connections = connection_ht_create(128);
-    if (sock->connections == NULL) {
-        log_perror("make_udp_socket.allocate_connections_ht");
-        sock->error = true;
-        return sock;
+    for (int attempt = 0; attempt < CLIENT_BIND_ATTEMPTS; attempt++) {
+        uint16_t port = CLIENT_PORT_MIN + jk_random_u32() % (65536 - CLIENT_PORT_MIN);
+        client_sockaddr.sin_port = htons(port);
+        client_sockaddr6.sin6_port = htons(port);
+
+        if (bind(fd, sa, sa_len) == 0) {
+            log_trace("bind_random_port: bound to %u", port);
+            return JK_OK;
+        }
+
+        if (errno != EADDRINUSE) {
+            log_perror("bind_random_port.bind");
+            return JK_ERROR;
+        }
     }
 
-    sock->wq = udp_wq_create(128);
-    if (sock->wq == NULL) {
-        log_perror("make_udp_socket.allocate_write_queue");
-        sock->error = true;
-        return sock;
+    // crowded port range, let the kernel pick an ephemeral port
+    client_sockaddr.sin_port = 0;
+    client_sockaddr6.sin6_port = 0;
+    if (bind(fd, sa, sa_len) < 0) {
+        log_perror("bind_random_port.bind_ephemeral");
+        return JK_ERROR;
     }
-    
-    sock->ev = NULL;
-    sock->fd = -1;
-    sock->readable = false;
-    sock->writable = false;
-    
+
+    return JK_OK;
+}
+
+static int64_t bind_server_port() {
+    settings_t *s = current_settings;
+    logger_t *logger = current_logger;
+
     struct sockaddr_in server_sockaddr;
     int yes = 1;
     int fd = 0;
@@ -60,18 +99,70 @@ udp_socket_t* make_udp_socket() {
     fd = socket(AF_INET, SOCK_DGRAM,0);
     if (fd < 0) {
         log_perror("make_udp_socket.socket");
-        sock->error = true;
-        return sock;
+        return JK_ERROR;
     }
     
     if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
         log_perror("make_udp_socket.setsockopt");
-        sock->error = true;
-        return sock;
+        close(fd);
+        return JK_ERROR;
+    }
+
+    // every worker binds the port on its own, the kernel spreads clients over them
+    if (s->workers > 1 && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1) {
+        log_perror("make_udp_socket.setsockopt_reuseport");
+        close(fd);
+        return JK_ERROR;
     }
     
     if (bind(fd, (struct sockaddr *)&server_sockaddr,sizeof(struct sockaddr)) < 0) {
         log_perror("make_udp_socket.bind");
+        close(fd);
+        return JK_ERROR;
+    }
+
+    return fd;
+}
+
+udp_socket_t* make_udp_socket() {
+    return make_server_udp_socket(-1);
+}
+
+udp_socket_t* make_inherited_udp_socket(int64_t fd) {
+    return make_server_udp_socket(fd);
+}
+
+// the port is bound here unless another process handed its socket over
+static udp_socket_t* make_server_udp_socket(int64_t inherited) {
+    logger_t *logger = current_logger;
+
+    udp_socket_t* sock = calloc(1, sizeof(udp_socket_t));
+    if (sock == NULL) {
+        log_perror("make_udp_socket.allocate_event_list");
+        return NULL;
+    }
+
+    sock->connections = connection_ht_create(128);
+    if (sock->connections == NULL) {
+        log_perror("make_udp_socket.allocate_connections_ht");
+        sock->error = true;
+        return sock;
+    }
+
+    sock->wq = udp_wq_create(128);
+    if (sock->wq == NULL) {
+        log_perror("make_udp_socket.allocate_write_queue");
+        sock->error = true;
+        return sock;
+    }
+    
+    sock->ev = NULL;
+    sock->fd = -1;
+    sock->readable = false;
+    sock->writable = false;
+
+    int64_t fd = inherited != -1 ? inherited : bind_server_port();
+    if (fd == JK_ERROR) {
         sock->error = true;
         return sock;
     }
@@ -80,13 +171,13 @@ udp_socket_t* make_udp_socket() {
     sock->bound = true;
 
     buffer_t buf;
-    buf.data = calloc(UDP_MSG_SIZE, sizeof(*buf.data));
+    buf.data = calloc(udp_buffer_size(), sizeof(*buf.data));
     if (buf.data == NULL) {
         log_perror("make_udp_socket.allocate_buffer");
         sock->error = true;
         return sock;
     }
-    buf.capacity = UDP_MSG_SIZE;
+    buf.capacity = udp_buffer_size();
     buf.taken = 0;
 
     sock->last_read_buf = buf;
@@ -112,7 +203,15 @@ udp_socket_t* make_udp_socket() {
     return sock;
 }
 
-udp_socket_t* make_client_udp_socket() {
+udp_socket_t* make_client_udp_socket(int af) {
+    return make_client_socket(udp_buffer_size(), af);
+}
+
+udp_socket_t* make_session_udp_socket(int af) {
+    return make_client_socket(UDP_MAX_DATAGRAM, af);
+}
+
+static udp_socket_t* make_client_socket(size_t read_size, int af) {
     logger_t *logger = current_logger;
 
     udp_socket_t* sock = calloc(1, sizeof(udp_socket_t));
@@ -140,33 +239,34 @@ udp_socket_t* make_client_udp_socket() {
     sock->readable = false;
     sock->writable = false;
     
-    int yes = 1;
     int fd = 0;
     
-    fd = socket(AF_INET, SOCK_DGRAM,0);
+    fd = socket(af, SOCK_DGRAM,0);
     if (fd < 0) {
         log_perror("make_client_udp_socket.socket");
         sock->error = true;
         return sock;
     }
     
-    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1) {
-        log_perror("make_client_udp_socket.setsockopt");
+    sock->fd = fd;
+    sock->client = true;
+
+    // no SO_REUSEADDR here: a shared port would let replies land on another socket
+    if (bind_random_port(fd, af) != JK_OK) {
         sock->error = true;
         return sock;
     }
-    
-    sock->fd = fd;
-    sock->bound = false;
+
+    sock->bound = true;
 
     buffer_t buf;
-    buf.data = calloc(UDP_MSG_SIZE, sizeof(*buf.data));
+    buf.data = calloc(read_size, sizeof(*buf.data));
     if (buf.data == NULL) {
         log_perror("make_client_udp_socket.allocate_buffer");
         sock->error = true;
         return sock;
     }
-    buf.capacity = UDP_MSG_SIZE;
+    buf.capacity = read_size;
     buf.taken = 0;
 
     sock->last_read_buf = buf;
@@ -0,0 +1,98 @@
+#include "reload.h"
+#include "core/decl.h"
+#include "core/epoch.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/signal.h"
+#include "dns/blocklist.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+#include "upstream/upstream.h"
+
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+
+static signal_source_t* hup = NULL;
+static event_t hup_ev;
+
+static void handle_hup(event_t* ev);
+static void release_old_settings(void* ptr);
+
+int64_t reload_init() {
+    logger_t* logger = current_logger;
+
+    hup = make_signal_source(SIGHUP);
+    if (hup == NULL || hup->error) {
+        log_error("reload_init: failed to watch SIGHUP");
+        release_signal_source(hup);
+        hup = NULL;
+        return JK_ERROR;
+    }
+
+    init_event(&hup_ev);
+    hup_ev.owner.ptr = hup;
+    hup_ev.owner.tag = EV_OWNER_SIGNAL;
+    hup_ev.write = false;
+    hup_ev.handler = handle_hup;
+    hup->ev = &hup_ev;
+
+    if (ev_backend->add_event(&hup_ev) == JK_ERROR) {
+        log_error("reload_init: failed to add SIGHUP event");
+        release_signal_source(hup);
+        hup = NULL;
+        return JK_ERROR;
+    }
+
+    return JK_OK;
+}
+
+void jk_reload() {
+    logger_t* logger = current_logger;
+
+    settings_t* old = current_settings;
+
+    settings_t* next = reload_settings(old);
+    if (next == NULL) {
+        log_error("jk_reload: new settings rejected, keeping the old ones");
+        return;
+    }
+
+    current_settings = next;
+
+    // data built from the settings follows them, everything reads current_settings
+    if (next->dns_mode || next->proxy_mode) {
+        upstream_reload();
+    }
+
+    if (next->dns_mode) {
+        dns_blocklist_reload();
+    }
+
+    jk_epoch_retire(old, release_old_settings);
+
+    log_info("jk_reload: settings reloaded");
+}
+
+static void handle_hup(event_t* ev) {
+    logger_t* logger = current_logger;
+
+    signal_source_t* src = ev->owner.ptr;
+
+    // several signals in a row make a single reload
+    int64_t count = src->error ? JK_ERROR : read_signals(src);
+    if (count == JK_ERROR) {
+        log_error("jk_reload: SIGHUP source failed, reloading is off");
+        ev_backend->del_event(ev);
+        return;
+    }
+
+    if (count > 0) {
+        jk_reload();
+    }
+}
+
+static void release_old_settings(void* ptr) {
+    return release_settings(ptr);
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stdint.h>
+
+// SIGHUP parses the arguments and the config file again. The new settings
+// and the data built from them are swapped in whole between events, requests
+// in flight keep what they started with until they are done (core/epoch.h).
+// Rejected settings leave everything as it was.
+int64_t reload_init();
+
+void jk_reload();
@@ -2,6 +2,7 @@
 #include "core/decl.h"
 #include "core/errors.h"
 
+#include <arpa/inet.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -13,20 +14,65 @@
 
 settings_t *current_settings = NULL;
 
+// the arguments as main got them, parsed again on reload
+static int saved_argc = 0;
+static char **saved_argv = NULL;
+
+static int64_t apply_option(settings_t *s, const char *name, const char *val);
+static int64_t load_config(settings_t *s, const char *path);
+static char *trim(char *str);
+static void keep_startup_settings(settings_t *s, const settings_t *old);
+static bool same_str(const char *a, const char *b);
+static bool valid_ip(const char *ip);
+
 void init_settings(settings_t *s) {
     if (s == NULL) {
         fprintf(stderr, "init_settings: settings is NULL\n");
         exit(1);
     }
 
+    s->config    = NULL;
     s->log_file  = NULL;
     s->log_level = NULL;
+    s->log_async = false;
 
     s->port = 0;
+    s->workers = 1;
+    s->handoff = NULL;
+    s->admin_port = 0;
+    s->stall_threshold = DEFAULT_STALL_THRESHOLD;
+    s->dns_mode = false;
+    s->edns_size = DEFAULT_EDNS_SIZE;
+    s->cache_size = DEFAULT_CACHE_SIZE;
+    s->cache_snapshot = NULL;
+    s->query_log = NULL;
+    s->rrl_rate = 0;
+    s->rrl_slip = DEFAULT_RRL_SLIP;
+    s->blocklist = NULL;
     s->proxy_mode = false;
     s->remote_ip = NULL;
     s->remote_port = 0;
     s->remote_use_udp = false;
+    s->upstreams_count = 0;
+
+    s->args = NULL;
+    s->args_count = 0;
+    s->config_text = NULL;
+}
+
+static int64_t handle_config(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "config setting requires a value\n");
+        return JK_ERROR;
+    }
+
+    if (s->config != NULL) {
+        fprintf(stderr, "config may be given once\n");
+        return JK_ERROR;
+    }
+    s->config = val;
+
+    return load_config(s, val);
 }
 
 static int64_t handle_port(struct settings_s *s, const char *val) {
@@ -39,6 +85,153 @@ static int64_t handle_port(struct settings_s *s, const char *val) {
     return JK_OK;
 }
 
+static int64_t handle_admin_port(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "admin_port setting requires a value\n");
+        return JK_ERROR;
+    }
+    s->admin_port = strtoll(val, NULL, 10);
+
+    return JK_OK;
+}
+
+static int64_t handle_stall_threshold(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "stall_threshold setting requires a value\n");
+        return JK_ERROR;
+    }
+    s->stall_threshold = strtoll(val, NULL, 10);
+
+    return JK_OK;
+}
+
+static int64_t handle_workers(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "workers setting requires a value\n");
+        return JK_ERROR;
+    }
+
+    long long workers = strtoll(val, NULL, 10);
+    if (workers < 1 || workers > MAX_WORKERS) {
+        fprintf(stderr, "workers must be within [1, %d]\n", MAX_WORKERS);
+        return JK_ERROR;
+    }
+    s->workers = (uint32_t)workers;
+
+    return JK_OK;
+}
+
+static int64_t handle_handoff(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "handoff setting requires a value\n");
+        return JK_ERROR;
+    }
+    s->handoff = val;
+
+    return JK_OK;
+}
+
+static int64_t handle_dns(struct settings_s *s, const char *val) {
+    (void)val; // unused
+    s->dns_mode = true;
+
+    return JK_OK;
+}
+
+static int64_t handle_edns_size(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "edns_size setting requires a value\n");
+        return JK_ERROR;
+    }
+
+    long long size = strtoll(val, NULL, 10);
+    if (size < UDP_MSG_SIZE || size > UINT16_MAX) {
+        fprintf(stderr, "edns_size must be within [%d, %d]\n", UDP_MSG_SIZE, UINT16_MAX);
+        return JK_ERROR;
+    }
+    s->edns_size = (uint16_t)size;
+
+    return JK_OK;
+}
+
+static int64_t handle_cache_size(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "cache_size setting requires a value\n");
+        return JK_ERROR;
+    }
+
+    long long size = strtoll(val, NULL, 10);
+    if (size < 0 || size > MAX_CACHE_SIZE) {
+        fprintf(stderr, "cache_size must be within [0, %d]\n", MAX_CACHE_SIZE);
+        return JK_ERROR;
+    }
+    s->cache_size = (uint32_t)size;
+
+    return JK_OK;
+}
+
+static int64_t handle_cache_snapshot(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "cache_snapshot setting requires a value\n");
+        return JK_ERROR;
+    }
+    s->cache_snapshot = val;
+
+    return JK_OK;
+}
+
+static int64_t handle_query_log(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "query_log setting requires a value\n");
+        return JK_ERROR;
+    }
+    s->query_log = val;
+
+    return JK_OK;
+}
+
+static int64_t handle_rrl_rate(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "rrl_rate setting requires a value\n");
+        return JK_ERROR;
+    }
+
+    long long rate = strtoll(val, NULL, 10);
+    if (rate < 0 || rate > MAX_RRL_RATE) {
+        fprintf(stderr, "rrl_rate must be within [0, %d]\n", MAX_RRL_RATE);
+        return JK_ERROR;
+    }
+    s->rrl_rate = (uint32_t)rate;
+
+    return JK_OK;
+}
+
+static int64_t handle_rrl_slip(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "rrl_slip setting requires a value\n");
+        return JK_ERROR;
+    }
+
+    long long slip = strtoll(val, NULL, 10);
+    if (slip < 0 || slip > UINT16_MAX) {
+        fprintf(stderr, "rrl_slip must be within [0, %d]\n", UINT16_MAX);
+        return JK_ERROR;
+    }
+    s->rrl_slip = (uint32_t)slip;
+
+    return JK_OK;
+}
+
+static int64_t handle_blocklist(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "blocklist setting requires a value\n");
+        return JK_ERROR;
+    }
+    s->blocklist = val;
+
+    return JK_OK;
+}
+
 static int64_t handle_proxy(struct settings_s *s, const char *val) {
     (void)val; // unused
     s->proxy_mode = true;
@@ -73,6 +266,47 @@ static int64_t handle_remote_use_udp(struct settings_s *s, const char *val) {
     return JK_OK;
 }
 
+// ip:port, or [ip]:port for IPv6
+static int64_t handle_upstream(struct settings_s *s, const char *val) {
+    if (!val) {
+        fprintf(stderr, "upstream setting requires a value\n");
+        return JK_ERROR;
+    }
+
+    if (s->upstreams_count == MAX_UPSTREAMS) {
+        fprintf(stderr, "at most %d upstreams are supported\n", MAX_UPSTREAMS);
+        return JK_ERROR;
+    }
+
+    // the value points into the settings' own copy of it, it is split in place
+    char *ip = (char *)val;
+    char *colon = strrchr(ip, ':');
+    if (colon == NULL || colon == ip) {
+        fprintf(stderr, "upstream must be ip:port\n");
+        return JK_ERROR;
+    }
+
+    *colon = '\0';
+
+    long long port = strtoll(colon + 1, NULL, 10);
+    if (port <= 0 || port > UINT16_MAX) {
+        fprintf(stderr, "upstream port must be within [1, %d]\n", UINT16_MAX);
+        return JK_ERROR;
+    }
+
+    size_t len = strlen(ip);
+    if (ip[0] == '[' && ip[len - 1] == ']') {
+        ip[len - 1] = '\0';
+        ip += 1;
+    }
+
+    s->upstreams[s->upstreams_count].ip = ip;
+    s->upstreams[s->upstreams_count].port = (uint16_t)port;
+    s->upstreams_count += 1;
+
+    return JK_OK;
+}
+
 static int64_t handle_log_file(struct settings_s *s, const char *val) {
     if (!val) {
         fprintf(stderr, "log_file setting requires a value\n");
@@ -93,6 +327,13 @@ static int64_t handle_log_level(struct settings_s *s, const char *val) {
     return JK_OK;
 }
 
+static int64_t handle_log_async(struct settings_s *s, const char *val) {
+    (void)val; // unused
+    s->log_async = true;
+
+    return JK_OK;
+}
+
 typedef enum {
     OPT_NONE,
     OPT_REQUIRED
@@ -106,13 +347,28 @@ typedef struct {
 } option_t;
 
 static option_t options[] = {
+    {"config",  'c', OPT_REQUIRED, handle_config},
     {"log-file",  'L', OPT_REQUIRED, handle_log_file},
     {"log-level",  'l', OPT_REQUIRED, handle_log_level},
+    {"log-async",  0, OPT_NONE, handle_log_async},
     {"port",  'p', OPT_REQUIRED, handle_port},
+    {"workers",  0, OPT_REQUIRED, handle_workers},
+    {"handoff",  0, OPT_REQUIRED, handle_handoff},
+    {"admin-port",  0, OPT_REQUIRED, handle_admin_port},
+    {"stall-threshold",  0, OPT_REQUIRED, handle_stall_threshold},
+    {"dns",  0 , OPT_NONE, handle_dns},
+    {"edns-size",  0, OPT_REQUIRED, handle_edns_size},
+    {"cache-size",  0, OPT_REQUIRED, handle_cache_size},
+    {"cache-snapshot",  0, OPT_REQUIRED, handle_cache_snapshot},
+    {"query-log",  0, OPT_REQUIRED, handle_query_log},
+    {"rrl-rate",  0, OPT_REQUIRED, handle_rrl_rate},
+    {"rrl-slip",  0, OPT_REQUIRED, handle_rrl_slip},
+    {"blocklist",  0, OPT_REQUIRED, handle_blocklist},
     {"proxy",  0 , OPT_NONE, handle_proxy},
     {"remote-ip",  0, OPT_REQUIRED, handle_remote_ip},
     {"remote-port",  0, OPT_REQUIRED, handle_remote_port},
     {"remote-use-udp",  0, OPT_NONE, handle_remote_use_udp},
+    {"upstream",  0, OPT_REQUIRED, handle_upstream},
     {0, 0, OPT_NONE, 0} // terminator
 };
 
@@ -122,8 +378,29 @@ int64_t parse_args(int argc, char *argv[], settings_t* settings) {
         exit(1);
     }
 
+    saved_argc = argc;
+    saved_argv = argv;
+
+    // values are split in place and kept, argv stays as it is for the next parse
+    settings->args = calloc(argc > 0 ? argc : 1, sizeof(char *));
+    if (settings->args == NULL) {
+        perror("parse_args.allocate_args");
+        return JK_ERROR;
+    }
+
+    for (int i = 0; i < argc; i++) {
+        settings->args[i] = strdup(argv[i]);
+        if (settings->args[i] == NULL) {
+            perror("parse_args.copy_arg");
+            return JK_ERROR;
+        }
+        settings->args_count = i + 1;
+    }
+
+    char **args = settings->args;
+
     for (int i = 1; i < argc; i++) {
-        char *arg = argv[i];
+        char *arg = args[i];
 
         if (strncmp(arg, "--", 2) == 0) {
             char *eq = strchr(arg, '=');
@@ -134,28 +411,12 @@ int64_t parse_args(int argc, char *argv[], settings_t* settings) {
                 *eq = '\0';
                 val = eq + 1;
             } else {
-                if (i + 1 < argc && argv[i+1][0] != '-') {
-                    val = argv[++i];
+                if (i + 1 < argc && args[i+1][0] != '-') {
+                    val = args[++i];
                 }
             }
 
-            int matched = 0;
-            for (option_t *opt = options; opt->long_name; opt++) {
-                if (strcmp(name, opt->long_name) == 0) {
-                    if (opt->arg_type == OPT_REQUIRED && !val) {
-                        fprintf(stderr, "--%s requires a value\n", opt->long_name);
-                        return JK_ERROR;
-                    }
-                    if (opt->handler(settings, val) == JK_ERROR) {
-                        fprintf(stderr, "parsing aborted\n");
-                        return JK_ERROR;
-                    }
-                    matched = 1;
-                    break;
-                }
-            }
-            if (!matched) {
-                fprintf(stderr, "Unknown option: --%s\n", name);
+            if (apply_option(settings, name, val) == JK_ERROR) {
                 return JK_ERROR;
             }
         } else {
@@ -167,6 +428,206 @@ int64_t parse_args(int argc, char *argv[], settings_t* settings) {
     return JK_OK;
 }
 
+settings_t* reload_settings(const settings_t* old) {
+    settings_t *s = malloc(sizeof(settings_t));
+    if (s == NULL) {
+        perror("reload_settings.allocate_settings");
+        return NULL;
+    }
+
+    init_settings(s);
+
+    if (parse_args(saved_argc, saved_argv, s) == JK_ERROR) {
+        release_settings(s);
+        return NULL;
+    }
+
+    keep_startup_settings(s, old);
+
+    if (validate_settings(s) == JK_ERROR) {
+        release_settings(s);
+        return NULL;
+    }
+
+    return s;
+}
+
+void release_settings(settings_t* s) {
+    if (s == NULL) {
+        return;
+    }
+
+    for (int i = 0; i < s->args_count; i++) {
+        free(s->args[i]);
+    }
+
+    free(s->args);
+    free(s->config_text);
+    free(s);
+}
+
+static int64_t apply_option(settings_t *s, const char *name, const char *val) {
+    for (option_t *opt = options; opt->long_name; opt++) {
+        if (strcmp(name, opt->long_name) != 0) {
+            continue;
+        }
+
+        if (opt->arg_type == OPT_REQUIRED && !val) {
+            fprintf(stderr, "--%s requires a value\n", opt->long_name);
+            return JK_ERROR;
+        }
+
+        if (opt->handler(s, val) == JK_ERROR) {
+            fprintf(stderr, "parsing aborted\n");
+            return JK_ERROR;
+        }
+
+        return JK_OK;
+    }
+
+    fprintf(stderr, "Unknown option: --%s\n", name);
+    return JK_ERROR;
+}
+
+// one option per line as on the command line without the dashes,
+// "name = value", "name value" or just "name", "#" starts a comment line
+static int64_t load_config(settings_t *s, const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror("load_config.fopen");
+        return JK_ERROR;
+    }
+
+    if (fseek(f, 0, SEEK_END) != 0) {
+        perror("load_config.fseek");
+        fclose(f);
+        return JK_ERROR;
+    }
+
+    long size = ftell(f);
+    rewind(f);
+
+    s->config_text = malloc(size > 0 ? (size_t)size + 1 : 1);
+    if (s->config_text == NULL) {
+        perror("load_config.allocate_text");
+        fclose(f);
+        return JK_ERROR;
+    }
+
+    size_t len = size > 0 ? fread(s->config_text, 1, (size_t)size, f) : 0;
+    s->config_text[len] = '\0';
+    fclose(f);
+
+    char *line = s->config_text;
+    int line_no = 0;
+
+    while (line != NULL) {
+        char *end = strchr(line, '\n');
+        if (end != NULL) {
+            *end = '\0';
+        }
+
+        line_no += 1;
+
+        char *name = trim(line);
+        line = end != NULL ? end + 1 : NULL;
+
+        if (*name == '\0' || *name == '#') {
+            continue;
+        }
+
+        char *val = name + strcspn(name, "= \t");
+        if (*val != '\0') {
+            *val = '\0';
+            val = trim(val + 1);
+            if (*val == '=') {
+                val = trim(val + 1);
+            }
+        }
+
+        if (strcmp(name, "config") == 0) {
+            fprintf(stderr, "%s:%d: config files do not nest\n", path, line_no);
+            return JK_ERROR;
+        }
+
+        if (apply_option(s, name, *val != '\0' ? val : NULL) == JK_ERROR) {
+            fprintf(stderr, "%s:%d: bad option\n", path, line_no);
+            return JK_ERROR;
+        }
+    }
+
+    return JK_OK;
+}
+
+// sockets, processes and handlers are set up once, these wait for a restart
+static void keep_startup_settings(settings_t *s, const settings_t *old) {
+    if (s->port != old->port) {
+        fprintf(stderr, "reload_settings: --port changes on restart\n");
+        s->port = old->port;
+    }
+
+    if (s->workers != old->workers) {
+        fprintf(stderr, "reload_settings: --workers changes on restart\n");
+        s->workers = old->workers;
+    }
+
+    if (s->dns_mode != old->dns_mode || s->proxy_mode != old->proxy_mode) {
+        fprintf(stderr, "reload_settings: --dns and --proxy change on restart\n");
+        s->dns_mode = old->dns_mode;
+        s->proxy_mode = old->proxy_mode;
+    }
+
+    // the strings belong to the old settings, only the warning is left
+    if (!same_str(s->log_file, old->log_file) || !same_str(s->log_level, old->log_level) ||
+        s->log_async != old->log_async) {
+        fprintf(stderr, "reload_settings: --log-file, --log-level and --log-async change on restart\n");
+    }
+
+    if (!same_str(s->cache_snapshot, old->cache_snapshot)) {
+        fprintf(stderr, "reload_settings: --cache-snapshot changes on restart\n");
+    }
+
+    if (!same_str(s->query_log, old->query_log)) {
+        fprintf(stderr, "reload_settings: --query-log changes on restart\n");
+    }
+
+    // udp buffers are sized for it once at startup
+    if (s->edns_size != old->edns_size) {
+        fprintf(stderr, "reload_settings: --edns-size changes on restart\n");
+        s->edns_size = old->edns_size;
+    }
+
+    if (s->admin_port != old->admin_port) {
+        fprintf(stderr, "reload_settings: --admin-port changes on restart\n");
+        s->admin_port = old->admin_port;
+    }
+
+    if (!same_str(s->handoff, old->handoff)) {
+        fprintf(stderr, "reload_settings: --handoff changes on restart\n");
+    }
+}
+
+static bool same_str(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return a == b;
+    }
+
+    return strcmp(a, b) == 0;
+}
+
+static char *trim(char *str) {
+    while (*str == ' ' || *str == '\t' || *str == '\r') {
+        str++;
+    }
+
+    size_t len = strlen(str);
+    while (len > 0 && (str[len - 1] == ' ' || str[len - 1] == '\t' || str[len - 1] == '\r')) {
+        str[--len] = '\0';
+    }
+
+    return str;
+}
+
 void dump_settings(FILE *f, settings_t *s) {
     // ToDo: changing bufferization mode in this manner seems to break things, look at it later
 
@@ -187,12 +648,29 @@ void dump_settings(FILE *f, settings_t *s) {
     }
 
     fprintf(f, "settings:\n");
+    fprintf(f, "%-*s : %s\n",  max_len, "config", s->config);
     fprintf(f, "%-*s : %s\n",  max_len, "log-file", s->log_file);
     fprintf(f, "%-*s : %s\n",  max_len, "log-level", s->log_level);
+    fprintf(f, "%-*s : %s\n",  max_len, "log-async", BOOL_TO_S(s->log_async));
+    fprintf(f, "%-*s : %u\n",  max_len, "workers", s->workers);
+    fprintf(f, "%-*s : %s\n",  max_len, "handoff", s->handoff);
+    fprintf(f, "%-*s : %u\n",  max_len, "admin-port", s->admin_port);
+    fprintf(f, "%-*s : %u\n",  max_len, "stall-threshold", s->stall_threshold);
+    fprintf(f, "%-*s : %s\n",  max_len, "dns-mode", BOOL_TO_S(s->dns_mode));
+    fprintf(f, "%-*s : %u\n",  max_len, "edns-size", s->edns_size);
+    fprintf(f, "%-*s : %u\n",  max_len, "cache-size", s->cache_size);
+    fprintf(f, "%-*s : %s\n",  max_len, "cache-snapshot", s->cache_snapshot);
+    fprintf(f, "%-*s : %s\n",  max_len, "query-log", s->query_log);
+    fprintf(f, "%-*s : %u\n",  max_len, "rrl-rate", s->rrl_rate);
+    fprintf(f, "%-*s : %u\n",  max_len, "rrl-slip", s->rrl_slip);
+    fprintf(f, "%-*s : %s\n",  max_len, "blocklist", s->blocklist);
     fprintf(f, "%-*s : %s\n",  max_len, "proxy-mode", BOOL_TO_S(s->proxy_mode));
     fprintf(f, "%-*s : %s\n",  max_len, "remote-ip", s->remote_ip);
     fprintf(f, "%-*s : %u\n",  max_len, "remote-port", s->remote_port);
     fprintf(f, "%-*s : %s\n",  max_len, "remote-use-udp", BOOL_TO_S(s->remote_use_udp));
+    for (uint32_t i = 0; i < s->upstreams_count; i++) {
+        fprintf(f, "%-*s : %s:%u\n",  max_len, "upstream", s->upstreams[i].ip, s->upstreams[i].port);
+    }
     fflush(f);
 
     // setvbuf(f, NULL, _IOLBF, 0);
@@ -209,15 +687,37 @@ int64_t validate_settings(settings_t *s) {
         return JK_ERROR;
     }
 
-    if (s->proxy_mode && s->remote_ip == NULL) {
+    // a proxy may get all of its servers from --upstream
+    bool has_upstreams = s->upstreams_count > 0;
+
+    if (s->proxy_mode && s->remote_ip == NULL && !has_upstreams) {
         fprintf(stderr, "remote_ip is not initialized\n");
         return JK_ERROR;
     }
 
-    if (s->proxy_mode && s->remote_port == 0) {
+    if (s->proxy_mode && s->remote_ip != NULL && s->remote_port == 0) {
         fprintf(stderr, "remote_port is not initialized\n");
         return JK_ERROR;
     }
 
+    // workers load these long after the supervisor accepted them, a typo must not get that far
+    if (s->remote_ip != NULL && !valid_ip(s->remote_ip)) {
+        fprintf(stderr, "remote_ip %s is not an ip address\n", s->remote_ip);
+        return JK_ERROR;
+    }
+
+    for (uint32_t i = 0; i < s->upstreams_count; i++) {
+        if (!valid_ip(s->upstreams[i].ip)) {
+            fprintf(stderr, "upstream %s is not an ip address\n", s->upstreams[i].ip);
+            return JK_ERROR;
+        }
+    }
+
     return JK_OK;
 }
+
+static bool valid_ip(const char *ip) {
+    struct in6_addr addr;
+
+    return inet_pton(AF_INET, ip, &addr) == 1 || inet_pton(AF_INET6, ip, &addr) == 1;
+}
@@ -5,16 +5,73 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+// fits a single unfragmented IPv6 datagram on common paths (DNS flag day 2020)
+#define DEFAULT_EDNS_SIZE 1232
+#define DEFAULT_CACHE_SIZE 10000
+#define MAX_CACHE_SIZE     (1 << 24)
+#define DEFAULT_RRL_SLIP   2
+#define MAX_RRL_RATE       100000
+#define MAX_UPSTREAMS      8
+#define MAX_WORKERS        64
+#define DEFAULT_STALL_THRESHOLD 10
+
+typedef struct {
+    const char* ip;
+    uint16_t    port;
+} settings_upstream_t;
+
 struct settings_s {
+    // options in this file apply where --config stands among the arguments
+    const char* config;
+
     const char* log_file;
     const char* log_level;
+    // workers hand their lines to a writer thread, lines that find its buffer full are dropped
+    bool        log_async;
 
     uint16_t port;
-    
+    // event loops, each a process pinned to a cpu of its own with its own cache shard
+    uint32_t workers;
+    // unix socket the bound sockets are passed over to the next binary,
+    // ".<worker>" is appended when there are several workers
+    const char* handoff;
+    // loopback port metrics are scraped from, 0 disables it
+    uint16_t admin_port;
+    // ms a single event or timer handler may run before it is logged, 0 disables it
+    uint32_t stall_threshold;
+
+    // frame and dispatch traffic as DNS messages instead of raw echo
+    bool        dns_mode;
+    // EDNS0 UDP payload size advertised upstream and accepted from clients
+    uint16_t    edns_size;
+    // answers kept from upstream, split evenly among the workers, 0 disables the cache
+    uint32_t    cache_size;
+    // file the cache is saved to now and then and warmed up from at startup
+    const char* cache_snapshot;
+    // binary ring of every query and its answer, mapped shared for other tools to follow,
+    // ".<worker>" is appended when there are several workers
+    const char* query_log;
+    // udp responses per second and client prefix, 0 disables rate limiting
+    uint32_t    rrl_rate;
+    // every n-th limited response is sent truncated instead of dropped, 0 drops all
+    uint32_t    rrl_slip;
+    // names answered with NXDOMAIN along with their subdomains, one per line
+    const char* blocklist;
+
     bool        proxy_mode;
     const char* remote_ip;
     uint16_t    remote_port;
     bool        remote_use_udp;
+
+    // servers besides remote_ip, dns queries go to the fastest one and
+    // proxy sessions to the less busy of two picked at random
+    settings_upstream_t upstreams[MAX_UPSTREAMS];
+    uint32_t    upstreams_count;
+
+    // the strings above point into these, owned by the settings
+    char**      args;
+    int         args_count;
+    char*       config_text;
 };
 
 extern settings_t *current_settings;
@@ -22,4 +79,12 @@ extern settings_t *current_settings;
 void init_settings(settings_t* s);
 int64_t validate_settings(settings_t* s);
 void dump_settings(FILE *f, settings_t* s);
+// parses a copy of argv, which is kept for reload_settings()
 int64_t parse_args(int argc, char *argv[], settings_t* settings);
+
+// the arguments and the config file parsed and validated again, what only
+// applies at startup is kept from old, NULL if they are rejected
+settings_t* reload_settings(const settings_t* old);
+
+// frees what the settings own along with s
+void release_settings(settings_t* s);
@@ -0,0 +1,172 @@
+#include "client_pool.h"
+#include "udp_socket.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/random.h"
+#include "core/time.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <sys/socket.h>
+
+// IPv4 sockets take the first half of the slots, IPv6 ones the second
+static udp_socket_t* pool[2 * CLIENT_USOCK_POOL_SIZE];
+static event_t pool_events[2 * CLIENT_USOCK_POOL_SIZE];
+
+static udp_socket_t* create_pool_socket(size_t slot, int af);
+static void handle_pool_socket_timeout(void* data);
+
+udp_socket_t* udp_client_pool_get(int af) {
+    size_t slot = jk_random_u32() % CLIENT_USOCK_POOL_SIZE;
+    if (af == AF_INET6) {
+        slot += CLIENT_USOCK_POOL_SIZE;
+    }
+
+    if (pool[slot] == NULL) {
+        pool[slot] = create_pool_socket(slot, af);
+    }
+
+    return pool[slot];
+}
+
+udp_socket_t* udp_client_socket_open(connection_t* owner) {
+    logger_t* logger = current_logger;
+
+    udp_socket_t* sock = make_session_udp_socket(owner->address.af);
+    if (sock == NULL) {
+        log_error("udp_client_socket_open: make_session_udp_socket failed");
+        return NULL;
+    }
+
+    if (sock->error) {
+        release_udp_socket(sock);
+        log_error("udp_client_socket_open: client socket setup failed");
+        return NULL;
+    }
+
+    event_t* ev = calloc(1, sizeof(event_t));
+    if (ev == NULL) {
+        log_perror("udp_client_socket_open.allocate_event");
+        release_udp_socket(sock);
+        return NULL;
+    }
+
+    init_event(ev);
+    ev->owner.tag = EV_OWNER_USOCK;
+    ev->owner.ptr = sock;
+    ev->write = false;
+    ev->handler = client_udp_ev_handler;
+
+    sock->ev = ev;
+    sock->owner = owner;
+
+    int64_t res = ev_backend->add_udp_sock(sock);
+    if (res != JK_OK) {
+        release_udp_socket(sock);
+        free(ev);
+        log_error("udp_client_socket_open: add_udp_sock failed");
+        return NULL;
+    }
+
+    return sock;
+}
+
+void udp_client_socket_close(udp_socket_t* sock) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(sock->owner != NULL, "socket has no owner");
+
+    event_t* ev = sock->ev;
+
+    ev_backend->del_udp_sock(sock);
+    release_udp_socket(sock);
+    free(ev);
+}
+
+static udp_socket_t* create_pool_socket(size_t slot, int af) {
+    logger_t* logger = current_logger;
+
+    udp_socket_t* sock = make_client_udp_socket(af);
+    if (sock == NULL) {
+        log_error("create_pool_socket: make_client_udp_socket failed");
+        return NULL;
+    }
+
+    if (sock->error) {
+        release_udp_socket(sock);
+        log_error("create_pool_socket: client socket setup failed");
+        return NULL;
+    }
+
+    event_t* ev = &pool_events[slot];
+    init_event(ev);
+    ev->owner.tag = EV_OWNER_USOCK;
+    ev->owner.ptr = sock;
+    ev->write = false;
+    ev->handler = client_udp_ev_handler;
+
+    sock->ev = ev;
+
+    int64_t res = ev_backend->add_udp_sock(sock);
+    if (res != JK_OK) {
+        release_udp_socket(sock);
+        log_error("create_pool_socket: add_udp_sock failed");
+        return NULL;
+    }
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, CLIENT_USOCK_TIMEOUT);
+    timer.handler = handle_pool_socket_timeout;
+    timer.data = (void*)slot;
+
+    jk_timer_t* timer_p = ev_backend->add_timer(timer);
+    if (timer_p == NULL) {
+        ev_backend->del_udp_sock(sock);
+        release_udp_socket(sock);
+        log_error("create_pool_socket: add_timer failed");
+        return NULL;
+    }
+
+    sock->timer = timer_p;
+
+    return sock;
+}
+
+static void handle_pool_socket_timeout(void* data) {
+    logger_t* logger = current_logger;
+
+    size_t slot = (size_t)data;
+    udp_socket_t* sock = pool[slot];
+
+    CHECK_INVARIANT(sock != NULL, "pool socket is NULL");
+
+    // the firing timer is popped right after this handler returns
+    sock->timer = NULL;
+
+    if (sock->inflight > 0) {
+        jk_timer_t timer;
+        jk_timer_start(&timer, CLIENT_USOCK_TIMEOUT);
+        timer.handler = handle_pool_socket_timeout;
+        timer.data = data;
+
+        sock->timer = ev_backend->add_timer(timer);
+        if (sock->timer != NULL) {
+            return;
+        }
+
+        log_warn("handle_pool_socket_timeout: failed to rearm timer, keeping socket");
+        return;
+    }
+
+    log_trace("handle_pool_socket_timeout: releasing idle client socket %zu", slot);
+
+    ev_backend->del_udp_sock(sock);
+    release_udp_socket(sock);
+    pool[slot] = NULL;
+}
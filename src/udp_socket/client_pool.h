@@ -0,0 +1,14 @@
+#pragma once
+
+#include "core/decl.h"
+#include "core/udp_socket.h"
+
+#define CLIENT_USOCK_POOL_SIZE 16
+
+// returns a client socket picked at random from the pool of family af,
+// sockets are bound to random ports and created on first use
+udp_socket_t* udp_client_pool_get(int af);
+
+// a client socket private to owner, released along with the connection
+udp_socket_t* udp_client_socket_open(connection_t* owner);
+void udp_client_socket_close(udp_socket_t* sock);
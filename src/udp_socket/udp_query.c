@@ -0,0 +1,261 @@
+#include "udp_query.h"
+#include "core/connection.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/htt.h"
+#include "core/random.h"
+#include "core/time.h"
+#include "core/udp_socket.h"
+#include "dns/message.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define UDP_QUERY_HT_CAPACITY 1024
+
+static udp_query_ht_t* queries = NULL;
+
+static udp_query_t* expiry_head = NULL;
+static udp_query_t* expiry_tail = NULL;
+
+static jk_timer_t* sweep_timer = NULL;
+
+static int64_t fill_key(
+    udp_query_key_t* key,
+    udp_socket_t* sock,
+    address_t* upstream,
+    const uint8_t* msg,
+    size_t len);
+static void unlink_query(udp_query_t* q);
+static void arm_sweep_timer();
+static void sweep_queries(void* data);
+
+// JK_ERROR for anything that is not a DNS message
+static int64_t fill_key(
+    udp_query_key_t* key,
+    udp_socket_t* sock,
+    address_t* upstream,
+    const uint8_t* msg,
+    size_t len) {
+    memset(key, 0, sizeof(*key));
+    key->sock = sock;
+    memcpy(&key->upstream, upstream, sizeof(*upstream));
+
+    dns_question_t question;
+    if (dns_parse_question(msg, len, &question) != JK_OK) {
+        return JK_ERROR;
+    }
+
+    key->id = dns_get_id(msg);
+    key->qhash = dns_question_hash(&question);
+
+    return JK_OK;
+}
+
+udp_query_t* udp_query_track(
+    udp_socket_t* sock,
+    address_t* upstream,
+    uint8_t* msg,
+    size_t len,
+    udp_query_handler_pt handler,
+    void* data) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(sock != NULL, "sock is NULL");
+    CHECK_INVARIANT(sock->client, "sock is not a client socket");
+    CHECK_INVARIANT(upstream != NULL, "upstream is NULL");
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+
+    if (queries == NULL) {
+        queries = udp_query_ht_create(UDP_QUERY_HT_CAPACITY);
+        if (queries == NULL) {
+            log_error("udp_query_track.udp_query_ht_create");
+            return NULL;
+        }
+    }
+
+    udp_query_t* q = calloc(1, sizeof(udp_query_t));
+    if (q == NULL) {
+        log_perror("udp_query_track.allocate_udp_query_t");
+        return NULL;
+    }
+
+    if (fill_key(&q->key, sock, upstream, msg, len) != JK_OK) {
+        log_warn("udp_query_track: not a dns message");
+        free(q);
+        return NULL;
+    }
+
+    q->orig_id = q->key.id;
+
+    bool found = false;
+    for (int attempt = 0; attempt < UDP_QUERY_ID_ATTEMPTS; attempt++) {
+        q->key.id = jk_random_u16();
+        if (udp_query_ht_lookup(queries, &q->key) == NULL) {
+            found = true;
+            break;
+        }
+    }
+
+    if (!found) {
+        log_warn("udp_query_track: failed to allocate unique query id");
+        free(q);
+        return NULL;
+    }
+
+    dns_set_id(msg, q->key.id);
+
+    if (udp_query_ht_insert(queries, &q->key, q) != JK_OK) {
+        log_error("udp_query_track.udp_query_ht_insert");
+        dns_set_id(msg, q->orig_id);
+        free(q);
+        return NULL;
+    }
+
+    q->sent_at = jk_now();
+    q->handler = handler;
+    q->data = data;
+
+    q->prev = expiry_tail;
+    q->next = NULL;
+    if (expiry_tail != NULL) {
+        expiry_tail->next = q;
+    } else {
+        expiry_head = q;
+    }
+    expiry_tail = q;
+
+    sock->inflight += 1;
+
+    arm_sweep_timer();
+
+    return q;
+}
+
+void udp_query_cancel(udp_query_t* q, uint8_t* msg) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(q != NULL, "q is NULL");
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+
+    dns_set_id(msg, q->orig_id);
+
+    udp_query_release(q);
+}
+
+int udp_query_deliver(udp_socket_t* sock, address_t* from, uint8_t* msg, size_t len) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(sock != NULL, "sock is NULL");
+    CHECK_INVARIANT(from != NULL, "from is NULL");
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+
+    if (queries == NULL) {
+        return JK_NOT_FOUND;
+    }
+
+    udp_query_key_t key;
+    if (fill_key(&key, sock, from, msg, len) != JK_OK) {
+        return JK_NOT_FOUND;
+    }
+
+    udp_query_t* q = udp_query_ht_lookup(queries, &key);
+    if (q == NULL) {
+        return JK_NOT_FOUND;
+    }
+
+    dns_set_id(msg, q->orig_id);
+
+    udp_query_handler_pt handler = q->handler;
+    void* data = q->data;
+
+    udp_query_release(q);
+
+    if (handler != NULL) {
+        handler(data, msg, len);
+    }
+
+    return JK_OK;
+}
+
+static void unlink_query(udp_query_t* q) {
+    if (q->prev != NULL) {
+        q->prev->next = q->next;
+    } else {
+        expiry_head = q->next;
+    }
+
+    if (q->next != NULL) {
+        q->next->prev = q->prev;
+    } else {
+        expiry_tail = q->prev;
+    }
+}
+
+void udp_query_release(udp_query_t* q) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(q != NULL, "q is NULL");
+    CHECK_INVARIANT(queries != NULL, "queries ht is NULL");
+
+    int res = udp_query_ht_delete(queries, &q->key);
+    CHECK_INVARIANT(res == JK_OK, "failed to remove query from queries ht");
+
+    unlink_query(q);
+
+    udp_socket_t* sock = q->key.sock;
+    CHECK_INVARIANT(sock->inflight > 0, "sock inflight underflow");
+    sock->inflight -= 1;
+
+    free(q);
+}
+
+static void arm_sweep_timer() {
+    if (sweep_timer != NULL) {
+        return;
+    }
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, UDP_QUERY_SWEEP_INTERVAL);
+    timer.handler = sweep_queries;
+    timer.data = NULL;
+
+    // on failure the next tracked query retries
+    sweep_timer = ev_backend->add_timer(timer);
+}
+
+static void sweep_queries(void* data) {
+    logger_t* logger = current_logger;
+
+    (void)data; // unused
+
+    // the firing timer is popped right after this handler returns
+    sweep_timer = NULL;
+
+    int64_t now = jk_now();
+
+    while (expiry_head != NULL && expiry_head->sent_at + UDP_QUERY_TIMEOUT <= now) {
+        udp_query_t* q = expiry_head;
+
+        udp_query_handler_pt handler = q->handler;
+        void* handler_data = q->data;
+
+        log_trace("sweep_queries: query %u timed out", q->key.id);
+
+        udp_query_release(q);
+
+        if (handler != NULL) {
+            handler(handler_data, NULL, 0);
+        }
+    }
+
+    if (expiry_head != NULL) {
+        arm_sweep_timer();
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "core/decl.h"
+#include "core/htt.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define UDP_QUERY_TIMEOUT 5000
+#define UDP_QUERY_SWEEP_INTERVAL 1000
+#define UDP_QUERY_ID_ATTEMPTS 8
+
+// msg is NULL when the query timed out, the query is already released at this point
+typedef void (*udp_query_handler_pt)(void* data, uint8_t* msg, size_t len);
+
+// Outstanding upstream query. Every query sent through a pooled socket gets a
+// fresh random ID, replies are matched by (socket, upstream, ID, question hash)
+// and get the original ID restored before delivery.
+struct udp_query_s {
+    udp_query_key_t key;
+    uint16_t orig_id;
+    int64_t sent_at;
+
+    udp_query_handler_pt handler;
+    void* data;
+
+    // expiry list in send order
+    udp_query_t* prev;
+    udp_query_t* next;
+};
+
+// rewrites the ID of msg in place and registers the query,
+// returns NULL for a message that is not DNS or if no unique key could be allocated
+udp_query_t* udp_query_track(
+    udp_socket_t* sock,
+    address_t* upstream,
+    uint8_t* msg,
+    size_t len,
+    udp_query_handler_pt handler,
+    void* data);
+
+// undoes udp_query_track for a message that was not sent
+void udp_query_cancel(udp_query_t* q, uint8_t* msg);
+
+// finds the query a reply belongs to, restores the original ID in msg,
+// releases the query and calls its handler, returns JK_NOT_FOUND for unsolicited replies
+int udp_query_deliver(udp_socket_t* sock, address_t* from, uint8_t* msg, size_t len);
+
+void udp_query_release(udp_query_t* q);
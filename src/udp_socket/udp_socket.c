@@ -9,11 +9,20 @@
 #include "core/event.h"
 #include "core/net.h"
 #include "connection/connection.h"
+#include "udp_query.h"
+#include "dns/dns_handler.h"
+#include "settings/settings.h"
+#include <stdbool.h>
 #include <stdint.h>
+#include <string.h>
+
+#include <netinet/in.h>
 
 static void handle_reads(udp_socket_t* sock);
 static void handle_writes(udp_socket_t* sock);
 static void client_handle_reads(udp_socket_t* sock);
+static void deliver_to_owner(udp_socket_t* sock, address_t* from);
+static bool same_peer(const address_t* a, const address_t* b);
 
 void udp_ev_handler(event_t* ev) {
     logger_t* logger = current_logger;
@@ -22,8 +31,9 @@ void udp_ev_handler(event_t* ev) {
     udp_socket_t* sock = ev->owner.ptr;
 
     CHECK_INVARIANT(sock->readable || sock->writable, "udp socket is neither writable or readable");
-    
-    if (sock->readable) {
+
+    // the queries are read by the process the socket was handed off to
+    if (sock->readable && !sock->draining) {
         handle_reads(sock);
     }
 
@@ -51,6 +61,7 @@ void client_udp_ev_handler(event_t* ev) {
 
 static void handle_reads(udp_socket_t* sock) {
     logger_t* logger = current_logger;
+    settings_t* s = current_settings;
 
     address_t address;
     buffer_t *buf = &sock->last_read_buf;
@@ -76,7 +87,12 @@ static void handle_reads(udp_socket_t* sock) {
         }
 
         buf->taken = read;
-        buf->capacity -= read;
+
+        // every datagram is a self-contained query, no per-client state is kept
+        if (s->dns_mode) {
+            handle_dns_udp(sock, buf->data, read, &address);
+            continue;
+        }
 
         connection_t* conn = connection_ht_lookup(ht, &address);
         if (conn == NULL) {
@@ -123,7 +139,6 @@ static void client_handle_reads(udp_socket_t* sock) {
 
     address_t address;
     buffer_t *buf = &sock->last_read_buf;
-    connection_ht_t* ht = sock->connections;
 
     for (;;) {
         ssize_t read = udp_recv(
@@ -145,22 +160,49 @@ static void client_handle_reads(udp_socket_t* sock) {
         }
 
         buf->taken = read;
-        buf->capacity -= read;
 
-        connection_t* conn = connection_ht_lookup(ht, &address);
-        if (conn == NULL) {
-            log_warn("handle_reads: discarding read from the unknown host");
+        if (sock->owner != NULL) {
+            deliver_to_owner(sock, &address);
             continue;
         }
-        
-        if (conn->read->enabled) {
-            conn->read->handler(conn->read);
-        } else {
-            log_warn("handle_reads: discarding data for unarmed event");
+
+        int res = udp_query_deliver(sock, &address, buf->data, read);
+        if (res == JK_NOT_FOUND) {
+            log_warn("client_handle_reads: discarding unsolicited reply");
         }
     }
 }
 
+static void deliver_to_owner(udp_socket_t* sock, address_t* from) {
+    logger_t* logger = current_logger;
+
+    connection_t* conn = sock->owner;
+
+    if (!same_peer(&conn->address, from)) {
+        log_warn("client_handle_reads: discarding datagram from another peer");
+        return;
+    }
+
+    if (!conn->read->enabled) {
+        log_warn("client_handle_reads: discarding datagram for unarmed event");
+        return;
+    }
+
+    conn->read->handler(conn->read);
+}
+
+static bool same_peer(const address_t* a, const address_t* b) {
+    if (a->af != b->af || a->src_port != b->src_port) {
+        return false;
+    }
+
+    if (a->af == AF_INET) {
+        return memcmp(&a->src.src_v4, &b->src.src_v4, sizeof(struct in_addr)) == 0;
+    }
+
+    return memcmp(&a->src.src_v6, &b->src.src_v6, sizeof(struct in6_addr)) == 0;
+}
+
 int64_t udp_add_event(event_t* ev, connection_t* conn) {
     logger_t* logger = current_logger;
 
@@ -227,6 +269,11 @@ int64_t udp_del_connection(connection_t *conn) {
     
     res = udp_wq_remove(sock->wq, conn->write);
     (void)res;
+
+    // the socket goes away with the connection, reads are off from now on
+    if (sock->owner != NULL) {
+        return JK_OK;
+    }
     
     res = connection_ht_delete(sock->connections, &conn->address);
     CHECK_INVARIANT(res == JK_OK, "failed to remove connection from connections ht");
@@ -0,0 +1,272 @@
+#include "upgrade.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/handoff.h"
+#include "core/listener.h"
+#include "core/process.h"
+#include "core/time.h"
+#include "core/udp_socket.h"
+#include "dns/cache_snapshot.h"
+#include "dns/dispatch.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define HANDOFF_PATH_MAX 4096
+
+static char handoff_path[HANDOFF_PATH_MAX];
+
+static listener_t* handoff_listener = NULL;
+static event_t handoff_ev;
+
+// the sockets a new process would get
+static listener_t* served_listener = NULL;
+static udp_socket_t* served_usock = NULL;
+
+// the handoff connection, open until the new process is serving
+static int64_t taken_conn = -1;
+static int64_t handed_conn = -1;
+
+static int64_t drain_started = 0;
+static jk_timer_t* drain_timer = NULL;
+
+static int64_t fill_handoff_path();
+static void handle_handoff(event_t* ev);
+static void arm_ready_timer();
+static void handle_ready_timer(void* data);
+static void start_draining();
+static void arm_drain_timer();
+static void handle_drain_timer(void* data);
+
+int64_t upgrade_take_over(listener_t** l, udp_socket_t** usock) {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    *l = NULL;
+    *usock = NULL;
+
+    if (s->handoff == NULL) {
+        return JK_OK;
+    }
+
+    if (fill_handoff_path() != JK_OK) {
+        return JK_ERROR;
+    }
+
+    int64_t fds[2];
+    int64_t res = receive_handoff(handoff_path, fds, 2);
+
+    if (res == JK_NOT_FOUND) {
+        log_info("upgrade: nothing to take over at %s", handoff_path);
+        return JK_OK;
+    }
+
+    if (res < 0) {
+        log_error("upgrade: failed to take over the sockets at %s", handoff_path);
+        return JK_ERROR;
+    }
+
+    taken_conn = res;
+
+    *l = make_inherited_listener(fds[0]);
+    *usock = make_inherited_udp_socket(fds[1]);
+
+    if (*l == NULL || (*l)->error || *usock == NULL || (*usock)->error) {
+        log_error("upgrade: failed to adopt the sockets taken over");
+        return JK_ERROR;
+    }
+
+    log_info("upgrade: took over the sockets at %s", handoff_path);
+
+    return JK_OK;
+}
+
+int64_t upgrade_init(listener_t* l, udp_socket_t* usock) {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    if (s->handoff == NULL) {
+        return JK_OK;
+    }
+
+    if (fill_handoff_path() != JK_OK) {
+        return JK_ERROR;
+    }
+
+    handoff_listener = make_handoff_listener(handoff_path);
+    if (handoff_listener == NULL || handoff_listener->error) {
+        log_error("upgrade: failed to listen on %s", handoff_path);
+        release_listener(handoff_listener);
+        handoff_listener = NULL;
+        return JK_ERROR;
+    }
+
+    init_event(&handoff_ev);
+    handoff_ev.owner.ptr = handoff_listener;
+    handoff_ev.owner.tag = EV_OWNER_LISTENER;
+    handoff_ev.write = false;
+    handoff_ev.handler = handle_handoff;
+    handoff_listener->accept = &handoff_ev;
+
+    if (ev_backend->add_event(&handoff_ev) == JK_ERROR) {
+        log_error("upgrade: failed to add handoff event");
+        release_listener(handoff_listener);
+        handoff_listener = NULL;
+        return JK_ERROR;
+    }
+
+    served_listener = l;
+    served_usock = usock;
+
+    // the previous process serves the sockets as well until it hears this
+    if (taken_conn >= 0) {
+        if (handoff_ready(taken_conn) != JK_OK) {
+            log_warn("upgrade: failed to tell the previous process, it drains on its own");
+        }
+        taken_conn = -1;
+    }
+
+    return JK_OK;
+}
+
+// every worker hands off its own sockets to the worker of the same number
+static int64_t fill_handoff_path() {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    int len = s->workers > 1
+        ? snprintf(handoff_path, sizeof(handoff_path), "%s.%u", s->handoff, current_worker)
+        : snprintf(handoff_path, sizeof(handoff_path), "%s", s->handoff);
+
+    if (len < 0 || (size_t)len >= sizeof(handoff_path)) {
+        log_error("upgrade: handoff path is too long");
+        return JK_ERROR;
+    }
+
+    return JK_OK;
+}
+
+static void handle_handoff(event_t* ev) {
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    listener_t* hl = ev->owner.ptr;
+
+    int64_t conn_fd = accept_handoff(hl);
+    if (conn_fd == JK_WOULD_BLOCK || conn_fd == JK_ERROR) {
+        return;
+    }
+
+    // the new process blocks until it has the sockets, it loads the snapshot next
+    if (s->dns_mode) {
+        dns_cache_snapshot_save();
+    }
+
+    int64_t fds[2] = {served_listener->fd, served_usock->fd};
+
+    if (send_handoff(conn_fd, fds, 2) != JK_OK) {
+        log_error("upgrade: failed to hand off the sockets, still serving");
+        return;
+    }
+
+    log_info("upgrade: sockets handed off, serving until the new process is ready");
+
+    ev_backend->del_event(&handoff_ev);
+    handed_conn = conn_fd;
+
+    arm_ready_timer();
+}
+
+static void arm_ready_timer() {
+    logger_t* logger = current_logger;
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, UPGRADE_DRAIN_POLL);
+    timer.handler = handle_ready_timer;
+    timer.data = NULL;
+
+    // without the timer nobody would ever look at the connection again,
+    // it is closed on exit
+    if (ev_backend->add_timer(timer) == NULL) {
+        log_error("upgrade: failed to add ready timer, draining now");
+        return start_draining();
+    }
+}
+
+static void handle_ready_timer(void* data) {
+    (void)data; // unused
+    logger_t* logger = current_logger;
+
+    int64_t res = poll_handoff_ready(handed_conn);
+    if (res == JK_WOULD_BLOCK) {
+        return arm_ready_timer();
+    }
+
+    handed_conn = -1;
+
+    if (res != JK_OK) {
+        log_error("upgrade: the new process went away before serving, still serving");
+        ev_backend->add_event(&handoff_ev);
+        return;
+    }
+
+    log_info("upgrade: the new process is serving, draining");
+
+    start_draining();
+}
+
+// the port stays bound through the copies the new process holds
+static void start_draining() {
+    release_listener(handoff_listener);
+    handoff_listener = NULL;
+
+    ev_backend->del_event(served_listener->accept);
+    release_listener(served_listener);
+    served_listener = NULL;
+
+    // replies to queries read so far still go out through it
+    served_usock->draining = true;
+
+    drain_started = jk_now();
+    arm_drain_timer();
+}
+
+static void arm_drain_timer() {
+    jk_timer_t timer;
+    jk_timer_start(&timer, UPGRADE_DRAIN_POLL);
+    timer.handler = handle_drain_timer;
+    timer.data = NULL;
+
+    drain_timer = ev_backend->add_timer(timer);
+}
+
+static void handle_drain_timer(void* data) {
+    (void)data; // unused
+    logger_t* logger = current_logger;
+    settings_t* s = current_settings;
+
+    // the firing timer is popped right after this handler returns
+    drain_timer = NULL;
+
+    // echo connections are not counted, they get the whole drain period
+    size_t left = s->dns_mode ? dns_request_count() : 1;
+    bool overdue = jk_now() - drain_started >= UPGRADE_DRAIN_MAX;
+
+    if (left > 0 && !overdue) {
+        return arm_drain_timer();
+    }
+
+    if (s->dns_mode && left > 0) {
+        log_warn("upgrade: exiting with %zu requests unanswered", left);
+    }
+
+    log_info("upgrade: drained, exiting");
+    exit(0);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "core/decl.h"
+
+#include <stdint.h>
+
+#define UPGRADE_DRAIN_POLL 100   // ms between checks for readiness and requests in flight
+#define UPGRADE_DRAIN_MAX  10000 // ms the old process keeps answering at most
+
+// Binary upgrade without a moment the port is unbound. A process started
+// with the --handoff path of a running one asks it for its tcp listener and
+// udp socket (core/handoff.h) instead of binding the port. The running
+// process saves its cache snapshot first, so the new one warms up from it.
+// Both serve the sockets until the new process has them registered and says
+// so, then the old one stops accepting and reading and exits once its
+// requests are answered. The new process listens on the path in turn, ready
+// for the next upgrade.
+
+// the sockets of the process listening on --handoff, both are left NULL
+// if there is none and the port is to be bound here
+int64_t upgrade_take_over(listener_t** l, udp_socket_t** usock);
+
+// listens on --handoff if set, l and usock are handed to whoever connects
+int64_t upgrade_init(listener_t* l, udp_socket_t* usock);
@@ -0,0 +1,165 @@
+#include "probe.h"
+#include "upstream.h"
+#include "connection/connection.h"
+#include "core/connection.h"
+#include "core/decl.h"
+#include "core/epoch.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/time.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+typedef struct {
+    upstream_t* u;
+    // the set u belongs to stays around until the probe is done
+    uint64_t epoch;
+
+    connection_t* conn;
+    jk_timer_t* timer;
+    int64_t started_at;
+} upstream_probe_t;
+
+static void schedule_probe(upstream_probe_t* p, int64_t delay);
+static void handle_probe_timer(void* data);
+static void handle_probe(event_t* ev);
+static void close_probe_conn(upstream_probe_t* p);
+static void probe_failed(upstream_probe_t* p);
+static void finish_probe(upstream_probe_t* p);
+
+void upstream_probe(upstream_t* u) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(u != NULL, "u is NULL");
+
+    if (u->probing) {
+        return;
+    }
+
+    upstream_probe_t* p = calloc(1, sizeof(upstream_probe_t));
+    if (p == NULL) {
+        // the upstream is retried by sessions once retry_at passes
+        log_perror("upstream_probe.allocate_probe");
+        return;
+    }
+
+    p->u = u;
+    p->epoch = jk_epoch_pin();
+
+    u->probing = true;
+
+    schedule_probe(p, UPSTREAM_RETRY_INTERVAL);
+}
+
+// a probe that cannot wait is given up, a later failure starts another one
+static void schedule_probe(upstream_probe_t* p, int64_t delay) {
+    logger_t* logger = current_logger;
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, delay);
+    timer.handler = handle_probe_timer;
+    timer.data = p;
+
+    p->timer = ev_backend->add_timer(timer);
+    if (p->timer == NULL) {
+        log_error("upstream_probe: failed to add probe timer, giving up the probe");
+        return finish_probe(p);
+    }
+}
+
+static void handle_probe_timer(void* data) {
+    logger_t* logger = current_logger;
+
+    upstream_probe_t* p = data;
+
+    // the firing timer is popped right after this handler returns
+    p->timer = NULL;
+
+    // a connect that takes this long counts as a failure
+    if (p->conn != NULL) {
+        return probe_failed(p);
+    }
+
+    // the upstream was reloaded away or got a probe of its own in the new set
+    if (!upstream_is_current(p->u)) {
+        return finish_probe(p);
+    }
+
+    p->conn = make_client_connection_to(
+        CONN_TYPE_TCP,
+        &p->u->addr,
+        handle_probe,
+        handle_probe);
+    if (p->conn == NULL) {
+        log_error("upstream_probe: failed to connect to upstream");
+        return probe_failed(p);
+    }
+
+    p->conn->data = p;
+    p->started_at = jk_now();
+
+    // writable once the connect went through
+    ev_backend->enable_event(p->conn->write);
+
+    schedule_probe(p, UPSTREAM_PROBE_TIMEOUT);
+}
+
+static void handle_probe(event_t* ev) {
+    logger_t* logger = current_logger;
+
+    connection_t* conn = ev->owner.ptr;
+    upstream_probe_t* p = conn->data;
+
+    if (p->timer != NULL) {
+        p->timer->enabled = false;
+        p->timer = NULL;
+    }
+
+    if (conn->error) {
+        log_perror("upstream_probe");
+        return probe_failed(p);
+    }
+
+    upstream_report_rtt(p->u, (jk_now() - p->started_at) * 1000);
+    log_info("upstream_probe: upstream is back");
+
+    finish_probe(p);
+}
+
+static void close_probe_conn(upstream_probe_t* p) {
+    if (p->conn == NULL) {
+        return;
+    }
+
+    ev_backend->del_conn(p->conn);
+    close_connection(p->conn);
+    p->conn = NULL;
+}
+
+static void probe_failed(upstream_probe_t* p) {
+    close_probe_conn(p);
+
+    if (!upstream_is_current(p->u)) {
+        return finish_probe(p);
+    }
+
+    upstream_report_failure(p->u);
+
+    schedule_probe(p, UPSTREAM_RETRY_INTERVAL);
+}
+
+static void finish_probe(upstream_probe_t* p) {
+    close_probe_conn(p);
+
+    p->u->probing = false;
+
+    uint64_t epoch = p->epoch;
+    free(p);
+
+    jk_epoch_unpin(epoch);
+}
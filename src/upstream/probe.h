@@ -0,0 +1,10 @@
+#pragma once
+
+#include "core/decl.h"
+
+#define UPSTREAM_PROBE_TIMEOUT 1000 // ms a probe connect may take
+
+// Tries a tcp connect to an ejected upstream every UPSTREAM_RETRY_INTERVAL
+// and keeps it out of the picks until one gets through. Sessions are not
+// sent to a server just to find out whether it is back.
+void upstream_probe(upstream_t* u);
@@ -0,0 +1,672 @@
+#include "tcp_pool.h"
+#include "connection/connection.h"
+#include "core/buffer.h"
+#include "core/connection.h"
+#include "core/decl.h"
+#include "core/errors.h"
+#include "core/ev_backend.h"
+#include "core/event.h"
+#include "core/htt.h"
+#include "core/net.h"
+#include "core/random.h"
+#include "core/time.h"
+#include "dns/message.h"
+#include "logger/logger.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TCP_POOL_HT_CAPACITY 16
+
+static tcp_pool_ht_t* pools = NULL;
+static tcp_pool_t* pools_head = NULL;
+
+static jk_timer_t* sweep_timer = NULL;
+
+static tcp_pool_t* get_pool(address_t* upstream);
+
+static void wait_push_back(tcp_pool_t* pool, tcp_pool_query_t* q);
+static void wait_push_front(tcp_pool_t* pool, tcp_pool_query_t* q);
+static void wait_remove(tcp_pool_t* pool, tcp_pool_query_t* q);
+static void sent_remove(tcp_pool_conn_t* pc, tcp_pool_query_t* q);
+
+static void pool_schedule(tcp_pool_t* pool);
+static tcp_pool_conn_t* pool_open_conn(tcp_pool_t* pool);
+static void pool_close_conn(tcp_pool_conn_t* pc, bool requeue);
+
+static bool pool_conn_has_room(tcp_pool_conn_t* pc, tcp_pool_query_t* q);
+static void pool_conn_assign(tcp_pool_conn_t* pc, tcp_pool_query_t* q);
+static tcp_pool_query_t* pool_conn_find(tcp_pool_conn_t* pc, uint16_t id);
+static void pool_conn_forget(tcp_pool_conn_t* pc, tcp_pool_query_t* q);
+static void pool_conn_update(tcp_pool_conn_t* pc);
+static int64_t pool_conn_process(tcp_pool_conn_t* pc);
+
+static void handle_pool_conn(event_t* ev);
+static int64_t pool_conn_read(tcp_pool_conn_t* pc);
+static int64_t pool_conn_write(tcp_pool_conn_t* pc);
+
+static void complete_query(tcp_pool_query_t* q, uint8_t* msg, size_t len);
+
+static void arm_sweep_timer();
+static void sweep_pools(void* data);
+
+static tcp_pool_t* get_pool(address_t* upstream) {
+    logger_t* logger = current_logger;
+
+    if (pools == NULL) {
+        pools = tcp_pool_ht_create(TCP_POOL_HT_CAPACITY);
+        if (pools == NULL) {
+            log_error("tcp_pool.tcp_pool_ht_create");
+            return NULL;
+        }
+    }
+
+    tcp_pool_t* pool = tcp_pool_ht_lookup(pools, upstream);
+    if (pool != NULL) {
+        return pool;
+    }
+
+    pool = calloc(1, sizeof(tcp_pool_t));
+    if (pool == NULL) {
+        log_perror("tcp_pool.allocate_pool");
+        return NULL;
+    }
+
+    memcpy(&pool->upstream, upstream, sizeof(*upstream));
+
+    if (tcp_pool_ht_insert(pools, upstream, pool) != JK_OK) {
+        log_error("tcp_pool.tcp_pool_ht_insert");
+        free(pool);
+        return NULL;
+    }
+
+    pool->next = pools_head;
+    pools_head = pool;
+
+    return pool;
+}
+
+tcp_pool_query_t* tcp_pool_send(
+    address_t* upstream,
+    const uint8_t* msg,
+    size_t len,
+    tcp_pool_handler_pt handler,
+    void* data) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(upstream != NULL, "upstream is NULL");
+    CHECK_INVARIANT(msg != NULL, "msg is NULL");
+
+    if (len < DNS_HEADER_SIZE || len + 2 > TCP_POOL_BUFFER_SIZE) {
+        log_warn("tcp_pool_send: bad message length %zu", len);
+        return NULL;
+    }
+
+    tcp_pool_t* pool = get_pool(upstream);
+    if (pool == NULL) {
+        return NULL;
+    }
+
+    // fail synchronously if the upstream is unreachable right away,
+    // so the handler is never called before this function returns
+    if (pool->nconns == 0 && pool_open_conn(pool) == NULL) {
+        return NULL;
+    }
+
+    tcp_pool_query_t* q = calloc(1, sizeof(tcp_pool_query_t));
+    if (q == NULL) {
+        log_perror("tcp_pool_send.allocate_query");
+        return NULL;
+    }
+
+    q->msg = malloc(len);
+    if (q->msg == NULL) {
+        log_perror("tcp_pool_send.allocate_msg");
+        free(q);
+        return NULL;
+    }
+
+    memcpy(q->msg, msg, len);
+    q->len = len;
+    q->orig_id = dns_get_id(msg);
+    q->pool = pool;
+    q->created_at = jk_now();
+    q->handler = handler;
+    q->data = data;
+
+    wait_push_back(pool, q);
+    arm_sweep_timer();
+
+    pool_schedule(pool);
+
+    return q;
+}
+
+void tcp_pool_cancel(tcp_pool_query_t* q) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(q != NULL, "q is NULL");
+
+    if (q->pconn == NULL) {
+        wait_remove(q->pool, q);
+        free(q->msg);
+        free(q);
+        return;
+    }
+
+    // the slot stays taken until the response or the timeout,
+    // otherwise a late response could be matched to a new query
+    q->handler = NULL;
+    q->data = NULL;
+}
+
+static void wait_push_back(tcp_pool_t* pool, tcp_pool_query_t* q) {
+    q->prev = pool->wait_tail;
+    q->next = NULL;
+    if (pool->wait_tail != NULL) {
+        pool->wait_tail->next = q;
+    } else {
+        pool->wait_head = q;
+    }
+    pool->wait_tail = q;
+}
+
+static void wait_push_front(tcp_pool_t* pool, tcp_pool_query_t* q) {
+    q->prev = NULL;
+    q->next = pool->wait_head;
+    if (pool->wait_head != NULL) {
+        pool->wait_head->prev = q;
+    } else {
+        pool->wait_tail = q;
+    }
+    pool->wait_head = q;
+}
+
+static void wait_remove(tcp_pool_t* pool, tcp_pool_query_t* q) {
+    if (q->prev != NULL) {
+        q->prev->next = q->next;
+    } else {
+        pool->wait_head = q->next;
+    }
+
+    if (q->next != NULL) {
+        q->next->prev = q->prev;
+    } else {
+        pool->wait_tail = q->prev;
+    }
+
+    q->prev = NULL;
+    q->next = NULL;
+}
+
+static void sent_remove(tcp_pool_conn_t* pc, tcp_pool_query_t* q) {
+    if (q->prev != NULL) {
+        q->prev->next = q->next;
+    } else {
+        pc->sent_head = q->next;
+    }
+
+    if (q->next != NULL) {
+        q->next->prev = q->prev;
+    } else {
+        pc->sent_tail = q->prev;
+    }
+
+    q->prev = NULL;
+    q->next = NULL;
+}
+
+static void pool_schedule(tcp_pool_t* pool) {
+    logger_t* logger = current_logger;
+
+    while (pool->wait_head != NULL) {
+        tcp_pool_query_t* q = pool->wait_head;
+
+        // least loaded connection that can take the query right now
+        tcp_pool_conn_t* best = NULL;
+        for (size_t i = 0; i < pool->nconns; i++) {
+            tcp_pool_conn_t* pc = pool->conns[i];
+            if (!pool_conn_has_room(pc, q)) {
+                continue;
+            }
+
+            if (best == NULL || pc->inflight < best->inflight) {
+                best = pc;
+            }
+        }
+
+        if (best == NULL) {
+            if (pool->nconns == TCP_POOL_MAX_CONNS) {
+                break;
+            }
+
+            best = pool_open_conn(pool);
+            if (best == NULL) {
+                if (pool->nconns > 0) {
+                    break;
+                }
+
+                // nothing is connected and nothing can be, fail everything that waits
+                log_warn("tcp_pool: upstream is unreachable, failing waiting queries");
+                while (pool->wait_head != NULL) {
+                    tcp_pool_query_t* failed = pool->wait_head;
+                    wait_remove(pool, failed);
+                    complete_query(failed, NULL, 0);
+                }
+                break;
+            }
+        }
+
+        wait_remove(pool, q);
+        pool_conn_assign(best, q);
+    }
+}
+
+static tcp_pool_conn_t* pool_open_conn(tcp_pool_t* pool) {
+    logger_t* logger = current_logger;
+
+    tcp_pool_conn_t* pc = calloc(1, sizeof(tcp_pool_conn_t));
+    if (pc == NULL) {
+        log_perror("tcp_pool.allocate_pool_conn");
+        return NULL;
+    }
+
+    pc->in.data = malloc(TCP_POOL_BUFFER_SIZE);
+    pc->out.data = malloc(TCP_POOL_BUFFER_SIZE);
+    if (pc->in.data == NULL || pc->out.data == NULL) {
+        log_perror("tcp_pool.allocate_pool_conn_buffers");
+        free(pc->in.data);
+        free(pc->out.data);
+        free(pc);
+        return NULL;
+    }
+
+    pc->in.capacity = TCP_POOL_BUFFER_SIZE;
+    pc->out.capacity = TCP_POOL_BUFFER_SIZE;
+
+    connection_t* conn = make_client_connection_to(
+        CONN_TYPE_TCP,
+        &pool->upstream,
+        handle_pool_conn,
+        handle_pool_conn);
+    if (conn == NULL) {
+        log_error("tcp_pool: failed to connect to upstream");
+        free(pc->in.data);
+        free(pc->out.data);
+        free(pc);
+        return NULL;
+    }
+
+    conn->data = pc;
+
+    pc->pool = pool;
+    pc->conn = conn;
+    pc->last_used = jk_now();
+
+    pool->conns[pool->nconns] = pc;
+    pool->nconns += 1;
+
+    log_trace("tcp_pool: opened upstream connection, %zu in pool", pool->nconns);
+
+    arm_sweep_timer();
+
+    return pc;
+}
+
+static void pool_close_conn(tcp_pool_conn_t* pc, bool requeue) {
+    logger_t* logger = current_logger;
+
+    tcp_pool_t* pool = pc->pool;
+
+    for (size_t i = 0; i < pool->nconns; i++) {
+        if (pool->conns[i] == pc) {
+            pool->conns[i] = pool->conns[pool->nconns - 1];
+            pool->nconns -= 1;
+            break;
+        }
+    }
+
+    log_trace("tcp_pool: closing upstream connection, %zu in flight", pc->inflight);
+
+    ev_backend->del_conn(pc->conn);
+    close_connection(pc->conn);
+
+    // resend in the original order ahead of everything that waits,
+    // a query gets only one more chance
+    tcp_pool_query_t* failed_head = NULL;
+
+    while (pc->sent_tail != NULL) {
+        tcp_pool_query_t* q = pc->sent_tail;
+        sent_remove(pc, q);
+
+        pool_conn_forget(pc, q);
+        q->pconn = NULL;
+
+        if (requeue && !q->retried && q->handler != NULL) {
+            q->retried = true;
+            wait_push_front(pool, q);
+        } else {
+            q->next = failed_head;
+            failed_head = q;
+        }
+    }
+
+    free(pc->in.data);
+    free(pc->out.data);
+    free(pc);
+
+    while (failed_head != NULL) {
+        tcp_pool_query_t* q = failed_head;
+        failed_head = q->next;
+        q->next = NULL;
+        complete_query(q, NULL, 0);
+    }
+
+    pool_schedule(pool);
+}
+
+static bool pool_conn_has_room(tcp_pool_conn_t* pc, tcp_pool_query_t* q) {
+    return pc->inflight < TCP_POOL_MAX_INFLIGHT &&
+        pc->out.capacity - pc->out.taken >= q->len + 2;
+}
+
+static void pool_conn_assign(tcp_pool_conn_t* pc, tcp_pool_query_t* q) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(pool_conn_has_room(pc, q), "no room for query");
+
+    // all 16 bits stay random, an id already in flight here is drawn again
+    uint16_t id = jk_random_u16();
+    while (pool_conn_find(pc, id) != NULL) {
+        id = jk_random_u16();
+    }
+
+    q->id = id;
+    q->pconn = pc;
+
+    tcp_pool_query_t** bucket = &pc->by_id[id & (TCP_POOL_ID_BUCKETS - 1)];
+    q->id_next = *bucket;
+    *bucket = q;
+    pc->inflight += 1;
+
+    q->prev = pc->sent_tail;
+    q->next = NULL;
+    if (pc->sent_tail != NULL) {
+        pc->sent_tail->next = q;
+    } else {
+        pc->sent_head = q;
+    }
+    pc->sent_tail = q;
+
+    uint8_t* frame = pc->out.data + pc->out.taken;
+    dns_write_u16(frame, (uint16_t)q->len);
+    memcpy(frame + 2, q->msg, q->len);
+    dns_set_id(frame + 2, q->id);
+    pc->out.taken += q->len + 2;
+
+    pool_conn_update(pc);
+}
+
+static tcp_pool_query_t* pool_conn_find(tcp_pool_conn_t* pc, uint16_t id) {
+    tcp_pool_query_t* q = pc->by_id[id & (TCP_POOL_ID_BUCKETS - 1)];
+    while (q != NULL && q->id != id) {
+        q = q->id_next;
+    }
+
+    return q;
+}
+
+static void pool_conn_forget(tcp_pool_conn_t* pc, tcp_pool_query_t* q) {
+    tcp_pool_query_t** link = &pc->by_id[q->id & (TCP_POOL_ID_BUCKETS - 1)];
+    while (*link != NULL && *link != q) {
+        link = &(*link)->id_next;
+    }
+
+    if (*link != NULL) {
+        *link = q->id_next;
+    }
+
+    q->id_next = NULL;
+}
+
+// reads stay on, writes are added while output is pending; the single
+// epoll registration then reports both directions on the read event
+static void pool_conn_update(tcp_pool_conn_t* pc) {
+    connection_t* conn = pc->conn;
+
+    if (!conn->read->enabled) {
+        ev_backend->enable_event(conn->read);
+    }
+
+    bool pending = pc->out.taken > 0;
+
+    if (pending && !conn->write->enabled) {
+        ev_backend->enable_event(conn->write);
+    } else if (!pending && conn->write->enabled) {
+        ev_backend->disable_event(conn->write);
+    }
+}
+
+static void handle_pool_conn(event_t* ev) {
+    logger_t* logger = current_logger;
+
+    connection_t* conn = ev->owner.ptr;
+    tcp_pool_conn_t* pc = conn->data;
+
+    if (conn->error) {
+        log_perror("tcp_pool: upstream connection failed");
+        pool_close_conn(pc, true);
+        return;
+    }
+
+    // either direction may be ready, each one closes the connection on failure
+    if (pc->out.taken > 0 && pool_conn_write(pc) != JK_OK) {
+        return;
+    }
+
+    if (!ev->write) {
+        pool_conn_read(pc);
+    }
+}
+
+static int64_t pool_conn_write(tcp_pool_conn_t* pc) {
+    logger_t* logger = current_logger;
+
+    tcp_pool_t* pool = pc->pool;
+
+    while (pc->out.taken > 0) {
+        ssize_t sent = send_buf(pc->conn, pc->out.data, pc->out.taken);
+        if (sent == JK_WOULD_BLOCK) {
+            sent = 0;
+        }
+
+        if (sent < 0) {
+            log_perror("tcp_pool: send failed");
+            pool_close_conn(pc, true);
+            return JK_ERROR;
+        }
+
+        if (sent > 0) {
+            memmove(pc->out.data, pc->out.data + sent, pc->out.taken - sent);
+            pc->out.taken -= sent;
+            pc->last_used = jk_now();
+        }
+
+        if (pc->out.taken > 0) {
+            // socket buffer is full, wait for the next edge
+            break;
+        }
+
+        // the buffer is drained, move in whatever was waiting for room
+        pool_schedule(pool);
+    }
+
+    pool_conn_update(pc);
+
+    return JK_OK;
+}
+
+static int64_t pool_conn_read(tcp_pool_conn_t* pc) {
+    logger_t* logger = current_logger;
+
+    for (;;) {
+        size_t space = pc->in.capacity - pc->in.taken;
+
+        ssize_t n = recv_buf(pc->conn, pc->in.data + pc->in.taken, space);
+        if (n == JK_WOULD_BLOCK) {
+            break;
+        }
+
+        if (n == 0) {
+            log_trace("tcp_pool: upstream closed connection");
+            pool_close_conn(pc, true);
+            return JK_ERROR;
+        }
+
+        if (n < 0) {
+            log_perror("tcp_pool: recv failed");
+            pool_close_conn(pc, true);
+            return JK_ERROR;
+        }
+
+        pc->in.taken += n;
+        pc->last_used = jk_now();
+
+        if (pool_conn_process(pc) != JK_OK) {
+            pool_close_conn(pc, true);
+            return JK_ERROR;
+        }
+
+        if ((size_t)n < space) {
+            break;
+        }
+    }
+
+    pool_schedule(pc->pool);
+    pool_conn_update(pc);
+
+    return JK_OK;
+}
+
+static int64_t pool_conn_process(tcp_pool_conn_t* pc) {
+    logger_t* logger = current_logger;
+
+    size_t pos = 0;
+
+    while (pc->in.taken - pos >= 2) {
+        size_t len = dns_read_u16(pc->in.data + pos);
+        if (pc->in.taken - pos - 2 < len) {
+            break;
+        }
+
+        uint8_t* msg = pc->in.data + pos + 2;
+        pos += len + 2;
+
+        if (len < DNS_HEADER_SIZE) {
+            log_warn("tcp_pool: short response from upstream");
+            return JK_ERROR;
+        }
+
+        uint16_t id = dns_get_id(msg);
+        tcp_pool_query_t* q = pool_conn_find(pc, id);
+        if (q == NULL) {
+            log_trace("tcp_pool: discarding response with unknown id %u", id);
+            continue;
+        }
+
+        dns_set_id(msg, q->orig_id);
+        complete_query(q, msg, len);
+    }
+
+    memmove(pc->in.data, pc->in.data + pos, pc->in.taken - pos);
+    pc->in.taken -= pos;
+
+    return JK_OK;
+}
+
+static void complete_query(tcp_pool_query_t* q, uint8_t* msg, size_t len) {
+    tcp_pool_conn_t* pc = q->pconn;
+    if (pc != NULL) {
+        pool_conn_forget(pc, q);
+        pc->inflight -= 1;
+        sent_remove(pc, q);
+    }
+
+    tcp_pool_handler_pt handler = q->handler;
+    void* data = q->data;
+
+    free(q->msg);
+    free(q);
+
+    if (handler != NULL) {
+        handler(data, msg, len);
+    }
+}
+
+static void arm_sweep_timer() {
+    if (sweep_timer != NULL) {
+        return;
+    }
+
+    jk_timer_t timer;
+    jk_timer_start(&timer, TCP_POOL_SWEEP_INTERVAL);
+    timer.handler = sweep_pools;
+    timer.data = NULL;
+
+    // on failure the next query retries
+    sweep_timer = ev_backend->add_timer(timer);
+}
+
+static void sweep_pools(void* data) {
+    logger_t* logger = current_logger;
+
+    (void)data; // unused
+
+    // the firing timer is popped right after this handler returns
+    sweep_timer = NULL;
+
+    int64_t now = jk_now();
+    bool active = false;
+
+    for (tcp_pool_t* pool = pools_head; pool != NULL; pool = pool->next) {
+        while (pool->wait_head != NULL &&
+            pool->wait_head->created_at + TCP_POOL_QUERY_TIMEOUT <= now) {
+            tcp_pool_query_t* q = pool->wait_head;
+            wait_remove(pool, q);
+            log_trace("tcp_pool: waiting query timed out");
+            complete_query(q, NULL, 0);
+        }
+
+        for (size_t i = pool->nconns; i > 0; i--) {
+            if (i > pool->nconns) {
+                continue;
+            }
+
+            tcp_pool_conn_t* pc = pool->conns[i - 1];
+
+            while (pc->sent_head != NULL &&
+                pc->sent_head->created_at + TCP_POOL_QUERY_TIMEOUT <= now) {
+                log_trace("tcp_pool: query %u timed out", pc->sent_head->id);
+                complete_query(pc->sent_head, NULL, 0);
+            }
+
+            if (pc->inflight == 0 && pc->out.taken == 0 &&
+                pc->last_used + TCP_POOL_IDLE_TIMEOUT <= now) {
+                pool_close_conn(pc, false);
+            }
+        }
+
+        pool_schedule(pool);
+
+        if (pool->nconns > 0 || pool->wait_head != NULL) {
+            active = true;
+        }
+    }
+
+    if (active) {
+        arm_sweep_timer();
+    }
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "core/decl.h"
+#include "core/buffer.h"
+#include "core/connection.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TCP_POOL_MAX_CONNS      4
+#define TCP_POOL_MAX_INFLIGHT   128     // per connection
+#define TCP_POOL_ID_BUCKETS     256     // per connection, power of two
+#define TCP_POOL_BUFFER_SIZE    (2 + 65535)
+#define TCP_POOL_IDLE_TIMEOUT   30000
+#define TCP_POOL_QUERY_TIMEOUT  5000
+#define TCP_POOL_SWEEP_INTERVAL 1000
+
+// msg is NULL when the query failed or timed out, the query is already released at this point
+typedef void (*tcp_pool_handler_pt)(void* data, uint8_t* msg, size_t len);
+
+typedef struct tcp_pool_conn_s tcp_pool_conn_t;
+typedef struct tcp_pool_query_s tcp_pool_query_t;
+
+// Persistent upstream TCP connections shared by all sessions. Queries are
+// sent back to back with 2-byte length framing, each one gets a random ID
+// unique on its connection so responses are matched in any order.
+struct tcp_pool_s {
+    address_t upstream;
+
+    tcp_pool_conn_t* conns[TCP_POOL_MAX_CONNS];
+    size_t nconns;
+
+    // queries waiting for a free in-flight slot
+    tcp_pool_query_t* wait_head;
+    tcp_pool_query_t* wait_tail;
+
+    tcp_pool_t* next;
+};
+
+struct tcp_pool_conn_s {
+    tcp_pool_t* pool;
+    connection_t* conn;
+
+    // in-flight queries chained by the low bits of their id
+    tcp_pool_query_t* by_id[TCP_POOL_ID_BUCKETS];
+    size_t inflight;
+
+    // in-flight queries in send order, used for timeouts
+    tcp_pool_query_t* sent_head;
+    tcp_pool_query_t* sent_tail;
+
+    buffer_t in;
+    buffer_t out;
+
+    int64_t last_used;
+};
+
+struct tcp_pool_query_s {
+    tcp_pool_t* pool;
+    tcp_pool_conn_t* pconn;
+
+    uint8_t* msg;
+    size_t len;
+
+    uint16_t orig_id;
+    uint16_t id;
+    int64_t created_at;
+
+    // already resent once after its connection went away
+    uint32_t retried:1;
+
+    tcp_pool_handler_pt handler;
+    void* data;
+
+    tcp_pool_query_t* prev;
+    tcp_pool_query_t* next;
+
+    tcp_pool_query_t* id_next;
+};
+
+tcp_pool_query_t* tcp_pool_send(
+    address_t* upstream,
+    const uint8_t* msg,
+    size_t len,
+    tcp_pool_handler_pt handler,
+    void* data);
+
+// the handler is never called after cancel
+void tcp_pool_cancel(tcp_pool_query_t* q);
@@ -0,0 +1,319 @@
+#include "upstream.h"
+#include "connection/connection.h"
+#include "core/decl.h"
+#include "core/epoch.h"
+#include "core/errors.h"
+#include "core/random.h"
+#include "core/time.h"
+#include "logger/logger.h"
+#include "settings/settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/socket.h>
+
+// replaced as a whole on reload, queries in flight keep pointing into the old one
+typedef struct {
+    upstream_t upstreams[UPSTREAM_MAX];
+    size_t count;
+} upstream_set_t;
+
+// the set loaded at startup, later ones are allocated
+static upstream_set_t first_set;
+static upstream_set_t* current_set = NULL;
+
+static upstream_set_t* get_set();
+static int64_t load_set(upstream_set_t* set);
+static void release_set(void* ptr);
+static int64_t add_upstream(upstream_set_t* set, const char* ip, uint16_t port);
+static bool same_address(const address_t* a, const address_t* b);
+static bool is_healthy(const upstream_t* u, int64_t now);
+static bool less_loaded(const upstream_t* a, const upstream_t* b);
+static void add_sample(upstream_t* u, int64_t rtt);
+
+size_t upstream_count() {
+    return get_set()->count;
+}
+
+upstream_t* upstream_pick(const upstream_t* exclude) {
+    upstream_set_t* set = get_set();
+
+    int64_t now = jk_now();
+
+    upstream_t* best = NULL;
+    bool best_healthy = false;
+
+    for (size_t i = 0; i < set->count; i++) {
+        upstream_t* u = &set->upstreams[i];
+        if (u == exclude) {
+            continue;
+        }
+
+        bool healthy = is_healthy(u, now);
+
+        if (best == NULL || (healthy && !best_healthy) ||
+            (healthy == best_healthy && u->srtt < best->srtt)) {
+            best = u;
+            best_healthy = healthy;
+        }
+    }
+
+    // servers passed over drift towards being tried again, a slow sample
+    // must not bench a server that has recovered since
+    for (size_t i = 0; i < set->count; i++) {
+        upstream_t* u = &set->upstreams[i];
+        if (u != best && u != exclude) {
+            u->srtt -= u->srtt >> UPSTREAM_DECAY_SHIFT;
+        }
+    }
+
+    return best;
+}
+
+upstream_t* upstream_pick_balanced(const upstream_t* exclude) {
+    upstream_set_t* set = get_set();
+
+    int64_t now = jk_now();
+
+    upstream_t* healthy[UPSTREAM_MAX];
+    size_t count = 0;
+    upstream_t* fallback = NULL;
+
+    for (size_t i = 0; i < set->count; i++) {
+        upstream_t* u = &set->upstreams[i];
+        if (u == exclude) {
+            continue;
+        }
+
+        if (is_healthy(u, now)) {
+            healthy[count] = u;
+            count += 1;
+        } else if (fallback == NULL || u->retry_at < fallback->retry_at) {
+            // the one that failed longest ago is the likeliest to be back
+            fallback = u;
+        }
+    }
+
+    if (count == 0) {
+        return fallback;
+    }
+
+    if (count == 1) {
+        return healthy[0];
+    }
+
+    // power of two choices, a busy upstream is avoided without every
+    // session piling onto the least loaded one
+    size_t a = jk_random_u32() % count;
+    size_t b = jk_random_u32() % (count - 1);
+    if (b >= a) {
+        b += 1;
+    }
+
+    return less_loaded(healthy[a], healthy[b]) ? healthy[a] : healthy[b];
+}
+
+bool upstream_is_current(const upstream_t* u) {
+    upstream_set_t* set = get_set();
+
+    return u >= set->upstreams && u < set->upstreams + set->count;
+}
+
+bool upstream_is_ejected(const upstream_t* u) {
+    return u->fails >= UPSTREAM_FAIL_LIMIT;
+}
+
+int64_t upstream_hedge_delay(const upstream_t* u) {
+    int64_t delay = (u->srtt + 2 * u->rttvar + 999) / 1000;
+
+    if (delay < UPSTREAM_HEDGE_MIN) {
+        return UPSTREAM_HEDGE_MIN;
+    }
+
+    return delay < UPSTREAM_HEDGE_MAX ? delay : UPSTREAM_HEDGE_MAX;
+}
+
+void upstream_report_rtt(upstream_t* u, int64_t rtt) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(u != NULL, "u is NULL");
+
+    add_sample(u, rtt);
+
+    u->fails = 0;
+    u->retry_at = 0;
+}
+
+void upstream_report_late(upstream_t* u, int64_t waited) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(u != NULL, "u is NULL");
+
+    // a stalled upstream loses every race, nothing else would slow it down
+    if (waited > u->srtt) {
+        add_sample(u, waited);
+    }
+}
+
+void upstream_report_failure(upstream_t* u) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(u != NULL, "u is NULL");
+
+    u->fails += 1;
+
+    // a lost query costs like a very slow one
+    u->srtt = 2 * (u->srtt > UPSTREAM_RTT_INITIAL ? u->srtt : UPSTREAM_RTT_INITIAL);
+    if (u->srtt > UPSTREAM_RTT_MAX) {
+        u->srtt = UPSTREAM_RTT_MAX;
+    }
+
+    if (u->fails >= UPSTREAM_FAIL_LIMIT) {
+        log_warn("upstream: skipping a failing upstream for %d ms", UPSTREAM_RETRY_INTERVAL);
+        u->retry_at = jk_now() + UPSTREAM_RETRY_INTERVAL;
+    }
+}
+
+void upstream_reload() {
+    logger_t* logger = current_logger;
+
+    upstream_set_t* old = get_set();
+
+    upstream_set_t* set = calloc(1, sizeof(upstream_set_t));
+    if (set == NULL) {
+        log_perror("upstream.allocate_set");
+        log_error("upstream: keeping the old upstreams");
+        return;
+    }
+
+    if (load_set(set) != JK_OK) {
+        log_error("upstream: keeping the old upstreams");
+        free(set);
+        return;
+    }
+
+    // servers kept across the reload keep what was learned about them
+    for (size_t i = 0; i < set->count; i++) {
+        for (size_t j = 0; j < old->count; j++) {
+            if (same_address(&set->upstreams[i].addr, &old->upstreams[j].addr)) {
+                memcpy(&set->upstreams[i], &old->upstreams[j], sizeof(upstream_t));
+
+                // sessions and probes stay with the old set
+                set->upstreams[i].active = 0;
+                set->upstreams[i].probing = false;
+                break;
+            }
+        }
+    }
+
+    current_set = set;
+
+    jk_epoch_retire(old, release_set);
+}
+
+static upstream_set_t* get_set() {
+    if (current_set == NULL) {
+        load_set(&first_set);
+        current_set = &first_set;
+    }
+
+    return current_set;
+}
+
+// an address that does not parse is left out, the rest are still loaded
+static int64_t load_set(upstream_set_t* set) {
+    settings_t* s = current_settings;
+
+    int64_t res = JK_OK;
+
+    if (s->remote_ip != NULL && add_upstream(set, s->remote_ip, s->remote_port) != JK_OK) {
+        res = JK_ERROR;
+    }
+
+    for (uint32_t i = 0; i < s->upstreams_count; i++) {
+        if (add_upstream(set, s->upstreams[i].ip, s->upstreams[i].port) != JK_OK) {
+            res = JK_ERROR;
+        }
+    }
+
+    return res;
+}
+
+static void release_set(void* ptr) {
+    if (ptr != &first_set) {
+        free(ptr);
+    }
+}
+
+static int64_t add_upstream(upstream_set_t* set, const char* ip, uint16_t port) {
+    logger_t* logger = current_logger;
+
+    CHECK_INVARIANT(set->count < UPSTREAM_MAX, "too many upstreams");
+
+    upstream_t* u = &set->upstreams[set->count];
+
+    if (fill_address(&u->addr, ip, port) != JK_OK) {
+        log_error("upstream: %s is not an ip address", ip);
+        memset(u, 0, sizeof(*u));
+        return JK_ERROR;
+    }
+
+    u->srtt = UPSTREAM_RTT_INITIAL;
+    u->rttvar = UPSTREAM_RTT_INITIAL / 2;
+
+    set->count += 1;
+
+    return JK_OK;
+}
+
+static bool same_address(const address_t* a, const address_t* b) {
+    if (a->af != b->af || a->src_port != b->src_port) {
+        return false;
+    }
+
+    if (a->af == AF_INET) {
+        return memcmp(&a->src.src_v4, &b->src.src_v4, sizeof(struct in_addr)) == 0;
+    }
+
+    return memcmp(&a->src.src_v6, &b->src.src_v6, sizeof(struct in6_addr)) == 0;
+}
+
+static bool is_healthy(const upstream_t* u, int64_t now) {
+    if (u->probing) {
+        return false;
+    }
+
+    return u->fails < UPSTREAM_FAIL_LIMIT || now >= u->retry_at;
+}
+
+static bool less_loaded(const upstream_t* a, const upstream_t* b) {
+    if (a->active != b->active) {
+        return a->active < b->active;
+    }
+
+    return a->srtt <= b->srtt;
+}
+
+// RFC 6298 with gains of 1/8 and 1/4
+static void add_sample(upstream_t* u, int64_t rtt) {
+    if (rtt < 0) {
+        rtt = 0;
+    } else if (rtt > UPSTREAM_RTT_MAX) {
+        rtt = UPSTREAM_RTT_MAX;
+    }
+
+    if (!u->sampled) {
+        u->srtt = rtt;
+        u->rttvar = rtt / 2;
+        u->sampled = true;
+        return;
+    }
+
+    int64_t err = rtt > u->srtt ? rtt - u->srtt : u->srtt - rtt;
+    u->rttvar += (err - u->rttvar) / 4;
+    u->srtt += (rtt - u->srtt) / 8;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include "core/decl.h"
+#include "core/connection.h"
+#include "settings/settings.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define UPSTREAM_MAX            (MAX_UPSTREAMS + 1) // --upstream entries and remote-ip
+#define UPSTREAM_RTT_INITIAL    20000   // us assumed until the first answer
+#define UPSTREAM_RTT_MAX        5000000 // us
+#define UPSTREAM_DECAY_SHIFT    6       // upstreams passed over look 1/64 faster every pick
+#define UPSTREAM_FAIL_LIMIT     3       // consecutive failures before an upstream is skipped
+#define UPSTREAM_RETRY_INTERVAL 2000    // ms a failing upstream is skipped for
+#define UPSTREAM_HEDGE_MIN      5       // ms
+#define UPSTREAM_HEDGE_MAX      1000    // ms
+
+// A DNS server queries are forwarded to. Response times feed an RFC 6298
+// style estimator, srtt + 2 * rttvar approximates the 95th percentile.
+struct upstream_s {
+    address_t addr;
+
+    // us, scaled like the samples
+    int64_t srtt;
+    int64_t rttvar;
+    uint32_t sampled:1;
+
+    uint32_t fails;
+    // the upstream is only picked as a last resort before this time, ms
+    int64_t retry_at;
+    // ejected until a probe gets through, retry_at does not apply
+    uint32_t probing:1;
+
+    // proxy sessions open to the upstream
+    uint32_t active;
+};
+
+size_t upstream_count();
+
+// the upstreams configured in current_settings replace the ones in use,
+// servers in both keep their statistics
+void upstream_reload();
+
+// the healthy upstream with the lowest srtt other than exclude, failing ones
+// are used when nothing else is left, NULL if exclude is the only upstream
+upstream_t* upstream_pick(const upstream_t* exclude);
+
+// two random healthy upstreams other than exclude, the one with fewer
+// active sessions wins, failing ones are used when nothing else is left
+upstream_t* upstream_pick_balanced(const upstream_t* exclude);
+
+// false once a reload replaced the set u belongs to
+bool upstream_is_current(const upstream_t* u);
+
+// too many failures in a row, the upstream is skipped for now
+bool upstream_is_ejected(const upstream_t* u);
+
+// ms to wait for an answer from u before asking another upstream
+int64_t upstream_hedge_delay(const upstream_t* u);
+
+// rtt in us of an answered query
+void upstream_report_rtt(upstream_t* u, int64_t rtt);
+
+// a query abandoned unanswered after waited us, it counts when u looked faster
+void upstream_report_late(upstream_t* u, int64_t waited);
+
+// the query timed out or could not be sent
+void upstream_report_failure(upstream_t* u);
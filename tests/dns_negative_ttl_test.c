@@ -0,0 +1,267 @@
+// A negative answer is cached for min(SOA ttl, SOA MINIMUM), RFC 2308
+// section 5: the upstream below answers NXDOMAIN with a SOA whose MINIMUM
+// is well under its ttl, the same question asked again comes from the
+// cache with the SOA ttl capped. Run as ./dns_negative_ttl_test path/to/jkdns
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROXY_PORT     25392
+#define UPSTREAM_PORT  25393
+#define SOA_TTL        3600
+#define SOA_MINIMUM    60
+#define IO_TIMEOUT     200   // ms per attempt
+#define START_ATTEMPTS 50    // queries, IO_TIMEOUT apart
+
+#define HEADER_SIZE    12
+#define RCODE_NXDOMAIN 3
+#define TYPE_SOA       6
+
+typedef struct {
+    int fd;
+    atomic_int queries;
+} upstream_t;
+
+static const uint8_t qname[] = "\x02nx\x07" "example\x00";
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)(v & 0xff);
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    put_u16(p, (uint16_t)(v >> 16));
+    put_u16(p + 2, (uint16_t)(v & 0xffff));
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return ((uint32_t)get_u16(p) << 16) | get_u16(p + 2);
+}
+
+// offset right after the question of msg, 0 if it is malformed
+static size_t question_end(const uint8_t* msg, size_t len) {
+    size_t pos = HEADER_SIZE;
+
+    while (pos < len && msg[pos] != 0) {
+        pos += (size_t)msg[pos] + 1;
+    }
+
+    pos += 1 + 4;
+
+    return pos <= len ? pos : 0;
+}
+
+// NXDOMAIN for whatever is asked, the question copied and a root SOA
+// in the authority section
+static void* serve_upstream(void* data) {
+    upstream_t* u = data;
+
+    for (;;) {
+        uint8_t msg[4096];
+        struct sockaddr_in peer;
+        socklen_t peer_len = sizeof(peer);
+
+        ssize_t n = recvfrom(u->fd, msg, sizeof(msg), 0, (struct sockaddr*)&peer, &peer_len);
+        if (n < 0) {
+            return NULL;
+        }
+
+        size_t end = question_end(msg, (size_t)n);
+        if (n < HEADER_SIZE || end == 0) {
+            continue;
+        }
+
+        atomic_fetch_add(&u->queries, 1);
+
+        uint8_t* soa = msg + end;
+        size_t soa_len = 1 + 10 + 22;
+        if (end + soa_len > sizeof(msg)) {
+            continue;
+        }
+
+        memset(soa, 0, soa_len);
+        put_u16(soa + 1, TYPE_SOA);
+        put_u16(soa + 3, 1);
+        put_u32(soa + 5, SOA_TTL);
+        put_u16(soa + 9, 22);
+        put_u32(soa + 11 + 2, 1);             // serial
+        put_u32(soa + 11 + 6, 7200);          // refresh
+        put_u32(soa + 11 + 10, 900);          // retry
+        put_u32(soa + 11 + 14, 1209600);      // expire
+        put_u32(soa + 11 + 18, SOA_MINIMUM);  // minimum
+
+        put_u16(msg + 2, (uint16_t)(0x8000 | (get_u16(msg + 2) & 0x0100) | 0x0080 | RCODE_NXDOMAIN));
+        put_u16(msg + 6, 0);
+        put_u16(msg + 8, 1);
+        put_u16(msg + 10, 0);
+
+        sendto(u->fd, msg, end + soa_len, 0, (struct sockaddr*)&peer, peer_len);
+    }
+}
+
+static int open_udp(uint16_t port, int timeout_ms) {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (port != 0 && bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval tv = { .tv_sec = timeout_ms / 1000, .tv_usec = (timeout_ms % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+static pid_t start_proxy(const char* binary) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    // the settings dump is of no interest here
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+    }
+
+    char port[16];
+    char upstream_port[16];
+    snprintf(port, sizeof(port), "%d", PROXY_PORT);
+    snprintf(upstream_port, sizeof(upstream_port), "%d", UPSTREAM_PORT);
+
+    execl(binary, binary,
+        "--dns",
+        "--proxy",
+        "--port", port,
+        "--remote-ip", "127.0.0.1",
+        "--remote-port", upstream_port,
+        "--remote-use-udp",
+        (char*)NULL);
+
+    perror("execl");
+    _exit(1);
+}
+
+// the SOA ttl of the answer, -1 if no NXDOMAIN with a SOA came back
+static int64_t ask(int fd, uint16_t id) {
+    uint8_t query[HEADER_SIZE + sizeof(qname) + 4] = {0};
+    put_u16(query, id);
+    put_u16(query + 2, 0x0100);
+    put_u16(query + 4, 1);
+    memcpy(query + HEADER_SIZE, qname, sizeof(qname));
+    put_u16(query + HEADER_SIZE + sizeof(qname), 1);
+    put_u16(query + HEADER_SIZE + sizeof(qname) + 2, 1);
+
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(PROXY_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (sendto(fd, query, sizeof(query), 0, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        return -1;
+    }
+
+    uint8_t msg[4096];
+    ssize_t n = recv(fd, msg, sizeof(msg), 0);
+    if (n < HEADER_SIZE || get_u16(msg) != id) {
+        return -1;
+    }
+
+    size_t end = question_end(msg, (size_t)n);
+    if ((get_u16(msg + 2) & 0x000f) != RCODE_NXDOMAIN || get_u16(msg + 8) != 1 || end == 0) {
+        return -1;
+    }
+
+    // the root owner name the upstream wrote
+    if (end + 11 > (size_t)n || msg[end] != 0 || get_u16(msg + end + 1) != TYPE_SOA) {
+        return -1;
+    }
+
+    return get_u32(msg + end + 5);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s path/to/jkdns\n", argv[0]);
+        return 2;
+    }
+
+    upstream_t upstream = {0};
+    upstream.fd = open_udp(UPSTREAM_PORT, 0);
+    if (upstream.fd < 0) {
+        perror("open_upstream");
+        return 1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_upstream, &upstream);
+
+    pid_t proxy = start_proxy(argv[1]);
+    if (proxy < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    int fd = open_udp(0, IO_TIMEOUT);
+
+    // the first answer to come back is the upstream's own
+    int64_t first = -1;
+    uint16_t id = 1;
+    for (int attempt = 0; attempt < START_ATTEMPTS && first < 0; attempt++) {
+        first = ask(fd, id++);
+    }
+
+    int asked = atomic_load(&upstream.queries);
+    int64_t cached = first < 0 ? -1 : ask(fd, id++);
+
+    bool ok = true;
+
+    if (first < 0 || cached < 0) {
+        fprintf(stderr, "no negative answer from the proxy\n");
+        ok = false;
+    } else if (atomic_load(&upstream.queries) != asked) {
+        fprintf(stderr, "the second answer did not come from the cache\n");
+        ok = false;
+    } else if (cached > SOA_MINIMUM) {
+        fprintf(stderr, "cached SOA ttl is %lld, over the MINIMUM of %d\n",
+            (long long)cached, SOA_MINIMUM);
+        ok = false;
+    }
+
+    kill(proxy, SIGTERM);
+    waitpid(proxy, NULL, 0);
+
+    close(fd);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+// Exact, longest-suffix and wildcard matches of the name trie, built along
+// with src/dns/name_trie.c and the name helpers it uses. Run as ./name_trie_test
+
+#include "dns/name.h"
+#include "dns/name_trie.h"
+#include "core/errors.h"
+#include "logger/logger.h"
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// the trie logs only when something is badly wrong, straight to stderr here
+static logger_t test_logger = { .fd = 2, .level = LOG_ERROR };
+logger_t* current_logger = &test_logger;
+
+static bool ok = true;
+
+void base_log(int64_t level, logger_t* logger, const char* fmt, ...) {
+    (void)level; // unused
+    (void)logger; // unused
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+void base_log_perror(int64_t level, logger_t* logger, const char* fmt, ...) {
+    (void)level; // unused
+    (void)logger; // unused
+
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    perror("");
+}
+
+static const uint8_t* wire(const char* str) {
+    static uint8_t names[8][DNS_NAME_MAX_LEN];
+    static size_t next = 0;
+
+    uint8_t* name = names[next++ % 8];
+    if (dns_name_from_str(str, name, DNS_NAME_MAX_LEN) <= 0) {
+        fprintf(stderr, "bad test name %s\n", str);
+        ok = false;
+    }
+
+    return name;
+}
+
+static void expect(bool cond, const char* what, const char* name) {
+    if (!cond) {
+        fprintf(stderr, "%s: %s\n", name, what);
+        ok = false;
+    }
+}
+
+static void check_match(name_trie_t* trie, const char* name, int res, void* exact,
+                        void* longest, size_t longest_labels, void* wildcard) {
+    name_trie_match_t m;
+
+    expect(name_trie_match(trie, wire(name), &m) == res, "wrong result", name);
+    expect(m.exact == exact, "wrong exact match", name);
+    expect(m.longest == longest, "wrong longest suffix", name);
+    expect(m.longest == NULL || m.longest_labels == longest_labels, "wrong suffix length", name);
+    expect(m.wildcard == wildcard, "wrong wildcard", name);
+}
+
+int main() {
+    int zone = 1, sub = 2, wild = 3, deep = 4, root = 5;
+
+    name_trie_t* trie = name_trie_create();
+    if (trie == NULL) {
+        printf("FAILED\n");
+        return 1;
+    }
+
+    name_trie_insert(trie, wire("example.com"), &zone);
+    name_trie_insert(trie, wire("Sub.Example.COM"), &sub);
+    name_trie_insert(trie, wire("*.example.com"), &wild);
+    name_trie_insert(trie, wire("a.b.c.example.com"), &deep);
+
+    expect(trie->size == 4, "wrong size after inserts", "trie");
+
+    // lookups fold case and want the whole name
+    expect(name_trie_lookup(trie, wire("EXAMPLE.com")) == &zone, "lookup missed", "EXAMPLE.com");
+    expect(name_trie_lookup(trie, wire("sub.example.com")) == &sub, "lookup missed", "sub.example.com");
+    expect(name_trie_lookup(trie, wire("com")) == NULL, "empty non-terminal found", "com");
+    expect(name_trie_lookup(trie, wire("b.c.example.com")) == NULL, "empty non-terminal found", "b.c.example.com");
+    expect(name_trie_lookup(trie, wire("example.org")) == NULL, "absent name found", "example.org");
+
+    // exact matches carry the longest suffix, which is the name itself
+    check_match(trie, "sub.example.com", JK_OK, &sub, &sub, 3, NULL);
+    check_match(trie, "a.b.c.example.com", JK_OK, &deep, &deep, 5, NULL);
+
+    // below a name: its value as the longest suffix, the wildcard of the closest encloser
+    check_match(trie, "www.sub.example.com", JK_OK, NULL, &sub, 3, NULL);
+    check_match(trie, "www.example.com", JK_OK, NULL, &zone, 2, &wild);
+    check_match(trie, "x.b.c.example.com", JK_OK, NULL, &zone, 2, NULL);
+
+    // an empty non-terminal is no exact match, a parent above it still is the suffix
+    check_match(trie, "c.example.com", JK_OK, NULL, &zone, 2, NULL);
+
+    // nothing on the path
+    check_match(trie, "example.org", JK_NOT_FOUND, NULL, NULL, 0, NULL);
+    check_match(trie, "com", JK_NOT_FOUND, NULL, NULL, 0, NULL);
+
+    // a value at the root is the suffix of everything
+    name_trie_insert(trie, wire("."), &root);
+    check_match(trie, "example.org", JK_OK, NULL, &root, 0, NULL);
+
+    // deleting prunes the path, the parents are kept
+    expect(name_trie_delete(trie, wire("a.b.c.example.com")) == JK_OK, "delete failed", "a.b.c.example.com");
+    expect(name_trie_delete(trie, wire("a.b.c.example.com")) == JK_NOT_FOUND, "deleted twice", "a.b.c.example.com");
+    expect(name_trie_delete(trie, wire("c.example.com")) == JK_NOT_FOUND, "deleted a non-terminal", "c.example.com");
+    check_match(trie, "a.b.c.example.com", JK_OK, NULL, &zone, 2, &wild);
+    expect(name_trie_lookup(trie, wire("example.com")) == &zone, "parent lost", "example.com");
+    expect(trie->size == 4, "wrong size after deletes", "trie");
+
+    name_trie_destroy(trie, NULL);
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+
+    return ok ? 0 : 1;
+}
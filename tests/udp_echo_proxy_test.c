@@ -0,0 +1,226 @@
+// An echo session proxied to a udp remote with more than one datagram in
+// flight: the remote below holds its replies until the whole payload came
+// in, then sends them all back. Run as ./udp_echo_proxy_test path/to/jkdns
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROXY_PORT     25390
+#define REMOTE_PORT    25391
+#define PAYLOAD_SIZE   20000 // five datagrams of at most 4096 bytes
+#define MAX_DATAGRAMS  64
+#define IO_TIMEOUT     5     // seconds
+#define START_ATTEMPTS 50    // connects, 100 ms apart
+
+typedef struct {
+    int fd;
+    int failed;
+} remote_t;
+
+static void* serve_remote(void* data) {
+    remote_t* r = data;
+
+    static uint8_t datagrams[MAX_DATAGRAMS][65536];
+    static size_t lens[MAX_DATAGRAMS];
+    size_t count = 0;
+    size_t total = 0;
+
+    struct sockaddr_in peer;
+    socklen_t peer_len = sizeof(peer);
+
+    while (total < PAYLOAD_SIZE && count < MAX_DATAGRAMS) {
+        ssize_t n = recvfrom(r->fd, datagrams[count], sizeof(datagrams[count]), 0,
+            (struct sockaddr*)&peer, &peer_len);
+        if (n <= 0) {
+            r->failed = 1;
+            return NULL;
+        }
+
+        lens[count++] = (size_t)n;
+        total += (size_t)n;
+    }
+
+    if (count < 2) {
+        fprintf(stderr, "remote: payload came in %zu datagram\n", count);
+        r->failed = 1;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        sendto(r->fd, datagrams[i], lens[i], 0, (struct sockaddr*)&peer, peer_len);
+    }
+
+    return NULL;
+}
+
+static int open_remote() {
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(REMOTE_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (bind(fd, (struct sockaddr*)&sa, sizeof(sa)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    struct timeval tv = { .tv_sec = IO_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    return fd;
+}
+
+static pid_t start_proxy(const char* binary) {
+    pid_t pid = fork();
+    if (pid != 0) {
+        return pid;
+    }
+
+    // the settings dump is of no interest here
+    int devnull = open("/dev/null", O_WRONLY);
+    if (devnull >= 0) {
+        dup2(devnull, STDOUT_FILENO);
+    }
+
+    char port[16];
+    char remote_port[16];
+    snprintf(port, sizeof(port), "%d", PROXY_PORT);
+    snprintf(remote_port, sizeof(remote_port), "%d", REMOTE_PORT);
+
+    execl(binary, binary,
+        "--proxy",
+        "--port", port,
+        "--remote-ip", "127.0.0.1",
+        "--remote-port", remote_port,
+        "--remote-use-udp",
+        (char*)NULL);
+
+    perror("execl");
+    _exit(1);
+}
+
+static int connect_proxy() {
+    struct sockaddr_in sa = {0};
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(PROXY_PORT);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    for (int attempt = 0; attempt < START_ATTEMPTS; attempt++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0) {
+            return -1;
+        }
+
+        if (connect(fd, (struct sockaddr*)&sa, sizeof(sa)) == 0) {
+            struct timeval tv = { .tv_sec = IO_TIMEOUT };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return fd;
+        }
+
+        close(fd);
+
+        struct timespec ts = { .tv_nsec = 100 * 1000000 };
+        nanosleep(&ts, NULL);
+    }
+
+    return -1;
+}
+
+static bool run_session(int fd) {
+    static uint8_t sent[PAYLOAD_SIZE];
+    static uint8_t got[PAYLOAD_SIZE];
+
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < PAYLOAD_SIZE; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        sent[i] = (uint8_t)x;
+    }
+
+    if (send(fd, sent, sizeof(sent), MSG_NOSIGNAL) != (ssize_t)sizeof(sent)) {
+        perror("send");
+        return false;
+    }
+
+    size_t taken = 0;
+    while (taken < sizeof(got)) {
+        ssize_t n = recv(fd, got + taken, sizeof(got) - taken, 0);
+        if (n <= 0) {
+            fprintf(stderr, "session: got %zu of %d bytes back\n", taken, PAYLOAD_SIZE);
+            return false;
+        }
+
+        taken += (size_t)n;
+    }
+
+    if (memcmp(sent, got, sizeof(sent)) != 0) {
+        fprintf(stderr, "session: echoed payload differs\n");
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s path/to/jkdns\n", argv[0]);
+        return 2;
+    }
+
+    remote_t remote = {0};
+    remote.fd = open_remote();
+    if (remote.fd < 0) {
+        perror("open_remote");
+        return 1;
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, serve_remote, &remote);
+
+    pid_t proxy = start_proxy(argv[1]);
+    if (proxy < 0) {
+        perror("fork");
+        return 1;
+    }
+
+    bool ok = false;
+
+    int fd = connect_proxy();
+    if (fd < 0) {
+        fprintf(stderr, "could not connect to the proxy\n");
+    } else {
+        ok = run_session(fd);
+        close(fd);
+    }
+
+    kill(proxy, SIGTERM);
+    waitpid(proxy, NULL, 0);
+
+    pthread_join(thread, NULL);
+    close(remote.fd);
+
+    ok = ok && !remote.failed;
+
+    printf("%s\n", ok ? "ok" : "FAILED");
+
+    return ok ? 0 : 1;
+}
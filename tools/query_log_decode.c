@@ -0,0 +1,305 @@
+// Prints the records of a --query-log file, oldest first, one line each:
+//
+//   time client proto qname qtype rcode latency_us [flags]
+//
+// With -f the file is followed like tail -f, a file replaced by a restarted
+// server is picked up again from its start.
+
+#include "dns/query_log.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+#define FOLLOW_INTERVAL_US 100000
+
+typedef struct {
+    uint8_t* map;
+    size_t map_len;
+    ino_t ino;
+    dns_query_log_header_t* header;
+    dns_query_log_record_t* records;
+    uint64_t mask;
+} query_log_t;
+
+static int open_log(const char* path, query_log_t* log);
+static void close_log(query_log_t* log);
+static bool replaced(const char* path, const query_log_t* log);
+static uint64_t print_records(query_log_t* log, uint64_t next, uint64_t head);
+static bool read_record(query_log_t* log, uint64_t index, dns_query_log_record_t* out);
+static void print_record(const dns_query_log_record_t* rec);
+static void format_qname(char* out, const dns_query_log_record_t* rec);
+static const char* qtype_name(uint16_t qtype, char* buf, size_t len);
+static const char* rcode_name(uint8_t rcode);
+
+int main(int argc, char* argv[]) {
+    bool follow = false;
+    const char* path = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0) {
+            follow = true;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            path = NULL;
+            break;
+        }
+    }
+
+    if (path == NULL) {
+        fprintf(stderr, "usage: %s [-f] <query log>\n", argv[0]);
+        return 1;
+    }
+
+    query_log_t log;
+    if (open_log(path, &log) != 0) {
+        return 1;
+    }
+
+    uint64_t head = atomic_load_explicit(&log.header->head, memory_order_acquire);
+    uint64_t next = head > log.header->capacity ? head - log.header->capacity : 0;
+
+    for (;;) {
+        next = print_records(&log, next, head);
+
+        if (!follow) {
+            break;
+        }
+
+        fflush(stdout);
+        usleep(FOLLOW_INTERVAL_US);
+
+        head = atomic_load_explicit(&log.header->head, memory_order_acquire);
+
+        // whatever the old writer still adds once it is replaced is lost
+        if (head == next && replaced(path, &log)) {
+            close_log(&log);
+            if (open_log(path, &log) != 0) {
+                return 1;
+            }
+
+            next = 0;
+            head = atomic_load_explicit(&log.header->head, memory_order_acquire);
+        }
+    }
+
+    close_log(&log);
+
+    return 0;
+}
+
+static int open_log(const char* path, query_log_t* log) {
+    memset(log, 0, sizeof(*log));
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        perror("open");
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat");
+        close(fd);
+        return -1;
+    }
+
+    if ((size_t)st.st_size < sizeof(dns_query_log_header_t)) {
+        fprintf(stderr, "%s: not a query log\n", path);
+        close(fd);
+        return -1;
+    }
+
+    log->map_len = (size_t)st.st_size;
+    log->ino = st.st_ino;
+    log->map = mmap(NULL, log->map_len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    if (log->map == MAP_FAILED) {
+        perror("mmap");
+        return -1;
+    }
+
+    log->header = (dns_query_log_header_t*)log->map;
+    log->records = (dns_query_log_record_t*)(log->map + sizeof(dns_query_log_header_t));
+
+    dns_query_log_header_t* h = log->header;
+    size_t expected = sizeof(*h) + h->capacity * sizeof(dns_query_log_record_t);
+
+    if (memcmp(h->magic, DNS_QUERY_LOG_MAGIC, sizeof(h->magic)) != 0 ||
+        h->version != DNS_QUERY_LOG_VERSION ||
+        h->record_size != sizeof(dns_query_log_record_t) ||
+        h->capacity == 0 || (h->capacity & (h->capacity - 1)) != 0 ||
+        expected != log->map_len) {
+        fprintf(stderr, "%s: not a query log of version %d\n", path, DNS_QUERY_LOG_VERSION);
+        munmap(log->map, log->map_len);
+        return -1;
+    }
+
+    log->mask = h->capacity - 1;
+
+    return 0;
+}
+
+static void close_log(query_log_t* log) {
+    munmap(log->map, log->map_len);
+}
+
+static bool replaced(const char* path, const query_log_t* log) {
+    struct stat st;
+    return stat(path, &st) == 0 && st.st_ino != log->ino;
+}
+
+// returns the index to continue from
+static uint64_t print_records(query_log_t* log, uint64_t next, uint64_t head) {
+    // the writer came around and overwrote what was not read yet
+    if (head - next > log->header->capacity) {
+        uint64_t oldest = head - log->header->capacity;
+        printf("# %llu records lost\n", (unsigned long long)(oldest - next));
+        next = oldest;
+    }
+
+    for (; next < head; next++) {
+        dns_query_log_record_t rec;
+
+        if (read_record(log, next, &rec)) {
+            print_record(&rec);
+        } else {
+            printf("# record %llu overwritten while read\n", (unsigned long long)next);
+        }
+    }
+
+    return next;
+}
+
+static bool read_record(query_log_t* log, uint64_t index, dns_query_log_record_t* out) {
+    dns_query_log_record_t* rec = &log->records[index & log->mask];
+
+    uint64_t seq = atomic_load_explicit(&rec->seq, memory_order_acquire);
+    if (seq != index + 1) {
+        return false;
+    }
+
+    memcpy(out, rec, sizeof(*out));
+    atomic_thread_fence(memory_order_acquire);
+
+    return atomic_load_explicit(&rec->seq, memory_order_relaxed) == seq;
+}
+
+static void print_record(const dns_query_log_record_t* rec) {
+    time_t sec = (time_t)(rec->received_at / 1000000);
+    struct tm tm;
+    gmtime_r(&sec, &tm);
+
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+    char addr[INET6_ADDRSTRLEN] = "?";
+    inet_ntop(rec->client_af == AF_INET ? AF_INET : AF_INET6, rec->client, addr, sizeof(addr));
+
+    char qname[DNS_QUERY_LOG_QNAME_SIZE * 4 + 8];
+    format_qname(qname, rec);
+
+    char qtype[16];
+
+    printf("%s.%06lldZ %s%s%s:%u %s %s %s %s %u%s%s\n",
+        when,
+        (long long)(rec->received_at % 1000000),
+        rec->client_af == AF_INET ? "" : "[",
+        addr,
+        rec->client_af == AF_INET ? "" : "]",
+        rec->client_port,
+        rec->flags & DNS_QUERY_LOG_TCP ? "tcp" : "udp",
+        qname,
+        rec->flags & DNS_QUERY_LOG_MALFORMED ? "-" : qtype_name(rec->qtype, qtype, sizeof(qtype)),
+        rec->flags & DNS_QUERY_LOG_DROPPED ? "-" : rcode_name(rec->rcode),
+        rec->latency,
+        rec->flags & DNS_QUERY_LOG_DROPPED ? " dropped" : "",
+        rec->flags & DNS_QUERY_LOG_MALFORMED ? " malformed" : "");
+}
+
+// presentation format, unprintable bytes escaped as \DDD
+static void format_qname(char* out, const dns_query_log_record_t* rec) {
+    if (rec->flags & DNS_QUERY_LOG_MALFORMED) {
+        strcpy(out, "-");
+        return;
+    }
+
+    size_t len = rec->qname_len < DNS_QUERY_LOG_QNAME_SIZE ? rec->qname_len : DNS_QUERY_LOG_QNAME_SIZE;
+    size_t pos = 0;
+    char* p = out;
+
+    while (pos < len && rec->qname[pos] != 0) {
+        size_t label = rec->qname[pos++];
+
+        for (size_t i = 0; i < label && pos < len; i++, pos++) {
+            uint8_t c = rec->qname[pos];
+
+            if (c == '.' || c == '\\') {
+                *p++ = '\\';
+                *p++ = (char)c;
+            } else if (c > 0x20 && c < 0x7f) {
+                *p++ = (char)c;
+            } else {
+                p += sprintf(p, "\\%03u", c);
+            }
+        }
+
+        *p++ = '.';
+    }
+
+    if (p == out) {
+        *p++ = '.';
+    }
+
+    if (rec->flags & DNS_QUERY_LOG_NAME_CUT) {
+        p = stpcpy(p, "...");
+    }
+
+    *p = '\0';
+}
+
+static const char* qtype_name(uint16_t qtype, char* buf, size_t len) {
+    switch (qtype) {
+    case 1:   return "A";
+    case 2:   return "NS";
+    case 5:   return "CNAME";
+    case 6:   return "SOA";
+    case 12:  return "PTR";
+    case 15:  return "MX";
+    case 16:  return "TXT";
+    case 28:  return "AAAA";
+    case 33:  return "SRV";
+    case 43:  return "DS";
+    case 48:  return "DNSKEY";
+    case 64:  return "SVCB";
+    case 65:  return "HTTPS";
+    case 255: return "ANY";
+    }
+
+    snprintf(buf, len, "TYPE%u", qtype);
+    return buf;
+}
+
+static const char* rcode_name(uint8_t rcode) {
+    switch (rcode) {
+    case 0: return "NOERROR";
+    case 1: return "FORMERR";
+    case 2: return "SERVFAIL";
+    case 3: return "NXDOMAIN";
+    case 4: return "NOTIMP";
+    case 5: return "REFUSED";
+    }
+
+    return "RCODE?";
+}